@@ -0,0 +1,217 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Checks that LKSMITH_ADVISE flags locks which seem to be the wrong kind of
+ * lock, in the given LKSMITH_MODE.
+ */
+
+#define MAX_ADVICE 64
+
+#define NUM_ROUNDS 20
+
+static pthread_spinlock_t g_slow_spin;
+static pthread_spinlock_t g_busy_spin;
+static pthread_mutex_t g_quick_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_started;
+static volatile int g_stop;
+
+static void sleep_us(long us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000L;
+	ts.tv_nsec = (us % 1000000L) * 1000L;
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * Find the advice of a given kind about a lock.
+ *
+ * @return		The advice, or NULL if there is none.
+ */
+static const struct lksmith_lock_advice *find_advice(
+		const struct lksmith_lock_advice *advice, int num,
+		const void *lock, int kind)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if ((advice[i].lock == lock) && (advice[i].kind == kind))
+			return &advice[i];
+	}
+	return NULL;
+}
+
+static int test_slow_spin(void)
+{
+	struct lksmith_lock_advice advice[MAX_ADVICE];
+	const struct lksmith_lock_advice *it;
+	int i, num = MAX_ADVICE;
+
+	EXPECT_ZERO(pthread_spin_init(&g_slow_spin, 0));
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		EXPECT_ZERO(pthread_spin_lock(&g_slow_spin));
+		sleep_us(100);
+		EXPECT_ZERO(pthread_spin_unlock(&g_slow_spin));
+	}
+	EXPECT_ZERO(lksmith_get_lock_advice(advice, &num));
+	it = find_advice(advice, num, (const void*)&g_slow_spin,
+			LKSMITH_ADVICE_SPIN_TO_MUTEX);
+	EXPECT_NOT_EQ(it, NULL);
+	EXPECT_EQ(it->acquisitions, NUM_ROUNDS);
+	EXPECT_ZERO(it->contended);
+	EXPECT_GE(it->mean_hold_ns, 100000);
+	EXPECT_GE(it->max_hold_ns, it->mean_hold_ns);
+	/* Nobody else wanted the lock, so it didn't cost anything yet. */
+	EXPECT_ZERO(it->score_ns);
+	return 0;
+}
+
+static int test_quick_mutex(void)
+{
+	struct lksmith_lock_advice advice[MAX_ADVICE];
+	int i, num = MAX_ADVICE;
+
+	for (i = 0; i < 1000; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_quick_mutex));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_quick_mutex));
+	}
+	/* A short-held mutex which is never contended is fine as it is. */
+	EXPECT_ZERO(lksmith_get_lock_advice(advice, &num));
+	EXPECT_EQ(find_advice(advice, num, &g_quick_mutex,
+			      LKSMITH_ADVICE_ADAPTIVE), NULL);
+	return 0;
+}
+
+static void *spin_waiter(void *v __attribute__((unused)))
+{
+	sem_post(&g_started);
+	pthread_spin_lock(&g_busy_spin);
+	pthread_spin_unlock(&g_busy_spin);
+	return NULL;
+}
+
+static void *burn_cpu(void *v __attribute__((unused)))
+{
+	while (!g_stop)
+		;
+	return NULL;
+}
+
+static int test_oversubscribed(void)
+{
+	struct lksmith_lock_advice advice[MAX_ADVICE];
+	const struct lksmith_lock_advice *it;
+	pthread_t waiter, *burners;
+	long i, num_burners;
+	int num = MAX_ADVICE;
+
+	if (access("/proc/loadavg", R_OK)) {
+		fprintf(stderr, "test_oversubscribed: can't count runnable "
+			"threads here.  Skipping.\n");
+		return 0;
+	}
+	/* Make the waiter spin while we hold the lock. */
+	EXPECT_ZERO(pthread_spin_init(&g_busy_spin, 0));
+	EXPECT_ZERO(sem_init(&g_started, 0, 0));
+	EXPECT_ZERO(pthread_spin_lock(&g_busy_spin));
+	EXPECT_ZERO(pthread_create(&waiter, NULL, spin_waiter, NULL));
+	EXPECT_ZERO(sem_wait(&g_started));
+	sleep_us(10000);
+	EXPECT_ZERO(pthread_spin_unlock(&g_busy_spin));
+	EXPECT_ZERO(pthread_join(waiter, NULL));
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		EXPECT_ZERO(pthread_spin_lock(&g_busy_spin));
+		EXPECT_ZERO(pthread_spin_unlock(&g_busy_spin));
+	}
+
+	/* Keep more threads runnable than there are CPUs for longer than
+	 * Locksmith waits between counts. */
+	num_burners = sysconf(_SC_NPROCESSORS_ONLN) + 1;
+	burners = calloc(num_burners, sizeof(pthread_t));
+	EXPECT_NOT_EQ(burners, NULL);
+	for (i = 0; i < num_burners; i++)
+		EXPECT_ZERO(pthread_create(&burners[i], NULL, burn_cpu, NULL));
+	sleep_us(200000);
+	EXPECT_ZERO(lksmith_get_lock_advice(advice, &num));
+	g_stop = 1;
+	for (i = 0; i < num_burners; i++)
+		EXPECT_ZERO(pthread_join(burners[i], NULL));
+	free(burners);
+
+	it = find_advice(advice, num, (const void*)&g_busy_spin,
+			LKSMITH_ADVICE_SPIN_OVERSUBSCRIBED);
+	EXPECT_NOT_EQ(it, NULL);
+	EXPECT_EQ(it->acquisitions, NUM_ROUNDS + 2);
+	EXPECT_EQ(it->contended, 1);
+	EXPECT_GT(it->score_ns, 0);
+	/* The advice is ranked by how much it would save. */
+	for (i = 1; i < num; i++)
+		EXPECT_GE(advice[i - 1].score_ns, advice[i].score_ns);
+	return 0;
+}
+
+static int test_report(void)
+{
+	clear_recorded_errors();
+	EXPECT_EQ(lksmith_report_lock_advice(), EWOULDBLOCK);
+	EXPECT_NOT_EQ(find_recorded_error(EWOULDBLOCK), 0);
+	clear_recorded_errors();
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	putenv("LKSMITH_ADVISE=1");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_slow_spin());
+	EXPECT_ZERO(test_quick_mutex());
+	EXPECT_ZERO(test_oversubscribed());
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(test_report());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Checks that LKSMITH_BOUNCE_SAMPLE counts locks moving between threads and
+ * CPUs, in the given LKSMITH_MODE.
+ */
+
+#define NUM_PING_PONGS 100
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_ping, g_pong;
+
+static int test_parse_cpulist(void)
+{
+	int nodes[16];
+	int i;
+
+	memset(nodes, 0, sizeof(nodes));
+	EXPECT_ZERO(parse_cpulist("1-3,8,14-20\n", 1, nodes, 16));
+	for (i = 0; i < 16; i++) {
+		EXPECT_EQ(nodes[i], ((i >= 1 && i <= 3) || (i == 8) ||
+				     (i >= 14)) ? 1 : 0);
+	}
+	EXPECT_ZERO(parse_cpulist("\n", 2, nodes, 16));
+	EXPECT_ZERO(parse_cpulist("", 2, nodes, 16));
+	EXPECT_EQ(nodes[0], 0);
+	EXPECT_EQ(parse_cpulist("3-1", 2, nodes, 16), EINVAL);
+	EXPECT_EQ(parse_cpulist("1-", 2, nodes, 16), EINVAL);
+	EXPECT_EQ(parse_cpulist("1,x", 2, nodes, 16), EINVAL);
+	return 0;
+}
+
+static void *pong_thread(void *v __attribute__((unused)))
+{
+	int i;
+
+	for (i = 0; i < NUM_PING_PONGS; i++) {
+		sem_wait(&g_ping);
+		pthread_mutex_lock(&g_lock1);
+		pthread_mutex_unlock(&g_lock1);
+		sem_post(&g_pong);
+	}
+	return NULL;
+}
+
+static int test_ping_pong(void)
+{
+	struct lksmith_bounce_stats stats;
+	pthread_t thread;
+	void *rval;
+	int i;
+
+	EXPECT_ZERO(sem_init(&g_ping, 0, 0));
+	EXPECT_ZERO(sem_init(&g_pong, 0, 0));
+	EXPECT_ZERO(pthread_create(&thread, NULL, pong_thread, NULL));
+	for (i = 0; i < NUM_PING_PONGS; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+		EXPECT_ZERO(sem_post(&g_ping));
+		EXPECT_ZERO(sem_wait(&g_pong));
+	}
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_ZERO(sem_destroy(&g_ping));
+	EXPECT_ZERO(sem_destroy(&g_pong));
+
+	/* The lock changed hands on every acquisition but the first. */
+	EXPECT_ZERO(lksmith_get_bounce_stats(&g_lock1, &stats));
+	EXPECT_EQ(stats.samples, NUM_PING_PONGS * 2);
+	EXPECT_EQ(stats.thread_changes, (NUM_PING_PONGS * 2) - 1);
+	/* We may be on a single CPU, so we can't count on CPU changes. */
+	EXPECT_GE(stats.thread_changes, stats.cpu_changes);
+	EXPECT_GE(stats.cpu_changes, stats.node_changes);
+	EXPECT_GE(stats.cost, stats.cpu_changes);
+	return 0;
+}
+
+static int test_one_thread(void)
+{
+	struct lksmith_bounce_stats stats;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int i;
+
+	EXPECT_EQ(lksmith_get_bounce_stats(&lock, &stats), ENOENT);
+	for (i = 0; i < 10; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&lock));
+		EXPECT_ZERO(pthread_mutex_unlock(&lock));
+	}
+	EXPECT_ZERO(lksmith_get_bounce_stats(&lock, &stats));
+	EXPECT_EQ(stats.samples, 10);
+	EXPECT_ZERO(stats.thread_changes);
+
+	/* The statistics of destroyed locks are kept. */
+	EXPECT_ZERO(pthread_mutex_destroy(&lock));
+	EXPECT_ZERO(lksmith_get_bounce_stats(&lock, &stats));
+	EXPECT_EQ(stats.samples, 10);
+	EXPECT_ZERO(lksmith_report_bouncing());
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	putenv("LKSMITH_BOUNCE_SAMPLE=1");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_parse_cpulist());
+	EXPECT_ZERO(test_ping_pong());
+	EXPECT_ZERO(test_one_thread());
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
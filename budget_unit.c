@@ -0,0 +1,89 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+
+static int __attribute__((noinline)) take_pair(pthread_mutex_t *first,
+			pthread_mutex_t *second)
+{
+	EXPECT_ZERO(pthread_mutex_lock(first));
+	EXPECT_ZERO(pthread_mutex_lock(second));
+	EXPECT_ZERO(pthread_mutex_unlock(second));
+	EXPECT_ZERO(pthread_mutex_unlock(first));
+	return 0;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec) * 1000ULL) + (ts.tv_nsec / 1000000);
+}
+
+static int test_new_edge_is_checked(void)
+{
+	uint64_t start;
+
+	/* Take the same locks from the same place for a while, so that we
+	 * start skipping checks. */
+	start = now_ms();
+	do {
+		EXPECT_ZERO(take_pair(&g_lock1, &g_lock2));
+	} while (now_ms() - start < 100);
+	EXPECT_ZERO(num_recorded_errors());
+	/* Reversing the order adds a new edge, so it must still be checked,
+	 * even though the call site is the same. */
+	EXPECT_ZERO(take_pair(&g_lock2, &g_lock1));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	clear_recorded_errors();
+	return 0;
+}
+
+int main(void)
+{
+	putenv("LKSMITH_MAX_OVERHEAD=0.001%");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_new_edge_is_checked());
+
+	return EXIT_SUCCESS;
+}
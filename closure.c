@@ -0,0 +1,220 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "closure.h"
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+ * Rows are padded out to a multiple of this many 64-bit words, and the row
+ * array is aligned to this many bytes.  This lets the vectorized OR
+ * functions use aligned loads and stores with no scalar tail.
+ */
+#define CLOSURE_ROW_ALIGN_WORDS 4
+#define CLOSURE_ROW_ALIGN_BYTES (CLOSURE_ROW_ALIGN_WORDS * sizeof(uint64_t))
+
+typedef void (*bitset_or_fn_t)(uint64_t * __restrict dst,
+		const uint64_t * __restrict src, uint32_t nwords);
+
+static void bitset_or_scalar(uint64_t * __restrict dst,
+		const uint64_t * __restrict src, uint32_t nwords)
+{
+	uint32_t i;
+
+	for (i = 0; i < nwords; i++) {
+		dst[i] |= src[i];
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+static void bitset_or_sse2(uint64_t * __restrict dst,
+		const uint64_t * __restrict src, uint32_t nwords)
+	__attribute__((target("sse2")));
+
+static void bitset_or_sse2(uint64_t * __restrict dst,
+		const uint64_t * __restrict src, uint32_t nwords)
+{
+	uint32_t i;
+	__m128i a, b;
+
+	for (i = 0; i < nwords; i += 2) {
+		a = _mm_load_si128((const __m128i*)(dst + i));
+		b = _mm_load_si128((const __m128i*)(src + i));
+		_mm_store_si128((__m128i*)(dst + i), _mm_or_si128(a, b));
+	}
+}
+
+static void bitset_or_avx2(uint64_t * __restrict dst,
+		const uint64_t * __restrict src, uint32_t nwords)
+	__attribute__((target("avx2")));
+
+static void bitset_or_avx2(uint64_t * __restrict dst,
+		const uint64_t * __restrict src, uint32_t nwords)
+{
+	uint32_t i;
+	__m256i a, b;
+
+	for (i = 0; i < nwords; i += 4) {
+		a = _mm256_load_si256((const __m256i*)(dst + i));
+		b = _mm256_load_si256((const __m256i*)(src + i));
+		_mm256_store_si256((__m256i*)(dst + i), _mm256_or_si256(a, b));
+	}
+}
+#endif
+
+/**
+ * The bitset OR implementation to use.  This is picked once, based on what
+ * the CPU supports.  It's only ever written while holding the lock that
+ * protects the closure, and it's idempotent, so races are harmless.
+ */
+static bitset_or_fn_t g_bitset_or;
+
+static const char *g_bitset_or_name = "scalar";
+
+static void closure_pick_impl(void)
+{
+	if (g_bitset_or)
+		return;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		g_bitset_or_name = "avx2";
+		g_bitset_or = bitset_or_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		g_bitset_or_name = "sse2";
+		g_bitset_or = bitset_or_sse2;
+		return;
+	}
+#endif
+	g_bitset_or_name = "scalar";
+	g_bitset_or = bitset_or_scalar;
+}
+
+const char *closure_impl_name(void)
+{
+	closure_pick_impl();
+	return g_bitset_or_name;
+}
+
+static inline uint64_t *closure_row(const struct lksmith_closure *c,
+			uint32_t node)
+{
+	return c->rows + ((uint64_t)node * c->row_words);
+}
+
+int closure_reserve(struct lksmith_closure *c, uint32_t nnodes)
+{
+	uint32_t i, nn, row_words;
+	uint64_t *rows;
+	size_t len;
+
+	closure_pick_impl();
+	if (nnodes <= c->nnodes)
+		return 0;
+	/* Grow geometrically, so that adding nodes one at a time doesn't
+	 * force us to copy the whole matrix every time. */
+	nn = c->nnodes ? c->nnodes : 64;
+	while (nn < nnodes) {
+		nn *= 2;
+	}
+	row_words = (nn + 63) / 64;
+	row_words = (row_words + CLOSURE_ROW_ALIGN_WORDS - 1) &
+		~(CLOSURE_ROW_ALIGN_WORDS - 1);
+	len = (size_t)nn * row_words * sizeof(uint64_t);
+	if (posix_memalign((void**)&rows, CLOSURE_ROW_ALIGN_BYTES, len))
+		return ENOMEM;
+	memset(rows, 0, len);
+	for (i = 0; i < c->nnodes; i++) {
+		memcpy(rows + ((uint64_t)i * row_words), closure_row(c, i),
+			c->row_words * sizeof(uint64_t));
+	}
+	free(c->rows);
+	c->rows = rows;
+	c->nnodes = nn;
+	c->row_words = row_words;
+	return 0;
+}
+
+void closure_clear(struct lksmith_closure *c)
+{
+	if (!c->rows)
+		return;
+	memset(c->rows, 0,
+		(size_t)c->nnodes * c->row_words * sizeof(uint64_t));
+}
+
+void closure_free(struct lksmith_closure *c)
+{
+	free(c->rows);
+	memset(c, 0, sizeof(*c));
+}
+
+void closure_add_edge(struct lksmith_closure *c, uint32_t from, uint32_t to)
+{
+	uint32_t i, fw = from / 64, tw = to / 64;
+	uint64_t fm = 1ULL << (from % 64), tm = 1ULL << (to % 64);
+	const uint64_t *src = closure_row(c, to);
+	uint64_t *dst;
+
+	/* Scan down the 'from' column to find every node which can reach
+	 * 'from'.  Each of those rows gets the 'to' row ORed in. */
+	for (i = 0; i < c->nnodes; i++) {
+		dst = closure_row(c, i);
+		if ((i != from) && (!(dst[fw] & fm)))
+			continue;
+		if (dst[tw] & tm) {
+			/* Since the closure is transitive, if 'i' could
+			 * already reach 'to', it could already reach
+			 * everything 'to' can. */
+			continue;
+		}
+		if (i != to)
+			g_bitset_or(dst, src, c->row_words);
+		dst[tw] |= tm;
+	}
+}
+
+void closure_merge(struct lksmith_closure *c, uint32_t from, uint32_t to)
+{
+	uint64_t *dst = closure_row(c, from);
+
+	if (from != to)
+		g_bitset_or(dst, closure_row(c, to), c->row_words);
+	dst[to / 64] |= 1ULL << (to % 64);
+}
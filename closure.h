@@ -0,0 +1,136 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_CLOSURE_H
+#define LKSMITH_CLOSURE_H
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+/**
+ * A transitive-closure reachability matrix.
+ *
+ * Row i is a bitset holding every node reachable from node i.  This lets us
+ * answer "is B reachable from A" with a single bit test, rather than a graph
+ * search.  The price is O(N^2) bits of memory, so this is only suitable for
+ * graphs with at most a few thousand nodes.
+ *
+ * The matrix can only grow.  Removing an edge may make any number of
+ * reachability bits stale, so callers must clear and rebuild the matrix when
+ * that happens.
+ */
+struct lksmith_closure {
+	/** Number of nodes we have room for */
+	uint32_t nnodes;
+	/** Number of 64-bit words in each row */
+	uint32_t row_words;
+	/** The rows, stored contiguously. */
+	uint64_t *rows;
+};
+
+/**
+ * Make sure that the closure has room for a given number of nodes.
+ * New rows and columns will start out empty.
+ *
+ * @param c		The closure
+ * @param nnodes	The number of nodes we need room for
+ *
+ * @return		0 on success; ENOMEM on out-of-memory.
+ */
+int closure_reserve(struct lksmith_closure *c, uint32_t nnodes);
+
+/**
+ * Clear every reachability bit in the closure.
+ *
+ * @param c		The closure
+ */
+void closure_clear(struct lksmith_closure *c);
+
+/**
+ * Free the memory associated with a closure.
+ *
+ * @param c		The closure
+ */
+void closure_free(struct lksmith_closure *c);
+
+/**
+ * Determine if one node is reachable from another.
+ *
+ * @param c		The closure
+ * @param from		The node to start at
+ * @param to		The node to look for
+ *
+ * @return		1 if 'to' is reachable from 'from'; 0 otherwise.
+ */
+static inline int closure_reaches(const struct lksmith_closure *c,
+			uint32_t from, uint32_t to)
+{
+	if ((from >= c->nnodes) || (to >= c->nnodes))
+		return 0;
+	return !!(c->rows[((uint64_t)from * c->row_words) + (to / 64)] &
+		(1ULL << (to % 64)));
+}
+
+/**
+ * Add an edge to the closure.
+ *
+ * Every node which can reach 'from' (including 'from' itself) will be able
+ * to reach 'to', plus everything 'to' can reach.
+ *
+ * Both nodes must already have been reserved with closure_reserve.
+ *
+ * @param c		The closure
+ * @param from		The source of the new edge
+ * @param to		The destination of the new edge
+ */
+void closure_add_edge(struct lksmith_closure *c, uint32_t from, uint32_t to);
+
+/**
+ * Fold a node's reachability set into another node's set.
+ *
+ * This is the building block for rebuilding a closure from scratch.  If we
+ * visit the nodes of an acyclic graph in depth-first post-order, calling this
+ * for each edge, we end up with the full closure.  Unlike closure_add_edge,
+ * this does not propagate the change to the predecessors of 'from'.
+ *
+ * Both nodes must already have been reserved with closure_reserve.
+ *
+ * @param c		The closure
+ * @param from		The source of the edge
+ * @param to		The destination of the edge
+ */
+void closure_merge(struct lksmith_closure *c, uint32_t from, uint32_t to);
+
+/**
+ * Get the name of the bitset implementation that we're using.
+ *
+ * @return		A statically allocated string like "avx2" or "scalar"
+ */
+const char *closure_impl_name(void);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "closure.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int test_closure_chain(void)
+{
+	struct lksmith_closure c;
+
+	memset(&c, 0, sizeof(c));
+	EXPECT_ZERO(closure_reserve(&c, 4));
+	EXPECT_EQ(closure_reaches(&c, 0, 1), 0);
+	/* 0 -> 1, then 2 -> 3, then join the chains with 1 -> 2 */
+	closure_add_edge(&c, 0, 1);
+	closure_add_edge(&c, 2, 3);
+	EXPECT_EQ(closure_reaches(&c, 0, 1), 1);
+	EXPECT_EQ(closure_reaches(&c, 0, 3), 0);
+	closure_add_edge(&c, 1, 2);
+	EXPECT_EQ(closure_reaches(&c, 0, 3), 1);
+	EXPECT_EQ(closure_reaches(&c, 1, 3), 1);
+	EXPECT_EQ(closure_reaches(&c, 3, 0), 0);
+	EXPECT_EQ(closure_reaches(&c, 2, 1), 0);
+	/* Out-of-range nodes are never reachable. */
+	EXPECT_EQ(closure_reaches(&c, 0, 100000), 0);
+	closure_clear(&c);
+	EXPECT_EQ(closure_reaches(&c, 0, 1), 0);
+	closure_free(&c);
+	return 0;
+}
+
+static int test_closure_grow(void)
+{
+	struct lksmith_closure c;
+	uint32_t i;
+
+	memset(&c, 0, sizeof(c));
+	EXPECT_ZERO(closure_reserve(&c, 10));
+	for (i = 0; i < 9; i++) {
+		closure_add_edge(&c, i, i + 1);
+	}
+	/* Growing the matrix must preserve everything already in it. */
+	EXPECT_ZERO(closure_reserve(&c, 1000));
+	EXPECT_GE(c.nnodes, 1000);
+	EXPECT_EQ(closure_reaches(&c, 0, 9), 1);
+	closure_add_edge(&c, 9, 999);
+	EXPECT_EQ(closure_reaches(&c, 0, 999), 1);
+	EXPECT_EQ(closure_reaches(&c, 999, 0), 0);
+	closure_free(&c);
+	return 0;
+}
+
+#define RANDOM_DAG_NODES 300
+#define RANDOM_DAG_EDGES 600
+
+static int g_dag[RANDOM_DAG_NODES][RANDOM_DAG_NODES];
+
+static void dag_mark_reachable(int from, char *seen)
+{
+	int i;
+
+	for (i = 0; i < RANDOM_DAG_NODES; i++) {
+		if ((!g_dag[from][i]) || (seen[i]))
+			continue;
+		seen[i] = 1;
+		dag_mark_reachable(i, seen);
+	}
+}
+
+static void dag_fill(struct lksmith_closure *c, int node, char *done)
+{
+	int i;
+
+	if (done[node])
+		return;
+	done[node] = 1;
+	for (i = 0; i < RANDOM_DAG_NODES; i++) {
+		if (!g_dag[node][i])
+			continue;
+		dag_fill(c, i, done);
+		closure_merge(c, node, i);
+	}
+}
+
+static int test_closure_random_dag(void)
+{
+	struct lksmith_closure inc, rebuilt;
+	char seen[RANDOM_DAG_NODES];
+	int i, from, to;
+
+	/* Edges only go from lower to higher numbered nodes, so the graph is
+	 * acyclic, just like the Locksmith lock graph. */
+	srandom(1234);
+	memset(g_dag, 0, sizeof(g_dag));
+	memset(&inc, 0, sizeof(inc));
+	memset(&rebuilt, 0, sizeof(rebuilt));
+	EXPECT_ZERO(closure_reserve(&inc, RANDOM_DAG_NODES));
+	EXPECT_ZERO(closure_reserve(&rebuilt, RANDOM_DAG_NODES));
+	for (i = 0; i < RANDOM_DAG_EDGES; i++) {
+		from = random() % (RANDOM_DAG_NODES - 1);
+		to = from + 1 + (random() % (RANDOM_DAG_NODES - from - 1));
+		g_dag[from][to] = 1;
+		closure_add_edge(&inc, from, to);
+	}
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < RANDOM_DAG_NODES; i++) {
+		dag_fill(&rebuilt, i, seen);
+	}
+	for (from = 0; from < RANDOM_DAG_NODES; from++) {
+		memset(seen, 0, sizeof(seen));
+		dag_mark_reachable(from, seen);
+		for (to = 0; to < RANDOM_DAG_NODES; to++) {
+			EXPECT_EQ(closure_reaches(&inc, from, to), seen[to]);
+			EXPECT_EQ(closure_reaches(&rebuilt, from, to),
+				closure_reaches(&inc, from, to));
+		}
+	}
+	closure_free(&inc);
+	closure_free(&rebuilt);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(die_on_error);
+	fprintf(stderr, "closure_unit: using the %s bitset "
+		"implementation.\n", closure_impl_name());
+	EXPECT_ZERO(test_closure_chain());
+	EXPECT_ZERO(test_closure_grow());
+	EXPECT_ZERO(test_closure_random_dag());
+
+	return EXIT_SUCCESS;
+}
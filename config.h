@@ -32,4 +32,12 @@
 
 #define HAVE_IMPROVED_TLS
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_TSC
+#endif
+
 #endif
@@ -32,4 +32,8 @@
 
 #cmakedefine HAVE_IMPROVED_TLS
 
+#cmakedefine HAVE_X86_SIMD
+
+#cmakedefine HAVE_X86_TSC
+
 #endif
@@ -0,0 +1,106 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Checks that LKSMITH_CS_SAMPLE finds critical sections which spend their
+ * time off the CPU, in the given LKSMITH_MODE.
+ */
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_spinlock_t g_spin;
+
+static int test_short_sections(void)
+{
+	int i;
+
+	/* Short critical sections which never leave the CPU are fine. */
+	for (i = 0; i < 100; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	}
+	EXPECT_ZERO(lksmith_report_critical_sections());
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_sleep_under_mutex(void)
+{
+	struct timespec ts = { 0, 20000000 };
+
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	nanosleep(&ts, NULL);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_EQ(lksmith_report_critical_sections(), EWOULDBLOCK);
+	EXPECT_EQ(find_recorded_error(EWOULDBLOCK), 1);
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_sleep_under_spin(void)
+{
+	struct timespec ts = { 0, 1000000 };
+
+	EXPECT_ZERO(pthread_spin_init(&g_spin, 0));
+	EXPECT_ZERO(pthread_spin_lock(&g_spin));
+	nanosleep(&ts, NULL);
+	EXPECT_ZERO(pthread_spin_unlock(&g_spin));
+	/* The mutex from test_sleep_under_mutex is still reported, along
+	 * with the spin lock. */
+	EXPECT_EQ(lksmith_report_critical_sections(), EWOULDBLOCK);
+	EXPECT_EQ(find_recorded_error(EWOULDBLOCK), 1);
+	EXPECT_EQ(find_recorded_error(EWOULDBLOCK), 1);
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(pthread_spin_destroy(&g_spin));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	putenv("LKSMITH_CS_SAMPLE=1");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_short_sections());
+	EXPECT_ZERO(test_sleep_under_mutex());
+	EXPECT_ZERO(test_sleep_under_spin());
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
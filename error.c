@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "config.h"
 #include "error.h"
 #include "handler.h"
 #include "util.h"
@@ -198,12 +199,10 @@ const char *terror(int err)
 {
 #ifdef HAVE_IMPROVED_TLS
 	static __thread char buf[4096];
-	int ret;
 
-	ret = strerror_r(err, buf, sizeof(buf));
-	if (ret)
-		return "unknown error";
-	return buf;
+	/* We build with _GNU_SOURCE, so this is the GNU strerror_r.  It
+	 * returns a pointer to the message rather than an error code. */
+	return strerror_r(err, buf, sizeof(buf));
 #else
 	if ((err < 0) || (err >= sys_nerr)) {
 		return "unknown error";
@@ -429,6 +429,63 @@ static int test_bad_cond_wait(void)
 	return 0;
 }
 
+#define NUM_BUCKETS 64
+
+static int test_lock_array(void)
+{
+	pthread_mutex_t buckets[NUM_BUCKETS];
+	pthread_mutex_t outer;
+	int i;
+
+	EXPECT_ZERO(pthread_mutex_init(&outer, NULL));
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		EXPECT_ZERO(pthread_mutex_init(&buckets[i], NULL));
+	}
+	EXPECT_ZERO(lksmith_register_lock_array(buckets,
+		sizeof(pthread_mutex_t), NUM_BUCKETS, "buckets"));
+	EXPECT_EQ(lksmith_register_lock_array(&buckets[10],
+		sizeof(pthread_mutex_t), 2, "overlap"), EEXIST);
+	EXPECT_EQ(find_recorded_error(EEXIST), 1);
+
+	/* ascending address order is fine */
+	EXPECT_ZERO(pthread_mutex_lock(&buckets[3]));
+	EXPECT_ZERO(pthread_mutex_lock(&buckets[40]));
+	EXPECT_ZERO(pthread_mutex_unlock(&buckets[3]));
+	EXPECT_ZERO(pthread_mutex_unlock(&buckets[40]));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 0);
+
+	/* descending address order is not */
+	EXPECT_ZERO(pthread_mutex_lock(&buckets[40]));
+	EXPECT_ZERO(pthread_mutex_lock(&buckets[3]));
+	EXPECT_ZERO(pthread_mutex_unlock(&buckets[3]));
+	EXPECT_ZERO(pthread_mutex_unlock(&buckets[40]));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+
+	/* the whole array is one node in the lock order graph */
+	EXPECT_ZERO(pthread_mutex_lock(&outer));
+	EXPECT_ZERO(pthread_mutex_lock(&buckets[7]));
+	EXPECT_ZERO(pthread_mutex_unlock(&buckets[7]));
+	EXPECT_ZERO(pthread_mutex_unlock(&outer));
+	EXPECT_ZERO(pthread_mutex_lock(&buckets[50]));
+	EXPECT_EQ(pthread_mutex_trylock(&outer), 0);
+	EXPECT_ZERO(pthread_mutex_unlock(&outer));
+	EXPECT_ZERO(pthread_mutex_unlock(&buckets[50]));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+
+	EXPECT_ZERO(pthread_mutex_lock(&buckets[1]));
+	EXPECT_EQ(lksmith_unregister_lock_array(buckets), EBUSY);
+	EXPECT_EQ(find_recorded_error(EBUSY), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&buckets[1]));
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		EXPECT_ZERO(pthread_mutex_destroy(&buckets[i]));
+	}
+	EXPECT_ZERO(lksmith_unregister_lock_array(buckets));
+	EXPECT_EQ(lksmith_unregister_lock_array(buckets), ENOENT);
+	EXPECT_ZERO(pthread_mutex_destroy(&outer));
+	clear_recorded_errors();
+	return 0;
+}
+
 int main(void)
 {
 	struct timespec ts;
@@ -452,5 +509,7 @@ int main(void)
 
 	EXPECT_ZERO(test_bad_cond_wait());
 
+	EXPECT_ZERO(test_lock_array());
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,169 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Checks that LKSMITH_FAIRNESS measures how locks are shared among threads,
+ * in the given LKSMITH_MODE.
+ */
+
+#define NUM_BARGES 5
+
+#define WAIT_MS 20
+
+/**
+ * Number of times we try to barge in.  On a busy machine, the waiter
+ * occasionally gets the lock first.
+ */
+#define MAX_TRIES 10
+
+static pthread_mutex_t g_locks[MAX_TRIES];
+
+static void *waiter_thread(void *v)
+{
+	pthread_mutex_t *lock = v;
+
+	pthread_mutex_lock(lock);
+	pthread_mutex_unlock(lock);
+	return NULL;
+}
+
+static int try_barging(pthread_mutex_t *lock,
+		       struct lksmith_fairness_stats *stats)
+{
+	struct timespec ts;
+	pthread_t thread;
+#ifdef SCHED_IDLE
+	struct sched_param param;
+#endif
+	int i;
+
+	EXPECT_ZERO(pthread_mutex_init(lock, NULL));
+	EXPECT_ZERO(pthread_mutex_lock(lock));
+	EXPECT_ZERO(pthread_create(&thread, NULL, waiter_thread, lock));
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000L;
+	do {
+		nanosleep(&ts, NULL);
+		EXPECT_ZERO(lksmith_get_fairness_stats(lock, stats));
+	} while (stats->waiters == 0);
+	ts.tv_nsec = WAIT_MS * 1000000L;
+	nanosleep(&ts, NULL);
+#ifdef SCHED_IDLE
+	/* Don't let the waiter preempt us when we wake it up.  Otherwise, on
+	 * a single CPU, it would always get the lock before we could take it
+	 * back. */
+	memset(&param, 0, sizeof(param));
+	EXPECT_ZERO(pthread_setschedparam(thread, SCHED_IDLE, &param));
+#endif
+	/* The waiter needs a while to wake up, so we can usually take the
+	 * lock back before it gets a chance. */
+	for (i = 0; i < NUM_BARGES; i++) {
+		EXPECT_ZERO(pthread_mutex_unlock(lock));
+		EXPECT_ZERO(pthread_mutex_lock(lock));
+	}
+	EXPECT_ZERO(pthread_mutex_unlock(lock));
+	EXPECT_ZERO(pthread_join(thread, NULL));
+
+	EXPECT_ZERO(lksmith_get_fairness_stats(lock, stats));
+	EXPECT_EQ(stats->acquisitions, NUM_BARGES + 2);
+	EXPECT_EQ(stats->threads, 2);
+	EXPECT_EQ(stats->max_thread_acquisitions, NUM_BARGES + 1);
+	EXPECT_EQ(stats->min_thread_acquisitions, 1);
+	EXPECT_LT(stats->fairness_pct, 100);
+	EXPECT_GE(NUM_BARGES, stats->barges);
+	EXPECT_GE(stats->max_wait_ns, WAIT_MS * 1000000ULL);
+	EXPECT_ZERO(stats->waiters);
+	return 0;
+}
+
+static int test_barging(void)
+{
+	struct lksmith_fairness_stats stats;
+	int i;
+
+	for (i = 0; i < MAX_TRIES; i++) {
+		EXPECT_ZERO(try_barging(&g_locks[i], &stats));
+		if (stats.barges > 0)
+			break;
+	}
+	EXPECT_LT(i, MAX_TRIES);
+	return 0;
+}
+
+static int test_one_thread(void)
+{
+	struct lksmith_fairness_stats stats;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int i;
+
+	EXPECT_EQ(lksmith_get_fairness_stats(&lock, &stats), ENOENT);
+	for (i = 0; i < 10; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&lock));
+		EXPECT_ZERO(pthread_mutex_unlock(&lock));
+	}
+	EXPECT_ZERO(lksmith_get_fairness_stats(&lock, &stats));
+	EXPECT_EQ(stats.acquisitions, 10);
+	EXPECT_EQ(stats.threads, 1);
+	EXPECT_EQ(stats.fairness_pct, 100);
+	/* Nobody else wanted the lock, so we never barged in. */
+	EXPECT_ZERO(stats.barges);
+
+	/* The statistics of destroyed locks are kept. */
+	EXPECT_ZERO(pthread_mutex_destroy(&lock));
+	EXPECT_ZERO(lksmith_get_fairness_stats(&lock, &stats));
+	EXPECT_EQ(stats.acquisitions, 10);
+	EXPECT_ZERO(lksmith_report_fairness());
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	putenv("LKSMITH_FAIRNESS=1");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_barging());
+	EXPECT_ZERO(test_one_thread());
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
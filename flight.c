@@ -0,0 +1,248 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flight.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint64_t g_flight_mask;
+
+/**
+ * The writable mapping of the flight recorder file, or NULL if there is no
+ * flight recorder.  Set once by flight_init.
+ */
+static struct flight_header *g_flight_hdr;
+
+static size_t g_flight_len;
+
+static struct flight_slot *flight_slot_at(const struct flight_header *hdr,
+		uint32_t i)
+{
+	return (struct flight_slot *)((char*)hdr + sizeof(*hdr) +
+				      ((size_t)i * hdr->slot_size));
+}
+
+/**
+ * After fork, the child would write into the same slots as the parent.  Give
+ * the child a private, empty copy of the mapping instead, so that the
+ * parent's history is left alone.
+ */
+static void flight_atfork_child(void)
+{
+	mmap(g_flight_hdr, g_flight_len, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+}
+
+int flight_init(const char *path, uint32_t num_slots, uint32_t ring_len,
+		uint64_t now)
+{
+	struct flight_header *hdr;
+	uint32_t len = 2;
+	size_t slot_size, total;
+	void *base;
+	int fd, ret;
+
+	while (len < ring_len) {
+		if (len >= 0x40000000U)
+			return EINVAL;
+		len <<= 1;
+	}
+	if (num_slots == 0)
+		return EINVAL;
+	slot_size = sizeof(struct flight_slot) +
+		((size_t)len * sizeof(struct flight_event));
+	if (slot_size > UINT32_MAX)
+		return EINVAL;
+	total = sizeof(*hdr) + (num_slots * slot_size);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return errno;
+	if (ftruncate(fd, total) < 0) {
+		ret = errno;
+		close(fd);
+		return ret;
+	}
+	base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ret = errno;
+	close(fd);
+	if (base == MAP_FAILED)
+		return ret;
+	hdr = base;
+	hdr->version = FLIGHT_VERSION;
+	hdr->slot_size = slot_size;
+	hdr->num_slots = num_slots;
+	hdr->ring_len = len;
+	hdr->pid = getpid();
+	hdr->start_ns = now;
+	__atomic_store_n(&hdr->magic, FLIGHT_MAGIC, __ATOMIC_RELEASE);
+	g_flight_mask = len - 1;
+	g_flight_len = total;
+	g_flight_hdr = hdr;
+	pthread_atfork(NULL, NULL, flight_atfork_child);
+	return 0;
+}
+
+/**
+ * Try to take over a slot in the given state.
+ *
+ * @param from		The state the slot must be in.
+ * @param name		The name of the thread taking the slot.
+ *
+ * @return		The slot, or NULL if no slot was in that state.
+ */
+static struct flight_slot *flight_claim(uint32_t from, const char *name)
+{
+	struct flight_slot *slot;
+	uint32_t i, state;
+
+	for (i = 0; i < g_flight_hdr->num_slots; i++) {
+		slot = flight_slot_at(g_flight_hdr, i);
+		state = from;
+		if (!__atomic_compare_exchange_n(&slot->state, &state,
+				FLIGHT_SLOT_LIVE, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED))
+			continue;
+		/* Clearing the ring also faults its pages in now, rather than
+		 * on our first few lock events. */
+		memset(slot->ring, 0, g_flight_hdr->slot_size - sizeof(*slot));
+		__atomic_store_n(&slot->head, 0, __ATOMIC_RELEASE);
+		flight_thread_rename(slot, name);
+		return slot;
+	}
+	return NULL;
+}
+
+struct flight_slot *flight_thread_start(const char *name)
+{
+	struct flight_slot *slot;
+
+	if (!g_flight_hdr)
+		return NULL;
+	slot = flight_claim(FLIGHT_SLOT_FREE, name);
+	if (!slot)
+		slot = flight_claim(FLIGHT_SLOT_EXITED, name);
+	return slot;
+}
+
+void flight_thread_rename(struct flight_slot *slot, const char *name)
+{
+	snprintf(slot->name, sizeof(slot->name), "%s", name);
+}
+
+void flight_thread_end(struct flight_slot *slot)
+{
+	__atomic_store_n(&slot->state, FLIGHT_SLOT_EXITED, __ATOMIC_RELEASE);
+}
+
+int flight_open(const char *path, struct flight_file *ff)
+{
+	const struct flight_header *hdr;
+	struct stat st;
+	void *base;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+	if (fstat(fd, &st) < 0) {
+		ret = errno;
+		close(fd);
+		return ret;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return EINVAL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	ret = errno;
+	close(fd);
+	if (base == MAP_FAILED)
+		return ret;
+	hdr = base;
+	if ((__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != FLIGHT_MAGIC) ||
+			(hdr->version != FLIGHT_VERSION) ||
+			(hdr->ring_len < 2) ||
+			(hdr->ring_len & (hdr->ring_len - 1)) ||
+			(hdr->slot_size != sizeof(struct flight_slot) +
+			 ((size_t)hdr->ring_len *
+			  sizeof(struct flight_event))) ||
+			((size_t)st.st_size < sizeof(*hdr) +
+			 ((size_t)hdr->num_slots * hdr->slot_size))) {
+		munmap(base, st.st_size);
+		return EINVAL;
+	}
+	ff->base = base;
+	ff->len = st.st_size;
+	ff->hdr = hdr;
+	return 0;
+}
+
+const struct flight_slot *flight_get_slot(const struct flight_file *ff,
+		uint32_t i)
+{
+	return flight_slot_at(ff->hdr, i);
+}
+
+uint32_t flight_get_events(const struct flight_file *ff,
+		const struct flight_slot *slot, struct flight_event *out)
+{
+	uint32_t len = ff->hdr->ring_len, num = 0;
+	const struct flight_event *ev;
+	uint64_t head, n;
+
+	head = __atomic_load_n(&slot->head, __ATOMIC_ACQUIRE);
+	for (n = (head > len) ? (head - len) : 0; n < head; n++) {
+		ev = &slot->ring[n & (len - 1)];
+		if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) !=
+				(uint32_t)n)
+			continue;
+		out[num] = *ev;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) !=
+				(uint32_t)n)
+			continue;
+		num++;
+	}
+	return num;
+}
+
+void flight_close(struct flight_file *ff)
+{
+	munmap((void*)ff->base, ff->len);
+	ff->base = NULL;
+	ff->hdr = NULL;
+}
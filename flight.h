@@ -0,0 +1,267 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_FLIGHT_H
+#define LKSMITH_FLIGHT_H
+
+#include <stdint.h> /* for uint64_t */
+#include <stdio.h> /* for FILE */
+#include <unistd.h> /* for size_t */
+
+/**
+ * The lock flight recorder.
+ *
+ * Each thread keeps its last few lock events in a ring inside a file-backed
+ * MAP_SHARED mapping.  Recording an event is a handful of stores into memory
+ * which the kernel will write back to the file even if the process is killed
+ * or crashes.  Afterwards, lksmith_flight decodes the file.
+ *
+ * The file starts with a struct flight_header, followed by num_slots slots.
+ * Each slot is a struct flight_slot followed by ring_len struct
+ * flight_events.  All integers are in the byte order of the machine which
+ * wrote the file.
+ */
+
+#define FLIGHT_MAGIC 0x31544c464d534b4cULL /* "LKSMFLT1" */
+
+#define FLIGHT_VERSION 1
+
+/** Started waiting for a lock */
+#define FLIGHT_OP_WAIT 1
+/** Took a lock */
+#define FLIGHT_OP_ACQUIRE 2
+/** Released a lock */
+#define FLIGHT_OP_RELEASE 3
+
+/** The slot has never been used */
+#define FLIGHT_SLOT_FREE 0
+/** The slot belongs to a running thread */
+#define FLIGHT_SLOT_LIVE 1
+/** The slot belonged to a thread which has exited */
+#define FLIGHT_SLOT_EXITED 2
+
+/** Length of a thread name in the file, including the terminating NUL */
+#define FLIGHT_NAME_MAX 16
+
+struct flight_header {
+	/** FLIGHT_MAGIC.  Written last, once the rest of the file is valid. */
+	uint64_t magic;
+	/** FLIGHT_VERSION */
+	uint32_t version;
+	/** Size of each slot, in bytes, including its ring */
+	uint32_t slot_size;
+	/** Number of slots */
+	uint32_t num_slots;
+	/** Number of events in each ring.  Always a power of 2. */
+	uint32_t ring_len;
+	/** ID of the process which wrote the file */
+	uint64_t pid;
+	/** Timestamp when the file was created, in nanoseconds */
+	uint64_t start_ns;
+	/** Padding to a cache line */
+	uint64_t pad[4];
+};
+
+struct flight_event {
+	/** When the event happened, in nanoseconds */
+	uint64_t ns;
+	/** The lock pointer */
+	uint64_t lock;
+	/** Where the lock was taken, or 0 if unknown */
+	uint64_t site;
+	/** FLIGHT_OP_* */
+	uint32_t op;
+	/** Low 32 bits of this event's sequence number.  Written last, so a
+	 * reader can tell a complete event from one that was being
+	 * overwritten. */
+	uint32_t seq;
+};
+
+struct flight_slot {
+	/** FLIGHT_SLOT_* */
+	uint32_t state;
+	/** Padding */
+	uint32_t pad;
+	/** Sequence number of the next event.  The last min(head, ring_len)
+	 * events are in the ring, event n at index n % ring_len. */
+	uint64_t head;
+	/** Name of the thread */
+	char name[FLIGHT_NAME_MAX];
+	/** Padding to a cache line */
+	uint64_t pad2[4];
+	/** The ring */
+	struct flight_event ring[];
+};
+
+/**
+ * Create the flight recorder file and map it.
+ *
+ * @param path		The file to create.  An existing file is replaced.
+ * @param num_slots	The number of threads we can record at once.
+ * @param ring_len	The number of events to keep per thread.  Rounded up
+ *			to a power of 2.
+ * @param now		The current time, in nanoseconds.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int flight_init(const char *path, uint32_t num_slots, uint32_t ring_len,
+		uint64_t now);
+
+/**
+ * Claim a slot for the calling thread.
+ *
+ * @param name		The thread's name.
+ *
+ * @return		The slot, or NULL if there is no flight recorder or
+ *			every slot is taken.
+ */
+struct flight_slot *flight_thread_start(const char *name);
+
+/**
+ * Rename the thread which owns a slot.
+ *
+ * @param slot		The slot.
+ * @param name		The new name.
+ */
+void flight_thread_rename(struct flight_slot *slot, const char *name);
+
+/**
+ * Mark a slot as belonging to a thread which has exited.  Its events are kept
+ * until another thread needs the slot.
+ *
+ * @param slot		The slot.
+ */
+void flight_thread_end(struct flight_slot *slot);
+
+/**
+ * Mask to turn a sequence number into a ring index.  Set once by
+ * flight_init.
+ */
+extern uint64_t g_flight_mask;
+
+/**
+ * Record an event.  Only the thread which owns the slot may call this.
+ *
+ * @param slot		The slot.
+ * @param op		FLIGHT_OP_*
+ * @param lock		The lock pointer.
+ * @param site		Where the lock was taken, or NULL if unknown.
+ * @param now		The current time, in nanoseconds.
+ */
+static inline void flight_record(struct flight_slot *slot, uint32_t op,
+		const void *lock, const void *site, uint64_t now)
+{
+	uint64_t seq = slot->head;
+	struct flight_event *ev = &slot->ring[seq & g_flight_mask];
+
+	/* Like a seqlock: mark the old event invalid before overwriting it.
+	 * ~seq never matches the old sequence number, since the ring length
+	 * is even. */
+	__atomic_store_n(&ev->seq, ~(uint32_t)seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev->ns = now;
+	ev->lock = (uintptr_t)lock;
+	ev->site = (uintptr_t)site;
+	ev->op = op;
+	__atomic_store_n(&ev->seq, (uint32_t)seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * A flight recorder file mapped for reading.
+ */
+struct flight_file {
+	/** The mapping */
+	const void *base;
+	/** Length of the mapping */
+	size_t len;
+	/** The header */
+	const struct flight_header *hdr;
+};
+
+/**
+ * Map a flight recorder file for reading, and check its header.
+ *
+ * @param path		The file.
+ * @param ff		(out param) The mapped file.
+ *
+ * @return		0 on success; EINVAL if the file is not a valid
+ *			flight recorder file; another error code otherwise.
+ */
+int flight_open(const char *path, struct flight_file *ff);
+
+/**
+ * Get a slot from a mapped flight recorder file.
+ *
+ * @param ff		The mapped file.
+ * @param i		The slot index, less than hdr->num_slots.
+ *
+ * @return		The slot.
+ */
+const struct flight_slot *flight_get_slot(const struct flight_file *ff,
+		uint32_t i);
+
+/**
+ * Copy the complete events out of a slot, oldest first.  Events which were
+ * being overwritten when the file was read are skipped.
+ *
+ * @param ff		The mapped file.
+ * @param slot		The slot.
+ * @param out		(out param) Array of at least ring_len events.
+ *
+ * @return		The number of events copied.
+ */
+uint32_t flight_get_events(const struct flight_file *ff,
+		const struct flight_slot *slot, struct flight_event *out);
+
+/**
+ * Write the events in a flight recorder file as Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto can load.
+ *
+ * Each thread gets a track, with a "waiting for" slice from each wait to the
+ * acquisition which ended it, and a "holding" slice from each acquisition to
+ * its release.  A flow arrow goes from each release to the next acquisition
+ * of the same lock by another thread.  Slices which were still open when the
+ * file was written end at the last event in the file.
+ *
+ * @param ff		The mapped file.
+ * @param out		Where to write the JSON.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int flight_write_chrome_trace(const struct flight_file *ff, FILE *out);
+
+/**
+ * Unmap a flight recorder file.
+ *
+ * @param ff		The mapped file.
+ */
+void flight_close(struct flight_file *ff);
+
+#endif
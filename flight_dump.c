@@ -0,0 +1,222 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flight.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Decodes a Locksmith flight recorder file (see LKSMITH_FLIGHT_FILE).
+ *
+ * For each thread, this prints its last lock events, the locks it still held
+ * when the file was last written, and the lock it was waiting for, if any.
+ * With -c, it writes Chrome trace-event JSON instead, which can be loaded
+ * into chrome://tracing or Perfetto.
+ *
+ * This program does not link against Locksmith, so it can be run on files
+ * left behind by processes which crashed or were killed.
+ */
+
+/**
+ * A lock which a thread held at the end of its events.
+ */
+struct held_lock {
+	uint64_t lock;
+	uint64_t site;
+	uint64_t ns;
+	int depth;
+};
+
+static const char *op_str(uint32_t op)
+{
+	switch (op) {
+	case FLIGHT_OP_WAIT:
+		return "wait";
+	case FLIGHT_OP_ACQUIRE:
+		return "acquire";
+	case FLIGHT_OP_RELEASE:
+		return "release";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *state_str(uint32_t state)
+{
+	switch (state) {
+	case FLIGHT_SLOT_LIVE:
+		return "running";
+	case FLIGHT_SLOT_EXITED:
+		return "exited";
+	default:
+		return "unknown";
+	}
+}
+
+static double rel_sec(const struct flight_file *ff, uint64_t ns)
+{
+	return ((int64_t)(ns - ff->hdr->start_ns)) / 1000000000.0;
+}
+
+/**
+ * Replay a thread's events to find the locks it held at the end.  Locks
+ * taken before the oldest event in the ring are unknown, so releases of them
+ * are ignored.
+ */
+static int find_held(const struct flight_event *evs, uint32_t num,
+		     struct held_lock *held)
+{
+	const struct flight_event *ev;
+	uint32_t i;
+	int j, num_held = 0;
+
+	for (i = 0; i < num; i++) {
+		ev = &evs[i];
+		for (j = 0; j < num_held; j++) {
+			if (held[j].lock == ev->lock)
+				break;
+		}
+		if (ev->op == FLIGHT_OP_ACQUIRE) {
+			if (j == num_held) {
+				held[num_held].lock = ev->lock;
+				held[num_held].site = ev->site;
+				held[num_held].ns = ev->ns;
+				held[num_held++].depth = 0;
+			}
+			held[j].depth++;
+		} else if ((ev->op == FLIGHT_OP_RELEASE) && (j < num_held)) {
+			if (--held[j].depth == 0)
+				held[j] = held[--num_held];
+		}
+	}
+	return num_held;
+}
+
+static void dump_slot(const struct flight_file *ff,
+		      const struct flight_slot *slot, struct flight_event *evs,
+		      struct held_lock *held)
+{
+	const struct flight_event *ev;
+	uint32_t i, num;
+	int j, num_held;
+
+	num = flight_get_events(ff, slot, evs);
+	printf("thread %.*s (%s): last %"PRIu32" of %"PRIu64" events\n",
+	       FLIGHT_NAME_MAX, slot->name, state_str(slot->state), num,
+	       slot->head);
+	for (i = 0; i < num; i++) {
+		ev = &evs[i];
+		printf("  %+.6f s %-7s lock 0x%"PRIx64" at [0x%"PRIx64"]\n",
+		       rel_sec(ff, ev->ns), op_str(ev->op), ev->lock, ev->site);
+	}
+	num_held = find_held(evs, num, held);
+	for (j = 0; j < num_held; j++) {
+		printf("  HELD lock 0x%"PRIx64" taken at [0x%"PRIx64"] "
+		       "%+.6f s\n", held[j].lock, held[j].site,
+		       rel_sec(ff, held[j].ns));
+	}
+	if ((num > 0) && (evs[num - 1].op == FLIGHT_OP_WAIT)) {
+		printf("  WAITING for lock 0x%"PRIx64" at [0x%"PRIx64"] since "
+		       "%+.6f s\n", evs[num - 1].lock, evs[num - 1].site,
+		       rel_sec(ff, evs[num - 1].ns));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct flight_file ff;
+	const struct flight_slot *slot;
+	struct flight_event *evs;
+	struct held_lock *held;
+	const char *path;
+	uint32_t i;
+	int c, chrome = 0, ret;
+
+	while ((c = getopt(argc, argv, "c")) != -1) {
+		switch (c) {
+		case 'c':
+			chrome = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind + 1 != argc)
+		goto usage;
+	path = argv[optind];
+	ret = flight_open(path, &ff);
+	if (ret) {
+		fprintf(stderr, "%s: failed to open %s: %s\n", argv[0],
+			path, (ret == EINVAL) ?
+			"not a Locksmith flight recorder file" :
+			strerror(ret));
+		return EXIT_FAILURE;
+	}
+	if (chrome) {
+		ret = flight_write_chrome_trace(&ff, stdout);
+		flight_close(&ff);
+		if (ret) {
+			fprintf(stderr, "%s: failed to write the trace: %s\n",
+				argv[0], strerror(ret));
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+	evs = calloc(ff.hdr->ring_len, sizeof(*evs));
+	held = calloc(ff.hdr->ring_len, sizeof(*held));
+	if ((!evs) || (!held)) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	printf("process %"PRIu64": %"PRIu32" thread slots, %"PRIu32" events "
+	       "per thread.  Times are relative to when the file was "
+	       "created.\n", ff.hdr->pid, ff.hdr->num_slots,
+	       ff.hdr->ring_len);
+	for (i = 0; i < ff.hdr->num_slots; i++) {
+		slot = flight_get_slot(&ff, i);
+		if (slot->state == FLIGHT_SLOT_FREE)
+			continue;
+		dump_slot(&ff, slot, evs, held);
+	}
+	free(evs);
+	free(held);
+	flight_close(&ff);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: %s [-c] <flight recorder file>\n"
+		"  -c  write Chrome trace-event JSON\n", argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,347 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flight.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Converts flight recorder files to Chrome trace-event JSON.
+ */
+
+/**
+ * An event, and the thread which recorded it.
+ */
+struct trace_event {
+	struct flight_event ev;
+	/** Track ID of the thread: its slot index plus 1 */
+	uint32_t tid;
+	/** Index of the event in its thread's list, to keep the sort stable */
+	uint32_t idx;
+};
+
+/**
+ * A slice which has begun but not ended yet.
+ */
+struct open_slice {
+	uint64_t lock;
+	uint64_t site;
+	uint64_t ns;
+	int depth;
+};
+
+/**
+ * The last release of a lock which no other thread has taken since.
+ */
+struct last_release {
+	uint64_t lock;
+	uint64_t ns;
+	uint32_t tid;
+};
+
+struct trace_writer {
+	FILE *out;
+	uint64_t start_ns;
+	uint64_t pid;
+	int first;
+};
+
+/**
+ * Write a string as the contents of a JSON string.
+ */
+static void trace_escape(FILE *out, const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = 0; (i < len) && (str[i]); i++) {
+		if ((str[i] == '"') || (str[i] == '\\'))
+			fprintf(out, "\\%c", str[i]);
+		else if ((unsigned char)str[i] < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char)str[i]);
+		else
+			fputc(str[i], out);
+	}
+}
+
+static void trace_begin(struct trace_writer *tw)
+{
+	fprintf(tw->out, tw->first ? "\n" : ",\n");
+	tw->first = 0;
+}
+
+static double trace_us(const struct trace_writer *tw, uint64_t ns)
+{
+	return ((int64_t)(ns - tw->start_ns)) / 1000.0;
+}
+
+static void trace_slice(struct trace_writer *tw, uint32_t tid,
+		const char *what, const struct open_slice *sl, uint64_t end_ns,
+		int unfinished)
+{
+	trace_begin(tw);
+	fprintf(tw->out, "{\"name\":\"%s 0x%"PRIx64"\",\"cat\":\"lock\","
+		"\"ph\":\"X\",\"pid\":%"PRIu64",\"tid\":%"PRIu32",\"ts\":%.3f,"
+		"\"dur\":%.3f,\"args\":{\"lock\":\"0x%"PRIx64"\",\"site\":"
+		"\"0x%"PRIx64"\"%s}}", what, sl->lock, tw->pid, tid,
+		trace_us(tw, sl->ns), (end_ns - sl->ns) / 1000.0, sl->lock,
+		sl->site, unfinished ? ",\"unfinished\":true" : "");
+}
+
+static void trace_flow(struct trace_writer *tw, uint64_t id, uint64_t lock,
+		const struct last_release *rel, uint32_t tid, uint64_t ns)
+{
+	/* A flow start binds to the slice which encloses it, so start the
+	 * arrow just before the releasing thread's holding slice ends. */
+	trace_begin(tw);
+	fprintf(tw->out, "{\"name\":\"hand-off 0x%"PRIx64"\",\"cat\":\"lock\","
+		"\"ph\":\"s\",\"id\":%"PRIu64",\"pid\":%"PRIu64",\"tid\":"
+		"%"PRIu32",\"ts\":%.3f}", lock, id, tw->pid, rel->tid,
+		trace_us(tw, rel->ns) - 0.001);
+	trace_begin(tw);
+	fprintf(tw->out, "{\"name\":\"hand-off 0x%"PRIx64"\",\"cat\":\"lock\","
+		"\"ph\":\"f\",\"id\":%"PRIu64",\"pid\":%"PRIu64",\"tid\":"
+		"%"PRIu32",\"ts\":%.3f}", lock, id, tw->pid, tid,
+		trace_us(tw, ns));
+}
+
+static struct open_slice *find_open(struct open_slice *sl, int num,
+				    uint64_t lock)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (sl[i].lock == lock)
+			return &sl[i];
+	}
+	return NULL;
+}
+
+/**
+ * Write the waiting and holding slices of one thread.
+ *
+ * @param tw		The writer.
+ * @param evs		The thread's events, oldest first.
+ * @param num		Number of events.
+ * @param end_ns	When slices which are still open end.
+ * @param waits		Scratch space for num open waits.
+ * @param held		Scratch space for num open holds.
+ */
+static void trace_thread(struct trace_writer *tw,
+		const struct trace_event *evs, uint32_t num, uint64_t end_ns,
+		struct open_slice *waits, struct open_slice *held)
+{
+	const struct flight_event *ev;
+	struct open_slice *sl;
+	int num_waits = 0, num_held = 0, i;
+	uint32_t j;
+
+	for (j = 0; j < num; j++) {
+		ev = &evs[j].ev;
+		switch (ev->op) {
+		case FLIGHT_OP_WAIT:
+			sl = find_open(waits, num_waits, ev->lock);
+			if (!sl)
+				sl = &waits[num_waits++];
+			sl->lock = ev->lock;
+			sl->site = ev->site;
+			sl->ns = ev->ns;
+			break;
+		case FLIGHT_OP_ACQUIRE:
+			sl = find_open(waits, num_waits, ev->lock);
+			if (sl) {
+				trace_slice(tw, evs[j].tid, "waiting for", sl,
+					    ev->ns, 0);
+				*sl = waits[--num_waits];
+			}
+			sl = find_open(held, num_held, ev->lock);
+			if (!sl) {
+				sl = &held[num_held++];
+				sl->lock = ev->lock;
+				sl->site = ev->site;
+				sl->ns = ev->ns;
+				sl->depth = 0;
+			}
+			sl->depth++;
+			break;
+		case FLIGHT_OP_RELEASE:
+			/* Locks taken before our oldest event have no
+			 * start, so we can't draw them. */
+			sl = find_open(held, num_held, ev->lock);
+			if ((!sl) || (--sl->depth > 0))
+				break;
+			trace_slice(tw, evs[j].tid, "holding", sl, ev->ns, 0);
+			*sl = held[--num_held];
+			break;
+		default:
+			break;
+		}
+	}
+	for (i = 0; i < num_waits; i++)
+		trace_slice(tw, evs[0].tid, "waiting for", &waits[i], end_ns, 1);
+	for (i = 0; i < num_held; i++)
+		trace_slice(tw, evs[0].tid, "holding", &held[i], end_ns, 1);
+}
+
+static int trace_event_compare(const void *a, const void *b)
+{
+	const struct trace_event *ea = a, *eb = b;
+
+	if (ea->ev.ns != eb->ev.ns)
+		return (ea->ev.ns < eb->ev.ns) ? -1 : 1;
+	if (ea->tid != eb->tid)
+		return (ea->tid < eb->tid) ? -1 : 1;
+	if (ea->idx != eb->idx)
+		return (ea->idx < eb->idx) ? -1 : 1;
+	return 0;
+}
+
+static struct last_release *find_release(struct last_release *tbl,
+		uint64_t mask, uint64_t lock)
+{
+	uint64_t h = (lock * 0x9e3779b97f4a7c15ULL) >> 16;
+
+	while (1) {
+		h &= mask;
+		if ((tbl[h].lock == lock) || (tbl[h].lock == 0))
+			return &tbl[h];
+		h++;
+	}
+}
+
+/**
+ * Write a flow arrow from each release to the next acquisition of the same
+ * lock by another thread.
+ *
+ * @param tw		The writer.
+ * @param all		Every thread's events.  Sorted by time.
+ * @param num		Number of events.
+ *
+ * @return		0 on success; ENOMEM on OOM.
+ */
+static int trace_flows(struct trace_writer *tw, struct trace_event *all,
+		       size_t num)
+{
+	struct last_release *tbl, *rel;
+	const struct flight_event *ev;
+	uint64_t cap = 16, id = 0;
+	size_t i;
+
+	while (cap < num * 2)
+		cap <<= 1;
+	tbl = calloc(cap, sizeof(*tbl));
+	if (!tbl)
+		return ENOMEM;
+	qsort(all, num, sizeof(*all), trace_event_compare);
+	for (i = 0; i < num; i++) {
+		ev = &all[i].ev;
+		if ((ev->lock == 0) || (ev->op == FLIGHT_OP_WAIT))
+			continue;
+		rel = find_release(tbl, cap - 1, ev->lock);
+		if (ev->op == FLIGHT_OP_RELEASE) {
+			rel->lock = ev->lock;
+			rel->ns = ev->ns;
+			rel->tid = all[i].tid;
+		} else if (rel->lock) {
+			if ((rel->tid) && (rel->tid != all[i].tid)) {
+				trace_flow(tw, ++id, ev->lock, rel,
+					   all[i].tid, ev->ns);
+			}
+			/* Only the next acquirer gets the arrow.  Leave the
+			 * entry in place, so that lookups which probed past
+			 * it still work, but forget who released it. */
+			rel->tid = 0;
+		}
+	}
+	free(tbl);
+	return 0;
+}
+
+int flight_write_chrome_trace(const struct flight_file *ff, FILE *out)
+{
+	struct trace_writer tw = { out, ff->hdr->start_ns, ff->hdr->pid, 1 };
+	uint32_t len = ff->hdr->ring_len, i, j, num;
+	struct flight_event *evs = NULL;
+	struct open_slice *waits = NULL, *held = NULL;
+	struct trace_event *all = NULL;
+	const struct flight_slot *slot;
+	uint64_t end_ns = ff->hdr->start_ns;
+	size_t total = 0, start;
+	int ret = ENOMEM;
+
+	evs = calloc(len, sizeof(*evs));
+	waits = calloc(len, sizeof(*waits));
+	held = calloc(len, sizeof(*held));
+	all = calloc((size_t)len * ff->hdr->num_slots, sizeof(*all));
+	if ((!evs) || (!waits) || (!held) || (!all))
+		goto done;
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	trace_begin(&tw);
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":"
+		"%"PRIu64",\"args\":{\"name\":\"process %"PRIu64"\"}}",
+		tw.pid, tw.pid);
+	for (i = 0; i < ff->hdr->num_slots; i++) {
+		slot = flight_get_slot(ff, i);
+		if (slot->state == FLIGHT_SLOT_FREE)
+			continue;
+		num = flight_get_events(ff, slot, evs);
+		for (j = 0; j < num; j++) {
+			all[total + j].ev = evs[j];
+			all[total + j].tid = i + 1;
+			all[total + j].idx = j;
+			if (evs[j].ns > end_ns)
+				end_ns = evs[j].ns;
+		}
+		total += num;
+		trace_begin(&tw);
+		fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":"
+			"%"PRIu64",\"tid\":%"PRIu32",\"args\":{\"name\":"
+			"\"", tw.pid, i + 1);
+		trace_escape(out, slot->name, FLIGHT_NAME_MAX);
+		fprintf(out, "\"}}");
+	}
+	for (start = 0; start < total; start += num) {
+		for (num = 0; (start + num < total) &&
+				(all[start + num].tid == all[start].tid); num++)
+			;
+		trace_thread(&tw, &all[start], num, end_ns, waits, held);
+	}
+	ret = trace_flows(&tw, all, total);
+	fprintf(out, "\n]}\n");
+done:
+	free(evs);
+	free(waits);
+	free(held);
+	free(all);
+	return ret;
+}
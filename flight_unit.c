@@ -0,0 +1,330 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flight.h"
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Checks that the flight recorder keeps each thread's last lock events in
+ * LKSMITH_FLIGHT_FILE, and that they survive the process being killed, in
+ * the given LKSMITH_MODE.
+ */
+
+#define RING_LEN 8
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_sem;
+
+static const struct flight_slot *find_slot(const struct flight_file *ff,
+					   const char *name)
+{
+	const struct flight_slot *slot;
+	uint32_t i;
+
+	for (i = 0; i < ff->hdr->num_slots; i++) {
+		slot = flight_get_slot(ff, i);
+		if ((slot->state != FLIGHT_SLOT_FREE) &&
+				(!strcmp(slot->name, name)))
+			return slot;
+	}
+	return NULL;
+}
+
+/**
+ * Get a slot's events, leaving out waits.  Full mode records a wait before
+ * each blocking lock, even if the lock turns out to be free.
+ */
+static uint32_t get_events_except_waits(const struct flight_file *ff,
+		const struct flight_slot *slot, struct flight_event *evs)
+{
+	uint32_t i, j = 0, num;
+
+	num = flight_get_events(ff, slot, evs);
+	for (i = 0; i < num; i++) {
+		if (evs[i].op != FLIGHT_OP_WAIT)
+			evs[j++] = evs[i];
+	}
+	return j;
+}
+
+/**
+ * Wait until a thread's most recent event is a wait for a lock.  Threads
+ * record the wait just before they block, so once we see it, the thread is
+ * stuck until the lock is released.
+ *
+ * @param name		The thread's name.
+ * @param lock		The lock.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+static int wait_for_waiter(const char *name, pthread_mutex_t *lock)
+{
+	struct timespec ts = { 0, 1000000 };
+	struct flight_event evs[RING_LEN];
+	struct flight_file ff;
+	const struct flight_slot *slot;
+	uint32_t num;
+	int found;
+
+	while (1) {
+		EXPECT_ZERO(flight_open(getenv("LKSMITH_FLIGHT_FILE"), &ff));
+		slot = find_slot(&ff, name);
+		num = slot ? flight_get_events(&ff, slot, evs) : 0;
+		found = (num > 0) && (evs[num - 1].op == FLIGHT_OP_WAIT) &&
+			(evs[num - 1].lock == (uintptr_t)lock);
+		flight_close(&ff);
+		if (found)
+			return 0;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void *holder_thread(void *v)
+{
+	const char *mode = v;
+	int ret = 0;
+
+	lksmith_set_thread_name("holder");
+	pthread_mutex_lock(&g_lock2);
+	sem_post(&g_sem);
+	/* Order mode doesn't hook waits, so there is nothing to wait for.
+	 * The waiter can't take the lock before we release it anyway. */
+	if (strcmp(mode, "order"))
+		ret = wait_for_waiter("waiter", &g_lock2);
+	pthread_mutex_unlock(&g_lock2);
+	return (void*)(intptr_t)ret;
+}
+
+static void *waiter_thread(void *v)
+{
+	pthread_mutex_t *lock = v;
+
+	lksmith_set_thread_name("waiter");
+	pthread_mutex_lock(lock);
+	pthread_mutex_unlock(lock);
+	return NULL;
+}
+
+/**
+ * Take some locks, and get killed while holding one of them, with another
+ * thread waiting for it.
+ */
+static int run_child(void)
+{
+	const char *mode = getenv("LKSMITH_MODE");
+	pthread_t thread;
+
+	lksmith_set_thread_name("child");
+	pthread_mutex_lock(&g_lock1);
+	pthread_mutex_lock(&g_lock2);
+	pthread_mutex_unlock(&g_lock2);
+	pthread_create(&thread, NULL, waiter_thread, &g_lock1);
+	/* Don't die until the waiter is waiting.  Order mode doesn't hook
+	 * waits, so the test doesn't look for one. */
+	if (strcmp(mode, "order")) {
+		if (wait_for_waiter("waiter", &g_lock1))
+			return EXIT_FAILURE;
+	}
+	raise(SIGKILL);
+	return EXIT_FAILURE;
+}
+
+static int test_killed(const char *mode)
+{
+	char path[] = "/tmp/flight_unit.XXXXXX";
+	char mode_env[64], path_env[64];
+	char *envp[] = { mode_env, path_env, NULL };
+	struct flight_event evs[RING_LEN];
+	struct flight_file ff;
+	const struct flight_slot *slot;
+	uint64_t lock1;
+	pid_t pid;
+	int fd, status;
+
+	fd = mkstemp(path);
+	EXPECT_GE(fd, 0);
+	close(fd);
+	snprintf(mode_env, sizeof(mode_env), "LKSMITH_MODE=%s", mode);
+	snprintf(path_env, sizeof(path_env), "LKSMITH_FLIGHT_FILE=%s", path);
+	pid = fork();
+	EXPECT_GE(pid, 0);
+	if (pid == 0) {
+		execle("/proc/self/exe", "flight_unit", "child", (char*)NULL,
+		       envp);
+		_exit(EXIT_FAILURE);
+	}
+	EXPECT_EQ(waitpid(pid, &status, 0), pid);
+	EXPECT_NONZERO(WIFSIGNALED(status));
+	EXPECT_EQ(WTERMSIG(status), SIGKILL);
+
+	EXPECT_ZERO(flight_open(path, &ff));
+	EXPECT_EQ(ff.hdr->pid, (uint64_t)pid);
+	slot = find_slot(&ff, "child");
+	EXPECT_NOT_EQ(slot, NULL);
+	EXPECT_EQ(slot->state, FLIGHT_SLOT_LIVE);
+	EXPECT_EQ(get_events_except_waits(&ff, slot, evs), 3);
+	EXPECT_EQ(evs[0].op, FLIGHT_OP_ACQUIRE);
+	EXPECT_EQ(evs[1].op, FLIGHT_OP_ACQUIRE);
+	EXPECT_EQ(evs[2].op, FLIGHT_OP_RELEASE);
+	EXPECT_NOT_EQ(evs[0].lock, evs[1].lock);
+	EXPECT_EQ(evs[1].lock, evs[2].lock);
+	EXPECT_NOT_EQ(evs[0].site, 0);
+	EXPECT_GE(evs[1].ns, evs[0].ns);
+	EXPECT_GE(evs[2].ns, evs[1].ns);
+	lock1 = evs[0].lock;
+
+	/* Order mode doesn't hook waits. */
+	if (strcmp(mode, "order")) {
+		slot = find_slot(&ff, "waiter");
+		EXPECT_NOT_EQ(slot, NULL);
+		EXPECT_EQ(flight_get_events(&ff, slot, evs), 1);
+		EXPECT_EQ(evs[0].op, FLIGHT_OP_WAIT);
+		EXPECT_EQ(evs[0].lock, lock1);
+	}
+	flight_close(&ff);
+	EXPECT_ZERO(unlink(path));
+	return 0;
+}
+
+static int test_ring(const char *mode)
+{
+	struct flight_event evs[RING_LEN];
+	struct flight_file ff;
+	const struct flight_slot *slot;
+	uint32_t i;
+	int j;
+
+	lksmith_set_thread_name("main");
+	for (j = 0; j < 10; j++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	}
+
+	/* The file can be read while we are still running.  Only the last
+	 * RING_LEN events are kept. */
+	EXPECT_ZERO(flight_open(getenv("LKSMITH_FLIGHT_FILE"), &ff));
+	EXPECT_EQ(ff.hdr->ring_len, RING_LEN);
+	slot = find_slot(&ff, "main");
+	EXPECT_NOT_EQ(slot, NULL);
+	EXPECT_EQ(slot->head, strcmp(mode, "full") ? 20 : 30);
+	EXPECT_EQ(flight_get_events(&ff, slot, evs), RING_LEN);
+	for (i = 0; i < RING_LEN; i++)
+		EXPECT_EQ(evs[i].lock, (uintptr_t)&g_lock1);
+	EXPECT_EQ(evs[RING_LEN - 1].op, FLIGHT_OP_RELEASE);
+	EXPECT_EQ(evs[RING_LEN - 2].op, FLIGHT_OP_ACQUIRE);
+	flight_close(&ff);
+	EXPECT_EQ(flight_open("/dev/null", &ff), EINVAL);
+	return 0;
+}
+
+static int test_chrome_trace(const char *mode)
+{
+	struct flight_file ff;
+	pthread_t holder, waiter;
+	void *ret;
+	char buf[65536], expect[64];
+	FILE *fp;
+	size_t len;
+
+	/* Hand g_lock2 from the holder thread to the waiter thread.  The
+	 * holder doesn't let go until the waiter has started waiting. */
+	EXPECT_ZERO(sem_init(&g_sem, 0, 0));
+	EXPECT_ZERO(pthread_create(&holder, NULL, holder_thread,
+				   (void*)mode));
+	EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_create(&waiter, NULL, waiter_thread, &g_lock2));
+	EXPECT_ZERO(pthread_join(holder, &ret));
+	EXPECT_EQ(ret, NULL);
+	EXPECT_ZERO(pthread_join(waiter, NULL));
+	EXPECT_ZERO(sem_destroy(&g_sem));
+
+	EXPECT_ZERO(flight_open(getenv("LKSMITH_FLIGHT_FILE"), &ff));
+	fp = tmpfile();
+	EXPECT_NOT_EQ(fp, NULL);
+	EXPECT_ZERO(flight_write_chrome_trace(&ff, fp));
+	flight_close(&ff);
+	rewind(fp);
+	len = fread(buf, 1, sizeof(buf) - 1, fp);
+	buf[len] = '\0';
+	fclose(fp);
+	EXPECT_NOT_EQ(strstr(buf, "\"traceEvents\""), NULL);
+	EXPECT_NOT_EQ(strstr(buf, "\"args\":{\"name\":\"holder\"}"), NULL);
+	snprintf(expect, sizeof(expect), "\"holding %p\"", &g_lock2);
+	EXPECT_NOT_EQ(strstr(buf, expect), NULL);
+	snprintf(expect, sizeof(expect), "\"waiting for %p\"", &g_lock2);
+	if (strcmp(mode, "order")) {
+		EXPECT_NOT_EQ(strstr(buf, expect), NULL);
+	} else {
+		EXPECT_EQ(strstr(buf, expect), NULL);
+	}
+	/* The hand-off is drawn as a flow arrow. */
+	snprintf(expect, sizeof(expect), "\"hand-off %p\"", &g_lock2);
+	EXPECT_NOT_EQ(strstr(buf, expect), NULL);
+	EXPECT_NOT_EQ(strstr(buf, "\"ph\":\"s\""), NULL);
+	EXPECT_NOT_EQ(strstr(buf, "\"ph\":\"f\""), NULL);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static char path_env[64];
+
+	if ((argc >= 2) && (!strcmp(argv[1], "child")))
+		return run_child();
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	snprintf(path_env, sizeof(path_env),
+		 "LKSMITH_FLIGHT_FILE=/tmp/flight_unit.%lld.main",
+		 (long long)getpid());
+	putenv(path_env);
+	putenv("LKSMITH_FLIGHT_EVENTS=8");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_ring(argv[1]));
+	EXPECT_ZERO(test_chrome_trace(argv[1]));
+	EXPECT_ZERO(test_killed(argv[1]));
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(unlink(getenv("LKSMITH_FLIGHT_FILE")));
+
+	return EXIT_SUCCESS;
+}
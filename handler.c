@@ -214,98 +214,209 @@ int pthread_mutex_destroy(pthread_mutex_t *mutex)
 	return ret;
 }
 
-int pthread_mutex_trylock(pthread_mutex_t *mutex)
+/******************************************************************
+ * Mode handlers
+ *
+ * Each mode gets its own set of lock and unlock functions, so that the hot
+ * path only does the work which that mode needs.  The public pthreads
+ * functions below call through g_lock_ops, which starts out pointing at
+ * the bootstrap functions.
+ *****************************************************************/
+struct lksmith_lock_ops {
+	int (*mutex_trylock)(pthread_mutex_t *mutex, const void *site);
+	int (*mutex_lock)(pthread_mutex_t *mutex, const void *site);
+	int (*mutex_timedlock)(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts, const void *site);
+	int (*mutex_unlock)(pthread_mutex_t *mutex);
+	int (*spin_trylock)(pthread_spinlock_t *lock, const void *site);
+	int (*spin_lock)(pthread_spinlock_t *lock, const void *site);
+	int (*spin_unlock)(pthread_spinlock_t *lock);
+	int (*cond_wait)(pthread_cond_t *__restrict cond,
+		pthread_mutex_t *__restrict mutex);
+	int (*cond_timedwait)(pthread_cond_t *__restrict cond,
+		pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict abstime, const void *site);
+};
+
+static const struct lksmith_lock_ops g_bootstrap_ops;
+
+/**
+ * The handler functions for the current mode.  This is set once, by
+ * lksmith_handler_set_mode.
+ */
+static const struct lksmith_lock_ops *g_lock_ops = &g_bootstrap_ops;
+
+/******** bootstrap: initialize, then use the real mode ********/
+static int bootstrap_mutex_trylock(pthread_mutex_t *mutex, const void *site)
 {
-	int ret = lksmith_prelock(mutex, 1);
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	ret = r_pthread_mutex_trylock(mutex);
-	lksmith_postlock(mutex, ret);
-	return ret;
+	return g_lock_ops->mutex_trylock(mutex, site);
 }
 
-int pthread_mutex_lock(pthread_mutex_t *mutex)
+static int bootstrap_mutex_lock(pthread_mutex_t *mutex, const void *site)
 {
-	int ret = lksmith_prelock(mutex, 1);
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	ret = r_pthread_mutex_lock(mutex);
-	lksmith_postlock(mutex, ret);
-	return ret;
+	return g_lock_ops->mutex_lock(mutex, site);
 }
 
-int pthread_mutex_timedlock(pthread_mutex_t *__restrict mutex,
-		__const struct timespec *__restrict ts)
+static int bootstrap_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts, const void *site)
 {
-	int ret = lksmith_prelock(mutex, 1);
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	ret = r_pthread_mutex_timedlock(mutex, ts);
-	lksmith_postlock(mutex, ret);
-	return ret;
+	return g_lock_ops->mutex_timedlock(mutex, ts, site);
 }
 
-int pthread_mutex_unlock(pthread_mutex_t *__restrict mutex)
+static int bootstrap_mutex_unlock(pthread_mutex_t *mutex)
 {
-	int ret = lksmith_preunlock(mutex);
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	ret = r_pthread_mutex_unlock(mutex);
+	return g_lock_ops->mutex_unlock(mutex);
+}
+
+static int bootstrap_spin_trylock(pthread_spinlock_t *lock, const void *site)
+{
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	lksmith_postunlock(mutex);
-	return 0;
+	return g_lock_ops->spin_trylock(lock, site);
 }
 
-// TODO: pthread_rwlock stuff
-int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
+static int bootstrap_spin_lock(pthread_spinlock_t *lock, const void *site)
 {
-	int ret;
-
-	ret = lksmith_optional_init((const void*)lock, 0, 0);
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	ret = r_pthread_spin_init(lock, pshared);
-	if (ret) {
-		lksmith_error(ret, "pthread_spin_init(mutex=%p): "
-			"failed with error %s (%d)", lock, terror(ret), ret);
-		lksmith_destroy((const void*)lock);
-		return ret;
-	}
-	return 0;
+	return g_lock_ops->spin_lock(lock, site);
 }
 
-int pthread_spin_destroy(pthread_spinlock_t *lock)
+static int bootstrap_spin_unlock(pthread_spinlock_t *lock)
 {
-	int ret;
+	int ret = init_tls();
+	if (ret)
+		return ret;
+	return g_lock_ops->spin_unlock(lock);
+}
 
-	ret = lksmith_destroy((const void*)lock);
+static int bootstrap_cond_wait(pthread_cond_t *__restrict cond,
+		pthread_mutex_t *__restrict mutex)
+{
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	return r_pthread_spin_destroy(lock);
+	return g_lock_ops->cond_wait(cond, mutex);
 }
 
-int pthread_spin_lock(pthread_spinlock_t *lock)
+static int bootstrap_cond_timedwait(pthread_cond_t *__restrict cond,
+		pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict abstime, const void *site)
 {
-	int ret = lksmith_prelock((const void*)lock, 0);
+	int ret = init_tls();
 	if (ret)
 		return ret;
-	ret = r_pthread_spin_lock(lock);
-	lksmith_postlock((const void*)lock, ret);
-	return ret;
+	return g_lock_ops->cond_timedwait(cond, mutex, abstime, site);
 }
 
-int pthread_spin_trylock(pthread_spinlock_t *lock)
+static const struct lksmith_lock_ops g_bootstrap_ops = {
+	bootstrap_mutex_trylock,
+	bootstrap_mutex_lock,
+	bootstrap_mutex_timedlock,
+	bootstrap_mutex_unlock,
+	bootstrap_spin_trylock,
+	bootstrap_spin_lock,
+	bootstrap_spin_unlock,
+	bootstrap_cond_wait,
+	bootstrap_cond_timedwait,
+};
+
+/******** off: straight to pthreads ********/
+static int off_mutex_trylock(pthread_mutex_t *mutex,
+		const void *site __attribute__((unused)))
+{
+	return r_pthread_mutex_trylock(mutex);
+}
+
+static int off_mutex_lock(pthread_mutex_t *mutex,
+		const void *site __attribute__((unused)))
+{
+	return r_pthread_mutex_lock(mutex);
+}
+
+static int off_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts,
+		const void *site __attribute__((unused)))
+{
+	return r_pthread_mutex_timedlock(mutex, ts);
+}
+
+static int off_spin_trylock(pthread_spinlock_t *lock,
+		const void *site __attribute__((unused)))
+{
+	return r_pthread_spin_trylock(lock);
+}
+
+static int off_spin_lock(pthread_spinlock_t *lock,
+		const void *site __attribute__((unused)))
+{
+	return r_pthread_spin_lock(lock);
+}
+
+static int off_mutex_unlock(pthread_mutex_t *mutex)
+{
+	return r_pthread_mutex_unlock(mutex);
+}
+
+static int off_spin_unlock(pthread_spinlock_t *lock)
+{
+	return r_pthread_spin_unlock(lock);
+}
+
+static int off_cond_wait(pthread_cond_t *__restrict cond,
+		pthread_mutex_t *__restrict mutex)
+{
+	return r_pthread_cond_wait(cond, mutex);
+}
+
+static int off_cond_timedwait(pthread_cond_t *__restrict cond,
+		pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict abstime,
+		const void *site __attribute__((unused)))
 {
-	int ret = lksmith_prelock((const void*)lock, 0);
+	return r_pthread_cond_timedwait(cond, mutex, abstime);
+}
+
+static const struct lksmith_lock_ops g_off_ops = {
+	off_mutex_trylock,
+	off_mutex_lock,
+	off_mutex_timedlock,
+	off_mutex_unlock,
+	off_spin_trylock,
+	off_spin_lock,
+	off_spin_unlock,
+	off_cond_wait,
+	off_cond_timedwait,
+};
+
+/******** unlocking and condition variables, for every checking mode ********/
+static int checked_mutex_unlock(pthread_mutex_t *mutex)
+{
+	int ret = lksmith_preunlock(mutex);
 	if (ret)
 		return ret;
-	ret = r_pthread_spin_trylock(lock);
-	lksmith_postlock((const void*)lock, ret);
-	return ret;
+	ret = r_pthread_mutex_unlock(mutex);
+	if (ret)
+		return ret;
+	lksmith_postunlock(mutex);
+	return 0;
 }
 
-int pthread_spin_unlock(pthread_spinlock_t *lock)
+static int checked_spin_unlock(pthread_spinlock_t *lock)
 {
 	int ret = lksmith_preunlock((const void*)lock);
 	if (ret)
@@ -317,20 +428,9 @@ int pthread_spin_unlock(pthread_spinlock_t *lock)
 	return 0;
 }
 
-int pthread_cond_init(pthread_cond_t *__restrict cond,
-		const pthread_condattr_t *__restrict attr)
-{
-	int ret = r_pthread_cond_init(cond, attr);
-	if (ret) {
-		lksmith_error(ret, "pthread_cond_init(mutex=%p): "
-			"failed with error %s (%d)", cond, terror(ret), ret);
-	}
-	return ret;
-}
-
-int pthread_cond_timedwait(pthread_cond_t *__restrict cond,
+static int checked_cond_timedwait(pthread_cond_t *__restrict cond,
 	pthread_mutex_t *__restrict mutex,
-	const struct timespec *__restrict abstime)
+	const struct timespec *__restrict abstime, const void *site)
 {
 	struct lksmith_cond *cnd = NULL;
 	int ret = lksmith_check_locked((const void*)mutex);
@@ -344,6 +444,7 @@ int pthread_cond_timedwait(pthread_cond_t *__restrict cond,
 			cond, mutex);
 		return EPERM;
 	}
+	lksmith_check_deadline(cond, site, abstime, 1);
 	ret = lksmith_cond_prewait(cond, mutex, &cnd);
 	if (ret)
 		return ret;
@@ -352,7 +453,7 @@ int pthread_cond_timedwait(pthread_cond_t *__restrict cond,
 	return ret;
 }
 
-int pthread_cond_wait(pthread_cond_t *__restrict cond,
+static int checked_cond_wait(pthread_cond_t *__restrict cond,
 	pthread_mutex_t *__restrict mutex)
 {
 	struct lksmith_cond *cnd = NULL;
@@ -374,6 +475,447 @@ int pthread_cond_wait(pthread_cond_t *__restrict cond,
 	return ret;
 }
 
+/******** order: lock order checks, but no wait timing ********/
+static int order_mutex_trylock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = lksmith_prelock_at(mutex, 1, site);
+	if (ret)
+		return ret;
+	ret = r_pthread_mutex_trylock(mutex);
+	lksmith_postlock(mutex, ret);
+	if (ret == EBUSY)
+		lksmith_trylock_failed(mutex, site);
+	return ret;
+}
+
+static int order_mutex_lock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = lksmith_prelock_at(mutex, 1, site);
+	if (ret)
+		return ret;
+	ret = r_pthread_mutex_lock(mutex);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+static int order_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts, const void *site)
+{
+	int ret;
+
+	lksmith_check_deadline(mutex, site, ts, 0);
+	ret = lksmith_prelock_at(mutex, 1, site);
+	if (ret)
+		return ret;
+	ret = r_pthread_mutex_timedlock(mutex, ts);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+static int order_spin_trylock(pthread_spinlock_t *lock, const void *site)
+{
+	int ret = lksmith_prelock_at((const void*)lock, 0, site);
+	if (ret)
+		return ret;
+	ret = r_pthread_spin_trylock(lock);
+	lksmith_postlock((const void*)lock, ret);
+	if (ret == EBUSY)
+		lksmith_trylock_failed((const void*)lock, site);
+	return ret;
+}
+
+static int order_spin_lock(pthread_spinlock_t *lock, const void *site)
+{
+	int ret = lksmith_prelock_at((const void*)lock, 0, site);
+	if (ret)
+		return ret;
+	ret = r_pthread_spin_lock(lock);
+	lksmith_postlock((const void*)lock, ret);
+	return ret;
+}
+
+static const struct lksmith_lock_ops g_order_ops = {
+	order_mutex_trylock,
+	order_mutex_lock,
+	order_mutex_timedlock,
+	checked_mutex_unlock,
+	order_spin_trylock,
+	order_spin_lock,
+	checked_spin_unlock,
+	checked_cond_wait,
+	checked_cond_timedwait,
+};
+
+/******** profile: wait timing, but no order checks ********/
+/*
+ * In profile mode, we try the real lock first.  If nobody else holds it, we
+ * record the holder without a backtrace and move on.  Only when the lock is
+ * contended do we pay for a backtrace of the waiter and time the wait.
+ */
+static int profile_mutex_trylock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = r_pthread_mutex_trylock(mutex);
+	if (ret == 0)
+		lksmith_took_lock(mutex, 1, site);
+	else if (ret == EBUSY)
+		lksmith_trylock_failed(mutex, site);
+	return ret;
+}
+
+static int profile_mutex_lock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = r_pthread_mutex_trylock(mutex);
+	if (ret == 0) {
+		lksmith_took_lock(mutex, 1, site);
+		return 0;
+	} else if (ret != EBUSY) {
+		return ret;
+	}
+	ret = lksmith_prelock_nocheck(mutex, 1, site, 1);
+	if (ret)
+		return ret;
+	ret = lksmith_prewait(mutex);
+	if (ret) {
+		lksmith_postlock(mutex, ret);
+		return ret;
+	}
+	ret = r_pthread_mutex_lock(mutex);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+static int profile_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts, const void *site)
+{
+	int ret;
+
+	lksmith_check_deadline(mutex, site, ts, 0);
+	ret = r_pthread_mutex_trylock(mutex);
+	if (ret == 0) {
+		lksmith_took_lock(mutex, 1, site);
+		return 0;
+	} else if (ret != EBUSY) {
+		return ret;
+	}
+	ret = lksmith_prelock_nocheck(mutex, 1, site, 1);
+	if (ret)
+		return ret;
+	ret = lksmith_prewait(mutex);
+	if (ret) {
+		lksmith_postlock(mutex, ret);
+		return ret;
+	}
+	ret = r_pthread_mutex_timedlock(mutex, ts);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+static int profile_spin_trylock(pthread_spinlock_t *lock, const void *site)
+{
+	int ret = r_pthread_spin_trylock(lock);
+	if (ret == 0)
+		lksmith_took_lock((const void*)lock, 0, site);
+	else if (ret == EBUSY)
+		lksmith_trylock_failed((const void*)lock, site);
+	return ret;
+}
+
+static int profile_spin_lock(pthread_spinlock_t *lock, const void *site)
+{
+	int ret = r_pthread_spin_trylock(lock);
+	if (ret == 0) {
+		lksmith_took_lock((const void*)lock, 0, site);
+		return 0;
+	} else if (ret != EBUSY) {
+		return ret;
+	}
+	ret = lksmith_prelock_nocheck((const void*)lock, 0, site, 1);
+	if (ret)
+		return ret;
+	ret = r_pthread_spin_lock(lock);
+	lksmith_postlock((const void*)lock, ret);
+	return ret;
+}
+
+static const struct lksmith_lock_ops g_profile_ops = {
+	profile_mutex_trylock,
+	profile_mutex_lock,
+	profile_mutex_timedlock,
+	checked_mutex_unlock,
+	profile_spin_trylock,
+	profile_spin_lock,
+	checked_spin_unlock,
+	checked_cond_wait,
+	checked_cond_timedwait,
+};
+
+/******** full: every check ********/
+static int full_mutex_lock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = lksmith_prelock_at(mutex, 1, site);
+	if (ret)
+		return ret;
+	ret = lksmith_prewait(mutex);
+	if (ret) {
+		lksmith_postlock(mutex, ret);
+		return ret;
+	}
+	ret = r_pthread_mutex_lock(mutex);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+static int full_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts, const void *site)
+{
+	int ret;
+
+	lksmith_check_deadline(mutex, site, ts, 0);
+	ret = lksmith_prelock_at(mutex, 1, site);
+	if (ret)
+		return ret;
+	ret = lksmith_prewait(mutex);
+	if (ret) {
+		lksmith_postlock(mutex, ret);
+		return ret;
+	}
+	ret = r_pthread_mutex_timedlock(mutex, ts);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+/* Try-locks and spin locks never wait, so they are the same as in order
+ * mode. */
+static const struct lksmith_lock_ops g_full_ops = {
+	order_mutex_trylock,
+	full_mutex_lock,
+	full_mutex_timedlock,
+	checked_mutex_unlock,
+	order_spin_trylock,
+	order_spin_lock,
+	checked_spin_unlock,
+	checked_cond_wait,
+	checked_cond_timedwait,
+};
+
+/*
+ * When nothing needs to know which lock a thread is waiting for, full mode
+ * skips lksmith_prewait.
+ */
+static int full_nowait_mutex_lock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = lksmith_prelock_at(mutex, 1, site);
+	if (ret)
+		return ret;
+	ret = r_pthread_mutex_lock(mutex);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+static int full_nowait_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts, const void *site)
+{
+	int ret;
+
+	lksmith_check_deadline(mutex, site, ts, 0);
+	ret = lksmith_prelock_at(mutex, 1, site);
+	if (ret)
+		return ret;
+	ret = r_pthread_mutex_timedlock(mutex, ts);
+	lksmith_postlock(mutex, ret);
+	return ret;
+}
+
+static const struct lksmith_lock_ops g_full_nowait_ops = {
+	order_mutex_trylock,
+	full_nowait_mutex_lock,
+	full_nowait_mutex_timedlock,
+	checked_mutex_unlock,
+	order_spin_trylock,
+	order_spin_lock,
+	checked_spin_unlock,
+	checked_cond_wait,
+	checked_cond_timedwait,
+};
+
+/******** trace: every check, and log every operation ********/
+static int trace_mutex_trylock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = order_mutex_trylock(mutex, site);
+	lksmith_trace("trylock", mutex, ret);
+	return ret;
+}
+
+static int trace_mutex_lock(pthread_mutex_t *mutex, const void *site)
+{
+	int ret = full_mutex_lock(mutex, site);
+	lksmith_trace("lock", mutex, ret);
+	return ret;
+}
+
+static int trace_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		const struct timespec *__restrict ts, const void *site)
+{
+	int ret = full_mutex_timedlock(mutex, ts, site);
+	lksmith_trace("timedlock", mutex, ret);
+	return ret;
+}
+
+static int trace_mutex_unlock(pthread_mutex_t *mutex)
+{
+	int ret = checked_mutex_unlock(mutex);
+	lksmith_trace("unlock", mutex, ret);
+	return ret;
+}
+
+static int trace_spin_trylock(pthread_spinlock_t *lock, const void *site)
+{
+	int ret = order_spin_trylock(lock, site);
+	lksmith_trace("spin_trylock", (const void*)lock, ret);
+	return ret;
+}
+
+static int trace_spin_lock(pthread_spinlock_t *lock, const void *site)
+{
+	int ret = order_spin_lock(lock, site);
+	lksmith_trace("spin_lock", (const void*)lock, ret);
+	return ret;
+}
+
+static int trace_spin_unlock(pthread_spinlock_t *lock)
+{
+	int ret = checked_spin_unlock(lock);
+	lksmith_trace("spin_unlock", (const void*)lock, ret);
+	return ret;
+}
+
+static const struct lksmith_lock_ops g_trace_ops = {
+	trace_mutex_trylock,
+	trace_mutex_lock,
+	trace_mutex_timedlock,
+	trace_mutex_unlock,
+	trace_spin_trylock,
+	trace_spin_lock,
+	trace_spin_unlock,
+	checked_cond_wait,
+	checked_cond_timedwait,
+};
+
+void lksmith_handler_set_mode(enum lksmith_mode mode, int hook_waits)
+{
+	switch (mode) {
+	case LKSMITH_MODE_OFF:
+		g_lock_ops = &g_off_ops;
+		break;
+	case LKSMITH_MODE_ORDER:
+		g_lock_ops = &g_order_ops;
+		break;
+	case LKSMITH_MODE_PROFILE:
+		g_lock_ops = &g_profile_ops;
+		break;
+	case LKSMITH_MODE_TRACE:
+		g_lock_ops = &g_trace_ops;
+		break;
+	case LKSMITH_MODE_FULL:
+	default:
+		g_lock_ops = hook_waits ? &g_full_ops : &g_full_nowait_ops;
+		break;
+	}
+}
+
+/******************************************************************
+ * pthreads functions
+ *****************************************************************/
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+	return g_lock_ops->mutex_trylock(mutex, __builtin_return_address(0));
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+	return g_lock_ops->mutex_lock(mutex, __builtin_return_address(0));
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+		__const struct timespec *__restrict ts)
+{
+	return g_lock_ops->mutex_timedlock(mutex, ts,
+		__builtin_return_address(0));
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *__restrict mutex)
+{
+	return g_lock_ops->mutex_unlock(mutex);
+}
+
+// TODO: pthread_rwlock stuff
+int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
+{
+	int ret;
+
+	ret = lksmith_optional_init((const void*)lock, 0, 0);
+	if (ret)
+		return ret;
+	ret = r_pthread_spin_init(lock, pshared);
+	if (ret) {
+		lksmith_error(ret, "pthread_spin_init(mutex=%p): "
+			"failed with error %s (%d)", lock, terror(ret), ret);
+		lksmith_destroy((const void*)lock);
+		return ret;
+	}
+	return 0;
+}
+
+int pthread_spin_destroy(pthread_spinlock_t *lock)
+{
+	int ret;
+
+	ret = lksmith_destroy((const void*)lock);
+	if (ret)
+		return ret;
+	return r_pthread_spin_destroy(lock);
+}
+
+int pthread_spin_lock(pthread_spinlock_t *lock)
+{
+	return g_lock_ops->spin_lock(lock, __builtin_return_address(0));
+}
+
+int pthread_spin_trylock(pthread_spinlock_t *lock)
+{
+	return g_lock_ops->spin_trylock(lock, __builtin_return_address(0));
+}
+
+int pthread_spin_unlock(pthread_spinlock_t *lock)
+{
+	return g_lock_ops->spin_unlock(lock);
+}
+
+int pthread_cond_init(pthread_cond_t *__restrict cond,
+		const pthread_condattr_t *__restrict attr)
+{
+	int ret = r_pthread_cond_init(cond, attr);
+	if (ret) {
+		lksmith_error(ret, "pthread_cond_init(mutex=%p): "
+			"failed with error %s (%d)", cond, terror(ret), ret);
+	}
+	return ret;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *__restrict cond,
+	pthread_mutex_t *__restrict mutex,
+	const struct timespec *__restrict abstime)
+{
+	return g_lock_ops->cond_timedwait(cond, mutex, abstime,
+					  __builtin_return_address(0));
+}
+
+int pthread_cond_wait(pthread_cond_t *__restrict cond,
+	pthread_mutex_t *__restrict mutex)
+{
+	return g_lock_ops->cond_wait(cond, mutex);
+}
+
 int pthread_cond_destroy(pthread_cond_t *cond)
 {
 	int ret = lksmith_cond_predestroy(cond);
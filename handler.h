@@ -77,9 +77,42 @@ EXTERN int (*r_pthread_cond_timedwait)(pthread_cond_t *__restrict cond,
 
 EXTERN int (*r_pthread_cond_destroy)(pthread_cond_t *cond);
 
+/******************************************************************
+ * Modes
+ *****************************************************************/
+/**
+ * What Locksmith does when a lock is taken or released.  Each mode has its
+ * own set of handler functions, chosen once at init.
+ */
+enum lksmith_mode {
+	/** Pass everything straight through to pthreads. */
+	LKSMITH_MODE_OFF = 0,
+	/** Check lock ordering only. */
+	LKSMITH_MODE_ORDER,
+	/** Time lock waits, but don't check lock ordering or take
+	 * backtraces. */
+	LKSMITH_MODE_PROFILE,
+	/** Do every check. */
+	LKSMITH_MODE_FULL,
+	/** Do every check, and log every lock and unlock. */
+	LKSMITH_MODE_TRACE,
+};
+
 /******************************************************************
  * Functions
  *****************************************************************/
 int lksmith_handler_init(void);
 
+/**
+ * Install the handler functions for a mode.
+ *
+ * This should be called once, at the end of initialization.  Until then,
+ * the handler functions initialize Locksmith on their first call.
+ *
+ * @param mode		The mode.
+ * @param hook_waits	Nonzero if lksmith_prewait has to be called before
+ *			blocking on a mutex.
+ */
+void lksmith_handler_set_mode(enum lksmith_mode mode, int hook_waits);
+
 #endif
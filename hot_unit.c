@@ -0,0 +1,181 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Checks that LKSMITH_TOPK finds the locks and call sites which spend the
+ * most time waiting and holding, in the given LKSMITH_MODE.
+ */
+
+#define TOPK 4
+
+#define NUM_DYNAMIC_LOCKS 10000
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_sem;
+
+/**
+ * Take a lock and hold it for 50 milliseconds.
+ */
+static void *holder_thread(void *v)
+{
+	pthread_mutex_t *lock = v;
+	struct timespec ts = { 0, 50000000 };
+
+	if (pthread_mutex_lock(lock))
+		return (void*)(intptr_t)EIO;
+	sem_post(&g_sem);
+	nanosleep(&ts, NULL);
+	pthread_mutex_unlock(lock);
+	return NULL;
+}
+
+/**
+ * Wait for a lock while holder_thread holds it.
+ */
+static int wait_for_holder(pthread_mutex_t *lock)
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(sem_init(&g_sem, 0, 0));
+	EXPECT_ZERO(pthread_create(&thread, NULL, holder_thread, lock));
+	EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_mutex_lock(lock));
+	EXPECT_ZERO(pthread_mutex_unlock(lock));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_ZERO(sem_destroy(&g_sem));
+	return 0;
+}
+
+static int test_hot_sites(void)
+{
+	struct lksmith_hot_site hot[TOPK * 2];
+	int num;
+
+	EXPECT_ZERO(wait_for_holder(&g_lock1));
+
+	num = TOPK * 2;
+	EXPECT_ZERO(lksmith_get_hot_sites(LKSMITH_HOT_WAIT, hot, &num));
+	EXPECT_GT(num, 0);
+	EXPECT_EQ(hot[0].lock, &g_lock1);
+	EXPECT_NOT_EQ(hot[0].site, NULL);
+	EXPECT_GE(hot[0].total_ns, 20000000ULL);
+
+	/* The holder thread's sketch was merged when it exited. */
+	num = TOPK * 2;
+	EXPECT_ZERO(lksmith_get_hot_sites(LKSMITH_HOT_HOLD, hot, &num));
+	EXPECT_GT(num, 0);
+	EXPECT_EQ(hot[0].lock, &g_lock1);
+	EXPECT_GE(hot[0].total_ns, 40000000ULL);
+	EXPECT_EQ(lksmith_get_hot_sites(2, hot, &num), EINVAL);
+	return 0;
+}
+
+static int test_handoff(void)
+{
+	struct lksmith_handoff_stats stats;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	/* test_hot_sites handed g_lock1 off from the holder thread to us.
+	 * Waking us up should take much less time than the lock was held. */
+	EXPECT_ZERO(lksmith_get_handoff_stats(&g_lock1, &stats));
+	EXPECT_EQ(stats.count, 1);
+	EXPECT_EQ(stats.total_ns, stats.max_ns);
+	EXPECT_LT(stats.max_ns, 40000000ULL);
+	EXPECT_GE(stats.max_ns, stats.p99_ns);
+	EXPECT_GE(stats.p99_ns, stats.p50_ns);
+
+	EXPECT_ZERO(pthread_mutex_lock(&lock));
+	EXPECT_ZERO(pthread_mutex_unlock(&lock));
+	EXPECT_EQ(lksmith_get_handoff_stats(&lock, &stats), ENOENT);
+
+	/* Hand-offs of destroyed locks are kept. */
+	EXPECT_ZERO(wait_for_holder(&lock));
+	EXPECT_ZERO(pthread_mutex_destroy(&lock));
+	EXPECT_ZERO(lksmith_get_handoff_stats(&lock, &stats));
+	EXPECT_EQ(stats.count, 1);
+	return 0;
+}
+
+static int test_bounded(void)
+{
+	struct lksmith_hot_site hot[TOPK * 2];
+	pthread_mutex_t *locks;
+	int i, num;
+
+	/* Each lock is at a different address, so each is a different key. */
+	locks = calloc(NUM_DYNAMIC_LOCKS, sizeof(pthread_mutex_t));
+	EXPECT_NOT_EQ(locks, NULL);
+	for (i = 0; i < NUM_DYNAMIC_LOCKS; i++) {
+		EXPECT_ZERO(pthread_mutex_init(&locks[i], NULL));
+		EXPECT_ZERO(pthread_mutex_lock(&locks[i]));
+		EXPECT_ZERO(pthread_mutex_unlock(&locks[i]));
+		EXPECT_ZERO(pthread_mutex_destroy(&locks[i]));
+	}
+	free(locks);
+	num = TOPK * 2;
+	EXPECT_ZERO(lksmith_get_hot_sites(LKSMITH_HOT_HOLD, hot, &num));
+	EXPECT_EQ(num, TOPK);
+	/* test_handoff's holder thread held another lock for as long as
+	 * g_lock1, so either may come first.  But none of the small locks may
+	 * push g_lock1 out, or rank above it. */
+	for (i = 0; (i < num) && (hot[i].lock != &g_lock1); i++)
+		EXPECT_GE(hot[i].total_ns, 40000000ULL);
+	EXPECT_LT(i, num);
+	EXPECT_ZERO(lksmith_report_hot_sites());
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	putenv("LKSMITH_TOPK=4");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_hot_sites());
+	EXPECT_ZERO(test_handoff());
+	EXPECT_ZERO(test_bounded());
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "idvec.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Find the position of an ID in a sorted array.
+ *
+ * @param arr		The sorted array
+ * @param size		The length of the array
+ * @param id		The ID to look for
+ * @param found		(out param) 1 if the ID was found; 0 otherwise
+ *
+ * @return		The index of the ID if it was found; otherwise, the
+ *			index where it should be inserted.
+ */
+static uint32_t idvec_search(const uint32_t *arr, uint32_t size,
+			uint32_t id, int *found)
+{
+	uint32_t lo = 0, hi = size, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (arr[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = ((lo < size) && (arr[lo] == id));
+	return lo;
+}
+
+int idvec_add(struct idvec *v, uint32_t id)
+{
+	uint32_t idx, ncap, *arr, *narr;
+	int found;
+
+	arr = (uint32_t*)idvec_data(v);
+	idx = idvec_search(arr, v->size, id, &found);
+	if (found)
+		return 0;
+	if ((v->cap == 0) && (v->size == IDVEC_INLINE)) {
+		/* Spill the inline storage to the heap. */
+		ncap = IDVEC_INLINE * 2;
+		narr = malloc(sizeof(uint32_t) * ncap);
+		if (!narr)
+			return ENOMEM;
+		memcpy(narr, v->u.inl, sizeof(uint32_t) * v->size);
+		v->u.ext = narr;
+		v->cap = ncap;
+		arr = narr;
+	} else if ((v->cap != 0) && (v->size == v->cap)) {
+		ncap = v->cap * 2;
+		narr = realloc(v->u.ext, sizeof(uint32_t) * ncap);
+		if (!narr)
+			return ENOMEM;
+		v->u.ext = narr;
+		v->cap = ncap;
+		arr = narr;
+	}
+	memmove(&arr[idx + 1], &arr[idx], sizeof(uint32_t) * (v->size - idx));
+	arr[idx] = id;
+	v->size++;
+	return 0;
+}
+
+int idvec_remove(struct idvec *v, uint32_t id)
+{
+	uint32_t idx, ncap, *arr, *narr;
+	int found;
+
+	arr = (uint32_t*)idvec_data(v);
+	idx = idvec_search(arr, v->size, id, &found);
+	if (!found)
+		return ENOENT;
+	memmove(&arr[idx], &arr[idx + 1],
+		sizeof(uint32_t) * (v->size - idx - 1));
+	v->size--;
+	if (v->cap == 0)
+		return 0;
+	if (v->size <= IDVEC_INLINE) {
+		/* Move back into the inline storage. */
+		narr = v->u.ext;
+		memcpy(v->u.inl, narr, sizeof(uint32_t) * v->size);
+		free(narr);
+		v->cap = 0;
+	} else if (v->size <= (v->cap / 4)) {
+		/* Shrink by half.  We wait until the array is a quarter
+		 * full, so that alternating adds and removes at a boundary
+		 * don't cause a realloc every time. */
+		ncap = v->cap / 2;
+		narr = realloc(v->u.ext, sizeof(uint32_t) * ncap);
+		if (narr) {
+			v->u.ext = narr;
+			v->cap = ncap;
+		}
+	}
+	return 0;
+}
+
+int idvec_contains(const struct idvec *v, uint32_t id)
+{
+	int found;
+
+	idvec_search(idvec_data(v), v->size, id, &found);
+	return found;
+}
+
+void idvec_free(struct idvec *v)
+{
+	if (v->cap)
+		free(v->u.ext);
+	memset(v, 0, sizeof(*v));
+}
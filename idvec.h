@@ -0,0 +1,110 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_IDVEC_H
+#define LKSMITH_IDVEC_H
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+/**
+ * The number of IDs that an idvec can hold without allocating any memory.
+ */
+#define IDVEC_INLINE 4
+
+/**
+ * A sorted set of 32-bit IDs.
+ *
+ * Small sets are stored inline.  Once a set outgrows the inline storage, it
+ * spills into a heap array whose capacity grows and shrinks geometrically, so
+ * that adding or removing one element doesn't cost a realloc.
+ */
+struct idvec {
+	/** Number of IDs in the set */
+	uint32_t size;
+	/** Capacity of the heap array, or 0 if we're using inline storage */
+	uint32_t cap;
+	union {
+		/** Inline storage, used when cap == 0 */
+		uint32_t inl[IDVEC_INLINE];
+		/** Heap storage, used when cap != 0 */
+		uint32_t *ext;
+	} u;
+};
+
+/**
+ * Get a pointer to the sorted IDs in an idvec.
+ *
+ * @param v		The idvec
+ *
+ * @return		A pointer to v->size sorted IDs.  This pointer is
+ *			invalidated by any modification to the idvec.
+ */
+static inline const uint32_t *idvec_data(const struct idvec *v)
+{
+	return v->cap ? v->u.ext : v->u.inl;
+}
+
+/**
+ * Add an ID to an idvec, if it's not already there.
+ *
+ * @param v		The idvec
+ * @param id		The ID to add
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+int idvec_add(struct idvec *v, uint32_t id);
+
+/**
+ * Remove an ID from an idvec.
+ *
+ * @param v		The idvec
+ * @param id		The ID to remove
+ *
+ * @return		0 on success; ENOENT if the ID was not present.
+ */
+int idvec_remove(struct idvec *v, uint32_t id);
+
+/**
+ * Determine if an idvec contains an ID.
+ *
+ * @param v		The idvec
+ * @param id		The ID to look for
+ *
+ * @return		1 if the ID is present; 0 otherwise.
+ */
+int idvec_contains(const struct idvec *v, uint32_t id);
+
+/**
+ * Free the memory associated with an idvec, leaving it empty.
+ *
+ * @param v		The idvec
+ */
+void idvec_free(struct idvec *v);
+
+#endif
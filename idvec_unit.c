@@ -0,0 +1,115 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "idvec.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int check_sorted(const struct idvec *v)
+{
+	uint32_t i;
+	const uint32_t *arr = idvec_data(v);
+
+	for (i = 1; i < v->size; i++) {
+		EXPECT_LT(arr[i - 1], arr[i]);
+	}
+	return 0;
+}
+
+static int test_idvec_inline(void)
+{
+	struct idvec v;
+
+	memset(&v, 0, sizeof(v));
+	EXPECT_ZERO(idvec_add(&v, 30));
+	EXPECT_ZERO(idvec_add(&v, 10));
+	EXPECT_ZERO(idvec_add(&v, 20));
+	/* adding a duplicate is a no-op */
+	EXPECT_ZERO(idvec_add(&v, 10));
+	EXPECT_EQ(v.size, 3);
+	EXPECT_EQ(v.cap, 0);
+	EXPECT_ZERO(check_sorted(&v));
+	EXPECT_EQ(idvec_contains(&v, 20), 1);
+	EXPECT_EQ(idvec_contains(&v, 25), 0);
+	EXPECT_ZERO(idvec_remove(&v, 20));
+	EXPECT_EQ(idvec_remove(&v, 20), ENOENT);
+	EXPECT_EQ(v.size, 2);
+	idvec_free(&v);
+	EXPECT_EQ(v.size, 0);
+	return 0;
+}
+
+static int test_idvec_spill(void)
+{
+	struct idvec v;
+	uint32_t i;
+
+	memset(&v, 0, sizeof(v));
+	/* Insert in a scrambled order, so that we exercise insertion into
+	 * the middle of the array. */
+	for (i = 0; i < 1000; i++) {
+		EXPECT_ZERO(idvec_add(&v, (i * 7919) % 1000));
+	}
+	EXPECT_EQ(v.size, 1000);
+	EXPECT_GE(v.cap, 1000);
+	EXPECT_ZERO(check_sorted(&v));
+	for (i = 0; i < 1000; i++) {
+		EXPECT_EQ(idvec_contains(&v, i), 1);
+	}
+	/* Removing most of the elements should shrink the array, and
+	 * eventually move us back to inline storage. */
+	for (i = 0; i < 990; i++) {
+		EXPECT_ZERO(idvec_remove(&v, i));
+	}
+	EXPECT_LT(v.cap, 100);
+	EXPECT_ZERO(check_sorted(&v));
+	for (i = 990; i < 997; i++) {
+		EXPECT_ZERO(idvec_remove(&v, i));
+	}
+	EXPECT_EQ(v.size, 3);
+	EXPECT_EQ(v.cap, 0);
+	EXPECT_EQ(idvec_contains(&v, 998), 1);
+	EXPECT_EQ(idvec_contains(&v, 996), 0);
+	idvec_free(&v);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(die_on_error);
+	EXPECT_ZERO(test_idvec_inline());
+	EXPECT_ZERO(test_idvec_spill());
+
+	return EXIT_SUCCESS;
+}
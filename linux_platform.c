@@ -28,12 +28,19 @@
  */
 
 #include "platform.h"
+#include "util.h"
 
+#include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
+#include <time.h>
 
 extern pid_t gettid(void);
 
@@ -46,6 +53,101 @@ void platform_create_thread_name(char * __restrict out, size_t out_len)
 	snprintf(out, out_len, "thread_%"PRId64, (uint64_t)tid);
 }
 
+int platform_get_sched(struct platform_sched *out)
+{
+	struct sched_param param;
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	int nice;
+
+	/* On Linux, the scheduling policy and nice value belong to each
+	 * thread, not to the process as a whole.  A pid of 0 means the
+	 * calling thread here. */
+	out->policy = sched_getscheduler(0);
+	if (out->policy < 0)
+		return errno;
+	if (sched_getparam(0, &param) < 0)
+		return errno;
+	out->rt_priority = param.sched_priority;
+	errno = 0;
+	nice = getpriority(PRIO_PROCESS, tid);
+	if ((nice == -1) && (errno))
+		return errno;
+	out->nice = nice;
+	return 0;
+}
+
+int platform_get_usage(struct platform_usage *out)
+{
+	struct timespec ts;
+	struct rusage ru;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return errno;
+	if (getrusage(RUSAGE_THREAD, &ru) < 0)
+		return errno;
+	out->cpu_ns = ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+	out->majflt = ru.ru_majflt;
+	out->nvcsw = ru.ru_nvcsw;
+	out->nivcsw = ru.ru_nivcsw;
+	return 0;
+}
+
+int platform_get_cpu(void)
+{
+	/* On x86-64, this is a vDSO call which reads the CPU number from the
+	 * TSC_AUX register, or from rseq. */
+	return sched_getcpu();
+}
+
+int platform_get_cpu_nodes(int *nodes, int num_cpus)
+{
+	char path[PATH_MAX], buf[8192];
+	struct dirent *de;
+	DIR *dp;
+	FILE *fp;
+	int node, ret = 0;
+
+	dp = opendir("/sys/devices/system/node");
+	if (!dp)
+		return errno;
+	while ((de = readdir(dp))) {
+		if (sscanf(de->d_name, "node%d", &node) != 1)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/"
+			 "cpulist", de->d_name);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (!fgets(buf, sizeof(buf), fp))
+			buf[0] = '\0';
+		fclose(fp);
+		ret = parse_cpulist(buf, node, nodes, num_cpus);
+		if (ret)
+			break;
+	}
+	closedir(dp);
+	return ret;
+}
+
+int platform_get_runnable(uint32_t *out)
+{
+	FILE *fp;
+	unsigned int runnable;
+	int ret = 0;
+
+	/* The fourth field of /proc/loadavg is runnable/total scheduling
+	 * entities.  Unlike the load averages, it is up to date. */
+	fp = fopen("/proc/loadavg", "r");
+	if (!fp)
+		return errno;
+	if (fscanf(fp, "%*s %*s %*s %u/", &runnable) != 1)
+		ret = EIO;
+	fclose(fp);
+	if (!ret)
+		*out = runnable;
+	return ret;
+}
+
 void* get_dlsym_next(const char *fname)
 {
 	void *v;
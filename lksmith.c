@@ -28,11 +28,18 @@
  */
 
 #include "backtrace.h"
+#include "closure.h"
 #include "config.h"
 #include "error.h"
+#include "flight.h"
 #include "handler.h"
+#include "idvec.h"
 #include "lksmith.h"
 #include "platform.h"
+#include "ptrset.h"
+#include "scc.h"
+#include "site.h"
+#include "topk.h"
 #include "tree.h"
 #include "util.h"
 
@@ -40,21 +47,90 @@
 #include <execinfo.h>
 #include <fnmatch.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /******************************************************************
  *  Locksmith private data structures
  *****************************************************************/
-#define MAX_NLOCK 0x1fffffffffffffffULL
+#define MAX_NLOCK 0x0fffffffffffffffULL
+
+/**
+ * The default maximum number of lock IDs for which we will maintain a
+ * transitive-closure matrix.  The matrix needs N^2 bits, so this works out to
+ * 2 MB.
+ */
+#define DEFAULT_CLOSURE_MAX 4096
+
+/**
+ * Tag used in g_pending for locks which were initialized as recursive.
+ */
+#define PENDING_RECURSIVE 0x1
+
+/**
+ * Graphs with at least this many locks are analyzed using more than one
+ * thread.
+ */
+#define ORDER_PARALLEL_MIN 65536
+
+/**
+ * Maximum number of threads to use when analyzing the lock order graph.
+ */
+#define ORDER_MAX_THREADS 8
+
+/**
+ * Maximum number of edges we describe for each lock order cycle.
+ */
+#define ORDER_MAX_REPORTED_EDGES 16
+
+/**
+ * How often we re-read a thread's scheduling information, in nanoseconds.
+ */
+#define SCHED_REFRESH_NS 100000000ULL
+
+/**
+ * Maximum length of a chain of waiting threads that we will follow when
+ * looking for a deadlock.
+ */
+#define MAX_WAIT_CHAIN 1024
+
+/**
+ * What we do on each lock and unlock.  Set once at init.
+ */
+static enum lksmith_mode g_mode;
+
+/**
+ * When we check for lock inversions.
+ */
+enum lksmith_order_check {
+	/** Check every new edge in the lock order graph as it is added. */
+	ORDER_CHECK_INLINE = 0,
+	/** Just record edges.  Cycles are found by lksmith_check_order, which
+	 * runs at exit. */
+	ORDER_CHECK_DEFERRED,
+};
+
+/**
+ * Lock IDs are mapped to locks through a two-level table.  Each page holds
+ * 2^LOCK_ID_PAGE_SHIFT entries.  Pages are never moved or freed, so a thread
+ * can look up a lock it holds without taking g_tree_lock.
+ */
+#define LOCK_ID_PAGE_SHIFT 12
+#define LOCK_ID_PAGE_SIZE (1U << LOCK_ID_PAGE_SHIFT)
+#define LOCK_ID_MAX_PAGES 16384
+#define LOCK_ID_MAX (LOCK_ID_PAGE_SIZE * LOCK_ID_MAX_PAGES)
 
 struct lksmith_lock_props {
 	/** The number of times this mutex has been locked. */
-	uint64_t nlock : 61;
+	uint64_t nlock : 60;
 	/** 1 if we should allow recursive locks. */
 	uint64_t recursive : 1;
 	/** 1 if this mutex is a sleeping lock */
@@ -62,6 +138,9 @@ struct lksmith_lock_props {
 	/** 1 if we have already warned about taking this lock while
 	 * a spin lock is held. */
 	uint64_t spin_warn : 1;
+	/** 1 if we have already warned about a priority inversion on this
+	 * lock. */
+	uint64_t prio_warn : 1;
 };
 
 struct lksmith_holder {
@@ -71,25 +150,307 @@ struct lksmith_holder {
 	char** bt_frames;
 	/** Number of stack frames */
 	int bt_len;
+	/** Address of the caller, or NULL if unknown */
+	const void *site;
+	/** When the lock was taken, in nanoseconds, or 0 if we aren't timing
+	 * waits */
+	uint64_t locked_ns;
 	/** Next in singly-linked list */
 	struct lksmith_holder *next;
 };
 
+/**
+ * Per-lock data which we touch on every lock and unlock.
+ *
+ * This is aligned to a cache line and fits inside one, so that looking at
+ * one lock never drags in another lock's data, and threads working on
+ * different locks don't bounce the same line back and forth.
+ */
 struct lksmith_lock {
-	RB_ENTRY(lksmith_lock) entry;
 	/** The lock pointer */
 	const void *ptr;
 	struct lksmith_lock_props props;
-	/** The color that this node has been painted (used in traversal) */
-	uint64_t color;
 	/** Lock holders */
 	struct lksmith_holder *holders;
-	/** Size of the before list. */
-	int before_size;
-	/** list of locks that have been taken before this lock */
-	struct lksmith_lock **before;
+	/** Lookup and graph data */
+	struct lksmith_lock_cold *cold;
+	/** Dense lock ID.  These are recycled when locks are destroyed. */
+	uint32_t id;
+	/** The thread which holds this lock, or NULL.  Not maintained for
+	 * lock arrays. */
+	struct lksmith_tls *owner;
+	/** When this lock was last released, in nanoseconds, or 0.  Only
+	 * maintained when we are tracking hot sites.  Written by the holder
+	 * just before it unlocks. */
+	uint64_t release_ns;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Make sure that nobody accidentally pushes struct lksmith_lock past one
+ * cache line. */
+typedef char lksmith_lock_fits_in_a_cache_line[
+	(sizeof(struct lksmith_lock) == CACHE_LINE_SIZE) ? 1 : -1];
+
+/**
+ * Per-lock data which we only touch when looking up a lock or working with
+ * the lock order graph.
+ */
+struct lksmith_lock_cold {
+	/** Entry in g_tree.  The key comes right after it, so that a lookup
+	 * only touches the first cache line of each node it visits. */
+	RB_ENTRY(lksmith_lock_cold) entry;
+	/** The lock pointer */
+	const void *ptr;
+	/** The hot per-lock data */
+	struct lksmith_lock *lk;
+	/** The color that this node has been painted (used in traversal) */
+	uint64_t color;
+	/** IDs of the locks that have been taken before this lock */
+	struct idvec before;
+	/** If this lock stands for a whole lock array, the array; otherwise
+	 * NULL. */
+	struct lksmith_lock_array *array;
+	/** Where each of the edges in 'before' came from */
+	struct lksmith_edge_prov *prov;
+	/** How long it took for this lock to pass from the thread which
+	 * released it to a thread which was waiting for it, or NULL if that
+	 * has never happened.  Protected by g_tree_lock. */
+	struct lksmith_handoff *handoff;
+	/** Where this lock's sampled acquisitions ran, or NULL if we aren't
+	 * sampling them.  Protected by g_tree_lock. */
+	struct lksmith_bounce *bounce;
+	/** What we know about how this lock is used, for
+	 * lksmith_report_lock_advice, or NULL if we aren't advising.
+	 * Protected by g_tree_lock. */
+	struct lksmith_advice *advice;
+	/** How this lock's acquisitions were shared among threads, or NULL
+	 * if we aren't measuring fairness.  Protected by g_tree_lock. */
+	struct lksmith_fairness *fairness;
+};
+
+/**
+ * Number of buckets in a hand-off latency histogram.  Bucket 0 counts
+ * hand-offs which took no time; bucket i counts hand-offs which took at least
+ * 2^(i-1) and less than 2^i nanoseconds.  The last bucket also counts
+ * anything longer.
+ */
+#define HANDOFF_BUCKETS 40
+
+/**
+ * Hand-off latencies for one lock.
+ */
+struct lksmith_handoff {
+	/** The lock pointer */
+	const void *ptr;
+	/** 1 if the lock has been destroyed */
+	int destroyed;
+	/** Number of hand-offs */
+	uint64_t count;
+	/** Total hand-off time, in nanoseconds */
+	uint64_t total_ns;
+	/** Longest hand-off, in nanoseconds */
+	uint64_t max_ns;
+	/** Histogram of hand-off times */
+	uint32_t buckets[HANDOFF_BUCKETS];
+};
+
+/**
+ * How often one lock moved between CPUs, threads, and NUMA nodes.
+ */
+struct lksmith_bounce {
+	/** The lock pointer */
+	const void *ptr;
+	/** 1 if the lock has been destroyed */
+	int destroyed;
+	/** CPU of the last sampled acquisition, or -1 if unknown */
+	int last_cpu;
+	/** Thread of the last sampled acquisition */
+	const struct lksmith_tls *last_tls;
+	/** Number of sampled acquisitions */
+	uint64_t samples;
+	/** Sampled acquisitions on a different CPU than the last one */
+	uint64_t cpu_changes;
+	/** Sampled acquisitions by a different thread than the last one */
+	uint64_t thread_changes;
+	/** Sampled acquisitions on a different NUMA node than the last one */
+	uint64_t node_changes;
+};
+
+/**
+ * How one lock has been used, as evidence for whether it is the right kind of
+ * lock.
+ */
+struct lksmith_advice {
+	/** The lock pointer */
+	const void *ptr;
+	/** 1 if the lock has been destroyed */
+	int destroyed;
+	/** 1 if the lock is a sleeping lock */
+	int sleeper;
+	/** Number of acquisitions */
+	uint64_t acquisitions;
+	/** Acquisitions which found the lock held by another thread */
+	uint64_t contended;
+	/** Number of timed critical sections */
+	uint64_t holds;
+	/** Total time the lock was held, in nanoseconds */
+	uint64_t hold_total_ns;
+	/** Longest time the lock was held, in nanoseconds */
+	uint64_t hold_max_ns;
+	/** Timed critical sections which ended on a different CPU than they
+	 * started on */
+	uint64_t migrated;
+	/** Critical sections sampled by LKSMITH_CS_SAMPLE */
+	uint64_t cs_samples;
+	/** Sampled critical sections with an involuntary context switch */
+	uint64_t cs_preempted;
+};
+
+/**
+ * Number of threads whose acquisitions of each lock we count separately.
+ * Acquisitions by any more threads are lumped together.
+ */
+#define FAIR_THREADS 16
+
+/**
+ * One thread's acquisitions of a lock.
+ */
+struct lksmith_fair_thread {
+	/** The thread's serial number */
+	uint64_t serial;
+	/** The thread's name */
+	char name[LKSMITH_THREAD_NAME_MAX];
+	/** Number of acquisitions */
+	uint64_t acquisitions;
+	/** Total time spent waiting, in nanoseconds */
+	uint64_t total_wait_ns;
+	/** Longest wait, in nanoseconds */
+	uint64_t max_wait_ns;
+	/** Acquisitions which barged in front of a waiting thread */
+	uint64_t barges;
+};
+
+/**
+ * How one lock's acquisitions were shared among threads.
+ */
+struct lksmith_fairness {
+	/** The lock pointer */
+	const void *ptr;
+	/** 1 if the lock has been destroyed */
+	int destroyed;
+	/** Number of threads between lksmith_prelock and lksmith_postlock on
+	 * this lock */
+	uint32_t waiters;
+	/** Number of entries in threads */
+	uint32_t num_threads;
+	/** Serial number of the thread which took the lock last */
+	uint64_t last_serial;
+	/** Number of acquisitions */
+	uint64_t acquisitions;
+	/** Acquisitions by the thread which took the lock last, while another
+	 * thread was waiting for it */
+	uint64_t barges;
+	/** Acquisitions by threads which aren't in threads */
+	uint64_t other_acquisitions;
+	/** Longest wait by any thread, in nanoseconds */
+	uint64_t max_wait_ns;
+	/** Name of the thread which waited longest */
+	char max_wait_thread[LKSMITH_THREAD_NAME_MAX];
+	/** Acquisitions by the first FAIR_THREADS threads to take the lock */
+	struct lksmith_fair_thread threads[FAIR_THREADS];
+};
+
+/**
+ * Where an edge in the lock order graph came from.
+ */
+struct lksmith_edge_prov {
+	/** ID of the lock which was held */
+	uint32_t id;
+	/** Site where the held lock was taken */
+	uint32_t held_site;
+	/** Site where this lock was taken */
+	uint32_t acq_site;
+	/** Name of the thread which took both locks */
+	char thread[LKSMITH_THREAD_NAME_MAX];
+	/** Next in singly-linked list */
+	struct lksmith_edge_prov *next;
+};
+
+/**
+ * An array of locks which share a single node in the lock order graph.
+ *
+ * Locks within the array may be nested only in ascending address order.
+ */
+struct lksmith_lock_array {
+	/** Entry in g_array_tree */
+	RB_ENTRY(lksmith_lock_array) entry;
+	/** Address of the first lock */
+	const char *base;
+	/** Distance in bytes between consecutive locks */
+	size_t stride;
+	/** Number of locks */
+	size_t count;
+	/** The lock data shared by all locks in the array */
+	struct lksmith_lock *lk;
+	/** Human-readable name of the array */
+	char name[LKSMITH_LOCK_NAME_MAX];
+};
+
+/**
+ * An entry in the list of locks a thread holds.
+ */
+struct lksmith_held {
+	/** The lock pointer.  For a lock array, this is the element pointer. */
+	const void *ptr;
+	/** The lock ID */
+	uint32_t id;
+	/** 1 if we are measuring this critical section's resource usage */
+	uint32_t sampled;
+	/** Address where we took the lock, or NULL if unknown */
+	const void *site;
+	/** When we took the lock, in nanoseconds, or 0 if we weren't timing
+	 * it */
+	uint64_t locked_ns;
+	/** Our resource usage when we took the lock, if sampled is set */
+	struct platform_usage usage;
+	/** When we took usage, in nanoseconds */
+	uint64_t usage_ns;
+	/** The CPU we took the lock on, or -1 if unknown.  Only set when we
+	 * are advising. */
+	int cpu;
+};
+
+/**
+ * A run of failed attempts to take a lock without waiting: try-locks which
+ * failed, or timed waits whose deadline had already passed.
+ */
+struct lksmith_streak {
+	/** The lock or condition variable, or NULL if this slot is free */
+	const void *ptr;
+	/** Address where we made the attempts, or NULL if unknown */
+	const void *site;
+	/** LKSMITH_STORM_TRYLOCK or LKSMITH_STORM_TIMED */
+	int kind;
+	/** 1 if cpu_start_ns is set */
+	int has_cpu;
+	/** Number of failed attempts */
+	uint64_t fails;
+	/** When the first attempt failed, in nanoseconds */
+	uint64_t first_ns;
+	/** When the last attempt failed, in nanoseconds */
+	uint64_t last_ns;
+	/** Longest time between two attempts, in nanoseconds */
+	uint64_t max_gap_ns;
+	/** Our CPU time at the second attempt, in nanoseconds */
+	uint64_t cpu_start_ns;
+	/** Our CPU time at the last attempt, in nanoseconds */
+	uint64_t cpu_last_ns;
 };
 
+/**
+ * Number of streaks each thread follows at once.
+ */
+#define STORM_SLOTS 4
+
 struct lksmith_cond {
 	RB_ENTRY(lksmith_cond) entry;
 	/** The condition variable pointer */
@@ -106,8 +467,73 @@ struct lksmith_tls {
 	char name[LKSMITH_THREAD_NAME_MAX];
 	/** Size of the held list. */
 	unsigned int num_held;
-	/** Unsorted list of locks held */
-	const void **held;
+	/** Capacity of the held list. */
+	unsigned int held_cap;
+	/** The locks we hold, in the order we took them */
+	struct lksmith_held *held;
+	/** The lock we are about to block on, or NULL.  Protected by
+	 * g_tree_lock. */
+	struct lksmith_lock *waiting_on;
+	/** Our scheduling information.  Protected by g_tree_lock. */
+	struct platform_sched sched;
+	/** When sched was last refreshed, in nanoseconds */
+	uint64_t sched_refresh_ns;
+	/** When we started waiting for waiting_on, in nanoseconds */
+	uint64_t wait_start_ns;
+	/** When the owner of waiting_on took it, in nanoseconds, or 0 */
+	uint64_t wait_owner_locked_ns;
+	/** Site where the owner of waiting_on took it */
+	uint32_t wait_owner_site;
+	/** If the owner of waiting_on had a lower priority than us when we
+	 * started waiting, its name.  Otherwise, the empty string. */
+	char inv_owner[LKSMITH_THREAD_NAME_MAX];
+	/** Scheduling information of inv_owner */
+	struct platform_sched inv_owner_sched;
+	/** Start of the current overhead measurement window, in
+	 * nanoseconds */
+	uint64_t budget_window_ns;
+	/** Time spent inside Locksmith during the current window, in
+	 * nanoseconds */
+	uint64_t budget_self_ns;
+	/** We do the full checks on one lock in this many */
+	uint32_t sample_period;
+	/** Locks left until we do the full checks again */
+	uint32_t sample_countdown;
+	/** Time spent waiting, by lock and call site, since we last merged
+	 * into g_wait_topk */
+	struct topk wait_topk;
+	/** Time spent holding locks, by lock and call site, since we last
+	 * merged into g_hold_topk */
+	struct topk hold_topk;
+	/** When we last merged our sketches into the global ones, in
+	 * nanoseconds */
+	uint64_t topk_merge_ns;
+	/** When lksmith_preunlock released the lock we are unlocking, in
+	 * nanoseconds, or 0 */
+	uint64_t unlock_ns;
+	/** Locks left until we measure a critical section again */
+	uint32_t cs_countdown;
+	/** Locks left until we sample where a lock was taken again */
+	uint32_t bounce_countdown;
+	/** Our slot in the flight recorder, or NULL */
+	struct flight_slot *flight;
+	/** Where we are taking the lock we are taking now, for the flight
+	 * recorder */
+	const void *flight_site;
+	/** 1 if the last entry in held is sampled, but we haven't taken its
+	 * resource usage yet */
+	uint32_t cs_pending;
+	/** 1 if the lock we are taking now was held by another thread when
+	 * we went to take it */
+	uint32_t advise_contended;
+	/** Our current runs of failed try-locks and expired timed waits */
+	struct lksmith_streak streaks[STORM_SLOTS];
+	/** Unique serial number of this thread */
+	uint64_t serial;
+	/** 1 if we are counted in the waiters of the lock we are taking */
+	uint32_t fair_waiting;
+	/** When we started taking the lock we are taking, in nanoseconds */
+	uint64_t fair_wait_ns;
 	/** Number of spin locks currently held. */
 	uint64_t num_spins : 63;
 	/** 1 if we should intercept pthreads calls; 0 otherwise */
@@ -121,17 +547,30 @@ struct lksmith_tls {
 /******************************************************************
  *  Locksmith prototypes
  *****************************************************************/
-static int lksmith_lock_compare(const struct lksmith_lock *a,
-		const struct lksmith_lock *b) __attribute__((const));
-RB_HEAD(lock_tree, lksmith_lock);
-RB_GENERATE(lock_tree, lksmith_lock, entry, lksmith_lock_compare);
+static int lksmith_lock_compare(const struct lksmith_lock_cold *a,
+		const struct lksmith_lock_cold *b) __attribute__((const));
+RB_HEAD(lock_tree, lksmith_lock_cold);
+RB_GENERATE(lock_tree, lksmith_lock_cold, entry, lksmith_lock_compare);
+static int lksmith_array_compare(const struct lksmith_lock_array *a,
+		const struct lksmith_lock_array *b) __attribute__((const));
+RB_HEAD(array_tree, lksmith_lock_array);
+RB_GENERATE(array_tree, lksmith_lock_array, entry, lksmith_array_compare);
 static int lksmith_cond_compare(const struct lksmith_cond *a,
 		const struct lksmith_cond *b) __attribute__((const));
 RB_HEAD(cond_tree, lksmith_cond);
 RB_GENERATE(cond_tree, lksmith_cond, entry, lksmith_cond_compare);
 static void lksmith_tls_destroy(void *v);
+static void tls_streak_end(struct lksmith_streak *st, int locked);
 static void lk_dump_to_stderr(struct lksmith_lock *lk) __attribute__((unused));
 static void tree_print(void) __attribute__((unused));
+static void lksmith_check_order_at_exit(void);
+static void lksmith_report_slow_waits_at_exit(void);
+static void lksmith_report_hot_sites_at_exit(void);
+static void lksmith_report_critical_sections_at_exit(void);
+static void lksmith_report_bouncing_at_exit(void);
+static void lksmith_report_lock_advice_at_exit(void);
+static void lksmith_report_trylock_storms_at_exit(void);
+static void lksmith_report_fairness_at_exit(void);
 static int compare_strings(const void *a, const void *b)
 	__attribute__((const));
 
@@ -164,6 +603,26 @@ static pthread_mutex_t g_tree_lock;
  */
 struct lock_tree g_tree;
 
+/**
+ * Tree of lock arrays sorted by base address.  Protected by g_tree_lock.
+ */
+struct array_tree g_array_tree;
+
+/**
+ * Mutex which protects g_pending.
+ * Lock ordering: g_tree_lock must be taken before this, if both are needed.
+ */
+static pthread_mutex_t g_pending_lock;
+
+/**
+ * Locks which have been initialized, but not yet locked.
+ *
+ * We don't create a lksmith_lock for these until they are first taken, since
+ * many programs initialize large numbers of locks which are never used.  The
+ * tag is PENDING_RECURSIVE if the lock was initialized as recursive.
+ */
+static struct ptrset g_pending;
+
 /**
  * Mutex which protects g_cond_tree
  */
@@ -180,1083 +639,5253 @@ struct cond_tree g_cond_tree;
 static uint64_t g_color;
 
 /**
- * A sorted list of frames to ignore.
+ * The next lock ID which has never been handed out.
  */
-static char **g_ignored_frames;
+static uint32_t g_next_lock_id;
 
 /**
- * The number of ignored frames.
+ * Maps lock IDs to locks.  Entries for unused IDs are NULL.
+ * Modified only under g_tree_lock.  See LOCK_ID_PAGE_SHIFT.
  */
-static int g_num_ignored_frames;
+static struct lksmith_lock **g_lock_id_pages[LOCK_ID_MAX_PAGES];
 
 /**
- * A list of frame patterns to ignore.
+ * Stack of lock IDs which have been released and can be handed out again.
  */
-static char **g_ignored_frame_patterns;
+static uint32_t *g_free_ids;
 
 /**
- * The number of ignored frame patterns.
+ * Number of entries in g_free_ids.
  */
-static int g_num_ignored_frame_patterns;
-
-/******************************************************************
- *  Initialization
- *****************************************************************/
-static int compare_strings(const void *a, const void *b)
-{
-	const char *sa = *(const char **)a;
-	const char *sb = *(const char **)b;
-	return strcmp(sa, sb);
-}
+static uint32_t g_num_free_ids;
 
-static int lksmith_init_ignored(const char *env, char ***out, int *out_len)
-{
-	int ret, num_ignored = 0;
-	const char *ignored_env;
-	char *ignored = NULL, **ignored_arr = 0, *saveptr = NULL;
-	const char *str;
+/**
+ * Capacity of g_free_ids.
+ */
+static uint32_t g_free_ids_cap;
 
-	ignored_env = getenv(env);
-	if (!ignored_env) {
-		ret = 0;
-		goto done;
-	}
-	ignored = strdup(ignored_env);
-	if (!ignored) {
-		ret = ENOMEM;
-		goto done;
-	}
-	for (str = strtok_r(ignored, ":", &saveptr);
-			str; str = strtok_r(NULL, ":", &saveptr)) {
-		num_ignored++;
-	}
-	strcpy(ignored, ignored_env);
-	ignored_arr = calloc(num_ignored, sizeof(char*));
-	if (!ignored_arr) {
-		ret = ENOMEM;
-		goto done;
-	}
-	num_ignored = 0;
-	for (str = strtok_r(ignored, ":", &saveptr);
-			str; str = strtok_r(NULL, ":", &saveptr)) {
-		ignored_arr[num_ignored] = strdup(str);
-		if (!ignored_arr[num_ignored]) {
-			ret = ENOMEM;
-			goto done;
-		}
-		num_ignored++;
-	}
-	qsort(ignored_arr, num_ignored, sizeof(char*), compare_strings);
-	ret = 0;
+/**
+ * Transitive closure of the 'before' graph, indexed by lock ID.
+ * Protected by g_tree_lock.
+ */
+static struct lksmith_closure g_closure;
 
-done:
-	free(ignored);
-	if (ret) {
-		if (ignored_arr) {
-			char **i;
-			for (i = ignored_arr; *i; i++) {
-				free(*i);
-			}
-			free(ignored_arr);
-		}
-		return ret;
-	}
-	*out = ignored_arr;
-	*out_len = num_ignored;
-	return 0;
-}
+/**
+ * 1 if we are maintaining g_closure.  Once the number of lock IDs exceeds
+ * g_closure_max, we free the matrix and fall back to graph searches.
+ */
+static int g_closure_enabled;
 
 /**
- * Initialize the locksmith library.
+ * 1 if g_closure needs to be rebuilt before it can be used.
  */
-static void lksmith_init(void)
-{
-	int ret;
+static int g_closure_dirty;
 
-	ret = lksmith_handler_init();
-	if (ret) {
-		/* can't use lksmith_error before handler */
-		fprintf(stderr, "lksmith_init: lksmith_handler_init failed.  "
-			"Can't find the real pthreads functions.\n");
-		abort();
-	}
-	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAMES",
-			&g_ignored_frames, &g_num_ignored_frames);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
-			"frames) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAME_PATTERNS",
-			&g_ignored_frame_patterns,
-			&g_num_ignored_frame_patterns);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
-			"patterns) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = pthread_key_create(&g_tls_key, lksmith_tls_destroy);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: pthread_key_create("
-			"g_tls_key) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = r_pthread_mutex_init(&g_tree_lock, NULL);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: pthread_mutex_init "
-			"g_tree_lock) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = r_pthread_mutex_init(&g_cond_tree_lock, NULL);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: pthread_mutex_init "
-			"g_cond_tree_lock) failed: error %d: %s\n",
-			ret, terror(ret));
-		abort();
-	}
-	lksmith_error(0, "Locksmith has been initialized for process %lld\n",
-		      (long long)getpid());
-	g_initialized = 1;
-}
+/**
+ * The maximum number of lock IDs for which we'll maintain g_closure.
+ */
+static uint64_t g_closure_max;
 
-/******************************************************************
- *  Thread-local storage
- *****************************************************************/
 /**
- * Callback which destroys thread-local storage.
- *
- * This callback will be invoked whenever a thread exits.
- *
- * @param v		The TLS object.
+ * When we check for lock inversions.  Set once at init.
  */
-static void lksmith_tls_destroy(void *v)
-{
-	struct lksmith_tls *tls = v;
-	free(tls->held);
-	free(tls);
-}
+static enum lksmith_order_check g_order_check;
+
+/**
+ * Call sites where locks were taken.  Protected by g_tree_lock.
+ */
+static struct site_table g_sites;
+
+/**
+ * 1 if we should fail lock acquisitions which would deadlock, rather than
+ * letting them hang.  Set once at init.
+ */
+static int g_prevent_deadlock;
+
+/**
+ * If a thread waits longer than this for a lock held by a lower-priority
+ * thread, we report a priority inversion.  0 disables the check.  Set once
+ * at init.
+ */
+static uint64_t g_prio_inversion_ns;
+
+/**
+ * Waits for a lock which take longer than this are counted as slow, and
+ * blamed on the thread holding the lock.  0 disables the check.  Set once
+ * at init.
+ */
+static uint64_t g_slow_wait_ns;
+
+/**
+ * 1 if lksmith_prewait has to record which lock each thread is waiting for,
+ * because deadlock prevention or wait timing is on.  Set once at init.
+ */
+static int g_track_waits;
+
+/**
+ * 1 if any optional feature has work to do when a lock is taken: wait
+ * tracking, critical section or bounce sampling, lock advice, trylock storm
+ * detection, or fairness.  When this is 0, taking a lock only does the work
+ * of the mode.  Set once at init.
+ */
+static int g_acquire_extras;
+
+/**
+ * Largest share of each thread's time that Locksmith should spend in
+ * lksmith_prelock and lksmith_postlock, in parts per million.  0 means that
+ * there is no limit, and every lock gets the full checks.  Set once at init.
+ */
+static uint64_t g_budget_ppm;
+
+/**
+ * How often each thread re-evaluates its sampling period, in nanoseconds.
+ */
+#define BUDGET_WINDOW_NS 10000000ULL
+
+/**
+ * Largest sampling period we will use.
+ */
+#define BUDGET_MAX_PERIOD 65536
+
+/**
+ * Call sites which have had the full checks at least once.  Call sites are
+ * code addresses, which need not be aligned, so they are shifted left to
+ * make room for the ptrset tag bits.  Protected by g_tree_lock.
+ */
+static struct ptrset g_seen_sites;
+
+/**
+ * Slow waits for a lock, aggregated by where the waiter and the holder took
+ * the lock.
+ */
+struct lksmith_slow_wait {
+	/** Site where the waiting thread took the lock */
+	uint32_t waiter_site;
+	/** Site where the holding thread took the lock, or SITE_UNKNOWN */
+	uint32_t holder_site;
+	/** Number of slow waits */
+	uint64_t count;
+	/** Total time spent waiting, in nanoseconds */
+	uint64_t total_wait_ns;
+	/** Longest wait, in nanoseconds */
+	uint64_t max_wait_ns;
+	/** Longest time the lock was held while someone waited, in
+	 * nanoseconds */
+	uint64_t max_hold_ns;
+	/** The last lock that was waited for */
+	const void *ptr;
+};
+
+/**
+ * Slow waits we have seen.  Slow waits are rare, and there are not many
+ * distinct pairs of call sites, so a flat array is good enough here.
+ * Protected by g_tree_lock.
+ */
+static struct lksmith_slow_wait *g_slow_waits;
+
+static size_t g_num_slow_waits;
+
+static size_t g_slow_waits_cap;
+
+/**
+ * Number of (lock, call site) pairs we track for wait time and for hold
+ * time, or 0 if we aren't tracking them.  Set once at init.
+ */
+static uint32_t g_topk;
+
+/**
+ * Largest value we accept for LKSMITH_TOPK.
+ */
+#define TOPK_MAX 65536
+
+/**
+ * How often each thread merges its sketches into the global ones, in
+ * nanoseconds.
+ */
+#define TOPK_MERGE_NS 1000000000ULL
+
+/**
+ * Largest number of (lock, call site) pairs we show in each report.
+ */
+#define TOPK_REPORT_MAX 20
+
+/**
+ * Records of destroyed locks which we keep, so that they can still be
+ * reported.  We keep the TOPK_REPORT_MAX records with the highest scores.
+ */
+struct retired_set {
+	/** The records.  Each was allocated with malloc. */
+	void *items[TOPK_REPORT_MAX];
+	/** The score of each record */
+	uint64_t scores[TOPK_REPORT_MAX];
+	/** Number of records */
+	int num;
+};
+
+/**
+ * The (lock, call site) pairs which have spent the most time waiting for the
+ * lock, merged from each thread's wait_topk.  Protected by g_tree_lock.
+ */
+static struct topk g_wait_topk;
+
+/**
+ * The (lock, call site) pairs which have spent the most time holding the
+ * lock, merged from each thread's hold_topk.  Protected by g_tree_lock.
+ */
+static struct topk g_hold_topk;
+
+/**
+ * Hand-off latencies of destroyed locks.  We keep the ones with the most
+ * total hand-off time, so that they can still be reported.  Protected by
+ * g_tree_lock.
+ */
+static struct retired_set g_retired_handoffs;
+
+/**
+ * We record the CPU and thread of one lock acquisition in this many, or none
+ * if this is 0.  Set once at init.
+ */
+static uint32_t g_bounce_sample;
+
+/**
+ * How much a cache line transfer between NUMA nodes costs, compared to one
+ * between CPUs on the same node.  Cross-socket transfers take roughly three
+ * times as long on common two-socket machines.
+ */
+#define BOUNCE_REMOTE_COST 3
+
+/**
+ * The NUMA node of each CPU.  Set once at init.
+ */
+static int *g_cpu_node;
+
+static int g_num_cpu_node;
+
+/**
+ * Where the sampled acquisitions of destroyed locks ran.  We keep the locks
+ * with the most estimated cache line transfers.  Protected by g_tree_lock.
+ */
+static struct retired_set g_retired_bounces;
+
+/**
+ * Default number of threads the flight recorder can hold at once.
+ */
+#define DEFAULT_FLIGHT_THREADS 64
+
+/**
+ * Default number of events the flight recorder keeps for each thread.
+ */
+#define DEFAULT_FLIGHT_EVENTS 256
+
+/**
+ * Largest value we accept for LKSMITH_FLIGHT_THREADS or
+ * LKSMITH_FLIGHT_EVENTS.
+ */
+#define FLIGHT_MAX 65536
+
+/**
+ * We measure the resource usage of one critical section in this many, or
+ * none if this is 0.  Set once at init.
+ */
+static uint32_t g_cs_sample;
+
+/**
+ * Call sites whose critical sections spent at least this percentage of
+ * their time off the CPU are reported.
+ */
+#define CS_OFFCPU_PCT 50
+
+/**
+ * Call sites whose critical sections spent less than this much time off the
+ * CPU in total, in nanoseconds, are not reported for it.
+ */
+#define CS_MIN_OFFCPU_NS 1000000ULL
+
+/**
+ * Resource usage of sampled critical sections, aggregated by where the lock
+ * was taken.
+ */
+struct lksmith_cs_site {
+	/** Address where the lock was taken, or NULL if unknown */
+	const void *site;
+	/** The last lock taken here */
+	const void *ptr;
+	/** 1 if the last lock taken here was a sleeping lock */
+	int sleeper;
+	/** Number of sampled critical sections */
+	uint64_t count;
+	/** Total wall-clock time, in nanoseconds */
+	uint64_t wall_ns;
+	/** Total CPU time, in nanoseconds */
+	uint64_t cpu_ns;
+	/** Longest time off the CPU in one critical section, in
+	 * nanoseconds */
+	uint64_t max_offcpu_ns;
+	/** Total major page faults */
+	uint64_t majflt;
+	/** Total voluntary context switches */
+	uint64_t nvcsw;
+	/** Total involuntary context switches */
+	uint64_t nivcsw;
+	/** Number of critical sections with at least one context switch */
+	uint64_t switched;
+};
+
+/**
+ * Sampled critical sections.  There are not many distinct call sites, so a
+ * flat array is good enough here.  Protected by g_tree_lock.
+ */
+static struct lksmith_cs_site *g_cs_sites;
+
+static size_t g_num_cs_sites;
+
+static size_t g_cs_sites_cap;
+
+/**
+ * 1 if we should gather evidence about whether each lock is the right kind of
+ * lock.  Set once at init.
+ */
+static int g_advise;
+
+/**
+ * Locks with fewer acquisitions than this get no advice.
+ */
+#define ADVISE_MIN_ACQUISITIONS 10
+
+/**
+ * Spin locks held longer than this on average, in nanoseconds, should
+ * probably be mutexes.  This is a few times what it costs to put a waiter to
+ * sleep and wake it up again.
+ */
+#define ADVISE_SPIN_HOLD_NS 10000ULL
+
+/**
+ * Spin locks whose holder is preempted in at least this percentage of
+ * critical sections should probably be mutexes.
+ */
+#define ADVISE_PREEMPT_PCT 1
+
+/**
+ * Mutexes held for less than this on average, in nanoseconds, are held for
+ * less time than it takes to put a waiter to sleep.
+ */
+#define ADVISE_SHORT_HOLD_NS 1000ULL
+
+/**
+ * Short-held mutexes with at least this percentage of contended acquisitions
+ * would benefit from spinning before they sleep.
+ */
+#define ADVISE_CONTENDED_PCT 10
+
+/**
+ * Roughly what it costs a waiter to go to sleep and be woken up, in
+ * nanoseconds.
+ */
+#define ADVISE_PARK_NS 5000ULL
+
+/**
+ * Roughly how long a spinning waiter runs before the scheduler switches it
+ * out, in nanoseconds.
+ */
+#define ADVISE_SLICE_NS 1000000ULL
+
+/**
+ * How often we count the runnable threads, in nanoseconds.
+ */
+#define ADVISE_LOAD_NS 100000000ULL
+
+/**
+ * Number of kinds of advice.
+ */
+#define ADVISE_KINDS 3
+
+/**
+ * Number of online CPUs.  Set once at init.
+ */
+static uint32_t g_num_cpus;
+
+/**
+ * When we last counted the runnable threads, in nanoseconds.  Protected by
+ * g_tree_lock.
+ */
+static uint64_t g_load_ns;
+
+/**
+ * Number of times we counted the runnable threads.  Protected by g_tree_lock.
+ */
+static uint64_t g_load_samples;
+
+/**
+ * Number of times there were more runnable threads than CPUs.  Protected by
+ * g_tree_lock.
+ */
+static uint64_t g_load_oversubscribed;
+
+/**
+ * Most runnable threads we have seen.  Protected by g_tree_lock.
+ */
+static uint32_t g_load_max_runnable;
+
+/**
+ * Usage of destroyed locks.  We keep the ones with the most costly advice.
+ * Protected by g_tree_lock.
+ */
+static struct retired_set g_retired_advice;
+
+/**
+ * Runs of at least this many failed try-locks, or timed waits with expired
+ * deadlines, from one thread on one lock at one call site are reported.  0
+ * means that we don't look for them.  Set once at init.
+ */
+static uint64_t g_storm_streak;
+
+/**
+ * Timed waits whose deadline is less than this far away, in nanoseconds, are
+ * counted as failed attempts, just like try-locks.
+ */
+#define STORM_NEAR_NS 10000LL
+
+/**
+ * Long runs of failed attempts, aggregated by call site.
+ */
+struct lksmith_storm_site {
+	/** Address where the attempts were made, or NULL if unknown */
+	const void *site;
+	/** The last lock or condition variable tried here */
+	const void *ptr;
+	/** LKSMITH_STORM_TRYLOCK or LKSMITH_STORM_TIMED */
+	int kind;
+	/** Number of runs */
+	uint64_t streaks;
+	/** Total failed attempts */
+	uint64_t failures;
+	/** Longest run */
+	uint64_t max_streak;
+	/** Total time from the first to the last attempt of each run, in
+	 * nanoseconds */
+	uint64_t wall_ns;
+	/** Total CPU time between the attempts, in nanoseconds */
+	uint64_t cpu_ns;
+	/** Longest time between two attempts, in nanoseconds */
+	uint64_t max_gap_ns;
+};
+
+/**
+ * Call sites with long runs of failed attempts.  There are not many distinct
+ * call sites, so a flat array is good enough here.  Protected by
+ * g_tree_lock.
+ */
+static struct lksmith_storm_site *g_storm_sites;
+
+static size_t g_num_storm_sites;
+
+static size_t g_storm_sites_cap;
+
+/**
+ * 1 if we should measure how fairly each lock is shared among threads.  Set
+ * once at init.
+ */
+static int g_fairness;
+
+/**
+ * The last thread serial number handed out.
+ */
+static uint64_t g_last_serial;
+
+/**
+ * Fairness of destroyed locks.  We keep the ones with the longest waits.
+ * Protected by g_tree_lock.
+ */
+static struct retired_set g_retired_fairness;
+
+/**
+ * A sorted list of frames to ignore.
+ */
+static char **g_ignored_frames;
+
+/**
+ * The number of ignored frames.
+ */
+static int g_num_ignored_frames;
+
+/**
+ * A list of frame patterns to ignore.
+ */
+static char **g_ignored_frame_patterns;
+
+/**
+ * The number of ignored frame patterns.
+ */
+static int g_num_ignored_frame_patterns;
+
+/**
+ * Get the lock with a given ID.
+ *
+ * The caller must either hold g_tree_lock, or hold the lock itself (which
+ * keeps it from being destroyed.)
+ *
+ * @param id		The lock ID
+ *
+ * @return		The lock
+ */
+static inline struct lksmith_lock *lk_by_id(uint32_t id)
+{
+	return g_lock_id_pages[id >> LOCK_ID_PAGE_SHIFT]
+		[id & (LOCK_ID_PAGE_SIZE - 1)];
+}
+
+/******************************************************************
+ *  Initialization
+ *****************************************************************/
+static int compare_strings(const void *a, const void *b)
+{
+	const char *sa = *(const char **)a;
+	const char *sb = *(const char **)b;
+	return strcmp(sa, sb);
+}
+
+static int lksmith_init_ignored(const char *env, char ***out, int *out_len)
+{
+	int ret, num_ignored = 0;
+	const char *ignored_env;
+	char *ignored = NULL, **ignored_arr = 0, *saveptr = NULL;
+	const char *str;
+
+	ignored_env = getenv(env);
+	if (!ignored_env) {
+		ret = 0;
+		goto done;
+	}
+	ignored = strdup(ignored_env);
+	if (!ignored) {
+		ret = ENOMEM;
+		goto done;
+	}
+	for (str = strtok_r(ignored, ":", &saveptr);
+			str; str = strtok_r(NULL, ":", &saveptr)) {
+		num_ignored++;
+	}
+	strcpy(ignored, ignored_env);
+	ignored_arr = calloc(num_ignored, sizeof(char*));
+	if (!ignored_arr) {
+		ret = ENOMEM;
+		goto done;
+	}
+	num_ignored = 0;
+	for (str = strtok_r(ignored, ":", &saveptr);
+			str; str = strtok_r(NULL, ":", &saveptr)) {
+		ignored_arr[num_ignored] = strdup(str);
+		if (!ignored_arr[num_ignored]) {
+			ret = ENOMEM;
+			goto done;
+		}
+		num_ignored++;
+	}
+	qsort(ignored_arr, num_ignored, sizeof(char*), compare_strings);
+	ret = 0;
+
+done:
+	free(ignored);
+	if (ret) {
+		if (ignored_arr) {
+			char **i;
+			for (i = ignored_arr; *i; i++) {
+				free(*i);
+			}
+			free(ignored_arr);
+		}
+		return ret;
+	}
+	*out = ignored_arr;
+	*out_len = num_ignored;
+	return 0;
+}
+
+/**
+ * Parse LKSMITH_MAX_OVERHEAD, which is a percentage such as "2%" or "0.5".
+ *
+ * @return		The overhead budget in parts per million, or 0 if
+ *			there is no budget.
+ */
+static uint64_t lksmith_init_max_overhead(void)
+{
+	const char *str;
+	char *end = NULL;
+	double pct;
+
+	str = getenv("LKSMITH_MAX_OVERHEAD");
+	if ((!str) || (!str[0]))
+		return 0;
+	errno = 0;
+	pct = strtod(str, &end);
+	if ((end) && (*end == '%'))
+		end++;
+	if (errno || (end == str) || (*end != '\0') || (pct < 0) ||
+			(pct > 100)) {
+		lksmith_error(EINVAL, "lksmith_init: unable to parse "
+			"LKSMITH_MAX_OVERHEAD='%s' as a percentage.  Not "
+			"limiting overhead.\n", str);
+		return 0;
+	}
+	return (uint64_t)(pct * 10000.0);
+}
+
+/**
+ * Parse LKSMITH_FLIGHT_FILE and friends, and create the flight recorder.
+ *
+ * @return		1 if the flight recorder is running; 0 otherwise.
+ */
+static int lksmith_init_flight(void)
+{
+	const char *str, *pct;
+	char path[PATH_MAX];
+	uint64_t threads, events;
+	int ret;
+
+	str = getenv("LKSMITH_FLIGHT_FILE");
+	if ((!str) || (!str[0]))
+		return 0;
+	/* Replace the first %p with our process ID, so that each process
+	 * gets its own file. */
+	pct = strstr(str, "%p");
+	if (pct) {
+		snprintf(path, sizeof(path), "%.*s%lld%s", (int)(pct - str),
+			 str, (long long)getpid(), pct + 2);
+	} else {
+		snprintf(path, sizeof(path), "%s", str);
+	}
+	threads = getenv_u64("LKSMITH_FLIGHT_THREADS",
+			     DEFAULT_FLIGHT_THREADS);
+	events = getenv_u64("LKSMITH_FLIGHT_EVENTS", DEFAULT_FLIGHT_EVENTS);
+	if ((threads > FLIGHT_MAX) || (events > FLIGHT_MAX)) {
+		lksmith_error(EINVAL, "lksmith_init: LKSMITH_FLIGHT_THREADS "
+			"and LKSMITH_FLIGHT_EVENTS can't be more than %d.  "
+			"Not using the flight recorder.\n", FLIGHT_MAX);
+		return 0;
+	}
+	ret = flight_init(path, threads, events, time_now_ns());
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: failed to create the flight "
+			"recorder file %s: error %d: %s\n", path, ret,
+			terror(ret));
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Find the NUMA node of each CPU.  If we can't, every CPU is on node 0.
+ */
+static void lksmith_init_cpu_nodes(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	if (n <= 0)
+		return;
+	g_cpu_node = calloc(n, sizeof(g_cpu_node[0]));
+	if (!g_cpu_node)
+		return;
+	g_num_cpu_node = n;
+	if (platform_get_cpu_nodes(g_cpu_node, g_num_cpu_node))
+		memset(g_cpu_node, 0, n * sizeof(g_cpu_node[0]));
+}
+
+/**
+ * Parse LKSMITH_TOPK, and set up the global sketches.
+ *
+ * @return		The number of (lock, call site) pairs to track, or 0
+ *			if we shouldn't track them.
+ */
+static uint32_t lksmith_init_topk(void)
+{
+	uint64_t k;
+
+	k = getenv_u64("LKSMITH_TOPK", 0);
+	if (k == 0)
+		return 0;
+	if (k > TOPK_MAX) {
+		lksmith_error(EINVAL, "lksmith_init: LKSMITH_TOPK=%"PRIu64" is "
+			"too large.  Using %d instead.\n", k, TOPK_MAX);
+		k = TOPK_MAX;
+	}
+	if ((topk_init(&g_wait_topk, k)) || (topk_init(&g_hold_topk, k))) {
+		lksmith_error(ENOMEM, "lksmith_init: failed to allocate "
+			"LKSMITH_TOPK sketches.  Not tracking hot sites.\n");
+		topk_free(&g_wait_topk);
+		topk_free(&g_hold_topk);
+		return 0;
+	}
+	return (uint32_t)k;
+}
+
+/**
+ * Parse LKSMITH_MODE.
+ *
+ * @return		The mode to use.
+ */
+static enum lksmith_mode lksmith_init_mode(void)
+{
+	const char *str;
+
+	str = getenv("LKSMITH_MODE");
+	if ((!str) || (!strcmp(str, "full")))
+		return LKSMITH_MODE_FULL;
+	if (!strcmp(str, "off"))
+		return LKSMITH_MODE_OFF;
+	if (!strcmp(str, "order"))
+		return LKSMITH_MODE_ORDER;
+	if (!strcmp(str, "profile"))
+		return LKSMITH_MODE_PROFILE;
+	if (!strcmp(str, "trace"))
+		return LKSMITH_MODE_TRACE;
+	lksmith_error(EINVAL, "lksmith_init: invalid LKSMITH_MODE '%s'.  "
+		"Valid values are 'off', 'order', 'profile', 'full', and "
+		"'trace'.\n", str);
+	return LKSMITH_MODE_FULL;
+}
+
+/**
+ * Parse LKSMITH_ORDER_CHECK.
+ *
+ * @return		The order checking mode to use.
+ */
+static enum lksmith_order_check lksmith_init_order_check(void)
+{
+	const char *str;
+
+	str = getenv("LKSMITH_ORDER_CHECK");
+	if ((!str) || (!strcmp(str, "inline")))
+		return ORDER_CHECK_INLINE;
+	if (!strcmp(str, "deferred"))
+		return ORDER_CHECK_DEFERRED;
+	lksmith_error(EINVAL, "lksmith_init: invalid LKSMITH_ORDER_CHECK "
+		"'%s'.  Valid values are 'inline' and 'deferred'.\n", str);
+	return ORDER_CHECK_INLINE;
+}
+
+/**
+ * Parse LKSMITH_CLOCK.
+ *
+ * @return		The time source to ask for.
+ */
+static enum time_source lksmith_init_clock(void)
+{
+	const char *str;
+
+	str = getenv("LKSMITH_CLOCK");
+	if ((!str) || (!strcmp(str, "tsc")))
+		return TIME_SOURCE_TSC;
+	if (!strcmp(str, "monotonic"))
+		return TIME_SOURCE_MONOTONIC;
+	if (!strcmp(str, "coarse"))
+		return TIME_SOURCE_COARSE;
+	lksmith_error(EINVAL, "lksmith_init: invalid LKSMITH_CLOCK '%s'.  "
+		"Valid values are 'tsc', 'monotonic', and 'coarse'.\n", str);
+	return TIME_SOURCE_TSC;
+}
+
+/**
+ * Initialize the locksmith library.
+ */
+static void lksmith_init(void)
+{
+	int ret, flight;
+	enum time_source time_src;
+
+	ret = lksmith_handler_init();
+	if (ret) {
+		/* can't use lksmith_error before handler */
+		fprintf(stderr, "lksmith_init: lksmith_handler_init failed.  "
+			"Can't find the real pthreads functions.\n");
+		abort();
+	}
+	time_src = time_init(lksmith_init_clock());
+	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAMES",
+			&g_ignored_frames, &g_num_ignored_frames);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
+			"frames) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAME_PATTERNS",
+			&g_ignored_frame_patterns,
+			&g_num_ignored_frame_patterns);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
+			"patterns) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	g_closure_max = getenv_u64("LKSMITH_CLOSURE_MAX", DEFAULT_CLOSURE_MAX);
+	g_closure_enabled = (g_closure_max > 0);
+	g_order_check = lksmith_init_order_check();
+	g_prevent_deadlock = !!getenv_u64("LKSMITH_PREVENT_DEADLOCK", 0);
+	g_prio_inversion_ns =
+		getenv_u64("LKSMITH_PRIO_INVERSION_US", 0) * 1000ULL;
+	g_slow_wait_ns = getenv_u64("LKSMITH_SLOW_WAIT_US", 0) * 1000ULL;
+	g_topk = lksmith_init_topk();
+	g_cs_sample = (uint32_t)getenv_u64("LKSMITH_CS_SAMPLE", 0);
+	g_bounce_sample = (uint32_t)getenv_u64("LKSMITH_BOUNCE_SAMPLE", 0);
+	g_advise = !!getenv_u64("LKSMITH_ADVISE", 0);
+	g_storm_streak = getenv_u64("LKSMITH_TRYLOCK_STREAK", 0);
+	g_fairness = !!getenv_u64("LKSMITH_FAIRNESS", 0);
+	flight = lksmith_init_flight();
+	g_budget_ppm = lksmith_init_max_overhead();
+	g_mode = lksmith_init_mode();
+	if (g_mode == LKSMITH_MODE_ORDER) {
+		/* Nothing calls lksmith_prewait in this mode, so there are
+		 * no waits to time or prevent. */
+		g_prevent_deadlock = 0;
+		g_prio_inversion_ns = 0;
+		g_slow_wait_ns = 0;
+		g_topk = 0;
+	}
+	g_track_waits = (g_prevent_deadlock) || (g_prio_inversion_ns) ||
+		(g_slow_wait_ns) || (g_topk);
+	g_acquire_extras = (g_track_waits) || (g_cs_sample) ||
+		(g_bounce_sample) || (g_advise) || (g_storm_streak) ||
+		(g_fairness);
+	if (g_slow_wait_ns)
+		atexit(lksmith_report_slow_waits_at_exit);
+	if (g_topk)
+		atexit(lksmith_report_hot_sites_at_exit);
+	if (g_cs_sample)
+		atexit(lksmith_report_critical_sections_at_exit);
+	if (g_bounce_sample) {
+		lksmith_init_cpu_nodes();
+		atexit(lksmith_report_bouncing_at_exit);
+	}
+	if (g_advise) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		g_num_cpus = (n > 0) ? (uint32_t)n : 1;
+		atexit(lksmith_report_lock_advice_at_exit);
+	}
+	if (g_storm_streak)
+		atexit(lksmith_report_trylock_storms_at_exit);
+	if (g_fairness)
+		atexit(lksmith_report_fairness_at_exit);
+	if ((g_order_check == ORDER_CHECK_DEFERRED) &&
+			((g_mode == LKSMITH_MODE_ORDER) ||
+			 (g_mode >= LKSMITH_MODE_FULL))) {
+		/* The closure is only used for inline checks. */
+		g_closure_enabled = 0;
+		atexit(lksmith_check_order_at_exit);
+	}
+	ret = pthread_key_create(&g_tls_key, lksmith_tls_destroy);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_key_create("
+			"g_tls_key) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_tree_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init "
+			"g_tree_lock) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_pending_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init "
+			"g_pending_lock) failed: error %d: %s\n",
+			ret, terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_cond_tree_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init "
+			"g_cond_tree_lock) failed: error %d: %s\n",
+			ret, terror(ret));
+		abort();
+	}
+	lksmith_handler_set_mode(g_mode, g_track_waits || flight);
+	lksmith_error(0, "Locksmith has been initialized for process %lld, "
+		      "using the %s clock\n", (long long)getpid(),
+		      time_source_str(time_src));
+	g_initialized = 1;
+}
+
+/******************************************************************
+ *  Thread-local storage
+ *****************************************************************/
+/**
+ * Callback which destroys thread-local storage.
+ *
+ * This callback will be invoked whenever a thread exits.
+ *
+ * @param v		The TLS object.
+ */
+static void lksmith_tls_destroy(void *v)
+{
+	struct lksmith_tls *tls = v;
+	struct lksmith_lock *lk;
+	unsigned int i;
+
+	if (tls->num_held > 0) {
+		/* The thread is exiting without releasing some locks.  Don't
+		 * leave them pointing at freed memory. */
+		r_pthread_mutex_lock(&g_tree_lock);
+		for (i = 0; i < tls->num_held; i++) {
+			lk = lk_by_id(tls->held[i].id);
+			if (lk->owner == tls)
+				lk->owner = NULL;
+		}
+		r_pthread_mutex_unlock(&g_tree_lock);
+	}
+	if ((tls->wait_topk.len) || (tls->hold_topk.len)) {
+		r_pthread_mutex_lock(&g_tree_lock);
+		topk_merge(&g_wait_topk, &tls->wait_topk);
+		topk_merge(&g_hold_topk, &tls->hold_topk);
+		r_pthread_mutex_unlock(&g_tree_lock);
+	}
+	topk_free(&tls->wait_topk);
+	topk_free(&tls->hold_topk);
+	if (g_storm_streak) {
+		for (i = 0; i < STORM_SLOTS; i++)
+			tls_streak_end(&tls->streaks[i], 0);
+	}
+	if (tls->flight)
+		flight_thread_end(tls->flight);
+	free(tls->held);
+	free(tls);
+}
 
 /**
  * Get or create the thread-local storage associated with this thread.
  *
- * The problem with POSIX thread-local storage is that in order to use it,
- * you must first initialize a 'key'.  But how do you initialize this key
- * prior to use?  There's no good way to do it.
+ * The problem with POSIX thread-local storage is that in order to use it,
+ * you must first initialize a 'key'.  But how do you initialize this key
+ * prior to use?  There's no good way to do it.
+ *
+ * gcc provides the non-portable __attribute__((constructor)), which seems like
+ * it could be useful.  Unfortunately, the order in which these constructor
+ * functions are called between shared libraries is not defined.
+ * If another shared library defines some constructor functions which invoke
+ * pthreads functions, and it gets run before we initialize, it's game over.
+ * C++ global constructors have the same issues.
+ *
+ * We could force Locksmith users to call an init function before calling any
+ * other Locksmith functions.  Then, this init function could initialize the
+ * key.  But that would be painful for many users.  This is especially true
+ * in C++, where global constructors often make use of mutexes long before
+ * main() runs.
+ *
+ * The other approach, which we have taken here, is to protect the key with a
+ * mutex.  This is somewhat slow, since it means that we have to take this
+ * mutex before every access to thread-local data.  Luckily, on platforms
+ * that support the __thread keyword, we can bypass this slowness.
+ * Thread-local variables declared using __thread don't need to be manually
+ * intialized before use.  They're ready to go before any code has been run.
+ *
+ * One advantage that POSIX thread-local variables have over __thread
+ * variables is that the former can declare "destructors" which are run when
+ * the thread is destroyed.  (These have no relation to the C++ concept of
+ * the same name.) We make use of that ability here, to clean up our
+ * malloc()ed thread-local data when the thread in question exits.
+ * By combining the __thread keyword and POSIX thread-local variables, we can
+ * get the best of each.
+ *
+ * @return			NULL on OOM, the TLS otherwise.
+ */
+static struct lksmith_tls *get_or_create_tls(void)
+{
+	int ret = 0;
+	struct lksmith_tls *tls;
+
+#ifdef HAVE_IMPROVED_TLS
+	static __thread struct lksmith_tls *t_improved_tls = NULL;
+	if (t_improved_tls) {
+		return t_improved_tls;
+	}
+#endif
+	simple_spin_lock(&g_init_state_lock);
+	if (!g_initialized) {
+		lksmith_init();
+	}
+	simple_spin_unlock(&g_init_state_lock);
+#ifndef HAVE_IMPROVED_TLS
+	tls = pthread_getspecific(g_tls_key);
+	if (tls) {
+		return tls;
+	}
+#endif
+	tls = calloc(1, sizeof(*tls));
+	if (!tls) {
+		lksmith_error(ENOMEM,
+			"get_or_create_tls(): failed to allocate "
+			"memory for thread-local storage.\n");
+		return NULL;
+	}
+	tls->intercept = 1;
+	tls->serial = __atomic_add_fetch(&g_last_serial, 1, __ATOMIC_RELAXED);
+	platform_create_thread_name(tls->name, LKSMITH_THREAD_NAME_MAX);
+	tls->flight = flight_thread_start(tls->name);
+	ret = pthread_setspecific(g_tls_key, tls);
+	if (ret) {
+		free(tls->held);
+		free(tls);
+		lksmith_error(ENOMEM,
+			"get_or_create_tls(): pthread_setspecific "
+			"failed with error %d: %s\n", ret, terror(ret));
+		return NULL;
+	}
+#ifdef HAVE_IMPROVED_TLS
+	t_improved_tls = tls;
+#endif
+	return tls;
+}
+
+int init_tls(void)
+{
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if (!tls)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * Add a lock to the end of the list of locks we hold.
+ *
+ * NOTE: locks can be added more than once to this list!
+ * This is so that we can support recursive mutexes.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock pointer.
+ * @param lid		The lock ID.
+ * @param site		Address where we took the lock, or NULL.
+ * @param now		When we took the lock, in nanoseconds, or 0.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int tls_append_held(struct lksmith_tls *tls, const void *ptr,
+			   uint32_t lid, const void *site, uint64_t now)
+{
+	struct lksmith_held *held;
+	unsigned int cap;
+
+	if (tls->num_held == tls->held_cap) {
+		cap = tls->held_cap ? (tls->held_cap * 2) : 8;
+		held = realloc(tls->held, sizeof(struct lksmith_held) * cap);
+		if (!held)
+			return ENOMEM;
+		tls->held = held;
+		tls->held_cap = cap;
+	}
+	tls->held[tls->num_held].ptr = ptr;
+	tls->held[tls->num_held].id = lid;
+	tls->held[tls->num_held].sampled = 0;
+	tls->held[tls->num_held].site = site;
+	tls->held[tls->num_held].locked_ns = now;
+	tls->held[tls->num_held].cpu = -1;
+	tls->num_held++;
+	return 0;
+}
+
+/**
+ * Remove a lock from the list of locks we hold.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock pointer.
+ * @param out		(out param) if non-NULL, a copy of the entry we
+ *			removed.
+ *
+ * @return		0 on success; ENOENT if we are not holding the
+ *			lock.
+ */
+static int tls_remove_held(struct lksmith_tls *tls, const void *ptr,
+			   struct lksmith_held *out)
+{
+	signed int i;
+
+	for (i = tls->num_held - 1; i >= 0; i--) {
+		if (tls->held[i].ptr == ptr)
+			break;
+	}
+	if (i < 0)
+		return ENOENT;
+	if (out)
+		*out = tls->held[i];
+	memmove(&tls->held[i], &tls->held[i + 1],
+		sizeof(struct lksmith_held) * (tls->num_held - i - 1));
+	tls->num_held--;
+	return 0;
+}
+
+/**
+ * Determine if we are holding a lock.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock pointer to find.
+ *
+ * @return		1 if we hold the lock; 0 otherwise.
+ */
+static int tls_contains_ptr(struct lksmith_tls *tls, const void *ptr)
+{
+	unsigned int i;
+
+	for (i = 0; i < tls->num_held; i++) {
+		if (tls->held[i].ptr == ptr)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Find a lock that we hold, given only its address.
+ *
+ * This doesn't need g_tree_lock, since the locks we hold can't be destroyed
+ * out from under us.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock to find.
+ *
+ * @return		The lock, or NULL if we don't hold it.
+ */
+static struct lksmith_lock *tls_find_held(struct lksmith_tls *tls,
+					  const void *ptr)
+{
+	signed int i;
+
+	for (i = tls->num_held - 1; i >= 0; i--) {
+		if (tls->held[i].ptr == ptr)
+			return lk_by_id(tls->held[i].id);
+	}
+	return NULL;
+}
+
+static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
+				  const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/**
+ * Locksmith error with thread information (including a backtrace)
+ *
+ * @param tls		Our thread-local storage object
+ * @param err		the locksmith error code
+ * @param fmt		printf-style format string
+ */
+static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
+				  const char *fmt, ...)
+{
+	va_list ap;
+	int nframes, prev_intercept;
+	char **frames = NULL;
+
+	if (!tls) {
+		tls = get_or_create_tls();
+		if (!tls) {
+			va_start(ap, fmt);
+			lksmith_errora(err, fmt, ap);
+			va_end(ap);
+			return;
+		}
+	}
+	prev_intercept = tls->intercept;
+	tls->intercept = 0;
+	nframes = bt_frames_create(&tls->backtrace_scratch,
+			&tls->backtrace_scratch_len, &frames);
+	tls->intercept = prev_intercept;
+	va_start(ap, fmt);
+	// lksmith_errora_with_bt handles nframes < 0 (the error case)
+	lksmith_errora_with_bt(err, frames, nframes, fmt, ap);
+	va_end(ap);
+	bt_frames_free(frames);
+}
+
+/******************************************************************
+ *  Lock holder functions
+ *****************************************************************/
+/**
+ * Dump out the contents of a lock holder structure
+ *
+ * @param holder        The lock holder
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void holder_dump(const struct lksmith_holder *holder,
+		char *buf, size_t *off, size_t buf_len)
+{
+	const char *prefix = "";
+	int i;
+
+	fwdprintf(buf, off, buf_len, "{name=%s, "
+		"bt_frames=[", holder->name);
+	for (i = 0; i < holder->bt_len; i++) {
+		fwdprintf(buf, off, buf_len, "%s%s", prefix,
+			  holder->bt_frames[i]);
+		prefix = ", ";
+	}
+	fwdprintf(buf, off, buf_len, "]}");
+}
+
+/**
+ * Create a lock holder.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param bt		1 if we should capture a backtrace; 0 otherwise.
+ *
+ * @return		The lock holder on success; NULL otherwise.
+ */
+static struct lksmith_holder* holder_create(struct lksmith_tls *tls, int bt)
+{
+	struct lksmith_holder *holder;
+	int intercept, ret;
+
+	holder = calloc(1, sizeof(*holder));
+	if (!holder)
+		return NULL;
+	snprintf(holder->name, sizeof(holder->name), "%s", tls->name);
+	if (!bt)
+		return holder;
+	intercept = tls->intercept;
+	tls->intercept = 0;
+	ret = bt_frames_create(&tls->backtrace_scratch,
+		&tls->backtrace_scratch_len, &holder->bt_frames);
+	tls->intercept = intercept;
+	if (ret < 0) {
+		free(holder);
+		return NULL;
+	}
+	holder->bt_len = ret;
+	return holder;
+}
+
+/**
+ * Free a lock holder structure
+ *
+ * @param holder        The lock holder
+ */
+static void holder_free(struct lksmith_holder *holder)
+{
+	bt_frames_free(holder->bt_frames);
+	free(holder);
+}
+
+/**
+ * Find the call site ID for a lock holder.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * Holders which were recorded without a backtrace are identified by their
+ * caller's address alone.
+ *
+ * @param holder	The lock holder.
+ * @param id		(out param) The site ID, or SITE_UNKNOWN.
+ */
+static void holder_intern_site(const struct lksmith_holder *holder,
+			uint32_t *id)
+{
+	char buf[32], *frames[1];
+
+	if (holder->bt_len > 0) {
+		site_intern(&g_sites, holder->bt_frames, holder->bt_len, id);
+	} else if (holder->site) {
+		snprintf(buf, sizeof(buf), "[%p]", holder->site);
+		frames[0] = buf;
+		site_intern(&g_sites, frames, 1, id);
+	} else {
+		*id = SITE_UNKNOWN;
+	}
+}
+
+/******************************************************************
+ *  Lock functions
+ *****************************************************************/
+static int lksmith_lock_compare(const struct lksmith_lock_cold *a,
+		const struct lksmith_lock_cold *b)
+{
+	const void *pa = a->ptr;
+	const void *pb = b->ptr;
+	if (pa < pb)
+		return -1;
+	else if (pa > pb)
+		return 1;
+	else
+		return 0;
+}
+
+static int lksmith_array_compare(const struct lksmith_lock_array *a,
+		const struct lksmith_lock_array *b)
+{
+	if (a->base < b->base)
+		return -1;
+	else if (a->base > b->base)
+		return 1;
+	else
+		return 0;
+}
+
+/**
+ * Add a lock to the 'before' set of this lock data.
+ * Note: you must call this function with the info->lock held.
+ *
+ * @param lk		The lock data.
+ * @param lid		The lock ID to add.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lk_add_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
+{
+	return idvec_add(&lk->cold->before, ak->id);
+}
+
+/**
+ * Remove a lock from the 'after' set of this lock data.
+ * Note: you must call this function with the info->lock held.
+ *
+ * @param lk		The lock data.
+ * @param lid		The lock ID to remove.
+ */
+static void lk_remove_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
+{
+	struct lksmith_edge_prov **prov, *next;
+
+	if (idvec_remove(&lk->cold->before, ak->id))
+		return;
+	for (prov = &lk->cold->prov; *prov; prov = &(*prov)->next) {
+		if ((*prov)->id == ak->id) {
+			next = (*prov)->next;
+			free(*prov);
+			*prov = next;
+			break;
+		}
+	}
+}
+
+/**
+ * Add a lock holder to the lock.
+ * Note: you must call this function with the info->lock held.
+ *
+ * @param lk		The lock data.
+ * @param holder	The lock holder to add.
+ */
+static void lk_holder_add(struct lksmith_lock *lk,
+			struct lksmith_holder *holder)
+{
+	holder->next = lk->holders;
+	lk->holders = holder;
+}
+
+/**
+ * Remove a lock holder from the lock.
+ * Note: you must call this function with the info->lock held.
+ *
+ * @param lk		The lock data.
+ * @param tls		The thread-local storage for the current thread.
+ *
+ * @return		0 on success; -ENOENT if the lock holder wasn't found.
+ */
+static int lk_holder_remove(struct lksmith_lock *lk,
+			struct lksmith_tls *tls)
+{
+	struct lksmith_holder **holder, *next;
+
+	/* By iterating forward through the list, we ensure that holders are
+	 * taken out in the reverse order that they were put in (since we also
+	 * insert to the head of the list.)  This is important when dealing
+	 * with recursive locks, where one thread can take the same lock over
+	 * and over. */
+	holder = &lk->holders;
+	while (*holder) {
+		if (!strcmp(tls->name, (*holder)->name))
+			break;
+		holder = &(*holder)->next;
+	}
+	if (!holder)
+		return -ENOENT;
+	next = (*holder)->next;
+	holder_free(*holder);
+	*holder = next;
+	return 0;
+}
+
+/**
+ * Record where an edge in the lock order graph came from.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param lk		The lock being taken.
+ * @param ak		The lock which was held.
+ * @param tls		The thread-local data.
+ * @param holder	The holder which is about to be added to lk.
+ */
+static void lk_add_prov(struct lksmith_lock *lk, struct lksmith_lock *ak,
+			struct lksmith_tls *tls, struct lksmith_holder *holder)
+{
+	struct lksmith_edge_prov *prov;
+	struct lksmith_holder *ah;
+
+	prov = calloc(1, sizeof(*prov));
+	if (!prov)
+		return;
+	prov->id = ak->id;
+	snprintf(prov->thread, sizeof(prov->thread), "%s", tls->name);
+	/* The most recent holder from this thread comes first. */
+	for (ah = ak->holders; ah; ah = ah->next) {
+		if (!strcmp(tls->name, ah->name)) {
+			holder_intern_site(ah, &prov->held_site);
+			break;
+		}
+	}
+	holder_intern_site(holder, &prov->acq_site);
+	prov->next = lk->cold->prov;
+	lk->cold->prov = prov;
+}
+
+/**
+ * Dump out the contents of a lock data structure.
+ *
+ * @param lk		The lock data
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void lk_dump(const struct lksmith_lock *lk,
+		char *buf, size_t *off, size_t buf_len)
+{
+	uint32_t i;
+	const uint32_t *before;
+	const char *prefix = "";
+	struct lksmith_holder *holder;
+
+	fwdprintf(buf, off, buf_len, "lk{ptr=%p, id=%"PRIu32", "
+		"nlock=%"PRId64", recursive=%d, sleeper=%d,"
+		"color=%"PRId64", ",
+		(void*)lk->ptr, lk->id, (uint64_t)lk->props.nlock,
+		lk->props.recursive, lk->props.sleeper,
+		lk->cold->color);
+	if (lk->cold->array) {
+		fwdprintf(buf, off, buf_len, "array=%s, stride=%zu, "
+			"count=%zu, ", lk->cold->array->name,
+			lk->cold->array->stride, lk->cold->array->count);
+	}
+	fwdprintf(buf, off, buf_len, "before={");
+	before = idvec_data(&lk->cold->before);
+	for (i = 0; i < lk->cold->before.size; i++) {
+		fwdprintf(buf, off, buf_len, "%s%"PRIu32,
+			  prefix, before[i]);
+		prefix = " ";
+	}
+	fwdprintf(buf, off, buf_len, "}, holders=[");
+	prefix = "";
+	holder = lk->holders;
+	while (holder) {
+		fwdprintf(buf, off, buf_len, "%s", prefix);
+		holder_dump(holder, buf, off, buf_len);
+		prefix = ", ";
+		holder = holder->next;
+	}
+	fwdprintf(buf, off, buf_len, "]}");
+}
+
+static void lk_dump_to_stderr(struct lksmith_lock *lk)
+{
+	char buf[16384];
+	size_t off = 0;
+
+	lk_dump(lk, buf, &off, sizeof(buf));
+	fputs(buf, stderr);
+	fputs("\n", stderr);
+}
+
+static void tree_print(void)
+{
+	char buf[8196];
+	struct lksmith_lock_cold *ck;
+	size_t off;
+	const char *prefix = "";
+
+	fprintf(stderr, "g_lock_tree: {");
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		off = 0;
+		lk_dump(ck->lk, buf, &off, sizeof(buf));
+		fprintf(stderr, "%s%s", prefix, buf);
+		prefix = ",\n";
+	}
+	fprintf(stderr, "\n}\n");
+}
+
+/**
+ * Allocate a lock ID.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param id		(out param) the new lock ID
+ *
+ * @return		0 on success; ENOSPC if we ran out of IDs.
+ */
+static int lk_id_alloc(uint32_t *id)
+{
+	uint32_t page;
+
+	if (g_num_free_ids > 0) {
+		*id = g_free_ids[--g_num_free_ids];
+		return 0;
+	}
+	if (g_next_lock_id == LOCK_ID_MAX)
+		return ENOSPC;
+	page = g_next_lock_id >> LOCK_ID_PAGE_SHIFT;
+	if (!g_lock_id_pages[page]) {
+		g_lock_id_pages[page] = calloc(LOCK_ID_PAGE_SIZE,
+					sizeof(struct lksmith_lock*));
+		if (!g_lock_id_pages[page])
+			return ENOMEM;
+	}
+	*id = g_next_lock_id++;
+	return 0;
+}
+
+/**
+ * Set the lock associated with a lock ID.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param id		The lock ID.  It must have come from lk_id_alloc.
+ * @param lk		The lock, or NULL to clear the entry.
+ */
+static void lk_set_id(uint32_t id, struct lksmith_lock *lk)
+{
+	g_lock_id_pages[id >> LOCK_ID_PAGE_SHIFT]
+		[id & (LOCK_ID_PAGE_SIZE - 1)] = lk;
+}
+
+/**
+ * Release a lock ID so that it can be handed out again.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param id		The lock ID to release.
+ */
+static void lk_id_free(uint32_t id)
+{
+	uint32_t *ids, cap;
+
+	if (g_num_free_ids == g_free_ids_cap) {
+		cap = g_free_ids_cap ? (g_free_ids_cap * 2) : 64;
+		ids = realloc(g_free_ids, sizeof(uint32_t) * cap);
+		if (!ids) {
+			/* We can live without recycling this ID. */
+			return;
+		}
+		g_free_ids = ids;
+		g_free_ids_cap = cap;
+	}
+	g_free_ids[g_num_free_ids++] = id;
+}
+
+/**
+ * Keep the record of a lock which is being destroyed, if it is among the
+ * highest-scoring records we have kept.  If the set is full, the
+ * lowest-scoring record is freed to make room.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param rs		The retired records.
+ * @param item		The record.  We take ownership.
+ * @param score		The record's score.
+ */
+static void retired_keep(struct retired_set *rs, void *item, uint64_t score)
+{
+	int i, min = 0;
+
+	if (rs->num < TOPK_REPORT_MAX) {
+		rs->items[rs->num] = item;
+		rs->scores[rs->num++] = score;
+		return;
+	}
+	for (i = 1; i < rs->num; i++) {
+		if (rs->scores[i] < rs->scores[min])
+			min = i;
+	}
+	if (rs->scores[min] >= score) {
+		free(item);
+		return;
+	}
+	free(rs->items[min]);
+	rs->items[min] = item;
+	rs->scores[min] = score;
+}
+
+/**
+ * Keep the hand-off latencies of a lock which is being destroyed, if they are
+ * among the largest we have kept.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param ho		The hand-off data, or NULL.  We take ownership.
+ */
+static void handoff_retire(struct lksmith_handoff *ho)
+{
+	if (!ho)
+		return;
+	ho->destroyed = 1;
+	retired_keep(&g_retired_handoffs, ho, ho->total_ns);
+}
+
+/**
+ * Estimate how many times a lock's cache line moved, weighting moves between
+ * NUMA nodes by how much more they cost.
+ *
+ * @param bo		The lock's sampled acquisitions.
+ *
+ * @return		The estimated cost, in local cache line transfers.
+ */
+static uint64_t bounce_cost(const struct lksmith_bounce *bo)
+{
+	return (bo->cpu_changes - bo->node_changes) +
+		(bo->node_changes * BOUNCE_REMOTE_COST);
+}
+
+/**
+ * Keep the sampled acquisitions of a lock which is being destroyed, if they
+ * are among the most costly we have kept.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param bo		The sampled acquisitions, or NULL.  We take
+ *			ownership.
+ */
+static void bounce_retire(struct lksmith_bounce *bo)
+{
+	if (!bo)
+		return;
+	bo->destroyed = 1;
+	retired_keep(&g_retired_bounces, bo, bounce_cost(bo));
+}
+
+static int advise_evaluate(const struct lksmith_advice *adv,
+			   struct lksmith_lock_advice *out);
+
+/**
+ * Find how much the costliest advice for a lock would save.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param adv		The lock's usage.
+ *
+ * @return		The estimated saving in nanoseconds, or 0 if we have
+ *			no advice for it.
+ */
+static uint64_t advise_score(const struct lksmith_advice *adv)
+{
+	struct lksmith_lock_advice items[ADVISE_KINDS];
+	uint64_t score = 0;
+	int i, n;
+
+	n = advise_evaluate(adv, items);
+	for (i = 0; i < n; i++) {
+		if (items[i].score_ns > score)
+			score = items[i].score_ns;
+	}
+	return score;
+}
+
+/**
+ * Keep the usage of a lock which is being destroyed, if we have advice for
+ * it and it is among the most costly we have kept.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param adv		The usage, or NULL.  We take ownership.
+ */
+static void advise_retire(struct lksmith_advice *adv)
+{
+	struct lksmith_lock_advice items[ADVISE_KINDS];
+
+	if (!adv)
+		return;
+	adv->destroyed = 1;
+	if (advise_evaluate(adv, items) == 0) {
+		free(adv);
+		return;
+	}
+	retired_keep(&g_retired_advice, adv, advise_score(adv));
+}
+
+/**
+ * Keep the fairness data of a lock which is being destroyed, if it has one of
+ * the longest waits we have kept.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param fa		The fairness data, or NULL.  We take ownership.
+ */
+static void fairness_retire(struct lksmith_fairness *fa)
+{
+	if (!fa)
+		return;
+	fa->destroyed = 1;
+	retired_keep(&g_retired_fairness, fa, fa->max_wait_ns);
+}
+
+static void lksmith_lock_free(struct lksmith_lock *lk)
+{
+	struct lksmith_edge_prov *prov, *next;
+
+	for (prov = lk->cold->prov; prov; prov = next) {
+		next = prov->next;
+		free(prov);
+	}
+	free(lk->cold->array);
+	handoff_retire(lk->cold->handoff);
+	bounce_retire(lk->cold->bounce);
+	advise_retire(lk->cold->advice);
+	fairness_retire(lk->cold->fairness);
+	idvec_free(&lk->cold->before);
+	free(lk->cold);
+	free(lk);
+}
+
+static int lksmith_insert(const void *ptr, int recursive,
+		int sleeper, struct lksmith_lock **lk)
+{
+	struct lksmith_lock *ak;
+	struct lksmith_lock_cold *ck;
+	int ret;
+
+	if (posix_memalign((void**)&ak, CACHE_LINE_SIZE, sizeof(*ak)))
+		return ENOMEM;
+	memset(ak, 0, sizeof(*ak));
+	ck = calloc(1, sizeof(*ck));
+	if (!ck) {
+		free(ak);
+		return ENOMEM;
+	}
+	ak->cold = ck;
+	ck->lk = ak;
+	ak->ptr = ck->ptr = ptr;
+	ak->props.recursive = !!recursive;
+	ak->props.sleeper = !!sleeper;
+	ak->holders = NULL;
+	if (RB_INSERT(lock_tree, &g_tree, ck)) {
+		lksmith_lock_free(ak);
+		return EEXIST;
+	}
+	ret = lk_id_alloc(&ak->id);
+	if (ret) {
+		RB_REMOVE(lock_tree, &g_tree, ck);
+		lksmith_lock_free(ak);
+		return ret;
+	}
+	lk_set_id(ak->id, ak);
+	*lk = ak;
+	return 0;
+}
+
+/**
+ * Find the lock array containing a given lock.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param ptr		The lock pointer.
+ *
+ * @return		The lock array, or NULL if the lock isn't part of
+ *			any lock array.
+ */
+static struct lksmith_lock_array *lksmith_array_find(const void *ptr)
+{
+	struct lksmith_lock_array exemplar, *arr;
+	size_t off;
+
+	if (RB_EMPTY(&g_array_tree))
+		return NULL;
+	exemplar.base = ptr;
+	/* Find the array with the greatest base address <= ptr. */
+	arr = RB_NFIND(array_tree, &g_array_tree, &exemplar);
+	if (!arr)
+		arr = RB_MAX(array_tree, &g_array_tree);
+	else if (arr->base != (const char*)ptr)
+		arr = RB_PREV(array_tree, &g_array_tree, arr);
+	if ((!arr) || ((const char*)ptr < arr->base))
+		return NULL;
+	off = (const char*)ptr - arr->base;
+	if ((off / arr->stride >= arr->count) || (off % arr->stride))
+		return NULL;
+	return arr;
+}
+
+static struct lksmith_lock *lksmith_find(const void *ptr)
+{
+	struct lksmith_lock_cold exemplar, *ck;
+	struct lksmith_lock_array *arr;
+
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.ptr = ptr;
+	ck = RB_FIND(lock_tree, &g_tree, &exemplar);
+	if (ck)
+		return ck->lk;
+	arr = lksmith_array_find(ptr);
+	return arr ? arr->lk : NULL;
+}
+
+/**
+ * Remove a lock from the graph and free it.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param lk		The lock.  Must not have any holders.
+ */
+static void lksmith_remove(struct lksmith_lock *lk)
+{
+	struct lksmith_lock_cold *ck;
+
+	RB_REMOVE(lock_tree, &g_tree, lk->cold);
+	/* TODO: could probably avoid traversing the whole tree by using both
+	 * before and after pointers inside locks, or some such? */
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		lk_remove_before(ck->lk, lk);
+	}
+	/* Removing edges can't be done incrementally in the closure. */
+	g_closure_dirty = 1;
+	lk_set_id(lk->id, NULL);
+	lk_id_free(lk->id);
+	lksmith_lock_free(lk);
+}
+
+/**
+ * Count a run of failed attempts against its call site.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param st		The run.
+ */
+static void storm_record(const struct lksmith_streak *st)
+{
+	struct lksmith_storm_site *ss, *nss;
+	size_t i, ncap;
+
+	for (i = 0; i < g_num_storm_sites; i++) {
+		if ((g_storm_sites[i].site == st->site) &&
+				(g_storm_sites[i].kind == st->kind))
+			break;
+	}
+	if (i == g_num_storm_sites) {
+		if (g_num_storm_sites == g_storm_sites_cap) {
+			ncap = g_storm_sites_cap ? (g_storm_sites_cap * 2) : 16;
+			nss = realloc(g_storm_sites, ncap * sizeof(*nss));
+			if (!nss)
+				return;
+			g_storm_sites = nss;
+			g_storm_sites_cap = ncap;
+		}
+		ss = &g_storm_sites[g_num_storm_sites++];
+		memset(ss, 0, sizeof(*ss));
+		ss->site = st->site;
+		ss->kind = st->kind;
+	}
+	ss = &g_storm_sites[i];
+	ss->ptr = st->ptr;
+	ss->streaks++;
+	ss->failures += st->fails;
+	if (st->fails > ss->max_streak)
+		ss->max_streak = st->fails;
+	ss->wall_ns += st->last_ns - st->first_ns;
+	if (st->has_cpu)
+		ss->cpu_ns += st->cpu_last_ns - st->cpu_start_ns;
+	if (st->max_gap_ns > ss->max_gap_ns)
+		ss->max_gap_ns = st->max_gap_ns;
+}
+
+/**
+ * End a run of failed attempts, and count it if it was long enough.
+ *
+ * @param st		The run.  The slot is freed.
+ * @param locked	1 if we hold g_tree_lock.
+ */
+static void tls_streak_end(struct lksmith_streak *st, int locked)
+{
+	if ((st->ptr) && (g_storm_streak) && (st->fails >= g_storm_streak)) {
+		if (!locked)
+			r_pthread_mutex_lock(&g_tree_lock);
+		storm_record(st);
+		if (!locked)
+			r_pthread_mutex_unlock(&g_tree_lock);
+	}
+	memset(st, 0, sizeof(*st));
+}
+
+/**
+ * Count a failed attempt to take a lock without waiting.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock or condition variable.
+ * @param site		Where the attempt was made, or NULL if unknown.
+ * @param kind		LKSMITH_STORM_TRYLOCK or LKSMITH_STORM_TIMED.
+ */
+static void tls_streak_fail(struct lksmith_tls *tls, const void *ptr,
+			    const void *site, int kind)
+{
+	struct lksmith_streak *st = NULL, *oldest = NULL;
+	struct platform_usage usage;
+	uint64_t now;
+	int i;
+
+	for (i = 0; i < STORM_SLOTS; i++) {
+		st = &tls->streaks[i];
+		if ((st->ptr == ptr) && (st->site == site) &&
+				(st->kind == kind))
+			break;
+		if ((!oldest) || (!st->ptr) ||
+				((oldest->ptr) && (st->last_ns < oldest->last_ns)))
+			oldest = st;
+	}
+	if (i == STORM_SLOTS) {
+		/* Give up on the run we've heard least from recently. */
+		st = oldest;
+		if (st->ptr)
+			tls_streak_end(st, 0);
+		st->ptr = ptr;
+		st->site = site;
+		st->kind = kind;
+	}
+	now = time_now_ns();
+	if (st->fails == 0) {
+		st->first_ns = now;
+	} else if (now - st->last_ns > st->max_gap_ns) {
+		st->max_gap_ns = now - st->last_ns;
+	}
+	st->last_ns = now;
+	st->fails++;
+	/* Once the caller has tried twice, it is looping.  Measure the CPU
+	 * time it spends doing so. */
+	if ((st->fails >= 2) && (!platform_get_usage(&usage))) {
+		if (!st->has_cpu) {
+			st->cpu_start_ns = usage.cpu_ns;
+			st->has_cpu = 1;
+		}
+		st->cpu_last_ns = usage.cpu_ns;
+	}
+}
+
+/**
+ * End the runs of failed attempts on a lock, because we took it.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock.
+ * @param locked	1 if we hold g_tree_lock.
+ */
+static void tls_streak_end_ptr(struct lksmith_tls *tls, const void *ptr,
+			       int locked)
+{
+	int i;
+
+	for (i = 0; i < STORM_SLOTS; i++) {
+		if (tls->streaks[i].ptr == ptr)
+			tls_streak_end(&tls->streaks[i], locked);
+	}
+}
+
+/******************************************************************
+ *  Cond functions
+ *****************************************************************/
+static int lksmith_cond_compare(const struct lksmith_cond *a,
+		const struct lksmith_cond *b)
+{
+	const void *pa = a->ptr;
+	const void *pb = b->ptr;
+	if (pa < pb)
+		return -1;
+	else if (pa > pb)
+		return 1;
+	else
+		return 0;
+}
+
+static struct lksmith_cond *lksmith_cond_find(const void *ptr)
+{
+	struct lksmith_cond exemplar;
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.ptr = ptr;
+	return RB_FIND(cond_tree, &g_cond_tree, &exemplar);
+}
+
+static int lksmith_cond_insert(const void *ptr, struct lksmith_cond **cond)
+{
+	struct lksmith_cond *cnd, *and;
+	cnd = calloc(1, sizeof(*cnd));
+	if (!cnd) {
+		return ENOMEM;
+	}
+	cnd->ptr = ptr;
+	and = RB_INSERT(cond_tree, &g_cond_tree, cnd);
+	if (and) {
+		free(cnd);
+		return EEXIST;
+	}
+	*cond = cnd;
+	return 0;
+}
+
+/******************************************************************
+ *  API functions
+ *****************************************************************/
+int lksmith_optional_init(const void *ptr, int recursive, int sleeper)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_lock *lk;
+	int ret;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_optional_init(lock=%p): "
+			"failed to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
+	}
+	if (!tls->intercept)
+		return 0;
+	if (((uintptr_t)ptr & PTRSET_TAG_MASK) == 0) {
+		/* Defer creating the lock data until the lock is first taken.
+		 * Whether the lock is a sleeper will be known then. */
+		r_pthread_mutex_lock(&g_pending_lock);
+		ret = ptrset_insert(&g_pending, ptr,
+			recursive ? PENDING_RECURSIVE : 0);
+		r_pthread_mutex_unlock(&g_pending_lock);
+	} else {
+		/* Misaligned locks have no room for a tag. */
+		r_pthread_mutex_lock(&g_tree_lock);
+		ret = lksmith_insert(ptr, recursive, sleeper, &lk);
+		r_pthread_mutex_unlock(&g_tree_lock);
+	}
+	if (ret) {
+		lksmith_error(ret, "lksmith_optional_init(lock=%p, "
+			"thread=%s): failed to allocate lock data: "
+			"error %d: %s\n", ptr, tls->name, ret, terror(ret));
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * Remove a lock from the set of initialized but never-taken locks.
+ *
+ * @param ptr		The lock
+ * @param recursive	(out param) set to 1 if the lock was initialized as
+ *			recursive; 0 otherwise.  Untouched if the lock is
+ *			not pending.
+ *
+ * @return		0 on success; ENOENT if the lock was not pending.
+ */
+static int lksmith_pending_take(const void *ptr, int *recursive)
+{
+	unsigned int tag;
+	int ret;
+
+	r_pthread_mutex_lock(&g_pending_lock);
+	ret = ptrset_remove(&g_pending, ptr, &tag);
+	r_pthread_mutex_unlock(&g_pending_lock);
+	if (ret)
+		return ret;
+	*recursive = !!(tag & PENDING_RECURSIVE);
+	return 0;
+}
+
+int lksmith_destroy(const void *ptr)
+{
+	int ret;
+	struct lksmith_lock *lk;
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_destroy(lock=%p): failed to "
+			"allocate thread-local storage.\n", ptr);
+		ret = ENOMEM;
+		goto done;
+	}
+	if (!tls->intercept)
+		return 0;
+	r_pthread_mutex_lock(&g_tree_lock);
+	lk = lksmith_find(ptr);
+	if (!lk) {
+		/* If the lock was initialized but never taken, there is no
+		 * lock data to clean up. */
+		int recursive;
+		ret = lksmith_pending_take(ptr, &recursive);
+		/* Otherwise, this might not be an error, if we used
+		 * PTHREAD_MUTEX_INITIALIZER and then never did anything else
+		 * with the lock prior to destroying it. */
+		goto done_unlock;
+	}
+	if (lk->cold->array) {
+		/* The lock data belongs to the whole array, and goes away in
+		 * lksmith_unregister_lock_array. */
+		int recursive;
+		lksmith_pending_take(ptr, &recursive);
+		if (tls_contains_ptr(tls, ptr)) {
+			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
+				"thread=%s): you must unlock this mutex "
+				"before destroying it.", ptr, tls->name);
+			ret = EBUSY;
+		} else {
+			ret = 0;
+		}
+		goto done_unlock;
+	}
+	if (lk->holders != NULL) {
+		if (tls_contains_ptr(tls, ptr) == 1) {
+			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
+				"thread=%s): you must unlock this mutex "
+				"before destroying it.", ptr, tls->name);
+		} else {
+			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
+				"thread=%s): this mutex is currently in use "
+				"and so cannot be destroyed.", ptr, tls->name);
+		}
+		ret = EBUSY;
+		goto done_unlock;
+	}
+	lksmith_remove(lk);
+	ret = 0;
+done_unlock:
+	r_pthread_mutex_unlock(&g_tree_lock);
+done:
+	return ret;
+}
+
+int lksmith_register_lock_array(const void *base, size_t stride,
+				size_t count, const char *name)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_lock_array *arr, *other;
+	struct lksmith_lock_cold exemplar, *ck;
+	struct lksmith_lock *lk;
+	const char *end;
+	int ret;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_register_lock_array(base=%p): "
+			"failed to allocate thread-local storage.\n", base);
+		return ENOMEM;
+	}
+	if (!tls->intercept)
+		return 0;
+	if ((stride == 0) || (count == 0) ||
+			(count > (UINTPTR_MAX - (uintptr_t)base) / stride)) {
+		lksmith_error(EINVAL, "lksmith_register_lock_array(base=%p, "
+			"stride=%zu, count=%zu): invalid array bounds.\n",
+			base, stride, count);
+		return EINVAL;
+	}
+	end = (const char*)base + (stride * count);
+	arr = calloc(1, sizeof(*arr));
+	if (!arr)
+		return ENOMEM;
+	arr->base = base;
+	arr->stride = stride;
+	arr->count = count;
+	snprintf(arr->name, sizeof(arr->name), "%s", name ? name : "");
+	r_pthread_mutex_lock(&g_tree_lock);
+	/* Don't allow the array to overlap any lock that we already know
+	 * about. */
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.ptr = base;
+	ck = RB_NFIND(lock_tree, &g_tree, &exemplar);
+	if ((ck) && ((const char*)ck->ptr < end)) {
+		ret = EEXIST;
+		goto error_unlock;
+	}
+	other = RB_NFIND(array_tree, &g_array_tree, arr);
+	other = other ? RB_PREV(array_tree, &g_array_tree, other) :
+		RB_MAX(array_tree, &g_array_tree);
+	if ((other) && (other->base + (other->stride * other->count) >
+			(const char*)base)) {
+		ret = EEXIST;
+		goto error_unlock;
+	}
+	/* Locks in the array are never recursive. */
+	ret = lksmith_insert(base, 0, 1, &lk);
+	if (ret)
+		goto error_unlock;
+	lk->cold->array = arr;
+	arr->lk = lk;
+	RB_INSERT(array_tree, &g_array_tree, arr);
+	r_pthread_mutex_unlock(&g_tree_lock);
+	return 0;
+
+error_unlock:
+	r_pthread_mutex_unlock(&g_tree_lock);
+	lksmith_error(ret, "lksmith_register_lock_array(base=%p, "
+		"stride=%zu, count=%zu, name=%s): failed with error %d: %s\n",
+		base, stride, count, arr->name, ret, terror(ret));
+	free(arr);
+	return ret;
+}
+
+int lksmith_unregister_lock_array(const void *base)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_lock_array exemplar, *arr;
+	int ret;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_unregister_lock_array(base=%p): "
+			"failed to allocate thread-local storage.\n", base);
+		return ENOMEM;
+	}
+	if (!tls->intercept)
+		return 0;
+	r_pthread_mutex_lock(&g_tree_lock);
+	exemplar.base = base;
+	arr = RB_FIND(array_tree, &g_array_tree, &exemplar);
+	if (!arr) {
+		ret = ENOENT;
+		goto done_unlock;
+	}
+	if (arr->lk->holders != NULL) {
+		lksmith_error(EBUSY, "lksmith_unregister_lock_array(base=%p, "
+			"thread=%s): locks in array '%s' are currently in "
+			"use.\n", base, tls->name, arr->name);
+		ret = EBUSY;
+		goto done_unlock;
+	}
+	RB_REMOVE(array_tree, &g_array_tree, arr);
+	lksmith_remove(arr->lk);
+	ret = 0;
+done_unlock:
+	r_pthread_mutex_unlock(&g_tree_lock);
+	return ret;
+}
+
+static int lksmith_search(struct lksmith_lock *lk, const void *start)
+{
+	int ret;
+	uint32_t i;
+	const uint32_t *before;
+
+	if (lk->ptr == start)
+		return 1;
+	if (lk->cold->color == g_color)
+		return 0;
+	lk->cold->color = g_color;
+	before = idvec_data(&lk->cold->before);
+	for (i = 0; i < lk->cold->before.size; i++) {
+		ret = lksmith_search(lk_by_id(before[i]), start);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * Add the closure of a lock and everything before it to g_closure.
+ *
+ * The 'before' graph is acyclic, since we never add an edge that would create
+ * a cycle.  So a depth-first post-order traversal fills in each row from rows
+ * which are already complete.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param lk		The lock to start at.
+ */
+static void lk_closure_fill(struct lksmith_lock *lk)
+{
+	uint32_t i;
+	const uint32_t *before;
+
+	if (lk->cold->color == g_color)
+		return;
+	lk->cold->color = g_color;
+	before = idvec_data(&lk->cold->before);
+	for (i = 0; i < lk->cold->before.size; i++) {
+		lk_closure_fill(lk_by_id(before[i]));
+		closure_merge(&g_closure, lk->id, before[i]);
+	}
+}
+
+/**
+ * Make sure that g_closure is ready to use, rebuilding it if necessary.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @return		1 if g_closure can be used; 0 if the caller must
+ *			fall back on searching the graph.
+ */
+static int lk_closure_sync(void)
+{
+	struct lksmith_lock_cold *ck;
+	int ret;
+
+	if (!g_closure_enabled)
+		return 0;
+	if (g_next_lock_id > g_closure_max) {
+		/* The matrix would be too big.  From now on, we'll search the
+		 * graph instead. */
+		closure_free(&g_closure);
+		g_closure_enabled = 0;
+		return 0;
+	}
+	ret = closure_reserve(&g_closure, g_next_lock_id);
+	if (ret) {
+		lksmith_error(ret, "lk_closure_sync: failed to allocate "
+			"the closure for %"PRIu32" locks.  Falling back on "
+			"graph search.\n", g_next_lock_id);
+		closure_free(&g_closure);
+		g_closure_enabled = 0;
+		return 0;
+	}
+	if (g_closure_dirty) {
+		closure_clear(&g_closure);
+		g_color++;
+		RB_FOREACH(ck, lock_tree, &g_tree) {
+			lk_closure_fill(ck->lk);
+		}
+		g_closure_dirty = 0;
+	}
+	return 1;
+}
+
+/**
+ * Determine if a lock has been taken before another lock, directly or
+ * indirectly.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param ak		The lock whose 'before' set we should look in.
+ * @param lk		The lock to look for.
+ * @param use_closure	1 if g_closure is ready to use.
+ *
+ * @return		1 if lk is in the transitive 'before' set of ak.
+ */
+static int lk_is_before(struct lksmith_lock *ak, struct lksmith_lock *lk,
+			int use_closure)
+{
+	if (use_closure)
+		return closure_reaches(&g_closure, ak->id, lk->id);
+	return lksmith_search(ak, lk->ptr);
+}
+
+static void lksmith_prelock_process_depends(struct lksmith_tls *tls,
+			struct lksmith_lock *lk, const void *ptr,
+			struct lksmith_holder *holder)
+{
+	unsigned int i;
+	struct lksmith_lock *ak;
+	int use_closure;
+
+	use_closure = lk_closure_sync();
+	g_color++;
+	for (i = 0; i < tls->num_held; i++) {
+		ak = lk_by_id(tls->held[i].id);
+		if ((ak == lk) && (tls->held[i].ptr != ptr)) {
+			/* Both locks are in the same lock array. */
+			if ((const char*)tls->held[i].ptr < (const char*)ptr)
+				continue;
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
+				"lock=%p, thread=%s): lock array order "
+				"violation!  Locks in array '%s' must be taken "
+				"in ascending address order, but this thread "
+				"already holds lock %p.\n", ptr, tls->name,
+				lk->cold->array->name, tls->held[i].ptr);
+			continue;
+		}
+		if (ak == lk) {
+			if (ak->props.recursive)
+				continue;
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
+				"lock=%p, thread=%s): this thread already holds "
+				"this lock, and it is not a recursive lock.\n",
+				ptr, tls->name);
+			continue;
+		}
+		if (idvec_contains(&lk->cold->before, ak->id))
+			continue;
+		if ((g_order_check == ORDER_CHECK_INLINE) &&
+				(lk_is_before(ak, lk, use_closure))) {
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
+				"lock=%p, thread=%s): lock inversion!  This "
+				"lock should have been taken before lock %p, "
+				"which this thread already holds.\n",
+				ptr, tls->name, ak->ptr);
+			continue;
+		}
+		if (lk_add_before(lk, ak))
+			continue;
+		lk_add_prov(lk, ak, tls, holder);
+		if ((use_closure) &&
+				(!closure_reaches(&g_closure, lk->id, ak->id)))
+			closure_add_edge(&g_closure, lk->id, ak->id);
+	}
+}
+
+/**
+ * Returns true if lksmith_prelock should skip dependency processing.
+ *
+ * We search the current backtrace for any element that is in the ignore
+ * list.
+ */
+static int should_skip_dependency_processing(struct lksmith_holder *holder)
+{
+	int bt_idx, ip_idx;
+	char *match;
+
+	for (bt_idx = 0; bt_idx < holder->bt_len; bt_idx++) {
+		const char *frame = holder->bt_frames[bt_idx];
+		match = bsearch(&frame, g_ignored_frames, g_num_ignored_frames,
+				sizeof(char*), compare_strings);
+		if (match) {
+			return 1;
+		}
+		for (ip_idx = 0; ip_idx < g_num_ignored_frame_patterns;
+			     ip_idx++) {
+			if (!fnmatch(g_ignored_frame_patterns[ip_idx],
+				     frame, 0)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Decide whether this thread should do the full checks on the next lock, and
+ * adjust how often we do them to stay within the overhead budget.
+ *
+ * @param tls		The thread-local data.
+ * @param now		The current time in nanoseconds.
+ *
+ * @return		1 if we should do the full checks; 0 if we may
+ *			skip them.
+ */
+static int tls_budget_sample(struct lksmith_tls *tls, uint64_t now)
+{
+	uint64_t elapsed, share;
+
+	if (tls->budget_window_ns == 0) {
+		tls->budget_window_ns = now;
+		tls->sample_period = 1;
+	}
+	elapsed = now - tls->budget_window_ns;
+	if (elapsed >= BUDGET_WINDOW_NS) {
+		share = (tls->budget_self_ns * 1000000ULL) / elapsed;
+		if (share > g_budget_ppm) {
+			if (tls->sample_period < BUDGET_MAX_PERIOD)
+				tls->sample_period *= 2;
+		} else if (share < (g_budget_ppm / 2)) {
+			if (tls->sample_period > 1)
+				tls->sample_period /= 2;
+		}
+		if (tls->sample_countdown > tls->sample_period)
+			tls->sample_countdown = tls->sample_period;
+		tls->budget_window_ns = now;
+		tls->budget_self_ns = 0;
+	}
+	if (tls->sample_countdown <= 1) {
+		tls->sample_countdown = tls->sample_period;
+		return 1;
+	}
+	tls->sample_countdown--;
+	return 0;
+}
+
+static void *site_key(const void *site)
+{
+	return (void*)(((uintptr_t)site) << 2);
+}
+
+/**
+ * Determine whether we can skip the full checks for a lock.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * We never skip a lock which would add an edge to the lock order graph, or
+ * which is taken from a call site that hasn't had the full checks yet.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock data, or NULL if there is none yet.
+ * @param site		The call site, or NULL if unknown.
+ *
+ * @return		1 if we can skip the full checks; 0 otherwise.
+ */
+static int lk_can_skip_checks(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, const void *site)
+{
+	unsigned int i;
+	struct lksmith_lock *ak;
+
+	if ((!lk) || (!site) || (lk->cold->array))
+		return 0;
+	if (!ptrset_contains(&g_seen_sites, site_key(site)))
+		return 0;
+	for (i = 0; i < tls->num_held; i++) {
+		ak = lk_by_id(tls->held[i].id);
+		if (ak == lk)
+			return 0;
+		if (!idvec_contains(&lk->cold->before, ak->id))
+			return 0;
+	}
+	return 1;
+}
+
+int lksmith_prelock(const void *ptr, int sleeper)
+{
+	return lksmith_prelock_at(ptr, sleeper, NULL);
+}
+
+/**
+ * Note whether the lock we are about to take is held by another thread.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock we are about to take.
+ */
+static void tls_advise_contended(struct lksmith_tls *tls,
+		const struct lksmith_lock *lk)
+{
+	tls->advise_contended = (lk->owner) && (lk->owner != tls);
+}
+
+/**
+ * Count ourselves as waiting for a lock until lksmith_postlock.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock we are about to take.
+ */
+static void tls_fair_start(struct lksmith_tls *tls, struct lksmith_lock *lk)
+{
+	struct lksmith_fairness *fa = lk->cold->fairness;
+
+	/* Threads taking different locks in an array don't compete. */
+	if (lk->cold->array)
+		return;
+	if (!fa) {
+		fa = calloc(1, sizeof(*fa));
+		if (!fa)
+			return;
+		fa->ptr = lk->ptr;
+		lk->cold->fairness = fa;
+	}
+	fa->waiters++;
+	tls->fair_waiting = 1;
+	tls->fair_wait_ns = time_now_ns();
+}
+
+/**
+ * Do the optional features' work before waiting for a lock.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock data.
+ */
+static void tls_prelock_extras(struct lksmith_tls *tls,
+			       struct lksmith_lock *lk)
+{
+	if (g_advise)
+		tls_advise_contended(tls, lk);
+	if (g_fairness)
+		tls_fair_start(tls, lk);
+}
+
+int lksmith_prelock_at(const void *ptr, int sleeper, const void *site)
+{
+	struct lksmith_lock *lk;
+	struct lksmith_tls *tls;
+	int ret;
+	struct lksmith_holder *holder = NULL;
+	uint64_t start = 0;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
+			"allocate thread-local storage.\n", ptr);
+		ret = ENOMEM;
+		goto done;
+	}
+	if (!tls->intercept)
+		return 0;
+	tls->flight_site = site;
+	if (g_budget_ppm) {
+		start = time_now_ns();
+		if (!tls_budget_sample(tls, start)) {
+			r_pthread_mutex_lock(&g_tree_lock);
+			lk = lksmith_find(ptr);
+			if (lk_can_skip_checks(tls, lk, site)) {
+				holder = holder_create(tls, 0);
+				if (holder) {
+					holder->site = site;
+					if (g_acquire_extras)
+						tls_prelock_extras(tls, lk);
+					lk_holder_add(lk, holder);
+					holder = NULL;
+					ret = 0;
+					goto done_unlock;
+				}
+			}
+			r_pthread_mutex_unlock(&g_tree_lock);
+		}
+	}
+	holder = holder_create(tls, 1);
+	if (holder)
+		holder->site = site;
+	if (!holder) {
+		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
+			"allocate lock holder data.\n", ptr);
+		ret = ENOMEM;
+		goto done;
+	}
+	r_pthread_mutex_lock(&g_tree_lock);
+	lk = lksmith_find(ptr);
+	if (!lk) {
+		/* If the lock hasn't been explicitly initialized using
+		 * lksmith_optional_init, we allow it to be recursive.
+		 * It might have been statically initialized with
+		 * PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP.
+		 */
+		int recursive = 1;
+		lksmith_pending_take(ptr, &recursive);
+		ret = lksmith_insert(ptr, recursive, sleeper, &lk);
+		if (ret) {
+			lksmith_error(ret, "lksmith_prelock(lock=%p, "
+				"thread=%s): failed to allocate lock data: "
+				"error %d: %s\n", ptr, tls->name, ret, terror(ret));
+			goto done_unlock;
+		}
+	}
+	if ((lk->cold->array) && (!lk->holders)) {
+		/* We don't know what kind of locks are in an array until
+		 * someone takes one. */
+		lk->props.sleeper = !!sleeper;
+	}
+	if (!should_skip_dependency_processing(holder)) {
+		lksmith_prelock_process_depends(tls, lk, ptr, holder);
+	}
+	if (g_acquire_extras)
+		tls_prelock_extras(tls, lk);
+	lk_holder_add(lk, holder);
+	if ((g_budget_ppm) && (site)) {
+		/* If this fails, we will just check this site again. */
+		ptrset_insert(&g_seen_sites, site_key(site), 0);
+	}
+
+	holder = NULL;
+	ret = 0;
+done_unlock:
+	r_pthread_mutex_unlock(&g_tree_lock);
+done:
+	if (holder) {
+		holder_free(holder);
+	}
+	if (start)
+		tls->budget_self_ns += time_now_ns() - start;
+	return ret;
+}
+
+/**
+ * Add a lock holder without checking lock ordering.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock pointer.
+ * @param sleeper	1 if this lock is a sleeper; 0 otherwise.
+ * @param holder	The lock holder to add.
+ * @param out		(out param) the lock data.
+ *
+ * @return		0 on success; error code otherwise.  On error, the
+ *			holder has not been added.
+ */
+static int lksmith_add_holder_nocheck(struct lksmith_tls *tls,
+		const void *ptr, int sleeper, struct lksmith_holder *holder,
+		struct lksmith_lock **out)
+{
+	struct lksmith_lock *lk;
+	int ret;
+
+	lk = lksmith_find(ptr);
+	if (!lk) {
+		int recursive = 1;
+		lksmith_pending_take(ptr, &recursive);
+		ret = lksmith_insert(ptr, recursive, sleeper, &lk);
+		if (ret) {
+			lksmith_error(ret, "lksmith_prelock(lock=%p, "
+				"thread=%s): failed to allocate lock data: "
+				"error %d: %s\n", ptr, tls->name, ret, terror(ret));
+			return ret;
+		}
+	}
+	if ((lk->cold->array) && (!lk->holders))
+		lk->props.sleeper = !!sleeper;
+	lk_holder_add(lk, holder);
+	*out = lk;
+	return 0;
+}
+
+/**
+ * Create a lock holder for lksmith_prelock_nocheck or lksmith_took_lock.
+ */
+static struct lksmith_holder *holder_create_nocheck(struct lksmith_tls *tls,
+		const void *ptr, const void *site, int backtrace)
+{
+	struct lksmith_holder *holder;
+
+	holder = holder_create(tls, backtrace);
+	if (!holder) {
+		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
+			"allocate lock holder data.\n", ptr);
+		return NULL;
+	}
+	holder->site = site;
+	return holder;
+}
+
+int lksmith_prelock_nocheck(const void *ptr, int sleeper, const void *site,
+			    int backtrace)
+{
+	struct lksmith_lock *lk;
+	struct lksmith_tls *tls;
+	struct lksmith_holder *holder;
+	int ret;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
+			"allocate thread-local storage.\n", ptr);
+		return ENOMEM;
+	}
+	if (!tls->intercept)
+		return 0;
+	tls->flight_site = site;
+	/* We only get here when the lock was busy. */
+	tls->advise_contended = 1;
+	holder = holder_create_nocheck(tls, ptr, site, backtrace);
+	if (!holder)
+		return ENOMEM;
+	r_pthread_mutex_lock(&g_tree_lock);
+	ret = lksmith_add_holder_nocheck(tls, ptr, sleeper, holder, &lk);
+	if ((!ret) && (g_fairness))
+		tls_fair_start(tls, lk);
+	r_pthread_mutex_unlock(&g_tree_lock);
+	if (ret)
+		holder_free(holder);
+	return ret;
+}
+
+/**
+ * Re-read our scheduling information, if it hasn't been read recently.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param now		The current time in nanoseconds.
+ */
+static void tls_refresh_sched(struct lksmith_tls *tls, uint64_t now)
+{
+	if ((tls->sched_refresh_ns != 0) &&
+			(now - tls->sched_refresh_ns < SCHED_REFRESH_NS))
+		return;
+	if (platform_get_sched(&tls->sched))
+		memset(&tls->sched, 0, sizeof(tls->sched));
+	tls->sched_refresh_ns = now;
+}
+
+/**
+ * Rank scheduling information, so that threads which the kernel favors get
+ * higher numbers.
+ *
+ * Real-time threads always beat normal threads, which always beat idle
+ * threads.  Among normal threads, a lower nice value is better.
+ */
+static int sched_rank(const struct platform_sched *sched)
+{
+	switch (sched->policy) {
+	case SCHED_FIFO:
+	case SCHED_RR:
+		return 100 + sched->rt_priority;
+#ifdef SCHED_IDLE
+	case SCHED_IDLE:
+		return 0;
+#endif
+	default:
+		return 40 - sched->nice;
+	}
+}
+
+static void sched_dump(const struct platform_sched *sched,
+		char *buf, size_t *off, size_t buf_len)
+{
+	switch (sched->policy) {
+	case SCHED_FIFO:
+		fwdprintf(buf, off, buf_len, "SCHED_FIFO priority %d",
+			  sched->rt_priority);
+		break;
+	case SCHED_RR:
+		fwdprintf(buf, off, buf_len, "SCHED_RR priority %d",
+			  sched->rt_priority);
+		break;
+	default:
+		fwdprintf(buf, off, buf_len, "nice %d", sched->nice);
+		break;
+	}
+}
+
+/**
+ * Find the most recent holder entry for a thread.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param lk		The lock data.
+ * @param name		The thread name.
+ *
+ * @return		The holder entry, or NULL if there is none.
+ */
+static struct lksmith_holder *lk_holder_find(struct lksmith_lock *lk,
+			const char *name)
+{
+	struct lksmith_holder *holder;
+
+	for (holder = lk->holders; holder; holder = holder->next) {
+		if (!strcmp(holder->name, name))
+			return holder;
+	}
+	return NULL;
+}
+
+/**
+ * Start timing a wait.  Remember where the lock owner took the lock, and
+ * whether it has a lower priority than us.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock we are about to wait for.
+ */
+static void tls_start_wait(struct lksmith_tls *tls, struct lksmith_lock *lk)
+{
+	struct lksmith_tls *owner = lk->owner;
+	struct lksmith_holder *holder;
+
+	tls->wait_start_ns = time_now_ns();
+	tls->wait_owner_locked_ns = 0;
+	tls->wait_owner_site = SITE_UNKNOWN;
+	tls->inv_owner[0] = '\0';
+	if (g_prio_inversion_ns)
+		tls_refresh_sched(tls, tls->wait_start_ns);
+	if ((!owner) || (owner == tls))
+		return;
+	holder = lk_holder_find(lk, owner->name);
+	if (holder) {
+		tls->wait_owner_locked_ns = holder->locked_ns;
+		holder_intern_site(holder, &tls->wait_owner_site);
+	}
+	if ((!g_prio_inversion_ns) || (lk->props.prio_warn))
+		return;
+	if (sched_rank(&owner->sched) >= sched_rank(&tls->sched))
+		return;
+	snprintf(tls->inv_owner, sizeof(tls->inv_owner), "%s", owner->name);
+	tls->inv_owner_sched = owner->sched;
+}
+
+static void site_dump(uint32_t id, char *buf, size_t *off, size_t buf_len)
+{
+	const struct site *site;
+	int i;
+
+	site = site_get(&g_sites, id);
+	if ((!site) || (site->nframes == 0)) {
+		fwdprintf(buf, off, buf_len, "(unknown)\n");
+		return;
+	}
+	for (i = 0; i < site->nframes; i++) {
+		fwdprintf(buf, off, buf_len, "%s\n", site->frames[i]);
+	}
+}
+
+/**
+ * Report a priority inversion if we waited too long for a lower-priority
+ * thread.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock we just took.
+ * @param waited	How long we waited, in nanoseconds.
+ */
+static void tls_check_prio_inversion(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, uint64_t waited)
+{
+	char buf[8192];
+	size_t off = 0;
+
+	if (!tls->inv_owner[0])
+		return;
+	tls->inv_owner[0] = '\0';
+	if ((waited < g_prio_inversion_ns) || (lk->props.prio_warn))
+		return;
+	lk->props.prio_warn = 1;
+	fwdprintf(buf, &off, sizeof(buf), "this thread (");
+	sched_dump(&tls->sched, buf, &off, sizeof(buf));
+	fwdprintf(buf, &off, sizeof(buf), ") waited %"PRIu64" us for this "
+		"lock, while it was held by thread %s (", waited / 1000,
+		tls->inv_owner);
+	sched_dump(&tls->inv_owner_sched, buf, &off, sizeof(buf));
+	fwdprintf(buf, &off, sizeof(buf), ").  Thread %s took the lock "
+		"at:\n", tls->inv_owner);
+	site_dump(tls->wait_owner_site, buf, &off, sizeof(buf));
+	lksmith_error_with_ti(tls, EWOULDBLOCK, "lksmith_postlock(lock=%p, "
+		"thread=%s): performance problem: priority inversion: %s"
+		"This thread waited at:\n", lk->ptr, tls->name, buf);
+}
+
+/**
+ * Count a slow wait against the pair of call sites involved.
+ * Note: you must call this function with g_tree_lock held.
  *
- * gcc provides the non-portable __attribute__((constructor)), which seems like
- * it could be useful.  Unfortunately, the order in which these constructor
- * functions are called between shared libraries is not defined.
- * If another shared library defines some constructor functions which invoke
- * pthreads functions, and it gets run before we initialize, it's game over.
- * C++ global constructors have the same issues.
+ * @param tls		The thread-local data.
+ * @param lk		The lock we just took.
+ * @param waited	How long we waited, in nanoseconds.
+ * @param now		The current time, in nanoseconds.
+ */
+static void tls_record_slow_wait(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, uint64_t waited, uint64_t now)
+{
+	struct lksmith_holder *holder;
+	struct lksmith_slow_wait *sw, *nsw;
+	uint32_t waiter_site = SITE_UNKNOWN;
+	uint64_t held = 0;
+	size_t i, ncap;
+
+	holder = lk_holder_find(lk, tls->name);
+	if (holder) {
+		holder_intern_site(holder, &waiter_site);
+	}
+	if (tls->wait_owner_locked_ns)
+		held = now - tls->wait_owner_locked_ns;
+	for (i = 0; i < g_num_slow_waits; i++) {
+		sw = &g_slow_waits[i];
+		if ((sw->waiter_site == waiter_site) &&
+				(sw->holder_site == tls->wait_owner_site))
+			break;
+	}
+	if (i == g_num_slow_waits) {
+		if (g_num_slow_waits == g_slow_waits_cap) {
+			ncap = g_slow_waits_cap ? (g_slow_waits_cap * 2) : 16;
+			nsw = realloc(g_slow_waits, ncap * sizeof(*nsw));
+			if (!nsw)
+				return;
+			g_slow_waits = nsw;
+			g_slow_waits_cap = ncap;
+		}
+		sw = &g_slow_waits[g_num_slow_waits++];
+		memset(sw, 0, sizeof(*sw));
+		sw->waiter_site = waiter_site;
+		sw->holder_site = tls->wait_owner_site;
+	}
+	sw->count++;
+	sw->total_wait_ns += waited;
+	if (waited > sw->max_wait_ns)
+		sw->max_wait_ns = waited;
+	if (held > sw->max_hold_ns)
+		sw->max_hold_ns = held;
+	sw->ptr = lk->ptr;
+}
+
+/**
+ * Count a hand-off of a lock from the thread which released it to a thread
+ * which was waiting for it.
+ * Note: you must call this function with g_tree_lock held.
  *
- * We could force Locksmith users to call an init function before calling any
- * other Locksmith functions.  Then, this init function could initialize the
- * key.  But that would be painful for many users.  This is especially true
- * in C++, where global constructors often make use of mutexes long before
- * main() runs.
+ * @param lk		The lock.
+ * @param ns		How long the hand-off took, in nanoseconds.
+ */
+static void lk_record_handoff(struct lksmith_lock *lk, uint64_t ns)
+{
+	struct lksmith_handoff *ho = lk->cold->handoff;
+	int b;
+
+	if (!ho) {
+		ho = calloc(1, sizeof(*ho));
+		if (!ho)
+			return;
+		ho->ptr = lk->ptr;
+		lk->cold->handoff = ho;
+	}
+	ho->count++;
+	ho->total_ns += ns;
+	if (ns > ho->max_ns)
+		ho->max_ns = ns;
+	b = ns ? (64 - __builtin_clzll(ns)) : 0;
+	if (b >= HANDOFF_BUCKETS)
+		b = HANDOFF_BUCKETS - 1;
+	ho->buckets[b]++;
+}
+
+/**
+ * Get the NUMA node of a CPU.
+ *
+ * @param cpu		The CPU, or -1 if unknown.
+ *
+ * @return		The NUMA node, or 0 if unknown.
+ */
+static int cpu_node(int cpu)
+{
+	if ((cpu < 0) || (cpu >= g_num_cpu_node))
+		return 0;
+	return g_cpu_node[cpu];
+}
+
+/**
+ * Count a sampled acquisition of a lock, noting whether the lock moved to
+ * another CPU, thread or NUMA node since the last one.  Each move means the
+ * cache line holding the lock had to move too.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param lk		The lock.
+ * @param tls		The thread which took the lock.
+ * @param cpu		The CPU it took the lock on, or -1 if unknown.
+ */
+static void lk_record_bounce(struct lksmith_lock *lk,
+		const struct lksmith_tls *tls, int cpu)
+{
+	struct lksmith_bounce *bo = lk->cold->bounce;
+
+	if (!bo) {
+		bo = calloc(1, sizeof(*bo));
+		if (!bo)
+			return;
+		bo->ptr = lk->ptr;
+		bo->last_cpu = cpu;
+		bo->last_tls = tls;
+		lk->cold->bounce = bo;
+	}
+	bo->samples++;
+	if (cpu != bo->last_cpu) {
+		bo->cpu_changes++;
+		if (cpu_node(cpu) != cpu_node(bo->last_cpu))
+			bo->node_changes++;
+		bo->last_cpu = cpu;
+	}
+	if (tls != bo->last_tls) {
+		bo->thread_changes++;
+		bo->last_tls = tls;
+	}
+}
+
+/**
+ * Decide whether to sample this event.
+ *
+ * @param countdown	(inout) Events left until the next sample.
+ * @param every		Sample one event in this many.
+ *
+ * @return		1 if we should sample this event; 0 otherwise.
+ */
+static int tls_should_sample(uint32_t *countdown, uint32_t every)
+{
+	/* A countdown of 0 wraps around, so new threads sample their first
+	 * event. */
+	if ((--*countdown != 0) && (*countdown <= every))
+		return 0;
+	*countdown = every;
+	return 1;
+}
+
+/**
+ * Find an upper bound on a percentile of a lock's hand-off times.
+ *
+ * @param ho		The hand-off data.
+ * @param pct		The percentile, from 1 to 100.
+ *
+ * @return		The upper bound, in nanoseconds.
+ */
+static uint64_t handoff_percentile(const struct lksmith_handoff *ho, int pct)
+{
+	uint64_t seen = 0, want;
+	int b;
+
+	want = (ho->count * pct + 99) / 100;
+	for (b = 0; b < HANDOFF_BUCKETS - 1; b++) {
+		seen += ho->buckets[b];
+		if (seen >= want)
+			break;
+	}
+	if ((b == 0) || (b == HANDOFF_BUCKETS - 1) ||
+			((1ULL << b) > ho->max_ns))
+		return b ? ho->max_ns : 0;
+	return 1ULL << b;
+}
+
+/**
+ * Add time spent on a lock to one of this thread's sketches.
+ *
+ * @param tk		The sketch.
+ * @param ptr		The lock.
+ * @param site		Address where we took the lock, or NULL.
+ * @param ns		The time, in nanoseconds.
+ */
+static void tls_topk_add(struct topk *tk, const void *ptr, const void *site,
+			 uint64_t ns)
+{
+	if ((!tk->cap) && (topk_init(tk, g_topk)))
+		return;
+	topk_add(tk, (uintptr_t)ptr, (uintptr_t)site, ns, 0);
+}
+
+/**
+ * Merge this thread's sketches into the global ones.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ */
+static void tls_topk_merge(struct lksmith_tls *tls)
+{
+	topk_merge(&g_wait_topk, &tls->wait_topk);
+	topk_clear(&tls->wait_topk);
+	topk_merge(&g_hold_topk, &tls->hold_topk);
+	topk_clear(&tls->hold_topk);
+}
+
+/**
+ * Merge this thread's sketches into the global ones, if we haven't done so
+ * recently.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param now		The current time, in nanoseconds.
+ */
+static void tls_topk_maybe_merge(struct lksmith_tls *tls, uint64_t now)
+{
+	if (now - tls->topk_merge_ns < TOPK_MERGE_NS)
+		return;
+	tls->topk_merge_ns = now;
+	tls_topk_merge(tls);
+}
+
+/**
+ * Finish timing a wait.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock we just took.
+ */
+static void tls_finish_wait(struct lksmith_tls *tls, struct lksmith_lock *lk)
+{
+	struct lksmith_holder *holder;
+	uint64_t now, waited, released;
+
+	now = time_now_ns();
+	waited = now - tls->wait_start_ns;
+	if (g_prio_inversion_ns) {
+		tls_refresh_sched(tls, now);
+		tls_check_prio_inversion(tls, lk, waited);
+	}
+	if ((g_slow_wait_ns) && (waited >= g_slow_wait_ns))
+		tls_record_slow_wait(tls, lk, waited, now);
+	if (g_topk) {
+		holder = lk_holder_find(lk, tls->name);
+		tls_topk_add(&tls->wait_topk, lk->ptr,
+			     holder ? holder->site : NULL, waited);
+		tls_topk_maybe_merge(tls, now);
+		/* If the lock was released while we waited, it was handed
+		 * off to us. */
+		released = __atomic_load_n(&lk->release_ns, __ATOMIC_RELAXED);
+		if ((released > tls->wait_start_ns) && (released <= now))
+			lk_record_handoff(lk, now - released);
+	}
+}
+
+/**
+ * Start measuring the resource usage of the critical section we just
+ * entered.  We do this without g_tree_lock, since getrusage is a system
+ * call.
+ *
+ * @param tls		The thread-local data.
+ */
+static void tls_cs_start(struct lksmith_tls *tls)
+{
+	struct lksmith_held *held = &tls->held[tls->num_held - 1];
+
+	tls->cs_pending = 0;
+	if (platform_get_usage(&held->usage))
+		return;
+	/* Read the clock after the counters, and before them at the end, so
+	 * that if we are switched out in between, the counters see it. */
+	held->usage_ns = time_now_ns();
+	held->sampled = 1;
+}
+
+/**
+ * Count a sampled critical section against the call site which entered it.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param lk		The lock.
+ * @param held		The critical section.
+ * @param usage		Our resource usage at the end of the critical
+ *			section.
+ * @param now		The time at the end of the critical section, in
+ *			nanoseconds.
+ */
+static void cs_record(const struct lksmith_lock *lk,
+		const struct lksmith_held *held,
+		const struct platform_usage *usage, uint64_t now)
+{
+	struct lksmith_cs_site *cs, *ncs;
+	uint64_t wall, cpu, nvcsw, nivcsw;
+	size_t i, ncap;
+
+	for (i = 0; i < g_num_cs_sites; i++) {
+		if (g_cs_sites[i].site == held->site)
+			break;
+	}
+	if (i == g_num_cs_sites) {
+		if (g_num_cs_sites == g_cs_sites_cap) {
+			ncap = g_cs_sites_cap ? (g_cs_sites_cap * 2) : 16;
+			ncs = realloc(g_cs_sites, ncap * sizeof(*ncs));
+			if (!ncs)
+				return;
+			g_cs_sites = ncs;
+			g_cs_sites_cap = ncap;
+		}
+		cs = &g_cs_sites[g_num_cs_sites++];
+		memset(cs, 0, sizeof(*cs));
+		cs->site = held->site;
+	}
+	cs = &g_cs_sites[i];
+	wall = now - held->usage_ns;
+	cpu = usage->cpu_ns - held->usage.cpu_ns;
+	/* The two clocks don't tick together, so a critical section which
+	 * never left the CPU can seem to use more CPU than wall time. */
+	if (cpu > wall)
+		cpu = wall;
+	nvcsw = usage->nvcsw - held->usage.nvcsw;
+	nivcsw = usage->nivcsw - held->usage.nivcsw;
+	cs->ptr = held->ptr;
+	cs->sleeper = lk->props.sleeper;
+	cs->count++;
+	cs->wall_ns += wall;
+	cs->cpu_ns += cpu;
+	if (wall - cpu > cs->max_offcpu_ns)
+		cs->max_offcpu_ns = wall - cpu;
+	cs->majflt += usage->majflt - held->usage.majflt;
+	cs->nvcsw += nvcsw;
+	cs->nivcsw += nivcsw;
+	if (nvcsw + nivcsw)
+		cs->switched++;
+	if (lk->cold->advice) {
+		lk->cold->advice->cs_samples++;
+		if (nivcsw)
+			lk->cold->advice->cs_preempted++;
+	}
+}
+
+/**
+ * Count an acquisition of a lock, and note which CPU we took it on.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.  The lock must be the last
+ *			entry in held.
+ * @param lk		The lock.
+ * @param contended	1 if another thread held the lock when we went to
+ *			take it.
+ */
+static void lk_advise_acquire(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, int contended)
+{
+	struct lksmith_advice *adv = lk->cold->advice;
+
+	/* We don't track the owners of locks in an array. */
+	if (lk->cold->array)
+		return;
+	if (!adv) {
+		adv = calloc(1, sizeof(*adv));
+		if (!adv)
+			return;
+		adv->ptr = lk->ptr;
+		lk->cold->advice = adv;
+	}
+	adv->sleeper = lk->props.sleeper;
+	adv->acquisitions++;
+	if (contended)
+		adv->contended++;
+	tls->held[tls->num_held - 1].cpu = platform_get_cpu();
+}
+
+/**
+ * Count an acquisition of a lock against the thread which took it.
+ * Note: you must call this function with g_tree_lock held, before making
+ * ourselves the owner.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock.
+ * @param wait		How long we took to get the lock, in nanoseconds.
+ */
+static void lk_fair_acquire(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, uint64_t wait)
+{
+	struct lksmith_fairness *fa = lk->cold->fairness;
+	struct lksmith_fair_thread *ft = NULL;
+	uint32_t i;
+	int barge;
+
+	if (lk->cold->array)
+		return;
+	if (!fa) {
+		fa = calloc(1, sizeof(*fa));
+		if (!fa)
+			return;
+		fa->ptr = lk->ptr;
+		lk->cold->fairness = fa;
+	}
+	/* Taking the lock again without letting anyone else have it, while
+	 * someone is waiting, is barging.  Taking a recursive lock we already
+	 * hold isn't. */
+	barge = (fa->acquisitions) && (fa->last_serial == tls->serial) &&
+		(fa->waiters > 0) && (lk->owner != tls);
+	fa->acquisitions++;
+	fa->last_serial = tls->serial;
+	if (barge)
+		fa->barges++;
+	if (wait > fa->max_wait_ns) {
+		fa->max_wait_ns = wait;
+		snprintf(fa->max_wait_thread, sizeof(fa->max_wait_thread),
+			 "%s", tls->name);
+	}
+	for (i = 0; i < fa->num_threads; i++) {
+		if (fa->threads[i].serial == tls->serial) {
+			ft = &fa->threads[i];
+			break;
+		}
+	}
+	if ((!ft) && (fa->num_threads < FAIR_THREADS)) {
+		ft = &fa->threads[fa->num_threads++];
+		ft->serial = tls->serial;
+		snprintf(ft->name, sizeof(ft->name), "%s", tls->name);
+	}
+	if (!ft) {
+		fa->other_acquisitions++;
+		return;
+	}
+	ft->acquisitions++;
+	ft->total_wait_ns += wait;
+	if (wait > ft->max_wait_ns)
+		ft->max_wait_ns = wait;
+	if (barge)
+		ft->barges++;
+}
+
+/**
+ * Count a timed critical section of a lock.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param lk		The lock.
+ * @param held		The critical section.
+ * @param cpu		The CPU we released the lock on, or -1 if unknown.
+ * @param now		When we released the lock, in nanoseconds.
+ */
+static void lk_advise_release(const struct lksmith_lock *lk,
+		const struct lksmith_held *held, int cpu, uint64_t now)
+{
+	struct lksmith_advice *adv = lk->cold->advice;
+	uint64_t hold;
+
+	if ((!adv) || (!held->locked_ns))
+		return;
+	hold = (now > held->locked_ns) ? (now - held->locked_ns) : 0;
+	adv->holds++;
+	adv->hold_total_ns += hold;
+	if (hold > adv->hold_max_ns)
+		adv->hold_max_ns = hold;
+	/* A critical section which moved to another CPU was switched out at
+	 * least once. */
+	if ((held->cpu >= 0) && (cpu >= 0) && (held->cpu != cpu))
+		adv->migrated++;
+}
+
+/**
+ * Count the runnable threads, if we haven't done so recently.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param now		The current time in nanoseconds.
+ */
+static void advise_sample_load(uint64_t now)
+{
+	uint32_t runnable;
+
+	if ((g_load_ns != 0) && (now - g_load_ns < ADVISE_LOAD_NS))
+		return;
+	g_load_ns = now;
+	if (platform_get_runnable(&runnable))
+		return;
+	g_load_samples++;
+	if (runnable > g_num_cpus)
+		g_load_oversubscribed++;
+	if (runnable > g_load_max_runnable)
+		g_load_max_runnable = runnable;
+}
+
+/**
+ * Record that we took a lock.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock data.
+ * @param ptr		The lock pointer.
+ * @param site		The call site, or NULL if we don't know it.
+ * @param now		The current time in nanoseconds, or 0 if we didn't
+ *			read the clock.
+ *
+ * @return		0 on success; ENOMEM if we couldn't record the lock
+ *			as held.
+ */
+static int lksmith_postlock_took(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, const void *ptr, const void *site,
+		uint64_t now)
+{
+	int ret;
+
+	if (!lk->cold->array)
+		lk->owner = tls;
+	if (lk->props.nlock < MAX_NLOCK) {
+		lk->props.nlock++;
+	}
+	ret = tls_append_held(tls, ptr, lk->id, site, now);
+	if (ret) {
+		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p, "
+			"thread=%s): failed to allocate space to store "
+			"another thread id.\n", ptr, tls->name);
+		return ENOMEM;
+	}
+	if (!lk->props.sleeper) {
+		tls->num_spins++;
+	} else if ((tls->num_spins > 0) && (!lk->props.spin_warn)) {
+		lksmith_error_with_ti(tls, EWOULDBLOCK, "lksmith_postlock("
+			"lock=%p, thread=%s): performance problem: you are "
+			"taking a sleeping lock while holding a spin lock.\n",
+			ptr, tls->name);
+		lk->props.spin_warn = 1;
+	}
+	return 0;
+}
+
+/**
+ * Update the lock data and thread-local data after taking a lock, or failing
+ * to take it, when optional features are on.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock data.
+ * @param ptr		The lock pointer.
+ * @param error		0 if we took the lock; the error code otherwise.
+ */
+static void lksmith_postlock_extras(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, const void *ptr, int error)
+{
+	const void *site = NULL;
+	uint64_t now = 0;
+	int sample = 0, contended;
+
+	contended = tls->advise_contended;
+	tls->advise_contended = 0;
+	if (tls->fair_waiting) {
+		lk->cold->fairness->waiters--;
+		tls->fair_waiting = 0;
+		if (!error)
+			lk_fair_acquire(tls, lk, time_now_ns() -
+					tls->fair_wait_ns);
+	} else if ((g_fairness) && (!error)) {
+		lk_fair_acquire(tls, lk, 0);
+	}
+	if ((tls->waiting_on) && (!error) &&
+			((g_prio_inversion_ns) || (g_slow_wait_ns) || (g_topk)))
+		tls_finish_wait(tls, lk);
+	tls->inv_owner[0] = '\0';
+	tls->waiting_on = NULL;
+	if (error) {
+		lk_holder_remove(lk, tls);
+		return;
+	}
+	if (g_cs_sample)
+		sample = tls_should_sample(&tls->cs_countdown, g_cs_sample);
+	if ((g_bounce_sample) &&
+			(tls_should_sample(&tls->bounce_countdown,
+					   g_bounce_sample)))
+		lk_record_bounce(lk, tls, platform_get_cpu());
+	if ((g_prio_inversion_ns) || (g_slow_wait_ns) || (g_topk) || (sample) ||
+			(g_advise)) {
+		struct lksmith_holder *holder;
+
+		now = time_now_ns();
+		if (g_prio_inversion_ns)
+			tls_refresh_sched(tls, now);
+		holder = lk_holder_find(lk, tls->name);
+		if (holder) {
+			holder->locked_ns = now;
+			site = holder->site;
+		}
+	}
+	if ((!site) && (tls->flight))
+		site = tls->flight_site;
+	if (lksmith_postlock_took(tls, lk, ptr, site, now))
+		return;
+	tls->cs_pending = sample;
+	if (g_storm_streak)
+		tls_streak_end_ptr(tls, ptr, 1);
+	if (g_advise)
+		lk_advise_acquire(tls, lk, contended);
+}
+
+/**
+ * Update the lock data and thread-local data after taking a lock, or failing
+ * to take it.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock data.
+ * @param ptr		The lock pointer.
+ * @param error		0 if we took the lock; the error code otherwise.
+ */
+static void lksmith_postlock_locked(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, const void *ptr, int error)
+{
+	if (g_acquire_extras) {
+		lksmith_postlock_extras(tls, lk, ptr, error);
+		return;
+	}
+	if (error) {
+		lk_holder_remove(lk, tls);
+		return;
+	}
+	lksmith_postlock_took(tls, lk, ptr,
+		tls->flight ? tls->flight_site : NULL, 0);
+}
+
+void lksmith_postlock(const void *ptr, int error)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_lock *lk;
+	uint64_t start = 0;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return;
+	}
+	if (!tls->intercept)
+		return;
+	if (g_budget_ppm)
+		start = time_now_ns();
+	r_pthread_mutex_lock(&g_tree_lock);
+	lk = lksmith_find(ptr);
+	if (!lk) {
+		lksmith_error(EIO, "lksmith_postlock(lock=%p, thread=%s): "
+			"logic error: prelock didn't create the lock data?\n",
+			ptr, tls->name);
+	} else {
+		lksmith_postlock_locked(tls, lk, ptr, error);
+	}
+	r_pthread_mutex_unlock(&g_tree_lock);
+	if ((tls->flight) && (!error)) {
+		flight_record(tls->flight, FLIGHT_OP_ACQUIRE, ptr,
+			      tls->flight_site, time_now_ns());
+	}
+	if (tls->cs_pending)
+		tls_cs_start(tls);
+	if (start)
+		tls->budget_self_ns += time_now_ns() - start;
+}
+
+void lksmith_took_lock(const void *ptr, int sleeper, const void *site)
+{
+	struct lksmith_lock *lk;
+	struct lksmith_tls *tls;
+	struct lksmith_holder *holder;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_took_lock(lock=%p): failed to "
+			"allocate thread-local storage.\n", ptr);
+		return;
+	}
+	if (!tls->intercept)
+		return;
+	tls->flight_site = site;
+	tls->advise_contended = 0;
+	holder = holder_create_nocheck(tls, ptr, site, 0);
+	if (!holder)
+		return;
+	r_pthread_mutex_lock(&g_tree_lock);
+	if (lksmith_add_holder_nocheck(tls, ptr, sleeper, holder, &lk)) {
+		r_pthread_mutex_unlock(&g_tree_lock);
+		holder_free(holder);
+		return;
+	}
+	lksmith_postlock_locked(tls, lk, ptr, 0);
+	r_pthread_mutex_unlock(&g_tree_lock);
+	if (tls->flight) {
+		flight_record(tls->flight, FLIGHT_OP_ACQUIRE, ptr,
+			      tls->flight_site, time_now_ns());
+	}
+	if (tls->cs_pending)
+		tls_cs_start(tls);
+}
+
+/**
+ * Determine if waiting for a lock would deadlock.
+ * Note: you must call this function with g_tree_lock held.
  *
- * The other approach, which we have taken here, is to protect the key with a
- * mutex.  This is somewhat slow, since it means that we have to take this
- * mutex before every access to thread-local data.  Luckily, on platforms
- * that support the __thread keyword, we can bypass this slowness.
- * Thread-local variables declared using __thread don't need to be manually
- * intialized before use.  They're ready to go before any code has been run.
+ * We follow the chain of lock owners, and the locks that they are waiting
+ * for, to see if it leads back to us.
  *
- * One advantage that POSIX thread-local variables have over __thread
- * variables is that the former can declare "destructors" which are run when
- * the thread is destroyed.  (These have no relation to the C++ concept of
- * the same name.) We make use of that ability here, to clean up our
- * malloc()ed thread-local data when the thread in question exits.
- * By combining the __thread keyword and POSIX thread-local variables, we can
- * get the best of each.
+ * @param tls		The thread-local data.
+ * @param lk		The lock we want to wait for.
+ * @param buf		(out param) buffer to describe the chain in
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
  *
- * @return			NULL on OOM, the TLS otherwise.
+ * @return		1 if we would deadlock; 0 otherwise.
  */
-static struct lksmith_tls *get_or_create_tls(void)
+static int lk_would_deadlock(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, char *buf, size_t *off,
+		size_t buf_len)
+{
+	struct lksmith_tls *owner;
+	unsigned int depth;
+
+	for (depth = 0; depth < MAX_WAIT_CHAIN; depth++) {
+		owner = lk->owner;
+		if (!owner)
+			return 0;
+		/* Taking a recursive lock again doesn't block. */
+		if ((owner == tls) && (depth == 0) && (lk->props.recursive))
+			return 0;
+		fwdprintf(buf, off, buf_len, depth ? "lock %p, which " :
+			  "Lock %p ", lk->ptr);
+		if (owner == tls) {
+			fwdprintf(buf, off, buf_len, "is held by this thread.");
+			return 1;
+		}
+		fwdprintf(buf, off, buf_len, "is held by thread %s, which is "
+			  "waiting for ", owner->name);
+		lk = owner->waiting_on;
+		if (!lk)
+			return 0;
+	}
+	return 0;
+}
+
+int lksmith_prewait(const void *ptr)
 {
-	int ret = 0;
 	struct lksmith_tls *tls;
+	struct lksmith_lock *lk;
+	char buf[1024];
+	size_t off = 0;
 
-#ifdef HAVE_IMPROVED_TLS
-	static __thread struct lksmith_tls *t_improved_tls = NULL;
-	if (t_improved_tls) {
-		return t_improved_tls;
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_prewait(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
 	}
-#endif
-	simple_spin_lock(&g_init_state_lock);
-	if (!g_initialized) {
-		lksmith_init();
+	if (!tls->intercept)
+		return 0;
+	if (g_track_waits) {
+		r_pthread_mutex_lock(&g_tree_lock);
+		lk = lksmith_find(ptr);
+		if (!lk) {
+			r_pthread_mutex_unlock(&g_tree_lock);
+			return 0;
+		}
+		if ((g_prevent_deadlock) && (!lk->cold->array) &&
+				(lk_would_deadlock(tls, lk, buf, &off,
+						   sizeof(buf)))) {
+			r_pthread_mutex_unlock(&g_tree_lock);
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prewait("
+				"lock=%p, thread=%s): refusing to wait for "
+				"this lock, since that would deadlock.  %s\n",
+				ptr, tls->name, buf);
+			return EDEADLK;
+		}
+		tls->waiting_on = lk;
+		if ((g_prio_inversion_ns) || (g_slow_wait_ns) || (g_topk))
+			tls_start_wait(tls, lk);
+		r_pthread_mutex_unlock(&g_tree_lock);
 	}
-	simple_spin_unlock(&g_init_state_lock);
-#ifndef HAVE_IMPROVED_TLS
-	tls = pthread_getspecific(g_tls_key);
-	if (tls) {
-		return tls;
+	if (tls->flight) {
+		flight_record(tls->flight, FLIGHT_OP_WAIT, ptr,
+			      tls->flight_site, time_now_ns());
 	}
-#endif
-	tls = calloc(1, sizeof(*tls));
+	return 0;
+}
+
+int lksmith_preunlock(const void *ptr)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_lock *lk;
+
+	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM,
-			"get_or_create_tls(): failed to allocate "
-			"memory for thread-local storage.\n");
-		return NULL;
+		lksmith_error(ENOMEM, "lksmith_preunlock(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
 	}
-	tls->intercept = 1;
-	platform_create_thread_name(tls->name, LKSMITH_THREAD_NAME_MAX);
-	ret = pthread_setspecific(g_tls_key, tls);
+	if (!tls->intercept)
+		return 0;
+	lk = tls_find_held(tls, ptr);
+	if (lk) {
+		if (!lk->props.sleeper) {
+			tls->num_spins--;
+		}
+		if ((g_topk) || (g_advise) || (tls->flight)) {
+			/* Stamp the release before the real unlock, so that
+			 * the next holder is sure to see it, and so that it
+			 * comes before the next holder's acquisition. */
+			tls->unlock_ns = time_now_ns();
+			if (g_topk)
+				__atomic_store_n(&lk->release_ns,
+					tls->unlock_ns, __ATOMIC_RELAXED);
+		}
+		return 0;
+	}
+	/* We don't hold the lock.  Figure out whether anyone does, so that
+	 * we can give a helpful error message. */
+	r_pthread_mutex_lock(&g_tree_lock);
+	lk = lksmith_find(ptr);
+	r_pthread_mutex_unlock(&g_tree_lock);
+	if (!lk) {
+		lksmith_error_with_ti(tls, ENOENT, "lksmith_preunlock(lock=%p, "
+			"thread=%s): attempted to unlock an unknown lock.\n",
+			ptr, tls->name);
+		return ENOENT;
+	}
+	lksmith_error_with_ti(tls, EPERM, "lksmith_preunlock(lock=%p, "
+		"thread=%s): attempted to unlock a lock that this "
+		"thread does not currently hold.\n", ptr, tls->name);
+	return EPERM;
+}
+
+void lksmith_postunlock(const void *ptr)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_lock *lk;
+	struct lksmith_held held;
+	struct platform_usage usage;
+	uint64_t now = 0;
+	int ret, sampled = 0, cpu = -1;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_postunlock(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return;
+	}
+	if (!tls->intercept)
+		return;
+	lk = tls_find_held(tls, ptr);
+	if (!lk) {
+		lksmith_error(EIO, "lksmith_postunlock(lock=%p, "
+			"thread=%s): logic error: preunlock check told us "
+			"we had the lock, but we don't?\n", ptr, tls->name);
+		return;
+	}
+	tls_remove_held(tls, ptr, &held);
+	if (((g_topk || g_advise) && (held.locked_ns)) || (held.sampled))
+		now = tls->unlock_ns ? tls->unlock_ns : time_now_ns();
+	if (g_advise)
+		cpu = platform_get_cpu();
+	if ((g_topk) && (held.locked_ns)) {
+		tls_topk_add(&tls->hold_topk, ptr, held.site,
+			     now - held.locked_ns);
+	}
+	if (held.sampled)
+		sampled = !platform_get_usage(&usage);
+	if (tls->flight) {
+		flight_record(tls->flight, FLIGHT_OP_RELEASE, ptr, held.site,
+			      tls->unlock_ns ? tls->unlock_ns : time_now_ns());
+	}
+	tls->unlock_ns = 0;
+	r_pthread_mutex_lock(&g_tree_lock);
+	if ((g_topk) && (now))
+		tls_topk_maybe_merge(tls, now);
+	if (sampled)
+		cs_record(lk, &held, &usage, now);
+	if ((g_advise) && (now)) {
+		lk_advise_release(lk, &held, cpu, now);
+		advise_sample_load(now);
+	}
+	if ((lk->owner == tls) && (!tls_find_held(tls, ptr)))
+		lk->owner = NULL;
+	ret = lk_holder_remove(lk, tls);
 	if (ret) {
-		free(tls->held);
-		free(tls);
-		lksmith_error(ENOMEM,
-			"get_or_create_tls(): pthread_setspecific "
-			"failed with error %d: %s\n", ret, terror(ret));
-		return NULL;
+		lksmith_error(EIO, "lksmith_preunlock(lock=%p, thread=%s): "
+			"logic error: failed to find backtrace for this "
+			"thread in the list of stored backtraces for this "
+			"lock (error %d).\n", ptr, tls->name, ret);
+		r_pthread_mutex_unlock(&g_tree_lock);
+		return;
 	}
-#ifdef HAVE_IMPROVED_TLS
-	t_improved_tls = tls;
-#endif
-	return tls;
+	r_pthread_mutex_unlock(&g_tree_lock);
 }
 
-int init_tls(void)
+void lksmith_trace(const char *op, const void *ptr, int error)
 {
 	struct lksmith_tls *tls;
 
 	tls = get_or_create_tls();
-	if (!tls)
-		return -ENOMEM;
-	return 0;
+	if ((!tls) || (!tls->intercept))
+		return;
+	lksmith_error(0, "lksmith_trace: time=%"PRIu64" thread=%s %s(%p) = "
+		"%d\n", time_now_ns(), tls->name, op, ptr, error);
+}
+
+void lksmith_trylock_failed(const void *ptr, const void *site)
+{
+	struct lksmith_tls *tls;
+
+	if (!g_storm_streak)
+		return;
+	tls = get_or_create_tls();
+	if ((!tls) || (!tls->intercept))
+		return;
+	tls_streak_fail(tls, ptr, site, LKSMITH_STORM_TRYLOCK);
 }
 
 /**
- * Add a lock ID to the end of the list of lock IDs we hold.
+ * Find how far away a deadline is.
  *
- * NOTE: lock IDs can be added more than once to this list!
- * This is so that we can support recursive mutexes.
+ * @param abstime	The deadline.
+ * @param any_clock	1 if the deadline may be on CLOCK_MONOTONIC rather
+ *			than CLOCK_REALTIME.
  *
- * @param tls		The thread-local data.
- * @param ptr		the lock to add to the list.
+ * @return		Nanoseconds until the deadline, or a negative number
+ *			if it has passed.
+ */
+static int64_t deadline_remaining_ns(const struct timespec *abstime,
+				     int any_clock)
+{
+	struct timespec ts;
+	int64_t deadline, rt, mono;
+
+	deadline = ((int64_t)abstime->tv_sec * 1000000000LL) +
+		abstime->tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rt = deadline - (((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+	if (!any_clock)
+		return rt;
+	/* We don't know which clock a condition variable was set up with.
+	 * Deadlines are rarely far from now, so guess the clock which is
+	 * closest to the deadline. */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono = deadline - (((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+	return (llabs(mono) < llabs(rt)) ? mono : rt;
+}
+
+void lksmith_check_deadline(const void *ptr, const void *site,
+			    const struct timespec *abstime, int any_clock)
+{
+	struct lksmith_tls *tls;
+	int i;
+
+	if ((!g_storm_streak) || (!abstime))
+		return;
+	tls = get_or_create_tls();
+	if ((!tls) || (!tls->intercept))
+		return;
+	if (deadline_remaining_ns(abstime, any_clock) < STORM_NEAR_NS) {
+		tls_streak_fail(tls, ptr, site, LKSMITH_STORM_TIMED);
+		return;
+	}
+	/* Really waiting, from anywhere, ends the run. */
+	for (i = 0; i < STORM_SLOTS; i++) {
+		if ((tls->streaks[i].ptr == ptr) &&
+				(tls->streaks[i].kind == LKSMITH_STORM_TIMED))
+			tls_streak_end(&tls->streaks[i], 0);
+	}
+}
+
+int lksmith_check_locked(const void *ptr)
+{
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_check_locked(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
+	}
+	if (!tls->intercept)
+		return 0;
+	return tls_find_held(tls, ptr) ? 0 : -1;
+}
+/******************************************************************
+ *  Lock order analysis
+ *****************************************************************/
+/**
+ * A copy of the lock order graph, which we can analyze without holding
+ * g_tree_lock.  Nodes are lock IDs.  There is an edge from A to B if B was
+ * held while A was taken.
+ */
+struct order_snap {
+	/** The graph */
+	struct scc_graph g;
+	/** Row offsets */
+	uint32_t *row;
+	/** Column indices */
+	uint32_t *col;
+	/** Provenance of each edge, in the same order as col */
+	struct lksmith_edge_prov *prov;
+	/** Lock pointer for each node, or NULL for unused IDs */
+	const void **ptrs;
+};
+
+static void order_snap_free(struct order_snap *snap)
+{
+	free(snap->row);
+	free(snap->col);
+	free(snap->prov);
+	free(snap->ptrs);
+}
+
+/**
+ * Find the position of an ID in a sorted array.
  *
- * @return		0 on success; ENOMEM if we ran out of memory.
+ * @return		The position, or -1 if the ID isn't present.
+ */
+static int64_t order_find_id(const uint32_t *arr, uint32_t len, uint32_t id)
+{
+	uint32_t lo = 0, hi = len, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (arr[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ((lo < len) && (arr[lo] == id)) ? (int64_t)lo : -1;
+}
+
+/**
+ * Copy the lock order graph.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param snap		(out param) the copy
+ *
+ * @return		0 on success; ENOMEM on out-of-memory.
+ */
+static int order_snap_create(struct order_snap *snap)
+{
+	struct lksmith_lock_cold *ck;
+	struct lksmith_lock *lk;
+	struct lksmith_edge_prov *p;
+	const uint32_t *before;
+	uint32_t n = g_next_lock_id, nedges = 0, id, e = 0;
+	int64_t j;
+
+	memset(snap, 0, sizeof(*snap));
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		nedges += ck->before.size;
+	}
+	snap->row = calloc(n + 1, sizeof(uint32_t));
+	snap->col = calloc(nedges + 1, sizeof(uint32_t));
+	snap->prov = calloc(nedges + 1, sizeof(struct lksmith_edge_prov));
+	snap->ptrs = calloc(n + 1, sizeof(const void*));
+	if ((!snap->row) || (!snap->col) || (!snap->prov) || (!snap->ptrs)) {
+		order_snap_free(snap);
+		return ENOMEM;
+	}
+	/* Lock IDs are dense, so we can use them as node numbers. */
+	for (id = 0; id < n; id++) {
+		snap->row[id] = e;
+		lk = lk_by_id(id);
+		if (!lk)
+			continue;
+		snap->ptrs[id] = lk->ptr;
+		before = idvec_data(&lk->cold->before);
+		memcpy(&snap->col[e], before,
+		       sizeof(uint32_t) * lk->cold->before.size);
+		for (p = lk->cold->prov; p; p = p->next) {
+			j = order_find_id(before, lk->cold->before.size, p->id);
+			if (j >= 0)
+				snap->prov[e + j] = *p;
+		}
+		e += lk->cold->before.size;
+	}
+	snap->row[n] = e;
+	snap->g.nnodes = n;
+	snap->g.row = snap->row;
+	snap->g.col = snap->col;
+	return 0;
+}
+
+/**
+ * Describe a lock in a report.
+ * Note: you must call this function with g_tree_lock held.
  */
-static int tls_append_held(struct lksmith_tls *tls, const void *ptr)
+static void order_dump_lock(const struct order_snap *snap, uint32_t id,
+			    char *buf, size_t *off, size_t buf_len)
 {
-	const void **held;
+	struct lksmith_lock *lk;
 
-	held = realloc(tls->held, sizeof(uintptr_t) * (tls->num_held + 1));
-	if (!held)
-		return ENOMEM;
-	tls->held = held;
-	held[tls->num_held++] = ptr;
-	return 0;
+	fwdprintf(buf, off, buf_len, "%p", snap->ptrs[id]);
+	lk = (id < g_next_lock_id) ? lk_by_id(id) : NULL;
+	if ((lk) && (lk->ptr == snap->ptrs[id]) && (lk->cold->array)) {
+		fwdprintf(buf, off, buf_len, " (array '%s')",
+			  lk->cold->array->name);
+	}
 }
 
 /**
- * Remove a lock ID from the list of lock IDs we hold.
- *
- * @param tls		The thread-local data.
- * @param ptr		the lock ID to add to the list.
- *
- * @return		0 on success; ENOENT if we are not holding the
- *			lock ID.
+ * Describe a call site in a report.
+ * Note: you must call this function with g_tree_lock held.
  */
-static int tls_remove_held(struct lksmith_tls *tls, const void *ptr)
+static void order_dump_site(uint32_t sid, char *buf, size_t *off,
+			    size_t buf_len)
 {
-	signed int i;
-	const void **held;
+	const struct site *site;
+	int i;
 
-	for (i = tls->num_held - 1; i >= 0; i--) {
-		if (tls->held[i] == ptr)
-			break;
+	site = site_get(&g_sites, sid);
+	if (!site) {
+		fwdprintf(buf, off, buf_len, "      (unknown)\n");
+		return;
 	}
-	if (i < 0)
-		return ENOENT;
-	memmove(&tls->held[i], &tls->held[i + 1],
-		sizeof(struct lksmith_held*) * (tls->num_held - i - 1));
-	held = realloc(tls->held, sizeof(uintptr_t) * (--tls->num_held));
-	if (held || (tls->num_held == 0)) {
-		tls->held = held;
+	for (i = 0; i < site->nframes; i++) {
+		fwdprintf(buf, off, buf_len, "      %s\n", site->frames[i]);
 	}
-	return 0;
 }
 
 /**
- * Determine if we are holding a lock.
- *
- * @param tls		The thread-local data.
- * @param ptr		The lock ID to find.
+ * Describe an edge in a report.
+ * Note: you must call this function with g_tree_lock held.
  *
- * @return		1 if we hold the lock; 0 otherwise.
+ * @param e		Index of the edge
+ * @param from		The node the edge starts at
+ * @param verbose	1 to include the call sites
  */
-static int tls_contains_lid(struct lksmith_tls *tls, const void *ptr)
+static void order_dump_edge(const struct order_snap *snap, uint32_t e,
+			    uint32_t from, int verbose, char *buf,
+			    size_t *off, size_t buf_len)
 {
-	unsigned int i;
+	const struct lksmith_edge_prov *prov = &snap->prov[e];
+	uint32_t to = snap->col[e];
 
-	for (i = 0; i < tls->num_held; i++) {
-		if (tls->held[i] == ptr)
-			return 1;
-	}
-	return 0;
+	fwdprintf(buf, off, buf_len, "  thread %s took lock ",
+		  prov->thread[0] ? prov->thread : "(unknown)");
+	order_dump_lock(snap, from, buf, off, buf_len);
+	fwdprintf(buf, off, buf_len, " while holding lock ");
+	order_dump_lock(snap, to, buf, off, buf_len);
+	fwdprintf(buf, off, buf_len, "\n");
+	if (!verbose)
+		return;
+	fwdprintf(buf, off, buf_len, "    %p was taken at:\n", snap->ptrs[to]);
+	order_dump_site(prov->held_site, buf, off, buf_len);
+	fwdprintf(buf, off, buf_len, "    %p was taken at:\n",
+		  snap->ptrs[from]);
+	order_dump_site(prov->acq_site, buf, off, buf_len);
 }
 
-static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
-				  const char *fmt, ...)
-	__attribute__((format(printf, 3, 4)));
-
 /**
- * Locksmith error with thread information (including a backtrace)
- *
- * @param tls		Our thread-local storage object
- * @param err		the locksmith error code
- * @param fmt		printf-style format string
+ * Find the index of the edge from one node to another.
  */
-static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
-				  const char *fmt, ...)
+static uint32_t order_edge_index(const struct order_snap *snap,
+				 uint32_t from, uint32_t to)
 {
-	va_list ap;
-	int nframes, prev_intercept;
-	char **frames = NULL;
-
-	if (!tls) {
-		tls = get_or_create_tls();
-		if (!tls) {
-			va_start(ap, fmt);
-			lksmith_errora(err, fmt, ap);
-			va_end(ap);
-			return;
-		}
-	}
-	prev_intercept = tls->intercept;
-	tls->intercept = 0;
-	nframes = bt_frames_create(&tls->backtrace_scratch,
-			&tls->backtrace_scratch_len, &frames);
-	tls->intercept = prev_intercept;
-	va_start(ap, fmt);
-	// lksmith_errora_with_bt handles nframes < 0 (the error case)
-	lksmith_errora_with_bt(err, frames, nframes, fmt, ap);
-	va_end(ap);
-	bt_frames_free(frames);
+	return snap->row[from] + order_find_id(&snap->col[snap->row[from]],
+			snap->row[from + 1] - snap->row[from], to);
 }
 
-/******************************************************************
- *  Lock holder functions
- *****************************************************************/
 /**
- * Dump out the contents of a lock holder structure
+ * Report a strongly connected component of the lock order graph.
+ * Note: you must call this function with g_tree_lock held.
  *
- * @param holder        The lock holder
- * @param buf		(out param) the buffer to write to
- * @param off		(inout param) current position in the buffer
- * @param buf_len	length of buf
+ * @param snap		The graph
+ * @param comp		Component numbers
+ * @param start		The lowest-numbered node in the component
+ * @param size		Number of nodes in the component
+ * @param path		Scratch space of snap->g.nnodes entries
  */
-static void holder_dump(const struct lksmith_holder *holder,
-		char *buf, size_t *off, size_t buf_len)
+static void order_report_scc(const struct order_snap *snap,
+		const uint32_t *comp, uint32_t start, uint32_t size,
+		uint32_t *path)
 {
+	char *buf;
+	size_t off = 0, buf_len = 65536;
 	const char *prefix = "";
-	int i;
+	uint32_t v, e, i, from, to, nedges = 0;
+	int64_t len;
 
-	fwdprintf(buf, off, buf_len, "{name=%s, "
-		"bt_frames=[", holder->name);
-	for (i = 0; i < holder->bt_len; i++) {
-		fwdprintf(buf, off, buf_len, "%s%s", prefix,
-			  holder->bt_frames[i]);
+	buf = malloc(buf_len);
+	if (!buf)
+		return;
+	fwdprintf(buf, &off, buf_len, "lksmith_check_order: potential "
+		"deadlock!  These %"PRIu32" locks have been taken in "
+		"inconsistent orders: ", size);
+	for (v = start; v < snap->g.nnodes; v++) {
+		if (comp[v] != comp[start])
+			continue;
+		fwdprintf(buf, &off, buf_len, "%s", prefix);
+		order_dump_lock(snap, v, buf, &off, buf_len);
 		prefix = ", ";
 	}
-	fwdprintf(buf, off, buf_len, "]}");
+	fwdprintf(buf, &off, buf_len, "\n");
+	len = scc_cycle(&snap->g, comp, start, path);
+	if (len > 0) {
+		fwdprintf(buf, &off, buf_len, "One cycle is:\n");
+		/* path[i + 1] was held while path[i] was taken.  Go
+		 * backwards, so that the report follows the order in which
+		 * the locks were taken. */
+		for (i = len; i > 0; i--) {
+			from = path[i - 1];
+			to = path[i % len];
+			order_dump_edge(snap, order_edge_index(snap, from, to),
+				from, 1, buf, &off, buf_len);
+		}
+	}
+	fwdprintf(buf, &off, buf_len, "All orderings between these locks:\n");
+	for (v = start; v < snap->g.nnodes; v++) {
+		if (comp[v] != comp[start])
+			continue;
+		for (e = snap->row[v]; e < snap->row[v + 1]; e++) {
+			if (comp[snap->col[e]] != comp[start])
+				continue;
+			if (nedges++ == ORDER_MAX_REPORTED_EDGES) {
+				fwdprintf(buf, &off, buf_len, "  ...\n");
+				break;
+			}
+			order_dump_edge(snap, e, v, 0, buf, &off, buf_len);
+		}
+		if (nedges > ORDER_MAX_REPORTED_EDGES)
+			break;
+	}
+	lksmith_error(EDEADLK, "%s", buf);
+	free(buf);
 }
 
 /**
- * Create a lock holder.
+ * Look for cycles in the lock order graph.
  *
- * @param tls		The thread-local storage for the current thread.
+ * @param at_exit	1 if we are running at exit.  In that case, we
+ *			give up rather than wait for g_tree_lock, since the
+ *			thread holding it might never run again.
  *
- * @return		The lock holder on success; NULL otherwise.
+ * @return		0 if there were no cycles; EDEADLK if we reported
+ *			at least one cycle; another error code otherwise.
  */
-static struct lksmith_holder* holder_create(struct lksmith_tls *tls)
+static int lksmith_check_order_impl(int at_exit)
 {
-	struct lksmith_holder *holder;
-	int intercept, ret;
+	struct order_snap snap;
+	uint32_t *comp = NULL, *sizes = NULL, *first = NULL, *path = NULL;
+	uint32_t v, c;
+	unsigned int nthreads = 1;
+	int64_t ncomp;
+	long ncpus;
+	int ret;
 
-	holder = calloc(1, sizeof(*holder));
-	if (!holder)
-		return NULL;
-	snprintf(holder->name, sizeof(holder->name), "%s", tls->name);
-	intercept = tls->intercept;
-	tls->intercept = 0;
-	ret = bt_frames_create(&tls->backtrace_scratch,
-		&tls->backtrace_scratch_len, &holder->bt_frames);
-	tls->intercept = intercept;
-	if (ret < 0) {
-		free(holder);
-		return NULL;
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
 	}
-	holder->bt_len = ret;
-	return holder;
+	ret = order_snap_create(&snap);
+	r_pthread_mutex_unlock(&g_tree_lock);
+	if (ret)
+		return ret;
+	if (snap.g.nnodes >= ORDER_PARALLEL_MIN) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpus > 1)
+			nthreads = (ncpus > ORDER_MAX_THREADS) ?
+				ORDER_MAX_THREADS : ncpus;
+	}
+	comp = malloc(sizeof(uint32_t) * (snap.g.nnodes + 1));
+	path = malloc(sizeof(uint32_t) * (snap.g.nnodes + 1));
+	if ((!comp) || (!path)) {
+		ret = ENOMEM;
+		goto done;
+	}
+	ncomp = scc_find(&snap.g, comp, nthreads);
+	if (ncomp < 0) {
+		ret = -ncomp;
+		goto done;
+	}
+	sizes = calloc(ncomp + 1, sizeof(uint32_t));
+	first = malloc(sizeof(uint32_t) * (ncomp + 1));
+	if ((!sizes) || (!first)) {
+		ret = ENOMEM;
+		goto done;
+	}
+	for (v = 0; v < snap.g.nnodes; v++) {
+		if (sizes[comp[v]]++ == 0)
+			first[comp[v]] = v;
+	}
+	ret = 0;
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock)) {
+			ret = EBUSY;
+			goto done;
+		}
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
+	}
+	for (c = 0; c < ncomp; c++) {
+		/* Every lock is in its own component, unless there is a
+		 * cycle. */
+		if (sizes[c] < 2)
+			continue;
+		order_report_scc(&snap, comp, first[c], sizes[c], path);
+		ret = EDEADLK;
+	}
+	r_pthread_mutex_unlock(&g_tree_lock);
+done:
+	free(comp);
+	free(path);
+	free(sizes);
+	free(first);
+	order_snap_free(&snap);
+	return ret;
 }
 
-/**
- * Free a lock holder structure
- *
- * @param holder        The lock holder
- */
-static void holder_free(struct lksmith_holder *holder)
+static void lksmith_check_order_at_exit(void)
 {
-	bt_frames_free(holder->bt_frames);
-	free(holder);
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if ((!tls) || (!tls->intercept))
+		return;
+	lksmith_check_order_impl(1);
 }
 
-/******************************************************************
- *  Lock functions
- *****************************************************************/
-static int lksmith_lock_compare(const struct lksmith_lock *a,
-		const struct lksmith_lock *b)
+int lksmith_check_order(void)
 {
-	const void *pa = a->ptr;
-	const void *pb = b->ptr;
-	if (pa < pb)
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_check_order: failed to "
+			"allocate thread-local storage.\n");
+		return ENOMEM;
+	}
+	return lksmith_check_order_impl(0);
+}
+
+static int slow_wait_compare(const void *a, const void *b)
+{
+	const struct lksmith_slow_wait *sa = a, *sb = b;
+
+	if (sa->total_wait_ns > sb->total_wait_ns)
 		return -1;
-	else if (pa > pb)
+	if (sa->total_wait_ns < sb->total_wait_ns)
 		return 1;
-	else
-		return 0;
+	return 0;
 }
 
-/**
- * Add an element to a sorted array, if it's not already there.
- *
- * @param arr		(inout) the array
- * @param num		(inout) the array length
- * @param lid		The lock ID to add.
- *
- * @return		0 on success; ENOMEM if we ran out of memory.
- */
-static int lk_add_sorted(struct lksmith_lock ** __restrict * __restrict arr,
-			int * __restrict num, struct lksmith_lock *lk)
+static int lksmith_report_slow_waits_impl(int at_exit)
 {
-	int i;
-	struct lksmith_lock **narr;
+	struct lksmith_slow_wait *sw;
+	char buf[16384];
+	size_t i, off;
 
-	for (i = 0; i < *num; i++) {
-		if ((*arr)[i] == lk)
-			return 0;
-		else if ((*arr)[i] > lk)
-			break;
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
 	}
-	narr = realloc(*arr, sizeof(struct lksmith_lock*) * (*num + 1));
-	if (!narr)
-		return ENOMEM;
-	*arr = narr;
-	memmove(&narr[i + 1], &narr[i], sizeof(uintptr_t) * (*num - i));
-	narr[i] = lk;
-	*num = *num + 1;
-	return 0;
+	if (g_num_slow_waits == 0) {
+		r_pthread_mutex_unlock(&g_tree_lock);
+		return 0;
+	}
+	/* Show the worst offenders first. */
+	qsort(g_slow_waits, g_num_slow_waits, sizeof(*g_slow_waits),
+	      slow_wait_compare);
+	for (i = 0; i < g_num_slow_waits; i++) {
+		sw = &g_slow_waits[i];
+		off = 0;
+		fwdprintf(buf, &off, sizeof(buf), "%"PRIu64" slow waits, "
+			"total %"PRIu64" us, max %"PRIu64" us, longest hold "
+			"%"PRIu64" us, last lock %p.\nThe waiting thread "
+			"took the lock at:\n", sw->count,
+			sw->total_wait_ns / 1000, sw->max_wait_ns / 1000,
+			sw->max_hold_ns / 1000, sw->ptr);
+		site_dump(sw->waiter_site, buf, &off, sizeof(buf));
+		fwdprintf(buf, &off, sizeof(buf), "The holding thread took "
+			"the lock at:\n");
+		site_dump(sw->holder_site, buf, &off, sizeof(buf));
+		lksmith_error(EWOULDBLOCK, "lksmith_report_slow_waits: "
+			"performance problem: %s", buf);
+	}
+	r_pthread_mutex_unlock(&g_tree_lock);
+	return EWOULDBLOCK;
 }
 
-/**
- * Remove an element from a sorted array.
- * We assume it appears only once in that array.
- * TODO: be smarter here-- use bsearch
- *
- * @param arr		(inout) the array
- * @param num		(inout) the array length
- * @param lid		The lock ID to remove.
- */
-static void lk_remove_sorted(struct lksmith_lock ** __restrict * __restrict arr,
-			int * __restrict num, struct lksmith_lock *ak)
+static void lksmith_report_slow_waits_at_exit(void)
 {
-	int i;
-	struct lksmith_lock **narr;
+	struct lksmith_tls *tls;
 
-	if (*arr == NULL)
+	tls = get_or_create_tls();
+	if ((!tls) || (!tls->intercept))
 		return;
-	for (i = 0; i < *num; i++) {
-		if ((*arr)[i] == ak)
-			break;
-		else if ((*arr)[i] > ak)
-			return;
+	lksmith_report_slow_waits_impl(1);
+}
+
+int lksmith_report_slow_waits(void)
+{
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_report_slow_waits: failed to "
+			"allocate thread-local storage.\n");
+		return ENOMEM;
 	}
-	if (i == *num)
-		return;
-	if (i < (*num -1))
-		memmove(&(*arr)[i], &(*arr)[i + 1],
-			sizeof(struct lksmith_lock*) * (*num - i - 1));
-	narr = realloc(*arr, sizeof(struct lksmith_lock*) * (--*num));
-	if (narr || (*num == 0))
-		*arr = narr;
+	return lksmith_report_slow_waits_impl(0);
 }
 
-/**
- * Add a lock to the 'before' set of this lock data.
- * Note: you must call this function with the info->lock held.
- *
- * @param lk		The lock data.
- * @param lid		The lock ID to add.
- *
- * @return		0 on success; ENOMEM if we ran out of memory.
- */
-static int lk_add_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
+static void topk_dump(const struct topk *tk, const char *what, char *buf,
+		      size_t *off, size_t buf_len)
 {
-	return lk_add_sorted(&lk->before, &lk->before_size, ak);
+	const struct topk_entry *e;
+	uint32_t i, n;
+
+	n = (tk->len < TOPK_REPORT_MAX) ? tk->len : TOPK_REPORT_MAX;
+	fwdprintf(buf, off, buf_len, "the %"PRIu32" locks and call sites "
+		"which spent the most time %s:\n", n, what);
+	for (i = 0; i < n; i++) {
+		e = &tk->ent[i];
+		fwdprintf(buf, off, buf_len, "%"PRIu32". lock %p at [%p]: "
+			"%"PRIu64" us", i + 1, (void*)(uintptr_t)e->a,
+			(void*)(uintptr_t)e->b, e->count / 1000);
+		if (e->err)
+			fwdprintf(buf, off, buf_len, " (up to %"PRIu64" us "
+				"may be from others)", e->err / 1000);
+		fwdprintf(buf, off, buf_len, "\n");
+	}
 }
 
-/**
- * Remove a lock from the 'after' set of this lock data.
- * Note: you must call this function with the info->lock held.
- *
- * @param lk		The lock data.
- * @param lid		The lock ID to remove.
- */
-static void lk_remove_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
+static int handoff_compare(const void *a, const void *b)
 {
-	lk_remove_sorted(&lk->before, &lk->before_size, ak);
+	const struct lksmith_handoff *ha = *(struct lksmith_handoff * const *)a;
+	const struct lksmith_handoff *hb = *(struct lksmith_handoff * const *)b;
+
+	if (ha->total_ns > hb->total_ns)
+		return -1;
+	if (ha->total_ns < hb->total_ns)
+		return 1;
+	return 0;
 }
 
 /**
- * Add a lock holder to the lock.
- * Note: you must call this function with the info->lock held.
- *
- * @param lk		The lock data.
- * @param holder	The lock holder to add.
+ * Describe the locks which spent the most time being handed off.
+ * Note: you must call this function with g_tree_lock held.
  */
-static void lk_holder_add(struct lksmith_lock *lk,
-			struct lksmith_holder *holder)
+static void handoff_dump(char *buf, size_t *off, size_t buf_len)
+{
+	struct lksmith_lock_cold *ck;
+	struct lksmith_handoff **hos;
+	const struct lksmith_handoff *ho;
+	size_t i, n = g_retired_handoffs.num;
+
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if (ck->handoff)
+			n++;
+	}
+	if (n == 0)
+		return;
+	hos = malloc(n * sizeof(*hos));
+	if (!hos)
+		return;
+	n = 0;
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if (ck->handoff)
+			hos[n++] = ck->handoff;
+	}
+	for (i = 0; i < (size_t)g_retired_handoffs.num; i++)
+		hos[n++] = g_retired_handoffs.items[i];
+	qsort(hos, n, sizeof(*hos), handoff_compare);
+	if (n > TOPK_REPORT_MAX)
+		n = TOPK_REPORT_MAX;
+	fwdprintf(buf, off, buf_len, "the %zu locks which spent the most "
+		"time being handed off from one thread to the next:\n", n);
+	for (i = 0; i < n; i++) {
+		ho = hos[i];
+		fwdprintf(buf, off, buf_len, "%zu. lock %p%s: %"PRIu64" "
+			"hand-offs, mean %.1f us, median <= %.1f us, 99th "
+			"percentile <= %.1f us, max %.1f us\n", i + 1,
+			ho->ptr, ho->destroyed ? " (destroyed)" : "", ho->count,
+			(ho->total_ns / (double)ho->count) / 1000.0,
+			handoff_percentile(ho, 50) / 1000.0,
+			handoff_percentile(ho, 99) / 1000.0,
+			ho->max_ns / 1000.0);
+	}
+	free(hos);
+}
+
+static int lksmith_report_hot_sites_impl(struct lksmith_tls *tls,
+					 int at_exit)
+{
+	char buf[16384];
+	size_t off;
+
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
+	}
+	tls_topk_merge(tls);
+	if (g_wait_topk.len) {
+		topk_sort(&g_wait_topk);
+		off = 0;
+		topk_dump(&g_wait_topk, "waiting", buf, &off, sizeof(buf));
+		lksmith_error(0, "lksmith_report_hot_sites: %s", buf);
+	}
+	if (g_hold_topk.len) {
+		topk_sort(&g_hold_topk);
+		off = 0;
+		topk_dump(&g_hold_topk, "holding the lock", buf, &off,
+			  sizeof(buf));
+		lksmith_error(0, "lksmith_report_hot_sites: %s", buf);
+	}
+	off = 0;
+	handoff_dump(buf, &off, sizeof(buf));
+	if (off)
+		lksmith_error(0, "lksmith_report_hot_sites: %s", buf);
+	r_pthread_mutex_unlock(&g_tree_lock);
+	return 0;
+}
+
+static void lksmith_report_hot_sites_at_exit(void)
 {
-	holder->next = lk->holders;
-	lk->holders = holder;
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if ((!tls) || (!tls->intercept))
+		return;
+	lksmith_report_hot_sites_impl(tls, 1);
 }
 
-/**
- * Remove a lock holder from the lock.
- * Note: you must call this function with the info->lock held.
- *
- * @param lk		The lock data.
- * @param tls		The thread-local storage for the current thread.
- *
- * @return		0 on success; -ENOENT if the lock holder wasn't found.
- */
-static int lk_holder_remove(struct lksmith_lock *lk,
-			struct lksmith_tls *tls)
+int lksmith_report_hot_sites(void)
 {
-	struct lksmith_holder **holder, *next;
+	struct lksmith_tls *tls;
 
-	/* By iterating forward through the list, we ensure that holders are
-	 * taken out in the reverse order that they were put in (since we also
-	 * insert to the head of the list.)  This is important when dealing
-	 * with recursive locks, where one thread can take the same lock over
-	 * and over. */
-	holder = &lk->holders;
-	while (*holder) {
-		if (!strcmp(tls->name, (*holder)->name))
-			break;
-		holder = &(*holder)->next;
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_report_hot_sites: failed to "
+			"allocate thread-local storage.\n");
+		return ENOMEM;
 	}
-	if (!holder)
-		return -ENOENT;
-	next = (*holder)->next;
-	holder_free(*holder);
-	*holder = next;
+	if (!g_topk)
+		return 0;
+	return lksmith_report_hot_sites_impl(tls, 0);
+}
+
+static int cs_site_compare(const void *a, const void *b)
+{
+	const struct lksmith_cs_site *ca = a, *cb = b;
+	uint64_t oa = ca->wall_ns - ca->cpu_ns, ob = cb->wall_ns - cb->cpu_ns;
+
+	if (oa > ob)
+		return -1;
+	if (oa < ob)
+		return 1;
 	return 0;
 }
 
-/**
- * Dump out the contents of a lock data structure.
- *
- * @param lk		The lock data
- * @param buf		(out param) the buffer to write to
- * @param off		(inout param) current position in the buffer
- * @param buf_len	length of buf
- */
-static void lk_dump(const struct lksmith_lock *lk,
-		char *buf, size_t *off, size_t buf_len)
+static int lksmith_report_critical_sections_impl(int at_exit)
 {
-	int i;
-	const char *prefix = "";
-	struct lksmith_holder *holder;
+	const struct lksmith_cs_site *cs;
+	uint64_t off;
+	size_t i;
+	int ret = 0;
 
-	fwdprintf(buf, off, buf_len, "lk{ptr=%p, "
-		"nlock=%"PRId64", recursive=%d, sleeper=%d,"
-		"color=%"PRId64", before={",
-		(void*)lk->ptr, (uint64_t)lk->props.nlock,
-		lk->props.recursive, lk->props.sleeper,
-		lk->color);
-	for (i = 0; i < lk->before_size; i++) {
-		fwdprintf(buf, off, buf_len, "%s%p",
-			  prefix, lk->before[i]);
-		prefix = " ";
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
 	}
-	fwdprintf(buf, off, buf_len, "}, holders=[");
-	prefix = "";
-	holder = lk->holders;
-	while (holder) {
-		fwdprintf(buf, off, buf_len, "%s", prefix);
-		holder_dump(holder, buf, off, buf_len);
-		prefix = ", ";
-		holder = holder->next;
+	qsort(g_cs_sites, g_num_cs_sites, sizeof(g_cs_sites[0]),
+	      cs_site_compare);
+	for (i = 0; i < g_num_cs_sites; i++) {
+		cs = &g_cs_sites[i];
+		off = cs->wall_ns - cs->cpu_ns;
+		if (!cs->sleeper) {
+			/* Nobody should sleep or be descheduled while
+			 * others spin waiting for them. */
+			if (!cs->switched)
+				continue;
+			lksmith_error(EWOULDBLOCK, "lksmith_report_critical_"
+				"sections: performance problem: spin lock %p "
+				"taken at [%p] was held while its holder was "
+				"switched out in %"PRIu64" of %"PRIu64" "
+				"sampled critical sections (%"PRIu64" "
+				"voluntary, %"PRIu64" involuntary context "
+				"switches, %"PRIu64" major faults, %"PRIu64" "
+				"us off the CPU).\n", cs->ptr, cs->site,
+				cs->switched, cs->count, cs->nvcsw, cs->nivcsw,
+				cs->majflt, off / 1000);
+			ret = EWOULDBLOCK;
+			continue;
+		}
+		if ((off < CS_MIN_OFFCPU_NS) ||
+				(off * 100 < cs->wall_ns * CS_OFFCPU_PCT))
+			continue;
+		if ((!cs->nvcsw) && (!cs->majflt) && (cs->nivcsw)) {
+			/* Being preempted is not the critical section's
+			 * fault, but everyone who wants the lock still has
+			 * to wait for the holder to run again. */
+			lksmith_error(0, "lksmith_report_critical_sections: "
+				"lock %p taken at [%p] was held off the CPU "
+				"for %"PRIu64" of %"PRIu64" us in %"PRIu64" "
+				"sampled critical sections (up to %"PRIu64" us "
+				"at once), only because its holder was "
+				"preempted (%"PRIu64" involuntary context "
+				"switches).  Are there more runnable threads "
+				"than CPUs?\n", cs->ptr, cs->site, off / 1000,
+				cs->wall_ns / 1000, cs->count,
+				cs->max_offcpu_ns / 1000, cs->nivcsw);
+			continue;
+		}
+		lksmith_error(EWOULDBLOCK, "lksmith_report_critical_sections: "
+			"performance problem: lock %p taken at [%p] was held "
+			"off the CPU for %"PRIu64" of %"PRIu64" us in "
+			"%"PRIu64" sampled critical sections (up to %"PRIu64" "
+			"us at once; %"PRIu64" voluntary, %"PRIu64" "
+			"involuntary context switches, %"PRIu64" major "
+			"faults).  Is it held across blocking I/O or "
+			"sleeps?\n", cs->ptr, cs->site, off / 1000,
+			cs->wall_ns / 1000, cs->count,
+			cs->max_offcpu_ns / 1000, cs->nvcsw, cs->nivcsw,
+			cs->majflt);
+		ret = EWOULDBLOCK;
 	}
-	fwdprintf(buf, off, buf_len, "]}");
+	r_pthread_mutex_unlock(&g_tree_lock);
+	return ret;
 }
 
-static void lk_dump_to_stderr(struct lksmith_lock *lk)
+static void lksmith_report_critical_sections_at_exit(void)
 {
-	char buf[16384];
-	size_t off = 0;
+	lksmith_report_critical_sections_impl(1);
+}
 
-	lk_dump(lk, buf, &off, sizeof(buf));
-	fputs(buf, stderr);
-	fputs("\n", stderr);
+int lksmith_report_critical_sections(void)
+{
+	if (!g_cs_sample)
+		return 0;
+	return lksmith_report_critical_sections_impl(0);
 }
 
-static void tree_print(void)
+static int storm_site_compare(const void *a, const void *b)
 {
-	char buf[8196];
-	struct lksmith_lock *lk;
-	size_t off;
-	const char *prefix = "";
+	const struct lksmith_storm_site *sa = a, *sb = b;
 
-	fprintf(stderr, "g_lock_tree: {");
-	RB_FOREACH(lk, lock_tree, &g_tree) {
-		off = 0;
-		lk_dump(lk, buf, &off, sizeof(buf));
-		fprintf(stderr, "%s%s", prefix, buf);
-		prefix = ",\n";
-	}
-	fprintf(stderr, "\n}\n");
+	if (sa->cpu_ns != sb->cpu_ns)
+		return (sa->cpu_ns > sb->cpu_ns) ? -1 : 1;
+	if (sa->failures != sb->failures)
+		return (sa->failures > sb->failures) ? -1 : 1;
+	return 0;
 }
 
-static int lksmith_insert(const void *ptr, int recursive,
-		int sleeper, struct lksmith_lock **lk)
+static int lksmith_report_trylock_storms_impl(int at_exit)
 {
-	struct lksmith_lock *ak, *bk;
-	ak = calloc(1, sizeof(*ak));
-	if (!ak) {
-		return ENOMEM;
+	const struct lksmith_storm_site *ss;
+	size_t i;
+	int ret = 0;
+
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
 	}
-	ak->ptr = ptr;
-	ak->props.recursive = !!recursive;
-	ak->props.sleeper = !!sleeper;
-	ak->holders = NULL;
-	bk = RB_INSERT(lock_tree, &g_tree, ak);
-	if (bk) {
-		free(ak);
-		return EEXIST;
+	qsort(g_storm_sites, g_num_storm_sites, sizeof(g_storm_sites[0]),
+	      storm_site_compare);
+	for (i = 0; i < g_num_storm_sites; i++) {
+		ss = &g_storm_sites[i];
+		lksmith_error(EWOULDBLOCK, "lksmith_report_trylock_storms: "
+			"performance problem: %s on %p at [%p] failed up to "
+			"%"PRIu64" times in a row.  There were %"PRIu64" such "
+			"runs, with %"PRIu64" failures in all, up to "
+			"%"PRIu64" us apart.  They took %"PRIu64" us, of "
+			"which %"PRIu64" us was CPU time spent retrying.  "
+			"%s\n", (ss->kind == LKSMITH_STORM_TRYLOCK) ?
+			"try-locking" : "timed waits with expired deadlines",
+			ss->ptr, ss->site, ss->max_streak, ss->streaks,
+			ss->failures, ss->max_gap_ns / 1000,
+			ss->wall_ns / 1000, ss->cpu_ns / 1000,
+			(ss->kind == LKSMITH_STORM_TRYLOCK) ?
+			"Block on the lock instead of polling it." :
+			"Is the deadline computed once, outside the loop?");
+		ret = EWOULDBLOCK;
 	}
-	*lk = ak;
-	return 0;
+	r_pthread_mutex_unlock(&g_tree_lock);
+	return ret;
 }
 
-static struct lksmith_lock *lksmith_find(const void *ptr)
+static void lksmith_report_trylock_storms_at_exit(void)
 {
-	struct lksmith_lock exemplar;
-	memset(&exemplar, 0, sizeof(exemplar));
-	exemplar.ptr = ptr;
-	return RB_FIND(lock_tree, &g_tree, &exemplar);
+	lksmith_report_trylock_storms_impl(1);
 }
 
-/******************************************************************
- *  Cond functions
- *****************************************************************/
-static int lksmith_cond_compare(const struct lksmith_cond *a,
-		const struct lksmith_cond *b)
+int lksmith_report_trylock_storms(void)
 {
-	const void *pa = a->ptr;
-	const void *pb = b->ptr;
-	if (pa < pb)
-		return -1;
-	else if (pa > pb)
-		return 1;
-	else
+	if (!g_storm_streak)
 		return 0;
+	return lksmith_report_trylock_storms_impl(0);
 }
 
-static struct lksmith_cond *lksmith_cond_find(const void *ptr)
+int lksmith_get_trylock_storms(struct lksmith_trylock_storm *out, int *num)
 {
-	struct lksmith_cond exemplar;
-	memset(&exemplar, 0, sizeof(exemplar));
-	exemplar.ptr = ptr;
-	return RB_FIND(cond_tree, &g_cond_tree, &exemplar);
+	struct lksmith_tls *tls;
+	const struct lksmith_storm_site *ss;
+	int i, n;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_get_trylock_storms: failed to "
+			"allocate thread-local storage.\n");
+		return ENOMEM;
+	}
+	r_pthread_mutex_lock(&g_tree_lock);
+	qsort(g_storm_sites, g_num_storm_sites, sizeof(g_storm_sites[0]),
+	      storm_site_compare);
+	n = ((size_t)*num < g_num_storm_sites) ? *num :
+		(int)g_num_storm_sites;
+	for (i = 0; i < n; i++) {
+		ss = &g_storm_sites[i];
+		out[i].ptr = ss->ptr;
+		out[i].site = ss->site;
+		out[i].kind = ss->kind;
+		out[i].streaks = ss->streaks;
+		out[i].failures = ss->failures;
+		out[i].max_streak = ss->max_streak;
+		out[i].wall_ns = ss->wall_ns;
+		out[i].cpu_ns = ss->cpu_ns;
+		out[i].max_gap_ns = ss->max_gap_ns;
+	}
+	r_pthread_mutex_unlock(&g_tree_lock);
+	*num = n;
+	return 0;
 }
 
-static int lksmith_cond_insert(const void *ptr, struct lksmith_cond **cond)
+int lksmith_get_hot_sites(int kind, struct lksmith_hot_site *out, int *num)
 {
-	struct lksmith_cond *cnd, *and;
-	cnd = calloc(1, sizeof(*cnd));
-	if (!cnd) {
+	struct lksmith_tls *tls;
+	struct topk *tk;
+	int i, n;
+
+	if (kind == LKSMITH_HOT_WAIT)
+		tk = &g_wait_topk;
+	else if (kind == LKSMITH_HOT_HOLD)
+		tk = &g_hold_topk;
+	else
+		return EINVAL;
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_get_hot_sites: failed to "
+			"allocate thread-local storage.\n");
 		return ENOMEM;
 	}
-	cnd->ptr = ptr;
-	and = RB_INSERT(cond_tree, &g_cond_tree, cnd);
-	if (and) {
-		free(cnd);
-		return EEXIST;
+	if (!g_topk) {
+		*num = 0;
+		return 0;
 	}
-	*cond = cnd;
+	r_pthread_mutex_lock(&g_tree_lock);
+	tls_topk_merge(tls);
+	topk_sort(tk);
+	n = ((uint32_t)*num < tk->len) ? *num : (int)tk->len;
+	for (i = 0; i < n; i++) {
+		out[i].lock = (const void*)(uintptr_t)tk->ent[i].a;
+		out[i].site = (const void*)(uintptr_t)tk->ent[i].b;
+		out[i].total_ns = tk->ent[i].count;
+		out[i].err_ns = tk->ent[i].err;
+	}
+	r_pthread_mutex_unlock(&g_tree_lock);
+	*num = n;
 	return 0;
 }
 
-/******************************************************************
- *  API functions
- *****************************************************************/
-int lksmith_optional_init(const void *ptr, int recursive, int sleeper)
+int lksmith_get_handoff_stats(const void *ptr,
+			      struct lksmith_handoff_stats *stats)
 {
 	struct lksmith_tls *tls;
 	struct lksmith_lock *lk;
-	int ret;
+	const struct lksmith_handoff *ho;
+	int i, ret = ENOENT;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_optional_init(lock=%p): "
-			"failed to allocate thread-local storage.\n", ptr);
+		lksmith_error(ENOMEM, "lksmith_get_handoff_stats: failed to "
+			"allocate thread-local storage.\n");
 		return ENOMEM;
 	}
-	if (!tls->intercept)
-		return 0;
 	r_pthread_mutex_lock(&g_tree_lock);
-	ret = lksmith_insert(ptr, recursive, sleeper, &lk);
+	lk = lksmith_find(ptr);
+	ho = lk ? lk->cold->handoff : NULL;
+	for (i = 0; (!ho) && (i < g_retired_handoffs.num); i++) {
+		ho = g_retired_handoffs.items[i];
+		if (ho->ptr != ptr)
+			ho = NULL;
+	}
+	if (ho) {
+		stats->count = ho->count;
+		stats->total_ns = ho->total_ns;
+		stats->max_ns = ho->max_ns;
+		stats->p50_ns = handoff_percentile(ho, 50);
+		stats->p99_ns = handoff_percentile(ho, 99);
+		ret = 0;
+	}
 	r_pthread_mutex_unlock(&g_tree_lock);
-	if (ret) {
-		lksmith_error(ret, "lksmith_optional_init(lock=%p, "
-			"thread=%s): failed to allocate lock data: "
-			"error %d: %s\n", ptr, tls->name, ret, terror(ret));
-		return ret;
+	return ret;
+}
+
+static int bounce_compare(const void *a, const void *b)
+{
+	const struct lksmith_bounce *ba = *(struct lksmith_bounce * const *)a;
+	const struct lksmith_bounce *bb = *(struct lksmith_bounce * const *)b;
+	uint64_t ca = bounce_cost(ba), cb = bounce_cost(bb);
+
+	if (ca != cb)
+		return (ca > cb) ? -1 : 1;
+	if (ba->thread_changes != bb->thread_changes)
+		return (ba->thread_changes > bb->thread_changes) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Describe the locks with the most estimated cache line transfers.
+ * Note: you must call this function with g_tree_lock held.
+ */
+static void bounce_dump(char *buf, size_t *off, size_t buf_len)
+{
+	struct lksmith_lock_cold *ck;
+	struct lksmith_bounce **bos;
+	const struct lksmith_bounce *bo;
+	size_t i, n = g_retired_bounces.num;
+
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if (ck->bounce)
+			n++;
+	}
+	if (n == 0)
+		return;
+	bos = malloc(n * sizeof(*bos));
+	if (!bos)
+		return;
+	n = 0;
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if ((ck->bounce) && (ck->bounce->thread_changes))
+			bos[n++] = ck->bounce;
+	}
+	for (i = 0; i < (size_t)g_retired_bounces.num; i++) {
+		if (((const struct lksmith_bounce *)
+				g_retired_bounces.items[i])->thread_changes)
+			bos[n++] = g_retired_bounces.items[i];
+	}
+	qsort(bos, n, sizeof(*bos), bounce_compare);
+	if (n > TOPK_REPORT_MAX)
+		n = TOPK_REPORT_MAX;
+	if (n == 0)
+		goto done;
+	fwdprintf(buf, off, buf_len, "the %zu locks with the most estimated "
+		"cache line transfers, sampling one acquisition in "
+		"%"PRIu32":\n", n, g_bounce_sample);
+	for (i = 0; i < n; i++) {
+		bo = bos[i];
+		fwdprintf(buf, off, buf_len, "%zu. lock %p%s: %"PRIu64" "
+			"sampled acquisitions, %.1f%% changed CPU, %.1f%% "
+			"changed thread, %.1f%% changed NUMA node\n", i + 1,
+			bo->ptr, bo->destroyed ? " (destroyed)" : "",
+			bo->samples, (bo->cpu_changes * 100.0) / bo->samples,
+			(bo->thread_changes * 100.0) / bo->samples,
+			(bo->node_changes * 100.0) / bo->samples);
+	}
+done:
+	free(bos);
+}
+
+static int lksmith_report_bouncing_impl(int at_exit)
+{
+	char buf[16384];
+	size_t off = 0;
+
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
 	}
+	bounce_dump(buf, &off, sizeof(buf));
+	if (off)
+		lksmith_error(0, "lksmith_report_bouncing: %s", buf);
+	r_pthread_mutex_unlock(&g_tree_lock);
 	return 0;
 }
 
-int lksmith_destroy(const void *ptr)
+static void lksmith_report_bouncing_at_exit(void)
+{
+	lksmith_report_bouncing_impl(1);
+}
+
+int lksmith_report_bouncing(void)
+{
+	if (!g_bounce_sample)
+		return 0;
+	return lksmith_report_bouncing_impl(0);
+}
+
+int lksmith_get_bounce_stats(const void *ptr,
+			     struct lksmith_bounce_stats *stats)
 {
-	int ret;
-	struct lksmith_lock *lk, *ak;
 	struct lksmith_tls *tls;
+	struct lksmith_lock *lk;
+	const struct lksmith_bounce *bo;
+	int i, ret = ENOENT;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_destroy(lock=%p): failed to "
-			"allocate thread-local storage.\n", ptr);
-		ret = ENOMEM;
-		goto done;
+		lksmith_error(ENOMEM, "lksmith_get_bounce_stats: failed to "
+			"allocate thread-local storage.\n");
+		return ENOMEM;
 	}
-	if (!tls->intercept)
-		return 0;
 	r_pthread_mutex_lock(&g_tree_lock);
 	lk = lksmith_find(ptr);
-	if (!lk) {
-		/* This might not be an error, if we used
-		 * PTHREAD_MUTEX_INITIALIZER and then never did anything else
-		 * with the lock prior to destroying it. */
-		ret = ENOENT;
-		goto done_unlock;
-	}
-	if (lk->holders != NULL) {
-		if (tls_contains_lid(tls, ptr) == 1) {
-			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
-				"thread=%s): you must unlock this mutex "
-				"before destroying it.", ptr, tls->name);
-		} else {
-			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
-				"thread=%s): this mutex is currently in use "
-				"and so cannot be destroyed.", ptr, tls->name);
-		}
-		ret = EBUSY;
-		goto done_unlock;
+	bo = lk ? lk->cold->bounce : NULL;
+	for (i = 0; (!bo) && (i < g_retired_bounces.num); i++) {
+		bo = g_retired_bounces.items[i];
+		if (bo->ptr != ptr)
+			bo = NULL;
 	}
-	RB_REMOVE(lock_tree, &g_tree, lk);
-	/* TODO: could probably avoid traversing the whole tree by using both
-	 * before and after pointers inside locks, or some such? */
-	RB_FOREACH(ak, lock_tree, &g_tree) {
-		lk_remove_before(ak, lk);
+	if (bo) {
+		stats->samples = bo->samples;
+		stats->cpu_changes = bo->cpu_changes;
+		stats->thread_changes = bo->thread_changes;
+		stats->node_changes = bo->node_changes;
+		stats->cost = bounce_cost(bo);
+		ret = 0;
 	}
-	free(lk->before);
-	free(lk);
-	ret = 0;
-done_unlock:
 	r_pthread_mutex_unlock(&g_tree_lock);
-done:
 	return ret;
 }
 
-static int lksmith_search(struct lksmith_lock *lk, const void *start)
+/**
+ * Decide what advice to give about a lock.
+ * Note: you must call this function with g_tree_lock held.
+ *
+ * @param adv		The lock's usage.
+ * @param out		(out param) array of at least ADVISE_KINDS entries
+ *			to fill in with advice.
+ *
+ * @return		The number of entries filled in.
+ */
+static int advise_evaluate(const struct lksmith_advice *adv,
+			   struct lksmith_lock_advice *out)
 {
-	int ret, i;
+	struct lksmith_lock_advice base;
+	uint64_t mean = 0;
+	int n = 0;
 
-	if (lk->ptr == start)
-		return 1;
-	if (lk->color == g_color)
+	if (adv->acquisitions < ADVISE_MIN_ACQUISITIONS)
 		return 0;
-	lk->color = g_color;
-	for (i = 0; i < lk->before_size; i++) {
-		ret = lksmith_search(lk->before[i], start);
-		if (ret)
-			return ret;
+	if (adv->holds)
+		mean = adv->hold_total_ns / adv->holds;
+	memset(&base, 0, sizeof(base));
+	base.lock = adv->ptr;
+	base.destroyed = adv->destroyed;
+	base.acquisitions = adv->acquisitions;
+	base.contended = adv->contended;
+	base.mean_hold_ns = mean;
+	base.max_hold_ns = adv->hold_max_ns;
+	/* Use whichever measure of preemption is worse.  Migrations miss
+	 * holders which were switched out and back in on the same CPU;
+	 * context switch counts are only sampled. */
+	base.preempted = adv->migrated;
+	base.preempt_samples = adv->holds;
+	if ((adv->cs_samples) && ((adv->cs_preempted * base.preempt_samples) >
+				  (base.preempted * adv->cs_samples))) {
+		base.preempted = adv->cs_preempted;
+		base.preempt_samples = adv->cs_samples;
 	}
-	return 0;
+	if (adv->sleeper) {
+		/* A mutex held for less time than it takes to sleep, which
+		 * is often busy, would do better to spin for a while
+		 * first. */
+		if ((adv->holds) && (mean < ADVISE_SHORT_HOLD_NS) &&
+				(adv->contended * 100 >=
+				 adv->acquisitions * ADVISE_CONTENDED_PCT)) {
+			out[n] = base;
+			out[n].kind = LKSMITH_ADVICE_ADAPTIVE;
+			out[n].score_ns = adv->contended * ADVISE_PARK_NS;
+			n++;
+		}
+		return n;
+	}
+	/* A spin lock held for a long time, or by a holder which is often
+	 * switched out, keeps its waiters spinning for a long time. */
+	if ((mean >= ADVISE_SPIN_HOLD_NS) || ((base.preempt_samples) &&
+			(base.preempted * 100 >=
+			 base.preempt_samples * ADVISE_PREEMPT_PCT))) {
+		out[n] = base;
+		out[n].kind = LKSMITH_ADVICE_SPIN_TO_MUTEX;
+		out[n].score_ns = adv->contended * mean;
+		n++;
+	}
+	/* When there are more runnable threads than CPUs, a waiter may spin
+	 * away its whole time slice while the holder waits for a CPU. */
+	if ((adv->contended) && (g_load_oversubscribed)) {
+		out[n] = base;
+		out[n].kind = LKSMITH_ADVICE_SPIN_OVERSUBSCRIBED;
+		out[n].score_ns = (adv->contended * ADVISE_SLICE_NS *
+			g_load_oversubscribed) / g_load_samples;
+		n++;
+	}
+	return n;
 }
 
-static void lksmith_prelock_process_depends(struct lksmith_tls *tls,
-			struct lksmith_lock *lk, const void *ptr)
+static int advice_compare(const void *a, const void *b)
 {
-	unsigned int i;
-	const void *held;
-	struct lksmith_lock *ak;
+	const struct lksmith_lock_advice *aa = a, *ab = b;
 
-	g_color++;
-	for (i = 0; i < tls->num_held; i++) {
-		held = tls->held[i];
-		ak = lksmith_find(held);
-		if (!ak) {
-			lksmith_error_with_ti(tls, ENOMEM, "lksmith_prelock("
-				"lock=%p, thread=%s): thread holds unknown "
-				"lock %p.\n", ptr, tls->name, held);
-			continue;
-		}
-		if (ak == lk) {
-			if (ak->props.recursive)
-				continue;
-			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
-				"lock=%p, thread=%s): this thread already holds "
-				"this lock, and it is not a recursive lock.\n",
-				ptr, tls->name);
-			continue;
-		}
-		if (lksmith_search(ak, ptr)) {
-			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
-				"lock=%p, thread=%s): lock inversion!  This "
-				"lock should have been taken before lock %p, "
-				"which this thread already holds.\n",
-				ptr, tls->name, held);
-			continue;
-		}
-		lk_add_before(lk, ak);
-	}
+	if (aa->score_ns != ab->score_ns)
+		return (aa->score_ns > ab->score_ns) ? -1 : 1;
+	if (aa->contended != ab->contended)
+		return (aa->contended > ab->contended) ? -1 : 1;
+	if (aa->kind != ab->kind)
+		return (aa->kind < ab->kind) ? -1 : 1;
+	return 0;
 }
 
 /**
- * Returns true if lksmith_prelock should skip dependency processing.
+ * Find the advice for every lock, ranked by how much it would save.
+ * Note: you must call this function with g_tree_lock held.
  *
- * We search the current backtrace for any element that is in the ignore
- * list.
+ * @param out		(out param) a malloc'ed array of advice, or NULL
+ *			if there is none.
+ * @param num		(out param) the length of out.
+ *
+ * @return		0 on success; error code otherwise.
  */
-static int should_skip_dependency_processing(struct lksmith_holder *holder)
+static int advise_collect(struct lksmith_lock_advice **out, size_t *num)
 {
-	int bt_idx, ip_idx;
-	char *match;
+	struct lksmith_lock_cold *ck;
+	struct lksmith_lock_advice *items;
+	size_t i, n = g_retired_advice.num;
 
-	for (bt_idx = 0; bt_idx < holder->bt_len; bt_idx++) {
-		const char *frame = holder->bt_frames[bt_idx];
-		match = bsearch(&frame, g_ignored_frames, g_num_ignored_frames,
-				sizeof(char*), compare_strings);
-		if (match) {
-			return 1;
-		}
-		for (ip_idx = 0; ip_idx < g_num_ignored_frame_patterns;
-			     ip_idx++) {
-			if (!fnmatch(g_ignored_frame_patterns[ip_idx],
-				     frame, 0)) {
-				return 1;
-			}
-		}
+	*out = NULL;
+	*num = 0;
+	advise_sample_load(time_now_ns());
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if (ck->advice)
+			n++;
+	}
+	if (n == 0)
+		return 0;
+	items = malloc(n * ADVISE_KINDS * sizeof(*items));
+	if (!items)
+		return ENOMEM;
+	n = 0;
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if (ck->advice)
+			n += advise_evaluate(ck->advice, items + n);
 	}
+	for (i = 0; i < (size_t)g_retired_advice.num; i++)
+		n += advise_evaluate(g_retired_advice.items[i], items + n);
+	qsort(items, n, sizeof(*items), advice_compare);
+	*out = items;
+	*num = n;
 	return 0;
 }
 
-int lksmith_prelock(const void *ptr, int sleeper)
+/**
+ * Log one piece of advice, with the evidence for it.
+ *
+ * @param rank		Where the advice ranks, starting at 1.
+ * @param it		The advice.
+ */
+static void advice_print(size_t rank, const struct lksmith_lock_advice *it)
 {
-	struct lksmith_lock *lk;
-	struct lksmith_tls *tls;
-	int ret;
-	struct lksmith_holder *holder = NULL;
+	double contended_pct = (it->contended * 100.0) / it->acquisitions;
+	double preempted_pct = it->preempt_samples ?
+		((it->preempted * 100.0) / it->preempt_samples) : 0.0;
+	const char *destroyed = it->destroyed ? " (destroyed)" : "";
+	char waiters[256];
 
-	tls = get_or_create_tls();
-	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
-			"allocate thread-local storage.\n", ptr);
-		ret = ENOMEM;
-		goto done;
-	}
-	if (!tls->intercept)
-		return 0;
-	holder = holder_create(tls);
-	if (!holder) {
-		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
-			"allocate lock holder data.\n", ptr);
-		ret = ENOMEM;
-		goto done;
-	}
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		/* If the lock hasn't been explicitly initialized using
-		 * lksmith_optional_init, we allow it to be recursive.
-		 * It might have been statically initialized with
-		 * PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP.
-		 */
-		ret = lksmith_insert(ptr, 1, sleeper, &lk);
-		if (ret) {
-			lksmith_error(ret, "lksmith_prelock(lock=%p, "
-				"thread=%s): failed to allocate lock data: "
-				"error %d: %s\n", ptr, tls->name, ret, terror(ret));
-			goto done_unlock;
+	switch (it->kind) {
+	case LKSMITH_ADVICE_SPIN_TO_MUTEX:
+		if (it->contended) {
+			snprintf(waiters, sizeof(waiters), "%"PRIu64" of its "
+				"%"PRIu64" acquisitions (%.1f%%) were "
+				"contended, so waiters may have spun for about "
+				"%"PRIu64" ns.", it->contended,
+				it->acquisitions, contended_pct, it->score_ns);
+		} else {
+			snprintf(waiters, sizeof(waiters), "None of its "
+				"%"PRIu64" acquisitions were contended yet.",
+				it->acquisitions);
 		}
+		lksmith_error(EWOULDBLOCK, "lksmith_report_lock_advice: "
+			"performance problem: %zu. spin lock %p%s should "
+			"probably be a mutex.  It was held for %"PRIu64" ns "
+			"on average and %"PRIu64" ns at most, and its holder "
+			"was preempted in %.1f%% of critical sections.  %s\n",
+			rank, it->lock, destroyed, it->mean_hold_ns,
+			it->max_hold_ns, preempted_pct, waiters);
+		break;
+	case LKSMITH_ADVICE_ADAPTIVE:
+		lksmith_error(EWOULDBLOCK, "lksmith_report_lock_advice: "
+			"performance problem: %zu. mutex %p%s would probably "
+			"do better spinning briefly before it sleeps, like "
+			"an adaptive mutex.  It was held for only %"PRIu64" "
+			"ns on average, but %"PRIu64" of its %"PRIu64" "
+			"acquisitions (%.1f%%) were contended, so waiters may "
+			"have spent about %"PRIu64" ns going to sleep and "
+			"waking up.\n", rank, it->lock, destroyed,
+			it->mean_hold_ns, it->contended, it->acquisitions,
+			contended_pct, it->score_ns);
+		break;
+	case LKSMITH_ADVICE_SPIN_OVERSUBSCRIBED:
+		lksmith_error(EWOULDBLOCK, "lksmith_report_lock_advice: "
+			"performance problem: %zu. spin lock %p%s is used on "
+			"an oversubscribed machine.  There were more runnable "
+			"threads than the %"PRIu32" online CPUs in %"PRIu64" "
+			"of %"PRIu64" samples, and as many as %"PRIu32".  "
+			"%"PRIu64" of its %"PRIu64" acquisitions (%.1f%%) were "
+			"contended, and a waiter which spins while the holder "
+			"is switched out wastes its time slice.  Consider a "
+			"mutex.\n", rank, it->lock, destroyed, g_num_cpus,
+			g_load_oversubscribed, g_load_samples,
+			g_load_max_runnable, it->contended, it->acquisitions,
+			contended_pct);
+		break;
 	}
-	if (!should_skip_dependency_processing(holder)) {
-		lksmith_prelock_process_depends(tls, lk, ptr);
-	}
-	lk_holder_add(lk, holder);
-
-	holder = NULL;
-	ret = 0;
-done_unlock:
-	r_pthread_mutex_unlock(&g_tree_lock);
-done:
-	if (holder) {
-		holder_free(holder);
-	}
-	return ret;
 }
 
-void lksmith_postlock(const void *ptr, int error)
+static int lksmith_report_lock_advice_impl(int at_exit)
 {
-	struct lksmith_tls *tls;
-	struct lksmith_lock *lk;
+	struct lksmith_lock_advice *items;
+	size_t i, n;
 	int ret;
 
-	tls = get_or_create_tls();
-	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p): failed "
-			"to allocate thread-local storage.\n", ptr);
-		goto done;
-	}
-	if (!tls->intercept)
-		return;
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		lksmith_error(EIO, "lksmith_postlock(lock=%p, thread=%s): "
-			"logic error: prelock didn't create the lock data?\n",
-			ptr, tls->name);
-		goto done_unlock;
-	}
-	if (error) {
-		lk_holder_remove(lk, tls);
-		goto done_unlock;
-	}
-	if (lk->props.nlock < MAX_NLOCK) {
-		lk->props.nlock++;
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
 	}
-	ret = tls_append_held(tls, ptr);
+	ret = advise_collect(&items, &n);
 	if (ret) {
-		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p, "
-			"thread=%s): failed to allocate space to store "
-			"another thread id.\n", ptr, tls->name);
-		goto done_unlock;
-	}
-	if (!lk->props.sleeper) {
-		tls->num_spins++;
-	} else if ((tls->num_spins > 0) && (!lk->props.spin_warn)) {
-		lksmith_error_with_ti(tls, EWOULDBLOCK, "lksmith_postlock("
-			"lock=%p, thread=%s): performance problem: you are "
-			"taking a sleeping lock while holding a spin lock.\n",
-			ptr, tls->name);
-		lk->props.spin_warn = 1;
+		r_pthread_mutex_unlock(&g_tree_lock);
+		return ret;
 	}
-done_unlock:
+	if (n > TOPK_REPORT_MAX)
+		n = TOPK_REPORT_MAX;
+	for (i = 0; i < n; i++)
+		advice_print(i + 1, &items[i]);
 	r_pthread_mutex_unlock(&g_tree_lock);
-done:
-	return;
+	free(items);
+	return n ? EWOULDBLOCK : 0;
 }
 
-int lksmith_preunlock(const void *ptr)
+static void lksmith_report_lock_advice_at_exit(void)
+{
+	lksmith_report_lock_advice_impl(1);
+}
+
+int lksmith_report_lock_advice(void)
+{
+	if (!g_advise)
+		return 0;
+	return lksmith_report_lock_advice_impl(0);
+}
+
+int lksmith_get_lock_advice(struct lksmith_lock_advice *out, int *num)
 {
 	struct lksmith_tls *tls;
-	struct lksmith_lock *lk;
-	int sleeper;
+	struct lksmith_lock_advice *items;
+	size_t n;
+	int ret;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_preunlock(lock=%p): failed "
-			"to allocate thread-local storage.\n", ptr);
+		lksmith_error(ENOMEM, "lksmith_get_lock_advice: failed to "
+			"allocate thread-local storage.\n");
 		return ENOMEM;
 	}
-	if (!tls->intercept)
+	if (!g_advise) {
+		*num = 0;
 		return 0;
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		lksmith_error_with_ti(tls, ENOENT, "lksmith_preunlock(lock=%p, "
-			"thread=%s): attempted to unlock an unknown lock.\n",
-			ptr, tls->name);
-		r_pthread_mutex_unlock(&g_tree_lock);
-		return ENOENT;
 	}
-	sleeper = lk->props.sleeper;
+	r_pthread_mutex_lock(&g_tree_lock);
+	ret = advise_collect(&items, &n);
 	r_pthread_mutex_unlock(&g_tree_lock);
-	if (tls_contains_lid(tls, ptr) == 0) {
-		lksmith_error_with_ti(tls, EPERM, "lksmith_preunlock(lock=%p, "
-			"thread=%s): attempted to unlock a lock that this "
-			"thread does not currently hold.\n", ptr, tls->name);
-		return EPERM;
-	}
-	if (!sleeper) {
-		tls->num_spins--;
+	if (ret)
+		return ret;
+	if (n > (size_t)*num)
+		n = *num;
+	if (n)
+		memcpy(out, items, n * sizeof(*items));
+	free(items);
+	*num = (int)n;
+	return 0;
+}
+
+/**
+ * Compute Jain's fairness index of a lock's acquisitions among the threads
+ * we counted separately.
+ *
+ * @param fa		The fairness data.
+ *
+ * @return		The index in percent: 100 if every thread took the
+ *			lock equally often, down to 100 / num_threads if one
+ *			thread took it every time.
+ */
+static uint32_t fairness_index_pct(const struct lksmith_fairness *fa)
+{
+	double sum = 0, sum_sq = 0, x;
+	uint32_t i;
+
+	for (i = 0; i < fa->num_threads; i++) {
+		x = fa->threads[i].acquisitions;
+		sum += x;
+		sum_sq += x * x;
 	}
+	if (sum_sq == 0)
+		return 100;
+	return (uint32_t)(((sum * sum * 100.0) / (fa->num_threads * sum_sq)) +
+			  0.5);
+}
+
+static int fairness_compare(const void *a, const void *b)
+{
+	const struct lksmith_fairness *fa =
+		*(struct lksmith_fairness * const *)a;
+	const struct lksmith_fairness *fb =
+		*(struct lksmith_fairness * const *)b;
+
+	if (fa->max_wait_ns != fb->max_wait_ns)
+		return (fa->max_wait_ns > fb->max_wait_ns) ? -1 : 1;
+	if (fa->barges != fb->barges)
+		return (fa->barges > fb->barges) ? -1 : 1;
 	return 0;
 }
 
-void lksmith_postunlock(const void *ptr)
+/**
+ * Describe how one lock was shared among threads.
+ */
+static void fairness_dump_one(char *buf, size_t *off, size_t buf_len,
+			      size_t rank, const struct lksmith_fairness *fa)
 {
-	struct lksmith_tls *tls;
-	struct lksmith_lock *lk;
-	int ret;
+	const struct lksmith_fair_thread *ft;
+	uint32_t i;
 
-	tls = get_or_create_tls();
-	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_postunlock(lock=%p): failed "
-			"to allocate thread-local storage.\n", ptr);
-		return;
+	fwdprintf(buf, off, buf_len, "%zu. lock %p%s: %"PRIu64" "
+		"acquisitions by %"PRIu32"%s threads (fairness index %"PRIu32"%%)."
+		"  Longest wait %"PRIu64" us, by thread %s.  %"PRIu64" "
+		"acquisitions (%.1f%%) barged in: the last holder took the "
+		"lock again while another thread waited.\n", rank, fa->ptr,
+		fa->destroyed ? " (destroyed)" : "", fa->acquisitions,
+		fa->num_threads, fa->other_acquisitions ? "+" : "",
+		fairness_index_pct(fa), fa->max_wait_ns / 1000,
+		fa->max_wait_thread, fa->barges,
+		(fa->barges * 100.0) / fa->acquisitions);
+	for (i = 0; i < fa->num_threads; i++) {
+		ft = &fa->threads[i];
+		fwdprintf(buf, off, buf_len, "    thread %s: %"PRIu64" "
+			"acquisitions (%.1f%%), mean wait %"PRIu64" us, "
+			"longest wait %"PRIu64" us, %"PRIu64" barges\n",
+			ft->name, ft->acquisitions,
+			(ft->acquisitions * 100.0) / fa->acquisitions,
+			(ft->total_wait_ns / ft->acquisitions) / 1000,
+			ft->max_wait_ns / 1000, ft->barges);
 	}
-	if (!tls->intercept)
-		return;
-	ret = tls_remove_held(tls, ptr);
-	if (ret) {
-		lksmith_error(EIO, "lksmith_postunlock(lock=%p, "
-			"thread=%s): logic error: preunlock check told us "
-			"we had the lock, but we don't?\n", ptr, tls->name);
-		return;
+	if (fa->other_acquisitions) {
+		fwdprintf(buf, off, buf_len, "    other threads: %"PRIu64" "
+			"acquisitions (%.1f%%)\n", fa->other_acquisitions,
+			(fa->other_acquisitions * 100.0) / fa->acquisitions);
 	}
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		lksmith_error_with_ti(tls, EIO, "lksmith_preunlock(lock=%p, "
-			"thread=%s): logic error: attempted to unlock an "
-			"unknown lock.\n", ptr, tls->name);
-		r_pthread_mutex_unlock(&g_tree_lock);
-		return;
+}
+
+static int lksmith_report_fairness_impl(int at_exit)
+{
+	struct lksmith_lock_cold *ck;
+	struct lksmith_fairness **fas;
+	char buf[16384];
+	size_t i, n = g_retired_fairness.num, off;
+
+	if (at_exit) {
+		if (r_pthread_mutex_trylock(&g_tree_lock))
+			return EBUSY;
+	} else {
+		r_pthread_mutex_lock(&g_tree_lock);
 	}
-	ret = lk_holder_remove(lk, tls);
-	if (ret) {
-		lksmith_error(EIO, "lksmith_preunlock(lock=%p, thread=%s): "
-			"logic error: failed to find backtrace for this "
-			"thread in the list of stored backtraces for this "
-			"lock (error %d).\n", ptr, tls->name, ret);
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if (ck->fairness)
+			n++;
+	}
+	fas = malloc((n + 1) * sizeof(*fas));
+	if (!fas) {
 		r_pthread_mutex_unlock(&g_tree_lock);
-		return;
+		return ENOMEM;
+	}
+	/* Locks which only one thread took can't be unfair. */
+	n = 0;
+	RB_FOREACH(ck, lock_tree, &g_tree) {
+		if ((ck->fairness) && ((ck->fairness->num_threads > 1) ||
+				(ck->fairness->other_acquisitions)))
+			fas[n++] = ck->fairness;
+	}
+	for (i = 0; i < (size_t)g_retired_fairness.num; i++) {
+		if (((const struct lksmith_fairness *)
+				g_retired_fairness.items[i])->num_threads > 1)
+			fas[n++] = g_retired_fairness.items[i];
+	}
+	qsort(fas, n, sizeof(*fas), fairness_compare);
+	if (n > TOPK_REPORT_MAX)
+		n = TOPK_REPORT_MAX;
+	for (i = 0; i < n; i++) {
+		off = 0;
+		if (i == 0) {
+			fwdprintf(buf, &off, sizeof(buf), "the %zu shared "
+				"locks with the longest waits:\n", n);
+		}
+		fairness_dump_one(buf, &off, sizeof(buf), i + 1, fas[i]);
+		lksmith_error(0, "lksmith_report_fairness: %s", buf);
 	}
 	r_pthread_mutex_unlock(&g_tree_lock);
+	free(fas);
+	return 0;
 }
 
-int lksmith_check_locked(const void *ptr)
+static void lksmith_report_fairness_at_exit(void)
+{
+	lksmith_report_fairness_impl(1);
+}
+
+int lksmith_report_fairness(void)
+{
+	if (!g_fairness)
+		return 0;
+	return lksmith_report_fairness_impl(0);
+}
+
+int lksmith_get_fairness_stats(const void *ptr,
+			       struct lksmith_fairness_stats *stats)
 {
 	struct lksmith_tls *tls;
+	struct lksmith_lock *lk;
+	const struct lksmith_fairness *fa;
+	uint32_t i;
+	int ret = ENOENT;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_check_locked(lock=%p): failed "
-			"to allocate thread-local storage.\n", ptr);
+		lksmith_error(ENOMEM, "lksmith_get_fairness_stats: failed to "
+			"allocate thread-local storage.\n");
 		return ENOMEM;
 	}
-	if (!tls->intercept)
-		return 0;
-	return tls_contains_lid(tls, ptr) ? 0 : -1;
+	r_pthread_mutex_lock(&g_tree_lock);
+	lk = lksmith_find(ptr);
+	fa = lk ? lk->cold->fairness : NULL;
+	for (i = 0; (!fa) && (i < (uint32_t)g_retired_fairness.num); i++) {
+		fa = g_retired_fairness.items[i];
+		if (fa->ptr != ptr)
+			fa = NULL;
+	}
+	if (fa) {
+		memset(stats, 0, sizeof(*stats));
+		stats->acquisitions = fa->acquisitions;
+		stats->threads = fa->num_threads;
+		stats->barges = fa->barges;
+		stats->max_wait_ns = fa->max_wait_ns;
+		stats->waiters = fa->waiters;
+		stats->fairness_pct = fairness_index_pct(fa);
+		for (i = 0; i < fa->num_threads; i++) {
+			if (fa->threads[i].acquisitions >
+					stats->max_thread_acquisitions) {
+				stats->max_thread_acquisitions =
+					fa->threads[i].acquisitions;
+			}
+			if ((i == 0) || (fa->threads[i].acquisitions <
+					stats->min_thread_acquisitions)) {
+				stats->min_thread_acquisitions =
+					fa->threads[i].acquisitions;
+			}
+		}
+		ret = 0;
+	}
+	r_pthread_mutex_unlock(&g_tree_lock);
+	return ret;
 }
 
 int lksmith_cond_prewait(const void *cond, const void *mutex,
@@ -1336,6 +5965,8 @@ int lksmith_set_thread_name(const char *const name)
 		return ENOMEM;
 	}
 	snprintf(tls->name, LKSMITH_THREAD_NAME_MAX, "%s", name);
+	if (tls->flight)
+		flight_thread_rename(tls->flight, tls->name);
 	return 0;
 }
 
@@ -57,6 +57,11 @@ struct lksmith_cond;
  */
 #define LKSMITH_THREAD_NAME_MAX 16
 
+/**
+ * Maximum length of a lock array name, including the terminating NULL byte.
+ */
+#define LKSMITH_LOCK_NAME_MAX 32
+
 /******************************************************************
  *  Locksmith API
  *****************************************************************/
@@ -91,6 +96,9 @@ int init_tls(void);
 /**
  * Initialize a locksmith lock.  This function is optional.
  *
+ * The lock data is not actually created until the lock is first taken.
+ * Until then, we only remember whether the lock is recursive.
+ *
  * @param ptr		pointer to the lock to initialize
  * @param recursive	1 to allow recursive locks; 0 otherwise
  * @param sleeper	1 if this lock is a sleeper; 0 otherwise
@@ -99,6 +107,42 @@ int init_tls(void);
  */
 int lksmith_optional_init(const void *ptr, int recursive, int sleeper);
 
+/**
+ * Register an array of locks.
+ *
+ * All of the locks in the array are treated as a single lock for the purpose
+ * of lock ordering.  A thread which holds more than one lock from the array
+ * must take them in ascending address order.  The locks are not recursive.
+ *
+ * This takes constant time, no matter how many locks are in the array.  The
+ * locks may be initialized either before or after they are registered.
+ *
+ * @param base		pointer to the first lock
+ * @param stride	distance in bytes between consecutive locks
+ * @param count		number of locks
+ * @param name		name to use for the array in error messages.  This
+ *			string will be deep-copied.  The copy will be
+ *			truncated to LKSMITH_LOCK_NAME_MAX bytes long,
+ *			including the terminating null.
+ *
+ * @return		0 on success; EEXIST if the array overlaps a lock
+ *			or lock array we already know about; error code
+ *			otherwise.
+ */
+int lksmith_register_lock_array(const void *base, size_t stride,
+				size_t count, const char *name);
+
+/**
+ * Unregister an array of locks.
+ *
+ * @param base		pointer to the first lock, as passed to
+ *			lksmith_register_lock_array
+ *
+ * @return		0 on success; ENOENT if there is no such array;
+ *			EBUSY if some locks in the array are held.
+ */
+int lksmith_unregister_lock_array(const void *base);
+
 /**
  * Destroy a lock.
  *
@@ -128,6 +172,88 @@ void lksmith_postdestroy(const void *ptr);
  */
 int lksmith_prelock(const void *ptr, int sleeper);
 
+/**
+ * Perform some error checking before taking a lock, from a known call site.
+ *
+ * This is the same as lksmith_prelock, except that when LKSMITH_MAX_OVERHEAD
+ * is set, we can skip the expensive checks for a call site that we have
+ * already seen, as long as the lock order graph wouldn't change.
+ *
+ * @param ptr		pointer to the lock
+ * @param sleeper	1 if this lock is a sleeper; 0 otherwise
+ * @param site		address identifying the caller, such as its return
+ *			address, or NULL if unknown.
+ *
+ * @return		0 if we should continue with the lock; error code
+ *			otherwise.
+ */
+int lksmith_prelock_at(const void *ptr, int sleeper, const void *site);
+
+/**
+ * Record that we are about to take a lock, without checking lock ordering.
+ *
+ * This is used when LKSMITH_MODE=profile, after a trylock has failed.
+ * lksmith_prewait and lksmith_postlock should be called afterwards as usual.
+ *
+ * @param ptr		pointer to the lock
+ * @param sleeper	1 if this lock is a sleeper; 0 otherwise
+ * @param site		address identifying the caller, or NULL if unknown.
+ * @param backtrace	1 if we should take a backtrace of the caller.
+ *
+ * @return		0 if we should continue with the lock; error code
+ *			otherwise.
+ */
+int lksmith_prelock_nocheck(const void *ptr, int sleeper, const void *site,
+			    int backtrace);
+
+/**
+ * Record that we took a lock without waiting for it.
+ *
+ * This is used when LKSMITH_MODE=profile, after a trylock has succeeded.  It
+ * does the work of lksmith_prelock_nocheck and lksmith_postlock in one step,
+ * and does not take a backtrace.  No other lksmith calls are needed.
+ *
+ * @param ptr		pointer to the lock
+ * @param sleeper	1 if this lock is a sleeper; 0 otherwise
+ * @param site		address identifying the caller, or NULL if unknown.
+ */
+void lksmith_took_lock(const void *ptr, int sleeper, const void *site);
+
+/**
+ * Record that a try-lock failed because the lock was busy.
+ *
+ * @param ptr		pointer to the lock
+ * @param site		address identifying the caller, or NULL if unknown.
+ */
+void lksmith_trylock_failed(const void *ptr, const void *site);
+
+struct timespec;
+
+/**
+ * Check the deadline of a timed wait before waiting.
+ *
+ * A deadline which has passed, or is nearly here, makes the wait a try-lock
+ * in disguise, so it is counted like a failed try-lock.
+ *
+ * @param ptr		pointer to the lock or condition variable
+ * @param site		address identifying the caller, or NULL if unknown.
+ * @param abstime	the deadline
+ * @param any_clock	0 if the deadline is on CLOCK_REALTIME; 1 if it may
+ *			be on CLOCK_MONOTONIC instead, as for condition
+ *			variables.
+ */
+void lksmith_check_deadline(const void *ptr, const void *site,
+			    const struct timespec *abstime, int any_clock);
+
+/**
+ * Log a lock operation.  This is used when LKSMITH_MODE=trace.
+ *
+ * @param op		name of the operation
+ * @param ptr		pointer to the lock
+ * @param error		the result of the operation
+ */
+void lksmith_trace(const char *op, const void *ptr, int error);
+
 /**
  * Take a lock.
  *
@@ -135,6 +261,22 @@ int lksmith_prelock(const void *ptr, int sleeper);
  */
 void lksmith_postlock(const void *ptr, int error);
 
+/**
+ * Get ready to block while waiting for a lock.
+ *
+ * This should be called after lksmith_prelock, just before a call which may
+ * block until the lock is available.  It isn't needed for try-locks, which
+ * can't block.
+ *
+ * @param ptr		pointer to the lock.
+ *
+ * @return		0 if we should go ahead and wait for the lock;
+ *			EDEADLK if waiting would deadlock, and deadlock
+ *			prevention is enabled.  In either case,
+ *			lksmith_postlock must be called afterwards.
+ */
+int lksmith_prewait(const void *ptr);
+
 /**
  * Determine if it's safe to release a lock.
  *
@@ -162,6 +304,368 @@ void lksmith_postunlock(const void *ptr);
  */
 int lksmith_check_locked(const void *ptr);
 
+/**
+ * Look for potential deadlocks in the lock order graph.
+ *
+ * This finds every set of locks which have been taken in inconsistent
+ * orders, using a strongly connected component search over the whole graph.
+ * Each set is reported, along with the threads and call sites which took the
+ * locks in each order.
+ *
+ * When LKSMITH_ORDER_CHECK=deferred, this is the only place where lock
+ * inversions are found.  It runs automatically at exit in that case.
+ *
+ * @return		0 if no potential deadlocks were found; EDEADLK if
+ *			at least one was reported; another error code
+ *			otherwise.
+ */
+int lksmith_check_order(void);
+
+/**
+ * Report slow lock acquisitions.
+ *
+ * When LKSMITH_SLOW_WAIT_US is set, each wait for a mutex which takes at
+ * least that long is blamed on the thread which held the mutex.  Waits are
+ * grouped by where the waiting thread and the holding thread took the lock.
+ * This reports one group at a time, starting with the one which spent the
+ * most time waiting.  It runs automatically at exit.
+ *
+ * @return		0 if there were no slow waits; EWOULDBLOCK if at
+ *			least one group was reported; another error code
+ *			otherwise.
+ */
+int lksmith_report_slow_waits(void);
+
+/**
+ * Kinds of time tracked by lksmith_get_hot_sites.
+ */
+#define LKSMITH_HOT_WAIT 0
+#define LKSMITH_HOT_HOLD 1
+
+/**
+ * A lock and call site which spent a lot of time on the lock.
+ */
+struct lksmith_hot_site {
+	/** The lock */
+	const void *lock;
+	/** Address where the lock was taken, or NULL if unknown */
+	const void *site;
+	/** Estimated total time, in nanoseconds */
+	uint64_t total_ns;
+	/** How much of total_ns may have been spent by other locks and
+	 * call sites */
+	uint64_t err_ns;
+};
+
+/**
+ * Get the locks and call sites which have spent the most time waiting for,
+ * or holding, a lock.
+ *
+ * When LKSMITH_TOPK is set, each thread keeps a fixed-size sketch of that
+ * many (lock, call site) pairs, which it merges into a global sketch about
+ * once a second.  This merges the calling thread's sketches first.  Time
+ * from other threads in the last second may not be included yet.
+ *
+ * @param kind		LKSMITH_HOT_WAIT or LKSMITH_HOT_HOLD
+ * @param out		(out param) array to fill in, largest total first
+ * @param num		(inout param) on input, the length of out.  On
+ *			output, the number of entries filled in.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int lksmith_get_hot_sites(int kind, struct lksmith_hot_site *out, int *num);
+
+/**
+ * Log the locks and call sites which have spent the most time waiting for,
+ * and holding, a lock, and the locks which have spent the most time being
+ * handed off.  See lksmith_get_hot_sites and lksmith_get_handoff_stats.  When
+ * LKSMITH_TOPK is set, this runs automatically at exit.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int lksmith_report_hot_sites(void);
+
+/**
+ * How long a lock took to pass from the thread which released it to a thread
+ * which was waiting for it.
+ */
+struct lksmith_handoff_stats {
+	/** Number of hand-offs */
+	uint64_t count;
+	/** Total hand-off time, in nanoseconds */
+	uint64_t total_ns;
+	/** Longest hand-off, in nanoseconds */
+	uint64_t max_ns;
+	/** Upper bound on the median hand-off, in nanoseconds */
+	uint64_t p50_ns;
+	/** Upper bound on the 99th percentile hand-off, in nanoseconds */
+	uint64_t p99_ns;
+};
+
+/**
+ * Get the hand-off latencies for a lock.
+ *
+ * When LKSMITH_TOPK is set, each unlock is timestamped just before the real
+ * unlock.  When a thread which was waiting for a mutex takes it, the time
+ * since it was released is counted as a hand-off.  This is mostly the time
+ * it takes to wake the waiter up and get it running.  The latencies of
+ * destroyed locks are kept only if they are among the largest.
+ *
+ * @param ptr		pointer to the lock
+ * @param stats		(out param) the hand-off latencies
+ *
+ * @return		0 on success; ENOENT if there have been no
+ *			hand-offs of this lock; another error code
+ *			otherwise.
+ */
+int lksmith_get_handoff_stats(const void *ptr,
+			      struct lksmith_handoff_stats *stats);
+
+/**
+ * Log the call sites whose critical sections spend much of their time off the
+ * CPU: sleeping locks held across blocking I/O, sleeps, or page faults, and
+ * spin locks whose holder was switched out.  Sleeping locks which were off
+ * the CPU only because their holder was preempted are logged as a note.
+ *
+ * When LKSMITH_CS_SAMPLE=N is set, each thread measures the CPU time, page
+ * faults and context switches of one critical section in N.  This runs
+ * automatically at exit.
+ *
+ * @return		0 if nothing was reported; EWOULDBLOCK if something
+ *			was; another error code otherwise.
+ */
+int lksmith_report_critical_sections(void);
+
+/**
+ * How often a lock moved between CPUs, threads and NUMA nodes.  Each move
+ * means the cache line holding the lock moved too.
+ */
+struct lksmith_bounce_stats {
+	/** Number of sampled acquisitions */
+	uint64_t samples;
+	/** Sampled acquisitions on a different CPU than the last one */
+	uint64_t cpu_changes;
+	/** Sampled acquisitions by a different thread than the last one */
+	uint64_t thread_changes;
+	/** Sampled acquisitions on a different NUMA node than the last one */
+	uint64_t node_changes;
+	/** Estimated cache line transfers, counting a transfer between NUMA
+	 * nodes as several local ones */
+	uint64_t cost;
+};
+
+/**
+ * Get the cache line bouncing statistics for a lock.
+ *
+ * When LKSMITH_BOUNCE_SAMPLE=N is set, each thread records the CPU and thread
+ * of one lock acquisition in N.  Each sample is compared with the lock's last
+ * sample, so with N > 1 the change rates are upper bounds.  The statistics of
+ * destroyed locks are kept only if they are among the most costly.
+ *
+ * @param ptr		pointer to the lock
+ * @param stats		(out param) the statistics
+ *
+ * @return		0 on success; ENOENT if no acquisitions of this lock
+ *			have been sampled; another error code otherwise.
+ */
+int lksmith_get_bounce_stats(const void *ptr,
+			     struct lksmith_bounce_stats *stats);
+
+/**
+ * Log the locks which moved between threads the most, ranked by their
+ * estimated cache line transfers.  These are the locks most worth sharding or
+ * making per-CPU.  When LKSMITH_BOUNCE_SAMPLE is set, this runs automatically
+ * at exit.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int lksmith_report_bouncing(void);
+
+/**
+ * Kinds of advice given by lksmith_get_lock_advice.
+ */
+/** A spin lock is held too long, or its holder is preempted too often */
+#define LKSMITH_ADVICE_SPIN_TO_MUTEX 0
+/** A mutex is held so briefly, and is so often busy, that waiters should
+ * spin for a while before they sleep */
+#define LKSMITH_ADVICE_ADAPTIVE 1
+/** A contended spin lock is used while there are more runnable threads than
+ * CPUs */
+#define LKSMITH_ADVICE_SPIN_OVERSUBSCRIBED 2
+
+/**
+ * Advice about whether a lock is the right kind of lock, and the evidence
+ * for it.
+ */
+struct lksmith_lock_advice {
+	/** The lock */
+	const void *lock;
+	/** One of the LKSMITH_ADVICE constants */
+	int kind;
+	/** 1 if the lock has been destroyed */
+	int destroyed;
+	/** Estimated time that taking the advice would save, in
+	 * nanoseconds */
+	uint64_t score_ns;
+	/** Number of acquisitions */
+	uint64_t acquisitions;
+	/** Acquisitions which found the lock held by another thread */
+	uint64_t contended;
+	/** Mean time the lock was held, in nanoseconds */
+	uint64_t mean_hold_ns;
+	/** Longest time the lock was held, in nanoseconds */
+	uint64_t max_hold_ns;
+	/** Critical sections in which the holder was preempted, out of
+	 * preempt_samples */
+	uint64_t preempted;
+	/** Critical sections checked for preemption */
+	uint64_t preempt_samples;
+};
+
+/**
+ * Get advice about locks which seem to be the wrong kind of lock: spin locks
+ * which should be mutexes, and mutexes which should spin before sleeping.
+ *
+ * When LKSMITH_ADVISE=1 is set, we count the acquisitions of each lock which
+ * found it held by another thread, time each critical section, and note
+ * whether it ended on a different CPU than it started on.  When
+ * LKSMITH_CS_SAMPLE is also set, sampled critical sections with an
+ * involuntary context switch count as preempted too.  We also count the
+ * runnable threads in the whole system every 100 ms.
+ *
+ * @param out		(out param) array to fill in, most valuable advice
+ *			first
+ * @param num		(inout param) on input, the length of out.  On
+ *			output, the number of entries filled in.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int lksmith_get_lock_advice(struct lksmith_lock_advice *out, int *num);
+
+/**
+ * Log the advice from lksmith_get_lock_advice, most valuable first, with the
+ * evidence for each.  When LKSMITH_ADVISE is set, this runs automatically at
+ * exit.
+ *
+ * @return		0 if there was no advice; EWOULDBLOCK if some was
+ *			reported; another error code otherwise.
+ */
+int lksmith_report_lock_advice(void);
+
+/**
+ * Kinds of runs tracked by lksmith_get_trylock_storms.
+ */
+/** Try-locks which failed because the lock was busy */
+#define LKSMITH_STORM_TRYLOCK 0
+/** Timed waits whose deadline had passed, or was less than 10 us away */
+#define LKSMITH_STORM_TIMED 1
+
+/**
+ * A call site which polled a lock many times in a row.
+ */
+struct lksmith_trylock_storm {
+	/** The last lock or condition variable polled here */
+	const void *ptr;
+	/** Address of the caller, or NULL if unknown */
+	const void *site;
+	/** LKSMITH_STORM_TRYLOCK or LKSMITH_STORM_TIMED */
+	int kind;
+	/** Number of runs of at least LKSMITH_TRYLOCK_STREAK failures */
+	uint64_t streaks;
+	/** Total failures in those runs */
+	uint64_t failures;
+	/** Longest run */
+	uint64_t max_streak;
+	/** Total time from the first to the last failure of each run, in
+	 * nanoseconds */
+	uint64_t wall_ns;
+	/** CPU time spent between the second and the last failure of each
+	 * run, in nanoseconds */
+	uint64_t cpu_ns;
+	/** Longest time between two failures, in nanoseconds */
+	uint64_t max_gap_ns;
+};
+
+/**
+ * Get the call sites which poll locks in a loop.
+ *
+ * When LKSMITH_TRYLOCK_STREAK=N is set, each thread counts consecutive
+ * failed try-locks on the same lock from the same call site, and consecutive
+ * timed waits with expired deadlines.  A run ends when the thread takes the
+ * lock, makes a timed wait with a real deadline, or starts polling too many
+ * other locks.  Runs of at least N failures are counted; runs still going on
+ * are not.
+ *
+ * @param out		(out param) array to fill in, most CPU time first
+ * @param num		(inout param) on input, the length of out.  On
+ *			output, the number of entries filled in.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int lksmith_get_trylock_storms(struct lksmith_trylock_storm *out, int *num);
+
+/**
+ * Log the call sites from lksmith_get_trylock_storms.  When
+ * LKSMITH_TRYLOCK_STREAK is set, this runs automatically at exit.
+ *
+ * @return		0 if nothing was reported; EWOULDBLOCK if something
+ *			was; another error code otherwise.
+ */
+int lksmith_report_trylock_storms(void);
+
+/**
+ * How fairly a lock was shared among the threads which took it.
+ */
+struct lksmith_fairness_stats {
+	/** Number of acquisitions */
+	uint64_t acquisitions;
+	/** Number of threads which took the lock, up to 16 */
+	uint32_t threads;
+	/** Jain's fairness index of the acquisitions among those threads,
+	 * in percent.  100 means that every thread took the lock equally
+	 * often. */
+	uint32_t fairness_pct;
+	/** Most acquisitions by one thread */
+	uint64_t max_thread_acquisitions;
+	/** Fewest acquisitions by one thread */
+	uint64_t min_thread_acquisitions;
+	/** Acquisitions by the thread which took the lock last, while another
+	 * thread was waiting for it */
+	uint64_t barges;
+	/** Longest time any thread took to get the lock, in nanoseconds */
+	uint64_t max_wait_ns;
+	/** Number of threads waiting for the lock right now */
+	uint32_t waiters;
+};
+
+/**
+ * Get the fairness statistics for a lock.
+ *
+ * When LKSMITH_FAIRNESS=1 is set, each acquisition is counted against the
+ * thread which made it, along with how long the thread took to get the lock.
+ * An acquisition barges in if the same thread took the lock last time, and
+ * another thread was trying to take it.  The statistics of destroyed locks
+ * are kept only if they have some of the longest waits.
+ *
+ * @param ptr		pointer to the lock
+ * @param stats		(out param) the statistics
+ *
+ * @return		0 on success; ENOENT if no acquisitions of the lock
+ *			have been counted; another error code otherwise.
+ */
+int lksmith_get_fairness_stats(const void *ptr,
+			       struct lksmith_fairness_stats *stats);
+
+/**
+ * Log how the locks taken by more than one thread were shared among them,
+ * longest wait first: each thread's share of the acquisitions, its mean and
+ * longest wait, and how often it barged in.  When LKSMITH_FAIRNESS is set,
+ * this runs automatically at exit.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+int lksmith_report_fairness(void);
+
 /**
  * Register a given condition variable as about to wait.
  *
@@ -0,0 +1,247 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "handler.h"
+#include "lksmith.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Microbenchmarks for the Locksmith lock and unlock paths.
+ *
+ * Each benchmark is run twice: once through the real pthreads functions,
+ * bypassing Locksmith, and once through the Locksmith wrappers.  The
+ * difference is the overhead that Locksmith adds.
+ */
+
+typedef int (*lock_fn_t)(pthread_mutex_t *mutex);
+
+struct bench_ops {
+	const char *name;
+	lock_fn_t lock;
+	lock_fn_t unlock;
+};
+
+static struct bench_ops g_ops[2];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+/** Lock and unlock a single mutex over and over. */
+static uint64_t bench_uncontended(const struct bench_ops *ops, int iters)
+{
+	pthread_mutex_t mutex;
+	uint64_t start;
+	int i;
+
+	pthread_mutex_init(&mutex, NULL);
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		ops->lock(&mutex);
+		ops->unlock(&mutex);
+	}
+	start = now_ns() - start;
+	pthread_mutex_destroy(&mutex);
+	return start;
+}
+
+/** Take two mutexes in a consistent order, over and over. */
+static uint64_t bench_nested(const struct bench_ops *ops, int iters)
+{
+	pthread_mutex_t a, b;
+	uint64_t start;
+	int i;
+
+	pthread_mutex_init(&a, NULL);
+	pthread_mutex_init(&b, NULL);
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		ops->lock(&a);
+		ops->lock(&b);
+		ops->unlock(&b);
+		ops->unlock(&a);
+	}
+	start = now_ns() - start;
+	pthread_mutex_destroy(&b);
+	pthread_mutex_destroy(&a);
+	return start;
+}
+
+#define BENCH_MANY_LOCKS 4096
+
+/** Lock and unlock many different mutexes, round-robin.  This stresses the
+ * lookup of per-lock data, since it won't all fit in cache. */
+static uint64_t bench_many(const struct bench_ops *ops, int iters)
+{
+	pthread_mutex_t *locks;
+	uint64_t start;
+	int i;
+
+	locks = xcalloc(sizeof(pthread_mutex_t) * BENCH_MANY_LOCKS);
+	for (i = 0; i < BENCH_MANY_LOCKS; i++) {
+		pthread_mutex_init(&locks[i], NULL);
+	}
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		/* Stride through the array so that consecutive locks are
+		 * far apart in memory. */
+		pthread_mutex_t *m = &locks[(i * 2053) % BENCH_MANY_LOCKS];
+		ops->lock(m);
+		ops->unlock(m);
+	}
+	start = now_ns() - start;
+	for (i = 0; i < BENCH_MANY_LOCKS; i++) {
+		pthread_mutex_destroy(&locks[i]);
+	}
+	free(locks);
+	return start;
+}
+
+#define BENCH_CONTENDED_THREADS 4
+
+struct contended_ctx {
+	const struct bench_ops *ops;
+	pthread_mutex_t *shared;
+	pthread_mutex_t mine;
+	int iters;
+};
+
+static void *contended_thread(void *v)
+{
+	struct contended_ctx *ctx = v;
+	int i;
+
+	for (i = 0; i < ctx->iters; i++) {
+		/* Each thread works on its own lock most of the time, but
+		 * every so often touches a shared one.  This models
+		 * per-thread state that sometimes needs to be published. */
+		pthread_mutex_t *m = (i % 8) ? &ctx->mine : ctx->shared;
+		ctx->ops->lock(m);
+		ctx->ops->unlock(m);
+	}
+	return NULL;
+}
+
+/** Several threads hammering on a pair of locks. */
+static uint64_t bench_contended(const struct bench_ops *ops, int iters)
+{
+	pthread_t threads[BENCH_CONTENDED_THREADS];
+	struct contended_ctx ctx[BENCH_CONTENDED_THREADS];
+	pthread_mutex_t shared;
+	uint64_t start;
+	int i;
+
+	pthread_mutex_init(&shared, NULL);
+	for (i = 0; i < BENCH_CONTENDED_THREADS; i++) {
+		ctx[i].ops = ops;
+		ctx[i].shared = &shared;
+		pthread_mutex_init(&ctx[i].mine, NULL);
+		ctx[i].iters = iters / BENCH_CONTENDED_THREADS;
+	}
+	start = now_ns();
+	for (i = 0; i < BENCH_CONTENDED_THREADS; i++) {
+		pthread_create(&threads[i], NULL, contended_thread, &ctx[i]);
+	}
+	for (i = 0; i < BENCH_CONTENDED_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	start = now_ns() - start;
+	for (i = 0; i < BENCH_CONTENDED_THREADS; i++) {
+		pthread_mutex_destroy(&ctx[i].mine);
+	}
+	pthread_mutex_destroy(&shared);
+	return start;
+}
+
+struct bench {
+	const char *name;
+	uint64_t (*fn)(const struct bench_ops *ops, int iters);
+	/** Lock/unlock pairs per iteration */
+	int pairs;
+};
+
+static const struct bench g_benches[] = {
+	{ "uncontended", bench_uncontended, 1 },
+	{ "nested", bench_nested, 2 },
+	{ "many_locks", bench_many, 1 },
+	{ "contended", bench_contended, 1 },
+};
+
+#define NUM_BENCHES (sizeof(g_benches) / sizeof(g_benches[0]))
+
+int main(int argc, char **argv)
+{
+	int iters = 100000;
+	unsigned int b, o;
+	uint64_t ns[2];
+
+	if (argc > 1)
+		iters = atoi(argv[1]);
+	if (iters <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* Make sure that the r_pthread functions have been loaded. */
+	if (init_tls()) {
+		fprintf(stderr, "init_tls failed\n");
+		return EXIT_FAILURE;
+	}
+	g_ops[0].name = "raw";
+	g_ops[0].lock = r_pthread_mutex_lock;
+	g_ops[0].unlock = r_pthread_mutex_unlock;
+	g_ops[1].name = "locksmith";
+	g_ops[1].lock = pthread_mutex_lock;
+	g_ops[1].unlock = pthread_mutex_unlock;
+
+	printf("%-14s %12s %12s %10s\n", "benchmark", "raw ns/op",
+		"lksmith ns/op", "overhead");
+	for (b = 0; b < NUM_BENCHES; b++) {
+		for (o = 0; o < 2; o++) {
+			ns[o] = g_benches[b].fn(&g_ops[o], iters);
+			ns[o] /= ((uint64_t)iters * g_benches[b].pairs);
+		}
+		printf("%-14s %12"PRIu64" %12"PRIu64" %9.1fx\n",
+			g_benches[b].name, ns[0], ns[1],
+			ns[0] ? ((double)ns[1] / ns[0]) : 0.0);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,435 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "handler.h"
+#include "lksmith.h"
+#include "mem.h"
+#include "test.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Randomized lock workloads for checking Locksmith.
+ *
+ * Each scenario is generated from a seed.  Worker threads take random
+ * nested sets of shared mutexes, always in ascending index order, so the
+ * workers never create a real lock inversion.  They mix in recursive
+ * mutexes, spin locks, condition variable waits, and destroying and
+ * re-initializing their private mutexes.  Afterwards, the main thread plants
+ * a known number of lock inversions.  Every planted inversion must be
+ * reported, and nothing else may be.
+ *
+ * Each workload is run once through the real pthreads functions and once
+ * through the Locksmith wrappers, so that we can see what the overhead is.
+ */
+
+#define FUZZ_MAX_LOCKS 64
+#define FUZZ_MAX_THREADS 8
+#define FUZZ_MAX_DEPTH 6
+#define FUZZ_NUM_SPINS 4
+
+struct fuzz_ops {
+	const char *name;
+	int (*mutex_init)(pthread_mutex_t *mutex,
+		const pthread_mutexattr_t *attr);
+	int (*mutex_destroy)(pthread_mutex_t *mutex);
+	int (*mutex_lock)(pthread_mutex_t *mutex);
+	int (*mutex_unlock)(pthread_mutex_t *mutex);
+	int (*spin_init)(pthread_spinlock_t *lock, int pshared);
+	int (*spin_destroy)(pthread_spinlock_t *lock);
+	int (*spin_lock)(pthread_spinlock_t *lock);
+	int (*spin_unlock)(pthread_spinlock_t *lock);
+	int (*cond_init)(pthread_cond_t *cond,
+		const pthread_condattr_t *attr);
+	int (*cond_destroy)(pthread_cond_t *cond);
+	int (*cond_timedwait)(pthread_cond_t *cond, pthread_mutex_t *mutex,
+		const struct timespec *abstime);
+};
+
+static struct fuzz_ops g_ops[2];
+
+struct fuzz_scenario {
+	/** Seed which everything else was generated from */
+	uint64_t seed;
+	/** Number of shared mutexes */
+	int nlocks;
+	/** Number of worker threads */
+	int nthreads;
+	/** Maximum number of shared mutexes held at once */
+	int max_depth;
+	/** Lock/unlock iterations per thread */
+	int iters;
+	/** Number of lock inversions to plant */
+	int nplanted;
+	/** Which of the shared mutexes are recursive */
+	uint64_t recursive;
+};
+
+struct fuzz_thread {
+	const struct fuzz_scenario *sc;
+	const struct fuzz_ops *ops;
+	pthread_mutex_t *locks;
+	pthread_spinlock_t *spins;
+	pthread_mutex_t mine;
+	pthread_cond_t cond;
+	uint64_t rng;
+	/** Number of lock acquisitions performed */
+	uint64_t nops;
+	int idx;
+};
+
+/** xorshift64* */
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717ULL;
+}
+
+static uint64_t rng_seed(uint64_t seed)
+{
+	/* Zero is a fixed point for xorshift. */
+	return seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+static void scenario_generate(uint64_t seed, int iters,
+			struct fuzz_scenario *sc)
+{
+	uint64_t rng = rng_seed(seed);
+
+	memset(sc, 0, sizeof(*sc));
+	sc->seed = seed;
+	sc->nlocks = 2 + (rng_next(&rng) % (FUZZ_MAX_LOCKS - 1));
+	sc->nthreads = 1 + (rng_next(&rng) % FUZZ_MAX_THREADS);
+	sc->max_depth = 1 + (rng_next(&rng) % FUZZ_MAX_DEPTH);
+	sc->iters = iters;
+	sc->nplanted = rng_next(&rng) % 4;
+	if (sc->nplanted > sc->nlocks - 1)
+		sc->nplanted = sc->nlocks - 1;
+	sc->recursive = rng_next(&rng) & rng_next(&rng);
+}
+
+static void mutex_init_kind(const struct fuzz_ops *ops,
+			pthread_mutex_t *mutex, int recursive)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	if (recursive)
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	ops->mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static int scenario_is_recursive(const struct fuzz_scenario *sc, int idx)
+{
+	return !!(sc->recursive & (1ULL << idx));
+}
+
+static void *fuzz_worker(void *v)
+{
+	struct fuzz_thread *ft = v;
+	const struct fuzz_scenario *sc = ft->sc;
+	const struct fuzz_ops *ops = ft->ops;
+	struct timespec past = { 0, 0 };
+	pthread_spinlock_t *spin;
+	int held[FUZZ_MAX_DEPTH];
+	int i, d, n, cur, range, mine;
+
+	for (i = 0; i < sc->iters; i++) {
+		/* Pick an ascending set of shared locks. */
+		n = 0;
+		cur = -1;
+		d = 1 + (rng_next(&ft->rng) % sc->max_depth);
+		range = sc->nlocks / d;
+		if (range < 1)
+			range = 1;
+		while ((n < d) && (cur + 1 < sc->nlocks)) {
+			cur += 1 + (rng_next(&ft->rng) % range);
+			if (cur >= sc->nlocks)
+				break;
+			held[n++] = cur;
+		}
+		for (d = 0; d < n; d++) {
+			ops->mutex_lock(&ft->locks[held[d]]);
+		}
+		ft->nops += n;
+		if ((n > 0) && (scenario_is_recursive(sc, held[n - 1])) &&
+				(rng_next(&ft->rng) % 4 == 0)) {
+			ops->mutex_lock(&ft->locks[held[n - 1]]);
+			ops->mutex_unlock(&ft->locks[held[n - 1]]);
+			ft->nops++;
+		}
+		/* Our private mutex comes after all the shared ones, and
+		 * spin locks come after that. */
+		mine = (rng_next(&ft->rng) % 4 == 0);
+		if (mine) {
+			ops->mutex_lock(&ft->mine);
+			ft->nops++;
+			if ((n == 0) && (rng_next(&ft->rng) % 2 == 0)) {
+				/* This times out right away, but still drops
+				 * and re-takes the mutex. */
+				ops->cond_timedwait(&ft->cond, &ft->mine,
+						    &past);
+			}
+		}
+		if (rng_next(&ft->rng) % 4 == 0) {
+			spin = &ft->spins[rng_next(&ft->rng) % FUZZ_NUM_SPINS];
+			ops->spin_lock(spin);
+			ops->spin_unlock(spin);
+			ft->nops++;
+		}
+		if (mine)
+			ops->mutex_unlock(&ft->mine);
+		while (n > 0) {
+			ops->mutex_unlock(&ft->locks[held[--n]]);
+		}
+		if (rng_next(&ft->rng) % 64 == 0) {
+			ops->mutex_destroy(&ft->mine);
+			mutex_init_kind(ops, &ft->mine, 0);
+		}
+	}
+	return NULL;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Plant lock inversions.  Each one takes a pair of locks in ascending order
+ * and then in descending order, from the main thread so that nothing can
+ * really deadlock.
+ */
+static void scenario_plant(const struct fuzz_scenario *sc,
+		const struct fuzz_ops *ops, pthread_mutex_t *locks)
+{
+	uint64_t rng = rng_seed(~sc->seed);
+	int pairs[FUZZ_MAX_LOCKS][2];
+	int i, j, a, b;
+
+	for (i = 0; i < sc->nplanted; i++) {
+		/* Every pair must be different, since we only report an
+		 * inversion the first time that we see it. */
+		do {
+			a = rng_next(&rng) % (sc->nlocks - 1);
+			b = a + 1 + (rng_next(&rng) % (sc->nlocks - a - 1));
+			for (j = 0; j < i; j++) {
+				if ((pairs[j][0] == a) && (pairs[j][1] == b))
+					break;
+			}
+		} while (j < i);
+		pairs[i][0] = a;
+		pairs[i][1] = b;
+		ops->mutex_lock(&locks[a]);
+		ops->mutex_lock(&locks[b]);
+		ops->mutex_unlock(&locks[b]);
+		ops->mutex_unlock(&locks[a]);
+		ops->mutex_lock(&locks[b]);
+		ops->mutex_lock(&locks[a]);
+		ops->mutex_unlock(&locks[a]);
+		ops->mutex_unlock(&locks[b]);
+	}
+}
+
+struct fuzz_result {
+	/** Nanoseconds per lock acquisition in the worker phase */
+	uint64_t ns_per_op;
+	/** Errors reported while the workers ran */
+	int nfalse;
+	/** Inversions reported after planting */
+	int nfound;
+	/** Other errors reported after planting */
+	int nother;
+};
+
+static void scenario_run(const struct fuzz_scenario *sc,
+		const struct fuzz_ops *ops, int deferred,
+		struct fuzz_result *res)
+{
+	pthread_t threads[FUZZ_MAX_THREADS];
+	struct fuzz_thread ft[FUZZ_MAX_THREADS];
+	pthread_mutex_t *locks;
+	pthread_spinlock_t spins[FUZZ_NUM_SPINS];
+	uint64_t start, nops = 0;
+	int i;
+
+	memset(res, 0, sizeof(*res));
+	clear_recorded_errors();
+	locks = xcalloc(sizeof(pthread_mutex_t) * sc->nlocks);
+	for (i = 0; i < sc->nlocks; i++) {
+		mutex_init_kind(ops, &locks[i], scenario_is_recursive(sc, i));
+	}
+	for (i = 0; i < FUZZ_NUM_SPINS; i++) {
+		ops->spin_init(&spins[i], PTHREAD_PROCESS_PRIVATE);
+	}
+	for (i = 0; i < sc->nthreads; i++) {
+		memset(&ft[i], 0, sizeof(ft[i]));
+		ft[i].sc = sc;
+		ft[i].ops = ops;
+		ft[i].locks = locks;
+		ft[i].spins = spins;
+		ft[i].rng = rng_seed(sc->seed + i + 1);
+		ft[i].idx = i;
+		mutex_init_kind(ops, &ft[i].mine, 0);
+		ops->cond_init(&ft[i].cond, NULL);
+	}
+	start = now_ns();
+	for (i = 0; i < sc->nthreads; i++) {
+		pthread_create(&threads[i], NULL, fuzz_worker, &ft[i]);
+	}
+	for (i = 0; i < sc->nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		nops += ft[i].nops;
+	}
+	start = now_ns() - start;
+	res->ns_per_op = nops ? (start / nops) : 0;
+	if (deferred)
+		lksmith_check_order();
+	res->nfalse = num_recorded_errors();
+	clear_recorded_errors();
+	scenario_plant(sc, ops, locks);
+	if (deferred)
+		lksmith_check_order();
+	while (find_recorded_error(EDEADLK)) {
+		res->nfound++;
+	}
+	res->nother = num_recorded_errors();
+	clear_recorded_errors();
+	for (i = 0; i < sc->nthreads; i++) {
+		ops->cond_destroy(&ft[i].cond);
+		ops->mutex_destroy(&ft[i].mine);
+	}
+	for (i = 0; i < FUZZ_NUM_SPINS; i++) {
+		ops->spin_destroy(&spins[i]);
+	}
+	for (i = 0; i < sc->nlocks; i++) {
+		ops->mutex_destroy(&locks[i]);
+	}
+	free(locks);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s seed] [-n scenarios] "
+		"[-i iterations]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	struct fuzz_scenario sc;
+	struct fuzz_result res[2];
+	uint64_t seed = 1;
+	int c, s, nscenarios = 20, iters = 2000, deferred, failed = 0;
+	const char *mode;
+
+	while ((c = getopt(argc, argv, "s:n:i:h")) != -1) {
+		switch (c) {
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			nscenarios = atoi(optarg);
+			break;
+		case 'i':
+			iters = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if ((nscenarios <= 0) || (iters <= 0)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	set_error_cb(record_error);
+	/* Make sure that the r_pthread functions have been loaded. */
+	if (init_tls()) {
+		fprintf(stderr, "init_tls failed\n");
+		return EXIT_FAILURE;
+	}
+	mode = getenv("LKSMITH_ORDER_CHECK");
+	deferred = (mode && (!strcmp(mode, "deferred")));
+	g_ops[0] = (struct fuzz_ops) { "raw",
+		r_pthread_mutex_init, r_pthread_mutex_destroy,
+		r_pthread_mutex_lock, r_pthread_mutex_unlock,
+		r_pthread_spin_init, r_pthread_spin_destroy,
+		r_pthread_spin_lock, r_pthread_spin_unlock,
+		r_pthread_cond_init, r_pthread_cond_destroy,
+		r_pthread_cond_timedwait };
+	g_ops[1] = (struct fuzz_ops) { "locksmith",
+		pthread_mutex_init, pthread_mutex_destroy,
+		pthread_mutex_lock, pthread_mutex_unlock,
+		pthread_spin_init, pthread_spin_destroy,
+		pthread_spin_lock, pthread_spin_unlock,
+		pthread_cond_init, pthread_cond_destroy,
+		pthread_cond_timedwait };
+
+	printf("%-20s %5s %7s %7s %5s %5s %9s %9s %8s\n", "seed", "locks",
+		"threads", "planted", "found", "false", "raw ns", "lk ns",
+		"overhead");
+	for (s = 0; s < nscenarios; s++) {
+		scenario_generate(seed + s, iters, &sc);
+		scenario_run(&sc, &g_ops[0], 0, &res[0]);
+		scenario_run(&sc, &g_ops[1], deferred, &res[1]);
+		printf("%-20"PRIu64" %5d %7d %7d %5d %5d %9"PRIu64" "
+			"%9"PRIu64" %7.1fx\n", sc.seed, sc.nlocks,
+			sc.nthreads, sc.nplanted, res[1].nfound,
+			res[1].nfalse + res[1].nother, res[0].ns_per_op,
+			res[1].ns_per_op, res[0].ns_per_op ?
+			((double)res[1].ns_per_op / res[0].ns_per_op) : 0.0);
+		/* In deferred mode, inversions are reported as strongly
+		 * connected components, which may group several together. */
+		if ((res[1].nfalse) || (res[1].nother) ||
+			((!deferred) && (res[1].nfound != sc.nplanted)) ||
+			(deferred && ((res[1].nfound > 0) != (sc.nplanted > 0)))) {
+			fprintf(stderr, "scenario with seed %"PRIu64" FAILED\n",
+				sc.seed);
+			failed = 1;
+		}
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,502 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Macro-benchmarks which use locks the way real programs do.
+ *
+ * This program does not link against Locksmith.  macro_bench.sh runs it
+ * once on its own, and then again with liblksmith.so in LD_PRELOAD, so that
+ * we can compare the throughput.
+ */
+
+#define NUM_WORKERS 4
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void *xcalloc(size_t len)
+{
+	void *v = calloc(1, len);
+
+	if (!v) {
+		fprintf(stderr, "out of memory\n");
+		abort();
+	}
+	return v;
+}
+
+/** A small amount of work that the compiler can't optimize away. */
+static uint64_t spin_work(uint64_t x, int rounds)
+{
+	int i;
+
+	for (i = 0; i < rounds; i++) {
+		x = (x * 6364136223846793005ULL) + 1442695040888963407ULL;
+	}
+	return x;
+}
+
+/******************************************************************
+ * Bounded queue: a mutex and two condition variables
+ *****************************************************************/
+#define QUEUE_CAP 64
+
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	uint64_t items[QUEUE_CAP];
+	int head;
+	int len;
+};
+
+static void queue_init(struct queue *q)
+{
+	memset(q, 0, sizeof(*q));
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+static void queue_destroy(struct queue *q)
+{
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+}
+
+static void queue_put(struct queue *q, uint64_t item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->len == QUEUE_CAP) {
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	q->items[(q->head + q->len) % QUEUE_CAP] = item;
+	q->len++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static uint64_t queue_get(struct queue *q)
+{
+	uint64_t item;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->len == 0) {
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+	item = q->items[q->head];
+	q->head = (q->head + 1) % QUEUE_CAP;
+	q->len--;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return item;
+}
+
+/** Items which tell a consumer to stop. */
+#define QUEUE_STOP UINT64_MAX
+
+/******************************************************************
+ * Thread pool: workers take jobs from a shared queue, and the
+ * submitter waits for all of them to finish.
+ *****************************************************************/
+struct pool {
+	struct queue jobs;
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+	uint64_t done;
+	uint64_t sum;
+};
+
+static void *pool_worker(void *v)
+{
+	struct pool *pool = v;
+	uint64_t job, result;
+
+	while (1) {
+		job = queue_get(&pool->jobs);
+		if (job == QUEUE_STOP)
+			break;
+		result = spin_work(job, 200);
+		pthread_mutex_lock(&pool->done_lock);
+		pool->sum += result;
+		if (++pool->done % 64 == 0)
+			pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->done_lock);
+	}
+	return NULL;
+}
+
+static uint64_t bench_pool(uint64_t ops)
+{
+	pthread_t threads[NUM_WORKERS];
+	struct pool pool;
+	uint64_t i;
+
+	memset(&pool, 0, sizeof(pool));
+	queue_init(&pool.jobs);
+	pthread_mutex_init(&pool.done_lock, NULL);
+	pthread_cond_init(&pool.done_cond, NULL);
+	for (i = 0; i < NUM_WORKERS; i++) {
+		pthread_create(&threads[i], NULL, pool_worker, &pool);
+	}
+	for (i = 0; i < ops; i++) {
+		queue_put(&pool.jobs, i);
+	}
+	pthread_mutex_lock(&pool.done_lock);
+	while (pool.done < ops) {
+		struct timespec ts;
+
+		/* Workers only signal every 64 jobs, so don't wait
+		 * forever for the last few. */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pool.done_cond, &pool.done_lock, &ts);
+	}
+	pthread_mutex_unlock(&pool.done_lock);
+	for (i = 0; i < NUM_WORKERS; i++) {
+		queue_put(&pool.jobs, QUEUE_STOP);
+	}
+	for (i = 0; i < NUM_WORKERS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_cond_destroy(&pool.done_cond);
+	pthread_mutex_destroy(&pool.done_lock);
+	queue_destroy(&pool.jobs);
+	return pool.sum;
+}
+
+/******************************************************************
+ * Striped hash map: 90% gets and 10% puts
+ *****************************************************************/
+#define MAP_STRIPES 16
+#define MAP_BUCKETS 4096
+#define MAP_KEYS 65536
+
+struct map_entry {
+	uint64_t key;
+	uint64_t val;
+	struct map_entry *next;
+};
+
+struct map {
+	pthread_mutex_t stripes[MAP_STRIPES];
+	struct map_entry *buckets[MAP_BUCKETS];
+};
+
+struct map_ctx {
+	struct map *map;
+	uint64_t ops;
+	uint64_t seed;
+	uint64_t hits;
+};
+
+static uint64_t map_hash(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> 20;
+}
+
+static void *map_worker(void *v)
+{
+	struct map_ctx *ctx = v;
+	struct map *map = ctx->map;
+	struct map_entry *e;
+	uint64_t i, key, h, rng = ctx->seed;
+
+	for (i = 0; i < ctx->ops; i++) {
+		rng = spin_work(rng, 1);
+		key = (rng >> 33) % MAP_KEYS;
+		h = map_hash(key) % MAP_BUCKETS;
+		pthread_mutex_lock(&map->stripes[h % MAP_STRIPES]);
+		for (e = map->buckets[h]; e; e = e->next) {
+			if (e->key == key)
+				break;
+		}
+		if ((rng >> 8) % 10 == 0) {
+			if (!e) {
+				e = xcalloc(sizeof(*e));
+				e->key = key;
+				e->next = map->buckets[h];
+				map->buckets[h] = e;
+			}
+			e->val = rng;
+		} else if (e) {
+			ctx->hits++;
+		}
+		pthread_mutex_unlock(&map->stripes[h % MAP_STRIPES]);
+	}
+	return NULL;
+}
+
+static uint64_t bench_map(uint64_t ops)
+{
+	pthread_t threads[NUM_WORKERS];
+	struct map_ctx ctx[NUM_WORKERS];
+	struct map *map;
+	struct map_entry *e, *next;
+	uint64_t i, hits = 0;
+
+	map = xcalloc(sizeof(*map));
+	for (i = 0; i < MAP_STRIPES; i++) {
+		pthread_mutex_init(&map->stripes[i], NULL);
+	}
+	for (i = 0; i < NUM_WORKERS; i++) {
+		ctx[i].map = map;
+		ctx[i].ops = ops / NUM_WORKERS;
+		ctx[i].seed = i + 1;
+		ctx[i].hits = 0;
+		pthread_create(&threads[i], NULL, map_worker, &ctx[i]);
+	}
+	for (i = 0; i < NUM_WORKERS; i++) {
+		pthread_join(threads[i], NULL);
+		hits += ctx[i].hits;
+	}
+	for (i = 0; i < MAP_BUCKETS; i++) {
+		for (e = map->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	for (i = 0; i < MAP_STRIPES; i++) {
+		pthread_mutex_destroy(&map->stripes[i]);
+	}
+	free(map);
+	return hits;
+}
+
+/******************************************************************
+ * Pipeline: a producer, two transforming stages, and a consumer,
+ * connected by bounded queues
+ *****************************************************************/
+#define PIPELINE_STAGES 2
+
+struct stage {
+	struct queue *in;
+	struct queue *out;
+};
+
+static void *pipeline_stage(void *v)
+{
+	struct stage *st = v;
+	uint64_t item;
+
+	while (1) {
+		item = queue_get(st->in);
+		if (item == QUEUE_STOP)
+			break;
+		queue_put(st->out, spin_work(item, 50) >> 1);
+	}
+	queue_put(st->out, QUEUE_STOP);
+	return NULL;
+}
+
+static uint64_t bench_pipeline(uint64_t ops)
+{
+	pthread_t threads[PIPELINE_STAGES];
+	struct stage stages[PIPELINE_STAGES];
+	struct queue queues[PIPELINE_STAGES + 1];
+	uint64_t i, item, sum = 0;
+
+	for (i = 0; i <= PIPELINE_STAGES; i++) {
+		queue_init(&queues[i]);
+	}
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		stages[i].in = &queues[i];
+		stages[i].out = &queues[i + 1];
+		pthread_create(&threads[i], NULL, pipeline_stage, &stages[i]);
+	}
+	/* The main thread both produces and consumes, so that the queues
+	 * stay busy without another thread. */
+	for (i = 0; i < ops; i++) {
+		queue_put(&queues[0], i);
+		if (i >= QUEUE_CAP)
+			sum += queue_get(&queues[PIPELINE_STAGES]);
+	}
+	queue_put(&queues[0], QUEUE_STOP);
+	while (1) {
+		item = queue_get(&queues[PIPELINE_STAGES]);
+		if (item == QUEUE_STOP)
+			break;
+		sum += item;
+	}
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (i = 0; i <= PIPELINE_STAGES; i++) {
+		queue_destroy(&queues[i]);
+	}
+	return sum;
+}
+
+/******************************************************************
+ * Logger: many threads format messages into one shared buffer
+ *****************************************************************/
+#define LOG_THREADS 8
+#define LOG_BUF_LEN 65536
+
+struct logger {
+	pthread_mutex_t lock;
+	char buf[LOG_BUF_LEN];
+	size_t off;
+	uint64_t flushed;
+};
+
+struct log_ctx {
+	struct logger *log;
+	uint64_t ops;
+	int idx;
+};
+
+static void *log_worker(void *v)
+{
+	struct log_ctx *ctx = v;
+	struct logger *log = ctx->log;
+	char msg[128];
+	uint64_t i;
+	int len;
+
+	for (i = 0; i < ctx->ops; i++) {
+		len = snprintf(msg, sizeof(msg), "thread %d: event %"PRIu64
+			" value %"PRIx64"\n", ctx->idx, i,
+			spin_work(i, 10));
+		pthread_mutex_lock(&log->lock);
+		if (log->off + len > LOG_BUF_LEN) {
+			/* Pretend to write the buffer out. */
+			log->flushed += log->off;
+			log->off = 0;
+		}
+		memcpy(log->buf + log->off, msg, len);
+		log->off += len;
+		pthread_mutex_unlock(&log->lock);
+	}
+	return NULL;
+}
+
+static uint64_t bench_logger(uint64_t ops)
+{
+	pthread_t threads[LOG_THREADS];
+	struct log_ctx ctx[LOG_THREADS];
+	struct logger *log;
+	uint64_t i, total;
+
+	log = xcalloc(sizeof(*log));
+	pthread_mutex_init(&log->lock, NULL);
+	for (i = 0; i < LOG_THREADS; i++) {
+		ctx[i].log = log;
+		ctx[i].ops = ops / LOG_THREADS;
+		ctx[i].idx = i;
+		pthread_create(&threads[i], NULL, log_worker, &ctx[i]);
+	}
+	for (i = 0; i < LOG_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	total = log->flushed + log->off;
+	pthread_mutex_destroy(&log->lock);
+	free(log);
+	return total;
+}
+
+struct macro_bench {
+	const char *name;
+	uint64_t (*fn)(uint64_t ops);
+	/** Default number of operations */
+	uint64_t ops;
+};
+
+static const struct macro_bench g_benches[] = {
+	{ "pool", bench_pool, 200000 },
+	{ "hashmap", bench_map, 2000000 },
+	{ "pipeline", bench_pipeline, 200000 },
+	{ "logger", bench_logger, 1000000 },
+};
+
+#define NUM_BENCHES (sizeof(g_benches) / sizeof(g_benches[0]))
+
+static void usage(const char *argv0)
+{
+	unsigned int b;
+
+	fprintf(stderr, "usage: %s <benchmark> [operations]\n"
+		"benchmarks:", argv0);
+	for (b = 0; b < NUM_BENCHES; b++) {
+		fprintf(stderr, " %s", g_benches[b].name);
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	const struct macro_bench *bench = NULL;
+	uint64_t ops, start, result;
+	unsigned int b;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (b = 0; b < NUM_BENCHES; b++) {
+		if (!strcmp(argv[1], g_benches[b].name))
+			bench = &g_benches[b];
+	}
+	if (!bench) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	ops = (argc > 2) ? strtoull(argv[2], NULL, 10) : bench->ops;
+	if (ops == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	start = now_ns();
+	result = bench->fn(ops);
+	start = now_ns() - start;
+	/* Print the result, so that the work can't be optimized out. */
+	printf("%s ops=%"PRIu64" ns=%"PRIu64" ops_per_sec=%.0f "
+		"result=%"PRIx64"\n", bench->name, ops, start,
+		start ? (ops * 1e9 / start) : 0.0, result);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Run the macro-benchmarks with and without Locksmith, and report the
+# throughput under each Locksmith mode relative to the baseline.
+#
+# usage: macro_bench.sh [build directory]
+#
+# Environment:
+#   MACRO_BENCH_OPS     operations per benchmark run.  Default 20000.
+#   MACRO_BENCH_MODES   space-separated list of modes to run.  Each mode is
+#                       name[:VAR=value[,VAR=value...]].  Default: off,
+#                       order, profile, and full modes, full mode with
+#                       a 2% overhead budget, and deferred order checks.
+#
+
+die() {
+    echo $@ 1>&2
+    exit 1
+}
+
+build_dir="${1:-.}"
+bench="${build_dir}/macro_bench"
+lib="${build_dir}/liblksmith.so"
+[ -x "${bench}" ] || die "can't find ${bench}"
+[ -f "${lib}" ] || die "can't find ${lib}"
+ops="${MACRO_BENCH_OPS:-20000}"
+modes="${MACRO_BENCH_MODES:-off:LKSMITH_MODE=off order:LKSMITH_MODE=order \
+profile:LKSMITH_MODE=profile full sampling:LKSMITH_MAX_OVERHEAD=2% \
+deferred:LKSMITH_ORDER_CHECK=deferred}"
+
+# Print the throughput of one run, in operations per second.
+run_one() {
+    "$@" | sed -n 's/.*ops_per_sec=\([0-9]*\).*/\1/p'
+}
+
+printf "%-10s %-10s %14s %10s\n" "benchmark" "mode" "ops/sec" "relative"
+for b in pool hashmap pipeline logger; do
+    base=$(run_one "${bench}" ${b} ${ops})
+    [ -n "${base}" ] || die "${b} failed"
+    printf "%-10s %-10s %14s %10s\n" ${b} baseline ${base} 1.000
+    for m in ${modes}; do
+        name="${m%%:*}"
+        vars=""
+        if [ "${name}" != "${m}" ]; then
+            vars=$(echo "${m#*:}" | tr ',' ' ')
+        fi
+        tput=$(run_one env ${vars} LD_PRELOAD="${lib}" \
+            "${bench}" ${b} ${ops} 2>/dev/null)
+        [ -n "${tput}" ] || die "${b} failed in mode ${name}"
+        rel=$(awk "BEGIN { printf \"%.3f\", ${tput} / ${base} }")
+        printf "%-10s %-10s %14s %10s\n" ${b} ${name} ${tput} ${rel}
+    done
+done
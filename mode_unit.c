@@ -0,0 +1,167 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Checks that each LKSMITH_MODE does the work it should, and no more.
+ * This is run once per mode, with the mode name as the argument.
+ */
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_sem;
+
+static int test_inversion(int expect)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	EXPECT_EQ(find_recorded_error(EDEADLK), expect);
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static void *holder_thread(void *v __attribute__((unused)))
+{
+	struct timespec ts = { 0, 50000000 };
+
+	if (pthread_mutex_lock(&g_lock1))
+		return (void*)(intptr_t)EIO;
+	sem_post(&g_sem);
+	nanosleep(&ts, NULL);
+	pthread_mutex_unlock(&g_lock1);
+	return NULL;
+}
+
+static int test_slow_wait(int expect)
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(sem_init(&g_sem, 0, 0));
+	EXPECT_ZERO(pthread_create(&thread, NULL, holder_thread, NULL));
+	EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_ZERO(sem_destroy(&g_sem));
+	EXPECT_EQ(lksmith_report_slow_waits(), expect ? EWOULDBLOCK : 0);
+	EXPECT_EQ(find_recorded_error(EWOULDBLOCK), expect);
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static void *trylock_thread(void *v __attribute__((unused)))
+{
+	return (void*)(intptr_t)pthread_mutex_trylock(&g_lock1);
+}
+
+static int test_uncontended(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutex_t recursive;
+	pthread_spinlock_t spin;
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_mutex_trylock(&g_lock1));
+	EXPECT_ZERO(pthread_create(&thread, NULL, trylock_thread, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, (void*)(intptr_t)EBUSY);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+
+	EXPECT_ZERO(pthread_mutexattr_init(&attr));
+	EXPECT_ZERO(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE));
+	EXPECT_ZERO(pthread_mutex_init(&recursive, &attr));
+	EXPECT_ZERO(pthread_mutexattr_destroy(&attr));
+	EXPECT_ZERO(pthread_mutex_lock(&recursive));
+	EXPECT_ZERO(pthread_mutex_lock(&recursive));
+	EXPECT_ZERO(pthread_mutex_unlock(&recursive));
+	EXPECT_ZERO(pthread_mutex_unlock(&recursive));
+	EXPECT_ZERO(pthread_mutex_destroy(&recursive));
+
+	EXPECT_ZERO(pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE));
+	EXPECT_ZERO(pthread_spin_lock(&spin));
+	EXPECT_ZERO(pthread_spin_unlock(&spin));
+	EXPECT_ZERO(pthread_spin_destroy(&spin));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_cond_wait(void)
+{
+	pthread_cond_t cond;
+	struct timespec past = { 0, 0 };
+
+	EXPECT_ZERO(pthread_cond_init(&cond, NULL));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_EQ(pthread_cond_timedwait(&cond, &g_lock1, &past), ETIMEDOUT);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_cond_destroy(&cond));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int order, profile;
+
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	putenv("LKSMITH_SLOW_WAIT_US=10000");
+	order = (!strcmp(argv[1], "order")) || (!strcmp(argv[1], "full")) ||
+		(!strcmp(argv[1], "trace"));
+	profile = (!strcmp(argv[1], "profile")) ||
+		(!strcmp(argv[1], "full")) || (!strcmp(argv[1], "trace"));
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_inversion(order));
+	EXPECT_ZERO(test_slow_wait(profile));
+	EXPECT_ZERO(test_uncontended());
+	EXPECT_ZERO(test_cond_wait());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock3 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock4 = PTHREAD_MUTEX_INITIALIZER;
+
+static int take_in_order(pthread_mutex_t *a, pthread_mutex_t *b)
+{
+	EXPECT_ZERO(pthread_mutex_lock(a));
+	EXPECT_ZERO(pthread_mutex_lock(b));
+	EXPECT_ZERO(pthread_mutex_unlock(b));
+	EXPECT_ZERO(pthread_mutex_unlock(a));
+	return 0;
+}
+
+static int test_no_cycles(void)
+{
+	EXPECT_ZERO(take_in_order(&g_lock1, &g_lock2));
+	EXPECT_ZERO(take_in_order(&g_lock2, &g_lock3));
+	EXPECT_ZERO(take_in_order(&g_lock1, &g_lock3));
+	EXPECT_ZERO(lksmith_check_order());
+	EXPECT_EQ(find_recorded_error(EDEADLK), 0);
+	return 0;
+}
+
+static int test_cycles(void)
+{
+	/* Close the cycle 1 -> 2 -> 3 -> 1.  This isn't noticed inline. */
+	EXPECT_ZERO(take_in_order(&g_lock3, &g_lock1));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 0);
+	EXPECT_EQ(lksmith_check_order(), EDEADLK);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 0);
+	/* A two-lock cycle which shares lock 2 with the first one.  Now 1, 2,
+	 * 3, and 4 are all reported together. */
+	EXPECT_ZERO(take_in_order(&g_lock2, &g_lock4));
+	EXPECT_ZERO(take_in_order(&g_lock4, &g_lock2));
+	EXPECT_EQ(lksmith_check_order(), EDEADLK);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 0);
+	clear_recorded_errors();
+	return 0;
+}
+
+static int test_destroy_breaks_cycle(void)
+{
+	pthread_mutex_t a, b;
+
+	EXPECT_ZERO(pthread_mutex_init(&a, NULL));
+	EXPECT_ZERO(pthread_mutex_init(&b, NULL));
+	EXPECT_ZERO(take_in_order(&a, &b));
+	EXPECT_ZERO(take_in_order(&b, &a));
+	EXPECT_EQ(lksmith_check_order(), EDEADLK);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_destroy(&a));
+	EXPECT_ZERO(lksmith_check_order());
+	EXPECT_ZERO(pthread_mutex_destroy(&b));
+	clear_recorded_errors();
+	return 0;
+}
+
+int main(void)
+{
+	/* Lock inversions are only found by lksmith_check_order in this
+	 * mode. */
+	putenv("LKSMITH_ORDER_CHECK=deferred");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_no_cycles());
+	EXPECT_ZERO(test_destroy_breaks_cycle());
+	EXPECT_ZERO(test_cycles());
+
+	return EXIT_SUCCESS;
+}
@@ -34,6 +34,7 @@
  * Interface for making platform-specific calls.
  */
 
+#include <stdint.h> /* for uint64_t */
 #include <unistd.h> /* for size_t */
 
 /**
@@ -47,6 +48,80 @@
  */
 void platform_create_thread_name(char * __restrict out, size_t out_len);
 
+/**
+ * Scheduling information about a thread.
+ */
+struct platform_sched {
+	/** Scheduling policy, such as SCHED_OTHER or SCHED_FIFO */
+	int policy;
+	/** Static priority.  Only meaningful for real-time policies. */
+	int rt_priority;
+	/** Nice value */
+	int nice;
+};
+
+/**
+ * Get scheduling information about the current thread.
+ *
+ * @param out		(out param) the scheduling information
+ *
+ * @return		0 on success; error code otherwise
+ */
+int platform_get_sched(struct platform_sched *out);
+
+/**
+ * Resource usage of a thread.
+ */
+struct platform_usage {
+	/** CPU time used, in nanoseconds */
+	uint64_t cpu_ns;
+	/** Page faults which needed I/O */
+	uint64_t majflt;
+	/** Context switches because the thread blocked */
+	uint64_t nvcsw;
+	/** Context switches because the thread was preempted */
+	uint64_t nivcsw;
+};
+
+/**
+ * Get the resource usage of the current thread.
+ *
+ * @param out		(out param) the resource usage.  On platforms which
+ *			can't count faults and context switches for each
+ *			thread, those are always 0.
+ *
+ * @return		0 on success; error code otherwise
+ */
+int platform_get_usage(struct platform_usage *out);
+
+/**
+ * Get the CPU which the current thread is running on.
+ *
+ * @return		The CPU number, or -1 if it can't be found.
+ */
+int platform_get_cpu(void);
+
+/**
+ * Find the NUMA node of each CPU.
+ *
+ * @param nodes		(out param) array to fill in with the node of each
+ *			CPU.  CPUs which aren't on any node are left alone.
+ * @param num_cpus	length of nodes
+ *
+ * @return		0 on success; error code otherwise
+ */
+int platform_get_cpu_nodes(int *nodes, int num_cpus);
+
+/**
+ * Get the number of threads in the whole system which are running or ready
+ * to run.
+ *
+ * @param out		(out param) the number of runnable threads
+ *
+ * @return		0 on success; error code otherwise
+ */
+int platform_get_runnable(uint32_t *out);
+
 /**
  * Find a function named 'fname' in a library other than the current one.  We
  * need this to forward methods that we have intercepted onwards to the
@@ -30,9 +30,13 @@
 #include "platform.h"
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
+#include <time.h>
 
 static uint64_t g_tid;
 
@@ -49,6 +53,54 @@ void platform_create_thread_name(char * __restrict out, size_t out_len)
 	snprintf(out, out_len, "thread_%"PRId64, new_tid);
 }
 
+int platform_get_sched(struct platform_sched *out)
+{
+	struct sched_param param;
+	int ret, nice;
+
+	ret = pthread_getschedparam(pthread_self(), &out->policy, &param);
+	if (ret)
+		return ret;
+	out->rt_priority = param.sched_priority;
+	/* POSIX only has a nice value for the whole process. */
+	errno = 0;
+	nice = getpriority(PRIO_PROCESS, 0);
+	if ((nice == -1) && (errno))
+		return errno;
+	out->nice = nice;
+	return 0;
+}
+
+int platform_get_usage(struct platform_usage *out)
+{
+	struct timespec ts;
+
+	/* POSIX only has rusage counters for the whole process. */
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return errno;
+	out->cpu_ns = ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+	out->majflt = 0;
+	out->nvcsw = 0;
+	out->nivcsw = 0;
+	return 0;
+}
+
+int platform_get_cpu(void)
+{
+	return -1;
+}
+
+int platform_get_cpu_nodes(int *nodes __attribute__((unused)),
+			   int num_cpus __attribute__((unused)))
+{
+	return ENOSYS;
+}
+
+int platform_get_runnable(uint32_t *out __attribute__((unused)))
+{
+	return ENOSYS;
+}
+
 void* get_dlsym_next(const char *fname)
 {
 	void *v;
@@ -0,0 +1,142 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t g_barrier;
+
+struct cross_args {
+	pthread_mutex_t *first;
+	pthread_mutex_t *second;
+};
+
+/**
+ * Take our first lock, wait until the other thread has taken its first
+ * lock, and then try to take the other thread's lock.
+ *
+ * @return		1 if we were told that we would deadlock; 0 if we
+ *			got the lock; -1 on error.
+ */
+static void *cross_thread(void *v)
+{
+	struct cross_args *args = v;
+	int ret;
+
+	if (pthread_mutex_lock(args->first))
+		return (void*)(intptr_t)-1;
+	pthread_barrier_wait(&g_barrier);
+	ret = pthread_mutex_lock(args->second);
+	if (ret == EDEADLK) {
+		pthread_mutex_unlock(args->first);
+		return (void*)(intptr_t)1;
+	} else if (ret) {
+		return (void*)(intptr_t)-1;
+	}
+	pthread_mutex_unlock(args->second);
+	pthread_mutex_unlock(args->first);
+	return (void*)(intptr_t)0;
+}
+
+static int test_cross_deadlock(void)
+{
+	pthread_t thread_a, thread_b;
+	struct cross_args args_a = { &g_lock1, &g_lock2 };
+	struct cross_args args_b = { &g_lock2, &g_lock1 };
+	void *rval_a, *rval_b;
+
+	EXPECT_ZERO(pthread_barrier_init(&g_barrier, NULL, 2));
+	EXPECT_ZERO(pthread_create(&thread_a, NULL, cross_thread, &args_a));
+	EXPECT_ZERO(pthread_create(&thread_b, NULL, cross_thread, &args_b));
+	EXPECT_ZERO(pthread_join(thread_a, &rval_a));
+	EXPECT_ZERO(pthread_join(thread_b, &rval_b));
+	/* Whichever thread closed the cycle should have been refused.  The
+	 * other one should then have gotten both locks. */
+	EXPECT_EQ((intptr_t)rval_a + (intptr_t)rval_b, 1);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_barrier_destroy(&g_barrier));
+	clear_recorded_errors();
+	return 0;
+}
+
+static int test_self_deadlock(void)
+{
+	pthread_mutex_t mutex;
+
+	EXPECT_ZERO(pthread_mutex_init(&mutex, NULL));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	EXPECT_EQ(pthread_mutex_lock(&mutex), EDEADLK);
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	/* The failed attempt must not have left anything behind. */
+	EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	clear_recorded_errors();
+	return 0;
+}
+
+static int test_recursive_is_not_deadlock(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutex_t mutex;
+
+	EXPECT_ZERO(pthread_mutexattr_init(&attr));
+	EXPECT_ZERO(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE));
+	EXPECT_ZERO(pthread_mutex_init(&mutex, &attr));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	EXPECT_ZERO(pthread_mutexattr_destroy(&attr));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 0);
+	return 0;
+}
+
+int main(void)
+{
+	putenv("LKSMITH_PREVENT_DEADLOCK=1");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_self_deadlock());
+	EXPECT_ZERO(test_recursive_is_not_deadlock());
+	EXPECT_ZERO(test_cross_deadlock());
+
+	return EXIT_SUCCESS;
+}
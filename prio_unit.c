@@ -0,0 +1,116 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_sem;
+
+/**
+ * Take g_lock1, optionally after lowering our own priority, and hold it
+ * for 50 milliseconds.
+ */
+static void *holder_thread(void *v)
+{
+	int nice_val = (int)(intptr_t)v;
+	struct timespec ts = { 0, 50000000 };
+
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice_val))
+		return (void*)(intptr_t)errno;
+	if (pthread_mutex_lock(&g_lock1))
+		return (void*)(intptr_t)EIO;
+	sem_post(&g_sem);
+	nanosleep(&ts, NULL);
+	pthread_mutex_unlock(&g_lock1);
+	return NULL;
+}
+
+static int wait_for_holder(int nice_val)
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_create(&thread, NULL, holder_thread,
+			(void*)(intptr_t)nice_val));
+	EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	return 0;
+}
+
+static int test_equal_priority(void)
+{
+	EXPECT_ZERO(wait_for_holder(getpriority(PRIO_PROCESS,
+			syscall(SYS_gettid))));
+	EXPECT_EQ(find_recorded_error(EWOULDBLOCK), 0);
+	clear_recorded_errors();
+	return 0;
+}
+
+static int test_priority_inversion(void)
+{
+	int nice_val = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+
+	/* Run the holder at a lower priority than we do. */
+	EXPECT_ZERO(wait_for_holder(nice_val + 10));
+	EXPECT_EQ(find_recorded_error(EWOULDBLOCK), 1);
+	/* We only warn once per lock. */
+	EXPECT_ZERO(wait_for_holder(nice_val + 10));
+	EXPECT_EQ(find_recorded_error(EWOULDBLOCK), 0);
+	clear_recorded_errors();
+	return 0;
+}
+
+int main(void)
+{
+	putenv("LKSMITH_PRIO_INVERSION_US=10000");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(sem_init(&g_sem, 0, 0));
+	EXPECT_ZERO(test_equal_priority());
+	EXPECT_ZERO(test_priority_inversion());
+	EXPECT_ZERO(sem_destroy(&g_sem));
+
+	return EXIT_SUCCESS;
+}
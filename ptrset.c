@@ -0,0 +1,151 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ptrset.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PTRSET_INITIAL_CAP 64
+
+static inline size_t ptrset_hash(const struct ptrset *set, uintptr_t key)
+{
+	uint64_t h = (uint64_t)key;
+
+	/* Fibonacci hashing.  Lock addresses tend to be evenly spaced, so we
+	 * need to scramble the bits a bit before masking. */
+	h ^= h >> 32;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (size_t)(h >> 16) & (set->cap - 1);
+}
+
+/**
+ * Find the slot where a key is, or where it would go.
+ */
+static size_t ptrset_find(const struct ptrset *set, uintptr_t key)
+{
+	size_t i = ptrset_hash(set, key);
+
+	while (1) {
+		if ((set->slots[i] == 0) ||
+				((set->slots[i] & ~PTRSET_TAG_MASK) == key))
+			return i;
+		i = (i + 1) & (set->cap - 1);
+	}
+}
+
+static int ptrset_grow(struct ptrset *set)
+{
+	struct ptrset nset;
+	size_t i;
+
+	nset.cap = set->cap ? (set->cap * 2) : PTRSET_INITIAL_CAP;
+	nset.size = set->size;
+	nset.slots = calloc(nset.cap, sizeof(uintptr_t));
+	if (!nset.slots)
+		return ENOMEM;
+	for (i = 0; i < set->cap; i++) {
+		if (set->slots[i] == 0)
+			continue;
+		nset.slots[ptrset_find(&nset,
+			set->slots[i] & ~PTRSET_TAG_MASK)] = set->slots[i];
+	}
+	free(set->slots);
+	*set = nset;
+	return 0;
+}
+
+int ptrset_insert(struct ptrset *set, const void *ptr, unsigned int tag)
+{
+	uintptr_t key = (uintptr_t)ptr;
+	size_t i;
+	int ret;
+
+	/* Keep the load factor under 1/2. */
+	if ((set->size + 1) * 2 > set->cap) {
+		ret = ptrset_grow(set);
+		if (ret)
+			return ret;
+	}
+	i = ptrset_find(set, key);
+	if (set->slots[i])
+		return EEXIST;
+	set->slots[i] = key | (tag & PTRSET_TAG_MASK);
+	set->size++;
+	return 0;
+}
+
+int ptrset_contains(const struct ptrset *set, const void *ptr)
+{
+	if (set->size == 0)
+		return 0;
+	return set->slots[ptrset_find(set, (uintptr_t)ptr)] != 0;
+}
+
+int ptrset_remove(struct ptrset *set, const void *ptr, unsigned int *tag)
+{
+	uintptr_t key = (uintptr_t)ptr;
+	size_t i, j, home;
+
+	if (set->size == 0)
+		return ENOENT;
+	i = ptrset_find(set, key);
+	if (!set->slots[i])
+		return ENOENT;
+	if (tag)
+		*tag = set->slots[i] & PTRSET_TAG_MASK;
+	set->slots[i] = 0;
+	set->size--;
+	/* Shift back any entries which were displaced past the hole we just
+	 * made, so that lookups never stop early. */
+	j = i;
+	while (1) {
+		j = (j + 1) & (set->cap - 1);
+		if (set->slots[j] == 0)
+			break;
+		home = ptrset_hash(set, set->slots[j] & ~PTRSET_TAG_MASK);
+		/* If the entry's home slot is cyclically in (i, j], it can
+		 * stay where it is. */
+		if ((i <= j) ? ((i < home) && (home <= j)) :
+				((i < home) || (home <= j)))
+			continue;
+		set->slots[i] = set->slots[j];
+		set->slots[j] = 0;
+		i = j;
+	}
+	return 0;
+}
+
+void ptrset_free(struct ptrset *set)
+{
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,101 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_PTRSET_H
+#define LKSMITH_PTRSET_H
+
+#include <stdint.h> /* for uintptr_t */
+#include <unistd.h> /* for size_t */
+
+/**
+ * The low bits of a pointer that can be used to store a tag.  Every pointer
+ * stored in a ptrset must have these bits clear.
+ */
+#define PTRSET_TAG_MASK ((uintptr_t)0x3)
+
+/**
+ * A hash set of pointers, each with a small tag.
+ *
+ * Each entry takes a single word: the tag is stored in the low bits of the
+ * pointer.  We use open addressing with linear probing.  Deletion shifts
+ * later entries back, so there are no tombstones.
+ */
+struct ptrset {
+	/** The slots.  0 means empty. */
+	uintptr_t *slots;
+	/** Number of slots.  Always 0 or a power of 2. */
+	size_t cap;
+	/** Number of entries in use */
+	size_t size;
+};
+
+/**
+ * Insert a pointer into a ptrset.
+ *
+ * @param set		The ptrset
+ * @param ptr		The pointer.  Must be non-NULL and have the
+ *			PTRSET_TAG_MASK bits clear.
+ * @param tag		The tag to associate with the pointer.
+ *
+ * @return		0 on success; EEXIST if the pointer was already
+ *			present (in which case nothing is changed);
+ *			ENOMEM on out-of-memory.
+ */
+int ptrset_insert(struct ptrset *set, const void *ptr, unsigned int tag);
+
+/**
+ * Determine whether a pointer is in a ptrset.
+ *
+ * @param set		The ptrset
+ * @param ptr		The pointer
+ *
+ * @return		1 if the pointer is present; 0 otherwise.
+ */
+int ptrset_contains(const struct ptrset *set, const void *ptr);
+
+/**
+ * Remove a pointer from a ptrset.
+ *
+ * @param set		The ptrset
+ * @param ptr		The pointer
+ * @param tag		(out param) if non-NULL, the tag that was stored
+ *			with the pointer.
+ *
+ * @return		0 on success; ENOENT if the pointer wasn't present.
+ */
+int ptrset_remove(struct ptrset *set, const void *ptr, unsigned int *tag);
+
+/**
+ * Free the memory associated with a ptrset, leaving it empty.
+ *
+ * @param set		The ptrset
+ */
+void ptrset_free(struct ptrset *set);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ptrset.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_PTRS 10000
+
+static int test_ptrset_basic(void)
+{
+	struct ptrset set;
+	unsigned int tag;
+	int a = 0, b = 0;
+
+	memset(&set, 0, sizeof(set));
+	EXPECT_EQ(ptrset_remove(&set, &a, &tag), ENOENT);
+	EXPECT_ZERO(ptrset_contains(&set, &a));
+	EXPECT_ZERO(ptrset_insert(&set, &a, 1));
+	EXPECT_EQ(ptrset_contains(&set, &a), 1);
+	EXPECT_ZERO(ptrset_contains(&set, &b));
+	EXPECT_EQ(ptrset_insert(&set, &a, 0), EEXIST);
+	EXPECT_ZERO(ptrset_insert(&set, &b, 0));
+	EXPECT_EQ(set.size, 2);
+	EXPECT_ZERO(ptrset_remove(&set, &a, &tag));
+	EXPECT_EQ(tag, 1);
+	EXPECT_EQ(ptrset_remove(&set, &a, &tag), ENOENT);
+	EXPECT_ZERO(ptrset_remove(&set, &b, &tag));
+	EXPECT_EQ(tag, 0);
+	EXPECT_EQ(set.size, 0);
+	ptrset_free(&set);
+	return 0;
+}
+
+static int test_ptrset_many(void)
+{
+	struct ptrset set;
+	unsigned int tag;
+	uintptr_t *arr;
+	int i;
+
+	memset(&set, 0, sizeof(set));
+	/* Evenly spaced pointers, like an array of locks. */
+	arr = calloc(NUM_PTRS, sizeof(uintptr_t));
+	EXPECT_NOT_EQ(arr, NULL);
+	for (i = 0; i < NUM_PTRS; i++) {
+		EXPECT_ZERO(ptrset_insert(&set, &arr[i], i & 1));
+	}
+	EXPECT_EQ(set.size, NUM_PTRS);
+	/* Remove every third entry, to exercise the backward shift. */
+	for (i = 0; i < NUM_PTRS; i += 3) {
+		EXPECT_ZERO(ptrset_remove(&set, &arr[i], &tag));
+		EXPECT_EQ(tag, (unsigned int)(i & 1));
+	}
+	for (i = 0; i < NUM_PTRS; i++) {
+		if ((i % 3) == 0) {
+			EXPECT_EQ(ptrset_remove(&set, &arr[i], NULL), ENOENT);
+		} else {
+			EXPECT_ZERO(ptrset_remove(&set, &arr[i], &tag));
+			EXPECT_EQ(tag, (unsigned int)(i & 1));
+		}
+	}
+	EXPECT_EQ(set.size, 0);
+	ptrset_free(&set);
+	free(arr);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(die_on_error);
+	EXPECT_ZERO(test_ptrset_basic());
+	EXPECT_ZERO(test_ptrset_many());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "scc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * State shared by all threads working on a graph.
+ *
+ * Threads only ever touch the per-node entries of nodes in the weakly
+ * connected components they claimed, so the per-node arrays need no locking.
+ */
+struct scc_state {
+	/** The graph */
+	const struct scc_graph *g;
+	/** Output component numbers */
+	uint32_t *comp;
+	/** DFS index plus one; 0 means unvisited */
+	uint32_t *index;
+	/** Tarjan low-link values */
+	uint32_t *low;
+	/** Next component number to hand out.  Accessed atomically. */
+	uint32_t next_comp;
+	/** Nodes, grouped by weakly connected component.  NULL if we are not
+	 * splitting the graph. */
+	uint32_t *order;
+	/** Offsets into order where each weakly connected component starts */
+	uint32_t *wcc_start;
+	/** Indices of weakly connected components, largest first */
+	uint32_t *wcc_order;
+	/** Number of weakly connected components */
+	uint32_t nwcc;
+	/** Next entry of wcc_order to claim.  Accessed atomically. */
+	uint32_t next_wcc;
+};
+
+/**
+ * Per-thread scratch space.
+ */
+struct scc_worker {
+	struct scc_state *st;
+	/** The Tarjan stack */
+	uint32_t *stack;
+	/** The DFS call stack: nodes */
+	uint32_t *cs_node;
+	/** The DFS call stack: next edge to look at */
+	uint32_t *cs_pos;
+	/** DFS index counter */
+	uint32_t counter;
+};
+
+static void scc_visit(struct scc_worker *w, uint32_t root)
+{
+	struct scc_state *st = w->st;
+	const uint32_t *row = st->g->row, *col = st->g->col;
+	uint32_t sp = 0, csp = 0, v, u, p, c;
+
+	st->index[root] = st->low[root] = ++w->counter;
+	w->stack[sp++] = root;
+	w->cs_node[csp] = root;
+	w->cs_pos[csp] = row[root];
+	csp++;
+	while (csp > 0) {
+		v = w->cs_node[csp - 1];
+		if (w->cs_pos[csp - 1] < row[v + 1]) {
+			u = col[w->cs_pos[csp - 1]++];
+			if (st->index[u] == 0) {
+				st->index[u] = st->low[u] = ++w->counter;
+				w->stack[sp++] = u;
+				w->cs_node[csp] = u;
+				w->cs_pos[csp] = row[u];
+				csp++;
+			} else if ((st->comp[u] == SCC_NONE) &&
+					(st->index[u] < st->low[v])) {
+				/* u is still on the Tarjan stack. */
+				st->low[v] = st->index[u];
+			}
+			continue;
+		}
+		csp--;
+		if (st->low[v] == st->index[v]) {
+			c = __atomic_fetch_add(&st->next_comp, 1,
+					       __ATOMIC_RELAXED);
+			do {
+				u = w->stack[--sp];
+				st->comp[u] = c;
+			} while (u != v);
+		}
+		if (csp > 0) {
+			p = w->cs_node[csp - 1];
+			if (st->low[v] < st->low[p])
+				st->low[p] = st->low[v];
+		}
+	}
+}
+
+static void *scc_worker_run(void *v)
+{
+	struct scc_worker *w = v;
+	struct scc_state *st = w->st;
+	uint32_t i, n, end;
+
+	if (!st->order) {
+		for (n = 0; n < st->g->nnodes; n++) {
+			if (st->index[n] == 0)
+				scc_visit(w, n);
+		}
+		return NULL;
+	}
+	while (1) {
+		i = __atomic_fetch_add(&st->next_wcc, 1, __ATOMIC_RELAXED);
+		if (i >= st->nwcc)
+			break;
+		i = st->wcc_order[i];
+		end = st->wcc_start[i + 1];
+		for (n = st->wcc_start[i]; n < end; n++) {
+			if (st->index[st->order[n]] == 0)
+				scc_visit(w, st->order[n]);
+		}
+	}
+	return NULL;
+}
+
+static uint32_t uf_find(uint32_t *parent, uint32_t x)
+{
+	while (parent[x] != x) {
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+static int wcc_compare_size(const void *a, const void *b, void *arg)
+{
+	const uint32_t *sizes = arg;
+	uint32_t sa = sizes[*(const uint32_t*)a];
+	uint32_t sb = sizes[*(const uint32_t*)b];
+
+	if (sa > sb)
+		return -1;
+	else if (sa < sb)
+		return 1;
+	return 0;
+}
+
+/**
+ * Split the graph into weakly connected components.
+ *
+ * @param st		The state.  On success, order, wcc_start,
+ *			wcc_order, and nwcc will be filled in.
+ *
+ * @return		0 on success; ENOMEM on out-of-memory.
+ */
+static int scc_split(struct scc_state *st)
+{
+	const struct scc_graph *g = st->g;
+	uint32_t *parent, *sizes, v, e, a, b, i;
+
+	/* We use the index array as scratch space for the union-find
+	 * parents, and the low array to map roots to components. */
+	parent = st->index;
+	sizes = st->low;
+	for (v = 0; v < g->nnodes; v++)
+		parent[v] = v;
+	for (v = 0; v < g->nnodes; v++) {
+		for (e = g->row[v]; e < g->row[v + 1]; e++) {
+			a = uf_find(parent, v);
+			b = uf_find(parent, g->col[e]);
+			if (a < b)
+				parent[b] = a;
+			else if (b < a)
+				parent[a] = b;
+		}
+	}
+	st->nwcc = 0;
+	for (v = 0; v < g->nnodes; v++) {
+		if (uf_find(parent, v) == v)
+			sizes[v] = st->nwcc++;
+	}
+	st->order = malloc(sizeof(uint32_t) * g->nnodes);
+	st->wcc_start = calloc(st->nwcc + 1, sizeof(uint32_t));
+	st->wcc_order = malloc(sizeof(uint32_t) * st->nwcc);
+	if ((!st->order) || (!st->wcc_start) || (!st->wcc_order))
+		return ENOMEM;
+	/* Counting sort of the nodes by component. */
+	for (v = 0; v < g->nnodes; v++)
+		st->wcc_start[sizes[uf_find(parent, v)] + 1]++;
+	for (i = 0; i < st->nwcc; i++) {
+		st->wcc_order[i] = st->wcc_start[i + 1];
+		st->wcc_start[i + 1] += st->wcc_start[i];
+	}
+	/* Hand out the biggest components first, so that one big component
+	 * doesn't end up running alone at the end. */
+	for (v = 0; v < g->nnodes; v++) {
+		i = sizes[uf_find(parent, v)];
+		st->order[st->wcc_start[i + 1] - st->wcc_order[i]] = v;
+		st->wcc_order[i]--;
+	}
+	/* wcc_order now holds zeros; reuse it for the work order. */
+	for (i = 0; i < st->nwcc; i++) {
+		st->wcc_order[i] = i;
+		sizes[i] = st->wcc_start[i + 1] - st->wcc_start[i];
+	}
+	qsort_r(st->wcc_order, st->nwcc, sizeof(uint32_t),
+		wcc_compare_size, sizes);
+	memset(st->index, 0, sizeof(uint32_t) * g->nnodes);
+	return 0;
+}
+
+static void scc_worker_free(struct scc_worker *w)
+{
+	free(w->stack);
+	free(w->cs_node);
+	free(w->cs_pos);
+}
+
+static int scc_worker_init(struct scc_worker *w, struct scc_state *st)
+{
+	uint32_t n = st->g->nnodes;
+
+	memset(w, 0, sizeof(*w));
+	w->st = st;
+	w->stack = malloc(sizeof(uint32_t) * n);
+	w->cs_node = malloc(sizeof(uint32_t) * n);
+	w->cs_pos = malloc(sizeof(uint32_t) * n);
+	if ((!w->stack) || (!w->cs_node) || (!w->cs_pos)) {
+		scc_worker_free(w);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+int64_t scc_find(const struct scc_graph *g, uint32_t *comp,
+		 unsigned int nthreads)
+{
+	struct scc_state st;
+	struct scc_worker *workers = NULL;
+	pthread_t *threads = NULL;
+	unsigned int i, nstarted = 0;
+	int ret;
+
+	if (g->nnodes == 0)
+		return 0;
+	memset(&st, 0, sizeof(st));
+	st.g = g;
+	st.comp = comp;
+	st.index = calloc(g->nnodes, sizeof(uint32_t));
+	st.low = malloc(sizeof(uint32_t) * g->nnodes);
+	if ((!st.index) || (!st.low)) {
+		ret = ENOMEM;
+		goto done;
+	}
+	memset(comp, 0xff, sizeof(uint32_t) * g->nnodes);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > 1) {
+		ret = scc_split(&st);
+		if (ret)
+			goto done;
+		if (nthreads > st.nwcc)
+			nthreads = st.nwcc;
+	}
+	workers = calloc(nthreads, sizeof(struct scc_worker));
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if ((!workers) || (!threads)) {
+		ret = ENOMEM;
+		goto done;
+	}
+	for (i = 0; i < nthreads; i++) {
+		ret = scc_worker_init(&workers[i], &st);
+		if (ret)
+			goto done;
+	}
+	/* The calling thread acts as worker 0. */
+	for (nstarted = 1; nstarted < nthreads; nstarted++) {
+		if (pthread_create(&threads[nstarted], NULL, scc_worker_run,
+				   &workers[nstarted]))
+			break;
+	}
+	scc_worker_run(&workers[0]);
+	for (i = 1; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+	ret = 0;
+done:
+	if (workers) {
+		for (i = 0; i < nthreads; i++)
+			scc_worker_free(&workers[i]);
+	}
+	free(workers);
+	free(threads);
+	free(st.order);
+	free(st.wcc_start);
+	free(st.wcc_order);
+	free(st.index);
+	free(st.low);
+	if (ret)
+		return -ret;
+	return st.next_comp;
+}
+
+int64_t scc_cycle(const struct scc_graph *g, const uint32_t *comp,
+		  uint32_t start, uint32_t *path)
+{
+	uint32_t *parent, *queue, head = 0, tail = 0, v, u, e, len;
+	int64_t ret = 0;
+
+	parent = malloc(sizeof(uint32_t) * g->nnodes);
+	queue = malloc(sizeof(uint32_t) * g->nnodes);
+	if ((!parent) || (!queue)) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	memset(parent, 0xff, sizeof(uint32_t) * g->nnodes);
+	parent[start] = start;
+	queue[tail++] = start;
+	while (head < tail) {
+		v = queue[head++];
+		for (e = g->row[v]; e < g->row[v + 1]; e++) {
+			u = g->col[e];
+			if (comp[u] != comp[start])
+				continue;
+			if (u == start) {
+				/* Walk back up to start, then reverse. */
+				len = 0;
+				for (; v != start; v = parent[v])
+					path[len++] = v;
+				path[len++] = start;
+				for (u = 0; u < len / 2; u++) {
+					v = path[u];
+					path[u] = path[len - 1 - u];
+					path[len - 1 - u] = v;
+				}
+				ret = len;
+				goto done;
+			}
+			if (parent[u] != SCC_NONE)
+				continue;
+			parent[u] = v;
+			queue[tail++] = u;
+		}
+	}
+done:
+	free(parent);
+	free(queue);
+	return ret;
+}
@@ -0,0 +1,92 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_SCC_H
+#define LKSMITH_SCC_H
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+/**
+ * Component number for nodes which have not been assigned one yet.
+ */
+#define SCC_NONE UINT32_MAX
+
+/**
+ * A directed graph in compressed sparse row form.
+ *
+ * The successors of node v are col[row[v]] through col[row[v + 1] - 1].
+ */
+struct scc_graph {
+	/** Number of nodes */
+	uint32_t nnodes;
+	/** Row offsets.  There are nnodes + 1 of these. */
+	const uint32_t *row;
+	/** Column indices.  There are row[nnodes] of these. */
+	const uint32_t *col;
+};
+
+/**
+ * Find the strongly connected components of a graph, using Tarjan's
+ * algorithm.
+ *
+ * The algorithm is iterative, so deep graphs can't overflow the stack.  If
+ * nthreads is greater than 1, the graph is first split into weakly connected
+ * components, which are then processed in parallel.
+ *
+ * @param g		The graph
+ * @param comp		(out param) array of g->nnodes component numbers.
+ *			Nodes in the same strongly connected component get
+ *			the same number.
+ * @param nthreads	Maximum number of threads to use.
+ *
+ * @return		The number of components on success; a negative
+ *			error code otherwise.
+ */
+int64_t scc_find(const struct scc_graph *g, uint32_t *comp,
+		 unsigned int nthreads);
+
+/**
+ * Find a shortest cycle through a node, staying within its strongly
+ * connected component.
+ *
+ * @param g		The graph
+ * @param comp		Component numbers, as returned from scc_find
+ * @param start		The node to start at
+ * @param path		(out param) array of at least g->nnodes entries.
+ *			On success, holds the nodes of the cycle, starting
+ *			with start.  The edge from the last node back to
+ *			start closes the cycle.
+ *
+ * @return		The length of the cycle on success; 0 if start is
+ *			not on any cycle; a negative error code otherwise.
+ */
+int64_t scc_cycle(const struct scc_graph *g, const uint32_t *comp,
+		  uint32_t start, uint32_t *path);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "scc.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANDOM_NODES 300
+#define RANDOM_EDGES 360
+#define CHAIN_NODES 200000
+
+/**
+ * Build a CSR graph from an edge list.
+ */
+static int build_graph(struct scc_graph *g, uint32_t nnodes,
+		       const uint32_t *from, const uint32_t *to, uint32_t nedges)
+{
+	uint32_t *row, *col, *pos, i;
+
+	row = calloc(nnodes + 1, sizeof(uint32_t));
+	col = calloc(nedges + 1, sizeof(uint32_t));
+	pos = calloc(nnodes + 1, sizeof(uint32_t));
+	EXPECT_NOT_EQ(row, NULL);
+	EXPECT_NOT_EQ(col, NULL);
+	EXPECT_NOT_EQ(pos, NULL);
+	for (i = 0; i < nedges; i++)
+		row[from[i] + 1]++;
+	for (i = 0; i < nnodes; i++)
+		row[i + 1] += row[i];
+	memcpy(pos, row, sizeof(uint32_t) * nnodes);
+	for (i = 0; i < nedges; i++)
+		col[pos[from[i]]++] = to[i];
+	free(pos);
+	g->nnodes = nnodes;
+	g->row = row;
+	g->col = col;
+	return 0;
+}
+
+static void free_graph(struct scc_graph *g)
+{
+	free((void*)g->row);
+	free((void*)g->col);
+}
+
+/**
+ * Mark everything reachable from a node.
+ */
+static void mark_reachable(const struct scc_graph *g, uint32_t v,
+			   uint8_t *seen)
+{
+	uint32_t e;
+
+	for (e = g->row[v]; e < g->row[v + 1]; e++) {
+		if (seen[g->col[e]])
+			continue;
+		seen[g->col[e]] = 1;
+		mark_reachable(g, g->col[e], seen);
+	}
+}
+
+static int has_edge(const struct scc_graph *g, uint32_t from, uint32_t to)
+{
+	uint32_t e;
+
+	for (e = g->row[from]; e < g->row[from + 1]; e++) {
+		if (g->col[e] == to)
+			return 1;
+	}
+	return 0;
+}
+
+static int test_scc_random(unsigned int nthreads)
+{
+	struct scc_graph g;
+	uint32_t from[RANDOM_EDGES], to[RANDOM_EDGES];
+	uint32_t comp[RANDOM_NODES], path[RANDOM_NODES], i, j;
+	static uint8_t reach[RANDOM_NODES][RANDOM_NODES];
+	int64_t ncomp, len;
+
+	srand(1234);
+	for (i = 0; i < RANDOM_EDGES; i++) {
+		from[i] = rand() % RANDOM_NODES;
+		to[i] = rand() % RANDOM_NODES;
+	}
+	EXPECT_ZERO(build_graph(&g, RANDOM_NODES, from, to, RANDOM_EDGES));
+	ncomp = scc_find(&g, comp, nthreads);
+	EXPECT_GT(ncomp, 0);
+	memset(reach, 0, sizeof(reach));
+	for (i = 0; i < RANDOM_NODES; i++) {
+		EXPECT_LT(comp[i], (uint32_t)ncomp);
+		reach[i][i] = 1;
+		mark_reachable(&g, i, reach[i]);
+	}
+	/* Two nodes are in the same component exactly when each can reach
+	 * the other. */
+	for (i = 0; i < RANDOM_NODES; i++) {
+		for (j = 0; j < RANDOM_NODES; j++) {
+			EXPECT_EQ(comp[i] == comp[j],
+				  reach[i][j] && reach[j][i]);
+		}
+	}
+	/* Every node in a non-trivial component is on a cycle. */
+	for (i = 0; i < RANDOM_NODES; i++) {
+		len = scc_cycle(&g, comp, i, path);
+		EXPECT_GE(len, 0);
+		if (len == 0)
+			continue;
+		EXPECT_EQ(path[0], i);
+		for (j = 0; j < len; j++) {
+			EXPECT_EQ(comp[path[j]], comp[i]);
+			EXPECT_EQ(has_edge(&g, path[j], path[(j + 1) % len]), 1);
+		}
+	}
+	free_graph(&g);
+	return 0;
+}
+
+static int test_scc_long_chain(unsigned int nthreads)
+{
+	struct scc_graph g;
+	uint32_t *from, *to, *comp, i;
+	int64_t ncomp;
+
+	/* A single cycle through every node.  A recursive implementation
+	 * would overflow the stack. */
+	from = calloc(CHAIN_NODES, sizeof(uint32_t));
+	to = calloc(CHAIN_NODES, sizeof(uint32_t));
+	comp = calloc(CHAIN_NODES, sizeof(uint32_t));
+	EXPECT_NOT_EQ(from, NULL);
+	EXPECT_NOT_EQ(to, NULL);
+	EXPECT_NOT_EQ(comp, NULL);
+	for (i = 0; i < CHAIN_NODES; i++) {
+		from[i] = i;
+		to[i] = (i + 1) % CHAIN_NODES;
+	}
+	EXPECT_ZERO(build_graph(&g, CHAIN_NODES, from, to, CHAIN_NODES));
+	ncomp = scc_find(&g, comp, nthreads);
+	EXPECT_EQ(ncomp, 1);
+	/* Break the cycle: now every node is alone. */
+	free_graph(&g);
+	EXPECT_ZERO(build_graph(&g, CHAIN_NODES, from, to, CHAIN_NODES - 1));
+	ncomp = scc_find(&g, comp, nthreads);
+	EXPECT_EQ(ncomp, CHAIN_NODES);
+	free_graph(&g);
+	free(from);
+	free(to);
+	free(comp);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(die_on_error);
+	EXPECT_ZERO(test_scc_random(1));
+	EXPECT_ZERO(test_scc_random(4));
+	EXPECT_ZERO(test_scc_long_chain(1));
+	EXPECT_ZERO(test_scc_long_chain(4));
+
+	return EXIT_SUCCESS;
+}
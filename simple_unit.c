@@ -118,6 +118,30 @@ static int test_recursive_mutex(void)
 	return 0;
 }
 
+#define NUM_POOLED_MUTEXES 1000
+
+static int test_mutex_pool(void)
+{
+	pthread_mutex_t *pool;
+	int i;
+
+	/* Most of these mutexes are never taken. */
+	pool = calloc(NUM_POOLED_MUTEXES, sizeof(pthread_mutex_t));
+	EXPECT_NOT_EQ(pool, NULL);
+	for (i = 0; i < NUM_POOLED_MUTEXES; i++) {
+		EXPECT_ZERO(pthread_mutex_init(&pool[i], NULL));
+	}
+	for (i = 0; i < NUM_POOLED_MUTEXES; i += 100) {
+		EXPECT_ZERO(pthread_mutex_lock(&pool[i]));
+		EXPECT_ZERO(pthread_mutex_unlock(&pool[i]));
+	}
+	for (i = 0; i < NUM_POOLED_MUTEXES; i++) {
+		EXPECT_ZERO(pthread_mutex_destroy(&pool[i]));
+	}
+	free(pool);
+	return 0;
+}
+
 int main(void)
 {
 	set_error_cb(die_on_error);
@@ -129,6 +153,7 @@ int main(void)
 	EXPECT_ZERO(test_mutex_lock_simple_static());
 	EXPECT_ZERO(test_spin_lock_simple());
 	EXPECT_ZERO(test_recursive_mutex());
+	EXPECT_ZERO(test_mutex_pool());
 
 	return EXIT_SUCCESS;
 }
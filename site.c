@@ -0,0 +1,179 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "site.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SITE_INITIAL_BUCKETS 64
+
+static uint64_t site_hash(char * const *frames, int nframes)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const unsigned char *c;
+	int i;
+
+	/* FNV-1a over all the frames, with a separator between frames. */
+	for (i = 0; i < nframes; i++) {
+		for (c = (const unsigned char*)frames[i]; *c; c++) {
+			h ^= *c;
+			h *= 0x100000001b3ULL;
+		}
+		h ^= 0xff;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int site_equals(const struct site *s, uint64_t hash,
+		       char * const *frames, int nframes)
+{
+	int i;
+
+	if ((s->hash != hash) || (s->nframes != nframes))
+		return 0;
+	for (i = 0; i < nframes; i++) {
+		if (strcmp(s->frames[i], frames[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static int site_rehash(struct site_table *t)
+{
+	uint32_t nbuckets, *buckets, id, b;
+
+	nbuckets = t->nbuckets ? (t->nbuckets * 2) : SITE_INITIAL_BUCKETS;
+	buckets = calloc(nbuckets, sizeof(uint32_t));
+	if (!buckets)
+		return ENOMEM;
+	for (id = 1; id < t->nsites; id++) {
+		b = t->sites[id]->hash & (nbuckets - 1);
+		t->sites[id]->next = buckets[b];
+		buckets[b] = id;
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->nbuckets = nbuckets;
+	return 0;
+}
+
+static struct site *site_create(uint64_t hash, char * const *frames,
+				int nframes)
+{
+	struct site *s;
+	size_t len = 0;
+	char *str;
+	int i;
+
+	for (i = 0; i < nframes; i++)
+		len += strlen(frames[i]) + 1;
+	s = malloc(sizeof(struct site) + (sizeof(char*) * nframes) + len);
+	if (!s)
+		return NULL;
+	s->hash = hash;
+	s->next = SITE_UNKNOWN;
+	s->nframes = nframes;
+	str = (char*)&s->frames[nframes];
+	for (i = 0; i < nframes; i++) {
+		len = strlen(frames[i]) + 1;
+		memcpy(str, frames[i], len);
+		s->frames[i] = str;
+		str += len;
+	}
+	return s;
+}
+
+int site_intern(struct site_table *t, char * const *frames, int nframes,
+		uint32_t *id)
+{
+	uint64_t hash;
+	uint32_t i, b, cap;
+	struct site *s, **sites;
+
+	if (nframes < 0)
+		nframes = 0;
+	hash = site_hash(frames, nframes);
+	if (t->nbuckets) {
+		b = hash & (t->nbuckets - 1);
+		for (i = t->buckets[b]; i != SITE_UNKNOWN;
+				i = t->sites[i]->next) {
+			if (site_equals(t->sites[i], hash, frames, nframes)) {
+				*id = i;
+				return 0;
+			}
+		}
+	}
+	if (t->nsites == 0)
+		t->nsites = 1;
+	if (t->nsites >= t->cap) {
+		cap = t->cap ? (t->cap * 2) : SITE_INITIAL_BUCKETS;
+		sites = realloc(t->sites, sizeof(struct site*) * cap);
+		if (!sites)
+			return ENOMEM;
+		sites[0] = NULL;
+		t->sites = sites;
+		t->cap = cap;
+	}
+	if (t->nsites >= t->nbuckets) {
+		if (site_rehash(t))
+			return ENOMEM;
+	}
+	s = site_create(hash, frames, nframes);
+	if (!s)
+		return ENOMEM;
+	i = t->nsites++;
+	t->sites[i] = s;
+	b = hash & (t->nbuckets - 1);
+	s->next = t->buckets[b];
+	t->buckets[b] = i;
+	*id = i;
+	return 0;
+}
+
+const struct site *site_get(const struct site_table *t, uint32_t id)
+{
+	if ((id == SITE_UNKNOWN) || (id >= t->nsites))
+		return NULL;
+	return t->sites[id];
+}
+
+void site_table_free(struct site_table *t)
+{
+	uint32_t id;
+
+	for (id = 1; id < t->nsites; id++)
+		free(t->sites[id]);
+	free(t->sites);
+	free(t->buckets);
+	memset(t, 0, sizeof(*t));
+}
@@ -0,0 +1,104 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_SITE_H
+#define LKSMITH_SITE_H
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+/**
+ * The site ID which means "unknown".  It is never handed out.
+ */
+#define SITE_UNKNOWN 0
+
+/**
+ * A call site: a backtrace which we have seen at least once.
+ */
+struct site {
+	/** Hash of the frames */
+	uint64_t hash;
+	/** Next site in the same hash bucket, or SITE_UNKNOWN */
+	uint32_t next;
+	/** Number of frames */
+	int nframes;
+	/** The frames.  These are stored in the same allocation. */
+	char *frames[];
+};
+
+/**
+ * A table which gives each distinct backtrace a small integer ID.
+ *
+ * Sites are never removed, so an ID remains valid as long as the table does.
+ * The table does no locking of its own.
+ */
+struct site_table {
+	/** Sites, indexed by ID.  Entry 0 is unused. */
+	struct site **sites;
+	/** Number of IDs handed out, plus one */
+	uint32_t nsites;
+	/** Capacity of the sites array */
+	uint32_t cap;
+	/** Hash buckets.  Each holds the ID of the first site in the chain. */
+	uint32_t *buckets;
+	/** Number of hash buckets.  Always 0 or a power of 2. */
+	uint32_t nbuckets;
+};
+
+/**
+ * Find or create the ID for a backtrace.
+ *
+ * @param t		The site table
+ * @param frames	The backtrace frames.  These will be deep-copied.
+ * @param nframes	Number of frames
+ * @param id		(out param) the site ID
+ *
+ * @return		0 on success; ENOMEM on out-of-memory.
+ */
+int site_intern(struct site_table *t, char * const *frames, int nframes,
+		uint32_t *id);
+
+/**
+ * Get a site by ID.
+ *
+ * @param t		The site table
+ * @param id		The site ID
+ *
+ * @return		The site, or NULL if the ID is SITE_UNKNOWN or
+ *			out of range.
+ */
+const struct site *site_get(const struct site_table *t, uint32_t id);
+
+/**
+ * Free a site table, leaving it empty.
+ *
+ * @param t		The site table
+ */
+void site_table_free(struct site_table *t);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_sem;
+
+/**
+ * Take g_lock1 and hold it for 50 milliseconds.
+ */
+static void *holder_thread(void *v __attribute__((unused)))
+{
+	struct timespec ts = { 0, 50000000 };
+
+	if (pthread_mutex_lock(&g_lock1))
+		return (void*)(intptr_t)EIO;
+	sem_post(&g_sem);
+	nanosleep(&ts, NULL);
+	pthread_mutex_unlock(&g_lock1);
+	return NULL;
+}
+
+static int __attribute__((noinline)) wait_for_holder(void)
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_create(&thread, NULL, holder_thread, NULL));
+	EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	return 0;
+}
+
+static int __attribute__((noinline)) wait_for_holder_elsewhere(void)
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_create(&thread, NULL, holder_thread, NULL));
+	EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	return 0;
+}
+
+static int test_no_slow_waits(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(lksmith_report_slow_waits());
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_slow_waits(void)
+{
+	int i;
+
+	/* Waits from the same place are reported together. */
+	for (i = 0; i < 3; i++) {
+		EXPECT_ZERO(wait_for_holder());
+	}
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_EQ(lksmith_report_slow_waits(), EWOULDBLOCK);
+	EXPECT_EQ(num_recorded_errors(), 1);
+	clear_recorded_errors();
+
+	/* A wait from somewhere else gets its own report. */
+	EXPECT_ZERO(wait_for_holder_elsewhere());
+	EXPECT_EQ(lksmith_report_slow_waits(), EWOULDBLOCK);
+	EXPECT_EQ(num_recorded_errors(), 2);
+	clear_recorded_errors();
+	return 0;
+}
+
+int main(void)
+{
+	putenv("LKSMITH_SLOW_WAIT_US=10000");
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(sem_init(&g_sem, 0, 0));
+	EXPECT_ZERO(test_no_slow_waits());
+	EXPECT_ZERO(test_slow_waits());
+	EXPECT_ZERO(sem_destroy(&g_sem));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Checks that LKSMITH_TRYLOCK_STREAK finds call sites which poll a lock in a
+ * loop, in the given LKSMITH_MODE.
+ */
+
+#define STREAK 10
+
+#define MAX_STORMS 16
+
+static pthread_mutex_t g_polled = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_briefly_polled = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_cond_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static volatile int g_attempts;
+
+/**
+ * Find the call site which polled a given lock.
+ *
+ * @return		The call site's runs, or NULL if there are none.
+ */
+static const struct lksmith_trylock_storm *find_storm(
+		const struct lksmith_trylock_storm *storms, int num,
+		const void *ptr, int kind)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if ((storms[i].ptr == ptr) && (storms[i].kind == kind))
+			return &storms[i];
+	}
+	return NULL;
+}
+
+static void *poll_thread(void *v __attribute__((unused)))
+{
+	while (pthread_mutex_trylock(&g_polled) == EBUSY) {
+		__atomic_add_fetch(&g_attempts, 1, __ATOMIC_SEQ_CST);
+		sched_yield();
+	}
+	pthread_mutex_unlock(&g_polled);
+	return NULL;
+}
+
+static int test_trylock_storm(void)
+{
+	struct lksmith_trylock_storm storms[MAX_STORMS];
+	const struct lksmith_trylock_storm *st;
+	pthread_t thread;
+	int num = MAX_STORMS;
+
+	EXPECT_ZERO(pthread_mutex_lock(&g_polled));
+	EXPECT_ZERO(pthread_create(&thread, NULL, poll_thread, NULL));
+	while (__atomic_load_n(&g_attempts, __ATOMIC_SEQ_CST) < STREAK * 5)
+		sched_yield();
+	EXPECT_ZERO(pthread_mutex_unlock(&g_polled));
+	EXPECT_ZERO(pthread_join(thread, NULL));
+
+	/* Taking the lock ended the run. */
+	EXPECT_ZERO(lksmith_get_trylock_storms(storms, &num));
+	st = find_storm(storms, num, &g_polled, LKSMITH_STORM_TRYLOCK);
+	EXPECT_NOT_EQ(st, NULL);
+	EXPECT_EQ(st->streaks, 1);
+	EXPECT_EQ(st->failures, (uint64_t)g_attempts);
+	EXPECT_EQ(st->max_streak, (uint64_t)g_attempts);
+	EXPECT_GE(st->wall_ns, st->cpu_ns);
+	EXPECT_GE(st->wall_ns, st->max_gap_ns);
+	EXPECT_NOT_EQ(st->site, NULL);
+	return 0;
+}
+
+static void *brief_poll_thread(void *v __attribute__((unused)))
+{
+	int i;
+
+	for (i = 0; i < STREAK - 1; i++) {
+		if (pthread_mutex_trylock(&g_briefly_polled) != EBUSY)
+			return (void*)(uintptr_t)1;
+	}
+	return NULL;
+}
+
+static int test_short_streak(void)
+{
+	struct lksmith_trylock_storm storms[MAX_STORMS];
+	pthread_t thread;
+	void *rval;
+	int num = MAX_STORMS;
+
+	EXPECT_ZERO(pthread_mutex_lock(&g_briefly_polled));
+	EXPECT_ZERO(pthread_create(&thread, NULL, brief_poll_thread, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_briefly_polled));
+
+	/* A run which is too short isn't counted, even when it ends because
+	 * the thread exits. */
+	EXPECT_ZERO(lksmith_get_trylock_storms(storms, &num));
+	EXPECT_EQ(find_storm(storms, num, &g_briefly_polled,
+			     LKSMITH_STORM_TRYLOCK), NULL);
+	return 0;
+}
+
+static int test_expired_deadlines(void)
+{
+	struct lksmith_trylock_storm storms[MAX_STORMS];
+	const struct lksmith_trylock_storm *st;
+	struct timespec ts;
+	int i, num = MAX_STORMS;
+
+	EXPECT_ZERO(pthread_mutex_lock(&g_cond_lock));
+	for (i = 0; i < STREAK * 2; i++) {
+		EXPECT_ZERO(get_current_timespec(&ts));
+		ts.tv_sec--;
+		EXPECT_EQ(pthread_cond_timedwait(&g_cond, &g_cond_lock, &ts),
+			  ETIMEDOUT);
+	}
+	/* A real deadline ends the run. */
+	EXPECT_ZERO(get_current_timespec(&ts));
+	ts.tv_nsec += 10000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	EXPECT_EQ(pthread_cond_timedwait(&g_cond, &g_cond_lock, &ts),
+		  ETIMEDOUT);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_cond_lock));
+
+	EXPECT_ZERO(lksmith_get_trylock_storms(storms, &num));
+	st = find_storm(storms, num, &g_cond, LKSMITH_STORM_TIMED);
+	EXPECT_NOT_EQ(st, NULL);
+	EXPECT_EQ(st->streaks, 1);
+	EXPECT_EQ(st->failures, STREAK * 2);
+	EXPECT_EQ(st->max_streak, STREAK * 2);
+	return 0;
+}
+
+static int test_report(void)
+{
+	clear_recorded_errors();
+	EXPECT_EQ(lksmith_report_trylock_storms(), EWOULDBLOCK);
+	EXPECT_NOT_EQ(find_recorded_error(EWOULDBLOCK), 0);
+	clear_recorded_errors();
+	return 0;
+}
+
+/**
+ * Poll a lock with LKSMITH_TRYLOCK_STREAK unset.  Nothing should be recorded,
+ * even when the polling thread exits.
+ */
+static int test_disabled(void)
+{
+	struct lksmith_trylock_storm storms[MAX_STORMS];
+	pthread_t thread;
+	int num = MAX_STORMS;
+
+	EXPECT_ZERO(pthread_mutex_lock(&g_polled));
+	EXPECT_ZERO(pthread_create(&thread, NULL, poll_thread, NULL));
+	while (__atomic_load_n(&g_attempts, __ATOMIC_SEQ_CST) < STREAK * 5)
+		sched_yield();
+	EXPECT_ZERO(pthread_mutex_unlock(&g_polled));
+	EXPECT_ZERO(pthread_join(thread, NULL));
+
+	EXPECT_ZERO(lksmith_get_trylock_storms(storms, &num));
+	EXPECT_ZERO(num);
+	EXPECT_ZERO(lksmith_report_trylock_storms());
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static char streak_env[64];
+
+	if (test_set_mode(argc, argv))
+		return EXIT_FAILURE;
+	if ((argc >= 3) && (!strcmp(argv[2], "disabled"))) {
+		set_error_cb(record_error);
+		EXPECT_ZERO(test_disabled());
+		EXPECT_ZERO(num_recorded_errors());
+		return EXIT_SUCCESS;
+	}
+	snprintf(streak_env, sizeof(streak_env), "LKSMITH_TRYLOCK_STREAK=%d",
+		 STREAK);
+	putenv(streak_env);
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_trylock_storm());
+	EXPECT_ZERO(test_short_streak());
+	EXPECT_ZERO(test_expired_deadlines());
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(test_report());
+
+	return EXIT_SUCCESS;
+}
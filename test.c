@@ -57,6 +57,20 @@ void set_error_cb(lksmith_error_cb_t cb)
 	putenv(g_lksmith_log_env);
 }
 
+static char g_lksmith_mode_env[64];
+
+int test_set_mode(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <mode>\n", argv[0]);
+		return EINVAL;
+	}
+	snprintf(g_lksmith_mode_env, sizeof(g_lksmith_mode_env),
+		"LKSMITH_MODE=%s", argv[1]);
+	putenv(g_lksmith_mode_env);
+	return 0;
+}
+
 struct recorded_error {
 	int code;
 	struct recorded_error *next;
@@ -43,6 +43,17 @@ struct timespec;
  */
 void set_error_cb(lksmith_error_cb_t cb);
 
+/**
+ * Set LKSMITH_MODE from a unit test's first argument.
+ *
+ * @param argc		The test's argc
+ * @param argv		The test's argv
+ *
+ * @return		0 on success; EINVAL if no mode was given, after
+ *			printing a usage message
+ */
+int test_set_mode(int argc, char **argv);
+
 /**
  * Error handling function that just aborts.
  *
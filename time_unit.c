@@ -0,0 +1,152 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_THREADS 4
+
+/**
+ * How long to run the threaded test, in nanoseconds.  This is long enough
+ * to see at least one TSC recalibration.
+ */
+#define THREAD_TEST_NS 1200000000ULL
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Read time_now_ns and CLOCK_MONOTONIC at the same moment.  If we are
+ * preempted between the two reads, they don't agree, so we retry until both
+ * were read within a few microseconds of each other.
+ */
+static void paired_now(uint64_t *t, uint64_t *m)
+{
+	uint64_t m0, m1;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		m0 = mono_ns();
+		*t = time_now_ns();
+		m1 = mono_ns();
+		if (m1 - m0 < 20000)
+			break;
+	}
+	*m = m0 + ((m1 - m0) / 2);
+}
+
+static int test_interval(enum time_source src, uint64_t slop_ns)
+{
+	struct timespec ts = { 0, 50000000 };
+	uint64_t t0, t1, m0, m1, prev, cur;
+	int i;
+
+	EXPECT_EQ(time_source_str(time_init(src)), time_source_str(src));
+	prev = time_now_ns();
+	for (i = 0; i < 100000; i++) {
+		cur = time_now_ns();
+		EXPECT_GE(cur, prev);
+		prev = cur;
+	}
+	paired_now(&t0, &m0);
+	nanosleep(&ts, NULL);
+	paired_now(&t1, &m1);
+	EXPECT_LT(t1 - t0, (m1 - m0) + slop_ns);
+	EXPECT_LT(m1 - m0, (t1 - t0) + slop_ns);
+	return 0;
+}
+
+static void *monotonic_thread(void *v __attribute__((unused)))
+{
+	uint64_t start, prev, cur;
+
+	start = prev = time_now_ns();
+	do {
+		cur = time_now_ns();
+		if (cur < prev)
+			return (void*)(intptr_t)EIO;
+		prev = cur;
+	} while (cur - start < THREAD_TEST_NS);
+	return NULL;
+}
+
+static int test_threads_monotonic(void)
+{
+	pthread_t threads[NUM_THREADS];
+	void *rval;
+	uint64_t t, m;
+	int64_t skew;
+	int i;
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		EXPECT_ZERO(pthread_create(&threads[i], NULL,
+				monotonic_thread, NULL));
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		EXPECT_ZERO(pthread_join(threads[i], &rval));
+		EXPECT_EQ(rval, NULL);
+	}
+	/* After recalibrating, we should agree closely with
+	 * CLOCK_MONOTONIC. */
+	paired_now(&t, &m);
+	skew = (int64_t)(t - m);
+	EXPECT_LT(skew, 1000000);
+	EXPECT_GT(skew, -1000000);
+	return 0;
+}
+
+int main(void)
+{
+	enum time_source src;
+
+	set_error_cb(die_on_error);
+	EXPECT_ZERO(test_interval(TIME_SOURCE_MONOTONIC, 1000000));
+	EXPECT_ZERO(test_interval(TIME_SOURCE_COARSE, 20000000));
+	src = time_init(TIME_SOURCE_TSC);
+	if (src != TIME_SOURCE_TSC) {
+		fprintf(stderr, "no invariant TSC; skipping TSC tests.\n");
+		return EXIT_SUCCESS;
+	}
+	EXPECT_ZERO(test_interval(TIME_SOURCE_TSC, 1000000));
+	EXPECT_ZERO(test_threads_monotonic());
+
+	return EXIT_SUCCESS;
+}
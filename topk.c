@@ -0,0 +1,199 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "topk.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint32_t topk_hash(const struct topk *tk, uint64_t a,
+				 uint64_t b)
+{
+	uint64_t h = a ^ (b * 0xc2b2ae3d27d4eb4fULL);
+
+	h ^= h >> 32;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (uint32_t)(h >> 16) & (tk->idx_cap - 1);
+}
+
+/**
+ * Find the index slot where a key is, or where it would go.
+ */
+static uint32_t topk_find(const struct topk *tk, uint64_t a, uint64_t b)
+{
+	uint32_t i = topk_hash(tk, a, b);
+	const struct topk_entry *e;
+
+	while (1) {
+		if (tk->idx[i] == 0)
+			return i;
+		e = &tk->ent[tk->idx[i] - 1];
+		if ((e->a == a) && (e->b == b))
+			return i;
+		i = (i + 1) & (tk->idx_cap - 1);
+	}
+}
+
+/**
+ * Remove the index slot for a key which is present.
+ */
+static void topk_unindex(struct topk *tk, uint64_t a, uint64_t b)
+{
+	uint32_t i, j, home;
+	const struct topk_entry *e;
+
+	i = topk_find(tk, a, b);
+	tk->idx[i] = 0;
+	/* Shift back any entries which were displaced past the hole we just
+	 * made, so that lookups never stop early. */
+	j = i;
+	while (1) {
+		j = (j + 1) & (tk->idx_cap - 1);
+		if (tk->idx[j] == 0)
+			break;
+		e = &tk->ent[tk->idx[j] - 1];
+		home = topk_hash(tk, e->a, e->b);
+		if ((i <= j) ? ((i < home) && (home <= j)) :
+				((i < home) || (home <= j)))
+			continue;
+		tk->idx[i] = tk->idx[j];
+		tk->idx[j] = 0;
+		i = j;
+	}
+}
+
+static void topk_reindex(struct topk *tk)
+{
+	uint32_t i;
+
+	memset(tk->idx, 0, tk->idx_cap * sizeof(uint32_t));
+	for (i = 0; i < tk->len; i++) {
+		tk->idx[topk_find(tk, tk->ent[i].a, tk->ent[i].b)] = i + 1;
+	}
+}
+
+int topk_init(struct topk *tk, uint32_t cap)
+{
+	uint32_t idx_cap = 4;
+
+	/* Keep the index load factor under 1/2. */
+	while (idx_cap < cap * 2)
+		idx_cap *= 2;
+	memset(tk, 0, sizeof(*tk));
+	tk->ent = calloc(cap, sizeof(struct topk_entry));
+	tk->idx = calloc(idx_cap, sizeof(uint32_t));
+	if ((!tk->ent) || (!tk->idx)) {
+		topk_free(tk);
+		return ENOMEM;
+	}
+	tk->idx_cap = idx_cap;
+	tk->cap = cap;
+	return 0;
+}
+
+void topk_add(struct topk *tk, uint64_t a, uint64_t b, uint64_t count,
+	      uint64_t err)
+{
+	struct topk_entry *e;
+	uint32_t i, min;
+
+	i = topk_find(tk, a, b);
+	if (tk->idx[i]) {
+		e = &tk->ent[tk->idx[i] - 1];
+		e->count += count;
+		e->err += err;
+		return;
+	}
+	if (tk->len < tk->cap) {
+		e = &tk->ent[tk->len++];
+		e->a = a;
+		e->b = b;
+		e->count = count;
+		e->err = err;
+		tk->idx[i] = tk->len;
+		return;
+	}
+	/* Take over the smallest counter. */
+	min = 0;
+	for (i = 1; i < tk->len; i++) {
+		if (tk->ent[i].count < tk->ent[min].count)
+			min = i;
+	}
+	e = &tk->ent[min];
+	topk_unindex(tk, e->a, e->b);
+	e->a = a;
+	e->b = b;
+	e->err = e->count + err;
+	e->count += count;
+	tk->idx[topk_find(tk, a, b)] = min + 1;
+}
+
+void topk_merge(struct topk *dst, const struct topk *src)
+{
+	uint32_t i;
+
+	for (i = 0; i < src->len; i++) {
+		topk_add(dst, src->ent[i].a, src->ent[i].b,
+			 src->ent[i].count, src->ent[i].err);
+	}
+}
+
+static int topk_entry_compare(const void *a, const void *b)
+{
+	const struct topk_entry *ea = a, *eb = b;
+
+	if (ea->count > eb->count)
+		return -1;
+	if (ea->count < eb->count)
+		return 1;
+	return 0;
+}
+
+void topk_sort(struct topk *tk)
+{
+	qsort(tk->ent, tk->len, sizeof(struct topk_entry), topk_entry_compare);
+	topk_reindex(tk);
+}
+
+void topk_clear(struct topk *tk)
+{
+	if (tk->len == 0)
+		return;
+	tk->len = 0;
+	memset(tk->idx, 0, tk->idx_cap * sizeof(uint32_t));
+}
+
+void topk_free(struct topk *tk)
+{
+	free(tk->ent);
+	free(tk->idx);
+	memset(tk, 0, sizeof(*tk));
+}
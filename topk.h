@@ -0,0 +1,131 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_TOPK_H
+#define LKSMITH_TOPK_H
+
+#include <stdint.h> /* for uint64_t */
+
+/**
+ * One counter in a topk sketch.
+ */
+struct topk_entry {
+	/** First half of the key */
+	uint64_t a;
+	/** Second half of the key */
+	uint64_t b;
+	/** Estimated total weight of this key.  This is never less than the
+	 * weight we saw for the key while it was being counted. */
+	uint64_t count;
+	/** How much of count may belong to other keys */
+	uint64_t err;
+};
+
+/**
+ * A heavy-hitters sketch, using the Space-Saving algorithm.
+ *
+ * The sketch counts the total weight of each key using a fixed number of
+ * counters.  When a new key arrives and every counter is in use, the key
+ * takes over the counter with the smallest count, and inherits that count
+ * as its error.  Any key whose true weight is more than 1/cap of the total
+ * is guaranteed to have a counter.
+ *
+ * Keys are found through a small open-addressed index, so adding to a key
+ * which already has a counter doesn't scan the counters.
+ */
+struct topk {
+	/** The counters */
+	struct topk_entry *ent;
+	/** Index into ent.  Each slot holds an entry index plus 1, or 0 if
+	 * the slot is empty. */
+	uint32_t *idx;
+	/** Number of slots in idx.  Always a power of 2. */
+	uint32_t idx_cap;
+	/** Number of counters */
+	uint32_t cap;
+	/** Number of counters in use */
+	uint32_t len;
+};
+
+/**
+ * Initialize a topk sketch.
+ *
+ * @param tk		The sketch
+ * @param cap		The number of counters.  Must be positive.
+ *
+ * @return		0 on success; ENOMEM on out-of-memory.
+ */
+int topk_init(struct topk *tk, uint32_t cap);
+
+/**
+ * Add weight to a key.
+ *
+ * @param tk		The sketch
+ * @param a		First half of the key
+ * @param b		Second half of the key
+ * @param count		The weight to add
+ * @param err		The error in count, if it came from another sketch;
+ *			0 otherwise.
+ */
+void topk_add(struct topk *tk, uint64_t a, uint64_t b, uint64_t count,
+	      uint64_t err);
+
+/**
+ * Add all the counters from one sketch into another.
+ *
+ * Weight which src had already dropped can't be recovered, so the counts in
+ * dst may be low by up to the smallest count in src.
+ *
+ * @param dst		The sketch to add to
+ * @param src		The sketch to add from.  This is not modified.
+ */
+void topk_merge(struct topk *dst, const struct topk *src);
+
+/**
+ * Sort the counters in a sketch, largest count first.
+ *
+ * @param tk		The sketch
+ */
+void topk_sort(struct topk *tk);
+
+/**
+ * Remove all the counters from a sketch.
+ *
+ * @param tk		The sketch
+ */
+void topk_clear(struct topk *tk);
+
+/**
+ * Free the memory associated with a topk sketch.
+ *
+ * @param tk		The sketch
+ */
+void topk_free(struct topk *tk);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test.h"
+#include "topk.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_HEAVY 4
+#define NUM_LIGHT 10000
+
+static const struct topk_entry *topk_get(const struct topk *tk, uint64_t a,
+					 uint64_t b)
+{
+	uint32_t i;
+
+	for (i = 0; i < tk->len; i++) {
+		if ((tk->ent[i].a == a) && (tk->ent[i].b == b))
+			return &tk->ent[i];
+	}
+	return NULL;
+}
+
+static int test_topk_basic(void)
+{
+	struct topk tk;
+	const struct topk_entry *e;
+
+	EXPECT_ZERO(topk_init(&tk, 2));
+	topk_add(&tk, 1, 1, 10, 0);
+	topk_add(&tk, 1, 2, 5, 0);
+	topk_add(&tk, 1, 1, 10, 0);
+	EXPECT_EQ(tk.len, 2);
+	e = topk_get(&tk, 1, 1);
+	EXPECT_NOT_EQ(e, NULL);
+	EXPECT_EQ(e->count, 20);
+	EXPECT_EQ(e->err, 0);
+	/* A new key takes over the smallest counter. */
+	topk_add(&tk, 2, 1, 1, 0);
+	EXPECT_EQ(tk.len, 2);
+	EXPECT_EQ(topk_get(&tk, 1, 2), NULL);
+	e = topk_get(&tk, 2, 1);
+	EXPECT_NOT_EQ(e, NULL);
+	EXPECT_EQ(e->count, 6);
+	EXPECT_EQ(e->err, 5);
+	/* Later adds must find the key through the index. */
+	topk_add(&tk, 2, 1, 1, 0);
+	EXPECT_EQ(topk_get(&tk, 2, 1)->count, 7);
+	topk_sort(&tk);
+	EXPECT_EQ(tk.ent[0].a, 1);
+	EXPECT_EQ(tk.ent[1].a, 2);
+	topk_add(&tk, 2, 1, 100, 0);
+	topk_sort(&tk);
+	EXPECT_EQ(tk.ent[0].a, 2);
+	EXPECT_EQ(tk.ent[0].count, 107);
+	topk_clear(&tk);
+	EXPECT_EQ(tk.len, 0);
+	EXPECT_EQ(topk_get(&tk, 2, 1), NULL);
+	topk_add(&tk, 2, 1, 3, 0);
+	EXPECT_EQ(topk_get(&tk, 2, 1)->count, 3);
+	topk_free(&tk);
+	return 0;
+}
+
+/**
+ * Feed a few heavy keys and many light keys through two sketches, merge
+ * them, and check that the heavy keys come out on top with counts that
+ * bracket their true weight.
+ */
+static int test_topk_heavy_hitters(void)
+{
+	struct topk tk[2], merged;
+	const struct topk_entry *e;
+	uint64_t truth[NUM_HEAVY];
+	uint32_t i, j, r = 1;
+
+	memset(truth, 0, sizeof(truth));
+	EXPECT_ZERO(topk_init(&tk[0], 16));
+	EXPECT_ZERO(topk_init(&tk[1], 16));
+	EXPECT_ZERO(topk_init(&merged, 16));
+	for (i = 0; i < NUM_LIGHT; i++) {
+		for (j = 0; j < 2; j++) {
+			r = r * 1103515245 + 12345;
+			topk_add(&tk[j], 1000 + (r >> 8) % NUM_LIGHT, 0, 1, 0);
+		}
+		if ((i % 10) == 0) {
+			j = (i / 10) % NUM_HEAVY;
+			topk_add(&tk[i & 1], j, 7, 10 * (j + 1), 0);
+			truth[j] += 10 * (j + 1);
+		}
+	}
+	topk_merge(&merged, &tk[0]);
+	topk_merge(&merged, &tk[1]);
+	topk_sort(&merged);
+	for (i = 0; i < NUM_HEAVY; i++) {
+		e = topk_get(&merged, i, 7);
+		EXPECT_NOT_EQ(e, NULL);
+		EXPECT_GE(e->count, truth[i]);
+		EXPECT_GE(truth[i], e->count - e->err);
+	}
+	EXPECT_EQ(merged.ent[0].a, NUM_HEAVY - 1);
+	EXPECT_EQ(merged.ent[0].b, 7);
+	topk_free(&tk[0]);
+	topk_free(&tk[1]);
+	topk_free(&merged);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(die_on_error);
+	EXPECT_ZERO(test_topk_basic());
+	EXPECT_ZERO(test_topk_heavy_hitters());
+
+	return EXIT_SUCCESS;
+}
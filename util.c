@@ -35,16 +35,23 @@
 #undef _XOPEN_SOURCE
 
 #include "config.h"
+#include "error.h"
 #include "util.h"
 
 #include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_X86_TSC
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 void fwdprintf(char *buf, size_t *off, size_t buf_len, const char *fmt, ...)
 {
 	int res;
@@ -63,6 +70,303 @@ void fwdprintf(char *buf, size_t *off, size_t buf_len, const char *fmt, ...)
 		*off = o + res;
 }
 
+uint64_t getenv_u64(const char *name, uint64_t def)
+{
+	const char *str;
+	char *end = NULL;
+	unsigned long long val;
+
+	str = getenv(name);
+	if ((!str) || (!str[0]))
+		return def;
+	errno = 0;
+	val = strtoull(str, &end, 0);
+	if (errno || (end == str) || (*end != '\0')) {
+		lksmith_error(EINVAL, "getenv_u64: unable to parse %s='%s' "
+			"as an unsigned integer.  Using the default value "
+			"of %llu instead.\n", name, str,
+			(unsigned long long)def);
+		return def;
+	}
+	return val;
+}
+
+int parse_cpulist(const char *str, int val, int *out, int num)
+{
+	unsigned long lo, hi, i;
+	char *end;
+
+	while (1) {
+		if ((*str < '0') || (*str > '9'))
+			break;
+		lo = hi = strtoul(str, &end, 10);
+		str = end;
+		if (*str == '-') {
+			str++;
+			if ((*str < '0') || (*str > '9'))
+				return EINVAL;
+			hi = strtoul(str, &end, 10);
+			str = end;
+			if (hi < lo)
+				return EINVAL;
+		}
+		for (i = lo; (i <= hi) && (i < (unsigned long)num); i++)
+			out[i] = val;
+		if (*str != ',')
+			break;
+		str++;
+	}
+	while ((*str == ' ') || (*str == '\n') || (*str == '\t'))
+		str++;
+	return (*str == '\0') ? 0 : EINVAL;
+}
+
+/**
+ * How often we recalibrate the TSC against CLOCK_MONOTONIC, in nanoseconds.
+ */
+#define TIME_RECALIBRATE_NS 1000000000ULL
+
+/**
+ * How long we spend on the initial TSC calibration, in nanoseconds.
+ */
+#define TIME_CALIBRATE_NS 2000000ULL
+
+/**
+ * The mapping from TSC ticks to nanoseconds.
+ *
+ * The mapping is protected by a sequence count.  Readers retry if the count
+ * is odd, or if it changed while they were reading.  There is only ever one
+ * writer at a time, since writers must hold g_time_calib_lock.
+ */
+struct time_calib {
+	/** Sequence count. */
+	uint32_t seq;
+	/** TSC value at which ns_base was valid. */
+	uint64_t tsc_base;
+	/** Time in nanoseconds at tsc_base. */
+	uint64_t ns_base;
+	/** Nanoseconds per tick, as a 32.32 fixed-point number. */
+	uint64_t mult;
+	/** TSC value at which we should next recalibrate. */
+	uint64_t tsc_next;
+	/** TSC value at the start of the initial calibration. */
+	uint64_t tsc_start;
+	/** CLOCK_MONOTONIC time at the start of the initial calibration. */
+	uint64_t mono_start;
+};
+
+static enum time_source g_time_source = TIME_SOURCE_MONOTONIC;
+
+static clockid_t g_time_clock = CLOCK_MONOTONIC;
+
+static struct time_calib g_time_calib;
+
+static int g_time_calib_lock;
+
+static uint64_t time_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+#ifdef HAVE_X86_TSC
+/**
+ * Determine whether the TSC ticks at a constant rate, and keeps ticking in
+ * deep C-states.
+ *
+ * @return		1 if the TSC is invariant; 0 otherwise.
+ */
+static int time_tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx))
+		return 0;
+	if (eax < 0x80000007)
+		return 0;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return !!(edx & (1U << 8));
+}
+
+/**
+ * Convert a TSC value to nanoseconds.
+ * The caller must be inside a read-side critical section of g_time_calib,
+ * or hold g_time_calib_lock.
+ */
+static uint64_t time_tsc_to_ns(uint64_t tsc)
+{
+	uint64_t base = __atomic_load_n(&g_time_calib.tsc_base,
+					__ATOMIC_RELAXED);
+	uint64_t ns = __atomic_load_n(&g_time_calib.ns_base, __ATOMIC_RELAXED);
+	uint64_t mult = __atomic_load_n(&g_time_calib.mult, __ATOMIC_RELAXED);
+
+	/* Another CPU's TSC may be slightly behind the one that set the
+	 * base. */
+	if (tsc < base)
+		return ns;
+	return ns + (uint64_t)(((unsigned __int128)(tsc - base) * mult) >> 32);
+}
+
+/**
+ * Publish a new TSC mapping.  The caller must hold g_time_calib_lock.
+ */
+static void time_tsc_publish(uint64_t tsc_base, uint64_t ns_base,
+			     uint64_t mult)
+{
+	uint64_t ticks = (uint64_t)(((unsigned __int128)TIME_RECALIBRATE_NS
+					<< 32) / mult);
+
+	__atomic_store_n(&g_time_calib.seq, g_time_calib.seq + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&g_time_calib.tsc_base, tsc_base, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_time_calib.ns_base, ns_base, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_time_calib.mult, mult, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_time_calib.tsc_next, tsc_base + ticks,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&g_time_calib.seq, g_time_calib.seq + 1,
+			 __ATOMIC_RELEASE);
+}
+
+/**
+ * Calibrate the TSC against CLOCK_MONOTONIC for the first time.
+ *
+ * @return		0 on success; EINVAL if the TSC doesn't seem to be
+ *			usable.
+ */
+static int time_tsc_calibrate(void)
+{
+	uint64_t mono0, mono1, tsc0, tsc1, mult;
+
+	mono0 = time_clock_ns(CLOCK_MONOTONIC);
+	tsc0 = __rdtsc();
+	do {
+		mono1 = time_clock_ns(CLOCK_MONOTONIC);
+	} while (mono1 - mono0 < TIME_CALIBRATE_NS);
+	tsc1 = __rdtsc();
+	if (tsc1 <= tsc0)
+		return EINVAL;
+	mult = (uint64_t)(((unsigned __int128)(mono1 - mono0) << 32) /
+			(tsc1 - tsc0));
+	if (mult == 0)
+		return EINVAL;
+	g_time_calib.tsc_start = tsc0;
+	g_time_calib.mono_start = mono0;
+	time_tsc_publish(tsc1, mono1, mult);
+	return 0;
+}
+
+/**
+ * Recalibrate the TSC against CLOCK_MONOTONIC.
+ *
+ * The rate is measured over the whole time since the initial calibration,
+ * so it gets more accurate as the program runs.  We never step our clock
+ * backwards.  Instead, we adjust the rate so that any error we have built up
+ * is gone by the next recalibration.
+ */
+static void time_tsc_recalibrate(void)
+{
+	uint64_t tsc, ns, mono, mult;
+	int64_t err, limit = TIME_RECALIBRATE_NS / 2;
+
+	if (!__sync_bool_compare_and_swap(&g_time_calib_lock, 0, 1))
+		return;
+	tsc = __rdtsc();
+	mono = time_clock_ns(CLOCK_MONOTONIC);
+	ns = time_tsc_to_ns(tsc);
+	if (tsc <= g_time_calib.tsc_start)
+		goto done;
+	mult = (uint64_t)(((unsigned __int128)(mono - g_time_calib.mono_start)
+			<< 32) / (tsc - g_time_calib.tsc_start));
+	err = (int64_t)(mono - ns);
+	if (err > limit) {
+		/* We're far behind, perhaps because the system was
+		 * suspended.  Catch up all at once. */
+		ns = mono;
+		err = 0;
+	} else if (err < -limit) {
+		err = -limit;
+	}
+	mult = (uint64_t)(((unsigned __int128)mult *
+			(uint64_t)((int64_t)TIME_RECALIBRATE_NS + err)) /
+			TIME_RECALIBRATE_NS);
+	if (mult == 0)
+		goto done;
+	time_tsc_publish(tsc, ns, mult);
+done:
+	__sync_bool_compare_and_swap(&g_time_calib_lock, 1, 0);
+}
+
+static uint64_t time_tsc_now_ns(void)
+{
+	uint32_t seq;
+	uint64_t tsc, ns, next;
+
+	do {
+		seq = __atomic_load_n(&g_time_calib.seq, __ATOMIC_ACQUIRE);
+		tsc = __rdtsc();
+		ns = time_tsc_to_ns(tsc);
+		next = __atomic_load_n(&g_time_calib.tsc_next,
+				       __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 (seq != __atomic_load_n(&g_time_calib.seq, __ATOMIC_RELAXED)));
+	if (tsc >= next)
+		time_tsc_recalibrate();
+	return ns;
+}
+#endif
+
+enum time_source time_init(enum time_source src)
+{
+	switch (src) {
+	case TIME_SOURCE_TSC:
+#ifdef HAVE_X86_TSC
+		if ((time_tsc_invariant()) && (!time_tsc_calibrate()))
+			break;
+#endif
+		src = TIME_SOURCE_MONOTONIC;
+		g_time_clock = CLOCK_MONOTONIC;
+		break;
+	case TIME_SOURCE_COARSE:
+#ifdef CLOCK_MONOTONIC_COARSE
+		g_time_clock = CLOCK_MONOTONIC_COARSE;
+		break;
+#endif
+	default:
+		src = TIME_SOURCE_MONOTONIC;
+		g_time_clock = CLOCK_MONOTONIC;
+		break;
+	}
+	g_time_source = src;
+	return src;
+}
+
+const char *time_source_str(enum time_source src)
+{
+	switch (src) {
+	case TIME_SOURCE_MONOTONIC:
+		return "monotonic";
+	case TIME_SOURCE_COARSE:
+		return "coarse";
+	case TIME_SOURCE_TSC:
+		return "tsc";
+	}
+	return "(unknown)";
+}
+
+uint64_t time_now_ns(void)
+{
+#ifdef HAVE_X86_TSC
+	if (g_time_source == TIME_SOURCE_TSC)
+		return time_tsc_now_ns();
+#endif
+	return time_clock_ns(g_time_clock);
+}
+
 void simple_spin_lock(int *lock)
 {
 	struct timespec ts;
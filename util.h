@@ -30,8 +30,16 @@
 #ifndef LKSMITH_UTIL_H
 #define LKSMITH_UTIL_H
 
+#include <stdint.h> /* for uint64_t */
 #include <unistd.h> /* for size_t */
 
+/**
+ * The size of a cache line, in bytes.  This is right for every x86 CPU and
+ * for most other modern CPUs; on CPUs where it's wrong, we'll waste a little
+ * bit of memory or get a little bit of false sharing.
+ */
+#define CACHE_LINE_SIZE 64
+
 /** Write a formatted string to the next available position in a
  * fixed-length buffer
  *
@@ -44,6 +52,80 @@
 void fwdprintf(char *buf, size_t *off, size_t buf_len,
 	const char *fmt, ...) __attribute__((format(printf, 4, 5)));
 
+/**
+ * Read an unsigned integer from an environment variable.
+ *
+ * @param name		The name of the environment variable
+ * @param def		The value to use if the variable is not set, or
+ *			cannot be parsed
+ *
+ * @return		The value
+ */
+uint64_t getenv_u64(const char *name, uint64_t def);
+
+/**
+ * Parse a Linux CPU list, such as "0-3,8,10-11", and set the entry for each
+ * CPU in it.
+ *
+ * @param str		The CPU list.  Trailing whitespace is ignored.
+ * @param val		The value to set.
+ * @param out		(out param) The array to set entries in.  CPUs
+ *			beyond the end of it are ignored.
+ * @param num		The length of out.
+ *
+ * @return		0 on success; EINVAL if the list can't be parsed.
+ */
+int parse_cpulist(const char *str, int val, int *out, int num);
+
+/**
+ * Sources of time for time_now_ns.
+ */
+enum time_source {
+	/** clock_gettime(CLOCK_MONOTONIC).  On Linux, this is a vDSO call. */
+	TIME_SOURCE_MONOTONIC = 0,
+	/** clock_gettime(CLOCK_MONOTONIC_COARSE).  Cheaper, but only as
+	 * precise as the kernel tick. */
+	TIME_SOURCE_COARSE,
+	/** The x86 timestamp counter, calibrated against CLOCK_MONOTONIC.
+	 * Only used if the CPU reports that the TSC is invariant. */
+	TIME_SOURCE_TSC,
+};
+
+/**
+ * Choose the source of time for time_now_ns.
+ *
+ * This should be called once, before there are other threads calling
+ * time_now_ns.  Until it is called, time_now_ns uses CLOCK_MONOTONIC.
+ *
+ * @param src		The time source we would like to use.
+ *
+ * @return		The time source we will use.  If the requested
+ *			source is not available, we fall back to
+ *			TIME_SOURCE_MONOTONIC.
+ */
+enum time_source time_init(enum time_source src);
+
+/**
+ * Get the name of a time source.
+ *
+ * @param src		The time source.
+ *
+ * @return		A statically allocated string.
+ */
+const char *time_source_str(enum time_source src);
+
+/**
+ * Get the current time from a monotonic clock.
+ *
+ * This is cheap enough to call on every lock operation.  With the TSC time
+ * source, times taken on different CPUs may be skewed by the small amount
+ * that the CPUs' TSCs disagree.
+ *
+ * @return		The time in nanoseconds.  This is only useful for
+ *			measuring intervals.
+ */
+uint64_t time_now_ns(void);
+
 void simple_spin_lock(int *lock);
 
 void simple_spin_unlock(int *lock);